@@ -0,0 +1,579 @@
+	@ FileCore driver for the RPCEmu paravirtual block device
+	@
+	@ Each transfer FileCore asks for is passed to the emulator with a
+	@ single ArcEm_BlockDev SWI, see src/blockdev.c. The emulator provides
+	@ up to two discs, which appear as BlockFS::4 and BlockFS::5.
+	@
+	@ Disc addresses have the drive in the top three bits. BlockFS
+	@ declares big disc support to FileCore, so for discs whose record has
+	@ the big flag set the other 29 bits are a sector number rather than
+	@ a byte offset. With 512 byte sectors this allows discs of up to
+	@ 256GB. Addresses are turned into 64-bit byte offsets for the
+	@ emulator.
+
+	@ ARM constants
+	VBIT = 1 << 28
+	CBIT = 1 << 29
+	ZBIT = 1 << 30
+	NBIT = 1 << 31
+
+	@ RISC OS constants
+	XOS_Module          = 0x2001e
+	XOS_FSControl       = 0x20029
+	XFileCore_Create    = 0x60540
+
+	OSModule_Delete    = 4
+	FSControl_SelectFS = 14
+
+	CreateFlag_BigDiscSupport = 1 << 9	@ Sector addresses for big discs
+
+	DiscOp_Verify      = 0
+	DiscOp_ReadSecs    = 1
+	DiscOp_WriteSecs   = 2
+	DiscOp_Seek        = 5
+	DiscOp_Restore     = 6
+	DiscOp_Specify     = 15
+	DiscOp_Op_Mask     = 0x0f
+	DiscOp_Op_ScatterList = 1 << 5
+
+	MiscOp_Mount       = 0
+	MiscOp_PollChanged = 1
+	MiscOp_LockDrive   = 2
+	MiscOp_UnlockDrive = 3
+	MiscOp_PollPeriod  = 4
+	MiscOp_Eject       = 5
+
+	PollChanged_NotChanged   = 1 << 0
+	PollChanged_ChangedWorks = 1 << 7
+
+	DISC_ADDRESS_DRIVE = 0xe0000000	@ Drive number bits of a disc address
+	SMALL_DISC_SIZE    = 0x20000000	@ Largest disc byte addresses can reach
+	MAX_DISC_SIZE_HIGH = 0x40	@ High word of the size sector addresses reach
+
+	@ Disc record
+	DiscRecord_Log2SecSize = 0
+	DiscRecord_SecsPerTrk  = 1
+	DiscRecord_Heads       = 2
+	DiscRecord_DiscSize    = 16
+	DiscRecord_DiscSize2   = 36
+	DiscRecord_BigFlag     = 41
+	DiscRecord_Size        = 64
+
+	@ ArcEm SWI chunk
+	ARCEM_SWI_CHUNK  = 0x56ac0
+	ARCEM_SWI_CHUNKX = ARCEM_SWI_CHUNK | 0x20000
+	ArcEm_BlockDev  = ARCEM_SWI_CHUNKX + 5
+
+	BLOCKDEV_DESCRIBE = 0
+	BLOCKDEV_READ     = 1
+	BLOCKDEV_WRITE    = 2
+
+	@ Filing system properties.
+	@
+	@ The filing system number, which also forms the error numbers.
+	@ BlockFS does not yet have an allocated number. 0x9a, the one after
+	@ the 0x99 HostFS uses, is a placeholder until one is allocated,
+	@ and must be replaced before the module is distributed outside
+	@ RPCEmu. If it clashes with another filing system, assemble with a
+	@ different one: make FS_NUMBER=<number>
+	.ifndef FILING_SYSTEM_NUMBER
+	FILING_SYSTEM_NUMBER = 0x9a
+	.endif
+	BLOCKFS_DRIVES       = 2	@ Discs the emulator can provide
+	FIRST_DRIVE          = 4	@ FileCore number of the first hard disc
+
+
+	.global	_start
+
+_start:
+
+
+module_start:
+
+	.int	0		@ Start
+	.int	init		@ Initialisation
+	.int	final		@ Finalisation
+	.int	0		@ Service Call
+	.int	title		@ Title String
+	.int	help		@ Help String
+	.int	table		@ Help and Command keyword table
+	.int	0		@ SWI Chunk base
+	.int	0		@ SWI handler code
+	.int	0		@ SWI decoding table
+	.int	0		@ SWI decoding code
+	.int    0		@ Message File
+	.int	modflags	@ Module Flags
+
+modflags:
+	.int	1		@ 32 bit compatible
+
+title:
+	.string	"RPCEmuBlockFS"
+
+help:
+	.string	"RPCEmu BlockFS\t0.02 (18 Oct 2026)"
+
+	.align
+
+
+	@ Help and Command keyword table
+table:
+	.string	"BlockFS"
+	.align
+	.int	command_blockfs
+	.int	0x00000000
+	.int	0
+	.int	command_blockfs_help
+
+	.byte	0	@ Table terminator
+
+command_blockfs_help:
+	.string	"*BlockFS selects the BlockFS filing system\rSyntax: *BlockFS"
+	.align
+
+
+	@ FileCore descriptor block
+filecore_desc:
+	.byte	CreateFlag_BigDiscSupport & 0xff	@ Flags: no FIQ, no background
+	.byte	(CreateFlag_BigDiscSupport >> 8) & 0xff	@ transfers, big discs
+	.byte	(CreateFlag_BigDiscSupport >> 16) & 0xff
+	.byte	FILING_SYSTEM_NUMBER
+	.int	fs_name - module_start		@ Filing system title
+	.int	fs_text - module_start		@ Boot text
+	.int	lowlevel - module_start		@ Low level disc op entry
+	.int	misc - module_start		@ Miscellaneous entry
+
+fs_name:
+	.string	"BlockFS"
+
+fs_text:
+	.string	"RPCEmu Block Device"
+
+filecore_instance:
+	.string	"FileCore%BlockFS"
+	.align
+
+
+	/* Entry:
+	 *   r10 = pointer to environment string
+	 *   r11 = I/O base or instantiation number
+	 *   r12 = pointer to private word for this instantiation
+	 *   r13 = stack pointer (supervisor)
+	 * Exit:
+	 *   r7-r11, r13 preserved
+	 *   other may be corrupted
+	 */
+init:
+	stmfd	sp!, {lr}
+
+	mov	r0, #0
+	str	r0, [r12]	@ No FileCore instance yet
+
+	@ Count the discs the emulator provides. The module is in the
+	@ emulator's podule ROM, so it starts whether or not there are any
+	@ discs, and quietly does nothing if there are none.
+	mov	r6, #0
+0:	mov	r0, #BLOCKDEV_DESCRIBE
+	mov	r1, r6
+	swi	ArcEm_BlockDev
+	bvs	init_done
+	teq	r0, #0
+	bne	1f
+	add	r6, r6, #1
+	cmp	r6, #BLOCKFS_DRIVES
+	blo	0b
+1:	teq	r6, #0
+	beq	init_done
+
+	@ Create the FileCore instance
+	adr	r0, filecore_desc
+	adr	r1, module_start
+	mov	r2, r12
+	mov	r3, r6, lsl #8			@ Number of hard discs, no floppies
+	orr	r3, r3, #(FIRST_DRIVE << 16)	@ Default drive
+	mov	r4, #0				@ Default directory cache size
+	mov	r5, #0				@ No file cache buffers
+	mov	r6, #0				@ Map sizes (new map discs only)
+	swi	XFileCore_Create
+	strvc	r0, [r12]	@ FileCore's private word for the instance
+	ldmfd	sp!, {pc}	@ exit init with V set if FileCore failed
+
+init_done:
+	cmp	pc, #0		@ Clears V (also clears N, Z, and sets C)
+	ldmfd	sp!, {pc}
+
+
+
+	/* Entry:
+	 *   r10 = fatality indication: 0 is non-fatal, 1 is fatal
+	 *   r11 = instantiation number
+	 *   r12 = pointer to private word for this instantiation of the module.
+	 *   r13 = supervisor stack pointer
+	 * Exit:
+	 *   preserve processor mode and interrupt state
+	 *   r7-r11, r13 preserved
+	 *   other and flags may be corrupted
+	 */
+final:
+	stmfd	sp!, {lr}
+
+	@ Remove the FileCore instance, if there is one, which removes the
+	@ filing system
+	ldr	r0, [r12]
+	teq	r0, #0
+	beq	final_done
+	mov	r0, #OSModule_Delete
+	adr	r1, filecore_instance
+	swi	XOS_Module
+	mov	r0, #0
+	str	r0, [r12]
+
+final_done:
+	cmp	pc, #0		@ Clears V (also clears N, Z, and sets C)
+	ldmfd	sp!, {pc}
+
+
+	/* Entry (for all *Commands):
+	 *   r0 = pointer to command tail (read-only)
+	 *   r1 = number of parameters (as counted by OSCLI)
+	 *   r12 = pointer to private word for this instantiation
+	 *   r13 = stack pointer (supervisor)
+	 *   r14 = return address
+	 * Exit:
+	 *   r0 = error pointer (if needed)
+	 *   r7-r11 preserved
+	 */
+
+	@ *BlockFS
+command_blockfs:
+	@ Select BlockFS as the current Filing System
+	stmfd	sp!, {lr}
+
+	mov	r0, #FSControl_SelectFS
+	adr	r1, fs_name
+	swi	XOS_FSControl
+
+	ldmfd	sp!, {pc}
+
+
+
+	/* Move one contiguous run of bytes between a disc and memory.
+	 *
+	 * Entry:
+	 *   r0 = buffer
+	 *   r1 = length in bytes
+	 *   r6 = drive, counting from 0
+	 *   r7 = BLOCKDEV_READ or BLOCKDEV_WRITE
+	 *   r8, r9 = byte offset on the disc, low and high words
+	 * Exit:
+	 *   V set and r0 = error, if failed
+	 *   r8, r9 = byte offset after the run, if successful
+	 *   other registers preserved
+	 */
+transfer_run:
+	stmfd	sp!, {r1 - r5, lr}
+
+	mov	r4, r0			@ Buffer
+	mov	r5, r1			@ Length
+	mov	r0, r7
+	mov	r1, r6
+	mov	r2, r8
+	mov	r3, r9
+	swi	ArcEm_BlockDev
+
+	ldmfd	sp!, {r1 - r5, lr}
+	teq	r0, #0
+	bne	return_disc_error
+	adds	r8, r8, r1
+	adc	r9, r9, #0
+	mov	pc, lr
+
+return_disc_error:
+	adr	r0, err_disc_error
+return_error:
+	cmp	r0, #NBIT
+	cmnvc	r0, #NBIT	@ Set V
+	mov	pc, lr
+
+
+
+	/* FileCore low level disc op entry
+	 *
+	 * Entry:
+	 *   r1 = reason code in bits 0-3, flags in bits 4-7
+	 *   r2 = disc address, with the drive in bits 29-31
+	 *   r3 = buffer, or scatter list if DiscOp_Op_ScatterList set
+	 *   r4 = length in bytes
+	 *   r5 = pointer to disc record
+	 *   r8 = FileCore private word
+	 *   r12 = pointer to private word for this instantiation
+	 * Exit:
+	 *   V set and r0 = error, if failed
+	 *   r2 = disc address of the next byte to transfer
+	 *   r3 = updated buffer or scatter list pointer
+	 *   r4 = number of bytes not transferred
+	 */
+lowlevel:
+	stmfd	sp!, {r0, r1, r5 - r9, lr}
+
+	and	r7, r1, #DiscOp_Op_Mask
+	teq	r7, #DiscOp_Seek
+	teqne	r7, #DiscOp_Restore
+	teqne	r7, #DiscOp_Specify
+	beq	lowlevel_done		@ Nothing to do without heads to move
+	teq	r7, #DiscOp_ReadSecs
+	teqne	r7, #DiscOp_WriteSecs
+	teqne	r7, #DiscOp_Verify
+	adrne	r0, err_bad_op
+	bne	lowlevel_error
+
+	mov	r6, r2, lsr #29
+	sub	r6, r6, #FIRST_DRIVE
+	cmp	r6, #BLOCKFS_DRIVES
+	bhs	lowlevel_no_drive
+
+	@ Find the byte offset on the disc, in r8 and r9
+	bic	r8, r2, #DISC_ADDRESS_DRIVE
+	mov	r9, #0
+	ldrb	r0, [r5, #DiscRecord_BigFlag]
+	tst	r0, #1
+	beq	0f
+	ldrb	r0, [r5, #DiscRecord_Log2SecSize]
+	rsb	r1, r0, #32
+	mov	r9, r8, lsr r1
+	mov	r8, r8, lsl r0
+0:
+	@ The host reports errors as they happen, so the disc is always good
+	teq	r7, #DiscOp_Verify
+	bne	lowlevel_transfer
+	adds	r8, r8, r4
+	adc	r9, r9, #0
+	mov	r4, #0
+	b	lowlevel_address
+
+lowlevel_transfer:
+	@ DiscOp_ReadSecs and DiscOp_WriteSecs match BLOCKDEV_READ and
+	@ BLOCKDEV_WRITE, so r7 is already the reason for the emulator
+	ldr	r1, [sp, #1 * 4]
+	tst	r1, #DiscOp_Op_ScatterList
+	bne	lowlevel_scatter
+
+	mov	r0, r3
+	mov	r1, r4
+	bl	transfer_run
+	bvs	lowlevel_error_address
+	add	r3, r3, r4
+	mov	r4, #0
+	b	lowlevel_address
+
+	@ Work through the scatter list, updating each entry as it is used
+lowlevel_scatter:
+	teq	r4, #0
+	beq	lowlevel_address
+	ldmia	r3, {r0, r1}		@ Entry address and length
+	cmn	r0, #0x10000		@ Address &FFFF0000 or above
+	addcs	r3, r3, r0		@ is an offset back to an earlier entry
+	bcs	lowlevel_scatter
+	teq	r1, #0
+	addeq	r3, r3, #8		@ Entry used up
+	beq	lowlevel_scatter
+
+	cmp	r1, r4
+	movhi	r1, r4
+	bl	transfer_run
+	bvs	lowlevel_error_address
+	sub	r4, r4, r1
+	ldmia	r3, {r0, r2}
+	add	r0, r0, r1
+	sub	r2, r2, r1
+	stmia	r3, {r0, r2}
+	b	lowlevel_scatter
+
+	@ Make the disc address to return from the byte offset
+lowlevel_address:
+	bl	disc_address
+lowlevel_done:
+	ldmfd	sp!, {r0, r1, r5 - r9, lr}
+	cmp	pc, #0		@ Clear V
+	mov	pc, lr
+
+lowlevel_error_address:
+	mov	r1, r0
+	bl	disc_address
+	mov	r0, r1
+	b	lowlevel_error
+
+lowlevel_no_drive:
+	adr	r0, err_drive_empty
+lowlevel_error:
+	add	sp, sp, #4		@ Discard the saved r0
+	ldmfd	sp!, {r1, r5 - r9, lr}
+	b	return_error
+
+
+	/* Convert a byte offset on a disc back to a disc address.
+	 *
+	 * Entry:
+	 *   r5 = pointer to disc record
+	 *   r6 = drive, counting from 0
+	 *   r8, r9 = byte offset on the disc, low and high words
+	 * Exit:
+	 *   r2 = disc address
+	 *   r0 corrupted, other registers preserved
+	 */
+disc_address:
+	ldrb	r0, [r5, #DiscRecord_BigFlag]
+	tst	r0, #1
+	moveq	r2, r8
+	beq	0f
+	ldrb	r0, [r5, #DiscRecord_Log2SecSize]
+	mov	r2, r8, lsr r0
+	rsb	r0, r0, #32
+	orr	r2, r2, r9, lsl r0
+0:	add	r0, r6, #FIRST_DRIVE
+	orr	r2, r2, r0, lsl #29
+	mov	pc, lr
+
+
+
+	/* FileCore miscellaneous entry
+	 *
+	 * Entry:
+	 *   r0 = reason code
+	 *   r1 = drive
+	 *   r8 = FileCore private word
+	 *   r12 = pointer to private word for this instantiation
+	 * Exit:
+	 *   V set and r0 = error, if failed
+	 */
+misc:
+	teq	r0, #MiscOp_Mount
+	beq	misc_mount
+	teq	r0, #MiscOp_PollChanged
+	beq	misc_poll_changed
+	teq	r0, #MiscOp_PollPeriod
+	beq	misc_poll_period
+	teq	r0, #MiscOp_LockDrive
+	teqne	r0, #MiscOp_UnlockDrive
+	teqne	r0, #MiscOp_Eject
+	beq	misc_done		@ Discs are fixed
+
+	adr	r0, err_bad_op
+	b	return_error
+
+misc_done:
+	cmp	pc, #0		@ Clear V
+	mov	pc, lr
+
+	/* MiscOp_PollChanged
+	 *
+	 * Exit:
+	 *   r2 = sequence number, unchanged
+	 *   r3 = status flags
+	 */
+misc_poll_changed:
+	mov	r3, #(PollChanged_NotChanged | PollChanged_ChangedWorks)
+	b	misc_done
+
+	/* MiscOp_PollPeriod
+	 *
+	 * Exit:
+	 *   r5 = poll period, -1 as the discs never change
+	 *   r6 = name of the media
+	 */
+misc_poll_period:
+	mvn	r5, #0
+	adr	r6, media_name
+	b	misc_done
+
+media_name:
+	.string	"disc"
+	.align
+
+	/* MiscOp_Mount
+	 *
+	 * Entry:
+	 *   r2 = disc address to read from, in bytes as there is no disc
+	 *        record yet
+	 *   r3 = buffer
+	 *   r4 = length to read
+	 *   r5 = disc record to fill in
+	 */
+misc_mount:
+	stmfd	sp!, {r0 - r9, lr}
+
+	sub	r6, r1, #FIRST_DRIVE
+	cmp	r6, #BLOCKFS_DRIVES
+	bhs	misc_mount_no_drive
+
+	mov	r0, #BLOCKDEV_DESCRIBE
+	mov	r1, r6
+	swi	ArcEm_BlockDev
+	teq	r0, #0
+	bne	misc_mount_no_drive
+	cmp	r2, #MAX_DISC_SIZE_HIGH
+	bhs	misc_mount_too_big
+
+	@ Describe the disc until FileCore reads its real disc record
+	ldr	r5, [sp, #5 * 4]
+	mov	r7, #DiscRecord_Size
+0:	subs	r7, r7, #4
+	str	r0, [r5, r7]		@ r0 is 0
+	bne	0b
+	mov	r0, #9
+	strb	r0, [r5, #DiscRecord_Log2SecSize]
+	strb	r3, [r5, #DiscRecord_SecsPerTrk]
+	strb	r4, [r5, #DiscRecord_Heads]	@ Density 0 for a hard disc
+	str	r1, [r5, #DiscRecord_DiscSize]
+	str	r2, [r5, #DiscRecord_DiscSize2]
+	mov	r0, #0			@ Big if sectors must be addressed
+	cmp	r1, #SMALL_DISC_SIZE
+	movhi	r0, #1
+	teq	r2, #0
+	movne	r0, #1
+	strb	r0, [r5, #DiscRecord_BigFlag]
+
+	ldr	r8, [sp, #2 * 4]
+	mov	r9, #0
+	ldr	r0, [sp, #3 * 4]
+	ldr	r1, [sp, #4 * 4]
+	mov	r7, #BLOCKDEV_READ
+	bl	transfer_run
+	bvs	misc_mount_error
+
+	ldmfd	sp!, {r0 - r9, lr}
+	b	misc_done
+
+misc_mount_too_big:
+	adr	r0, err_disc_too_big
+	b	misc_mount_error
+
+misc_mount_no_drive:
+	adr	r0, err_drive_empty
+misc_mount_error:
+	add	sp, sp, #4		@ Discard the saved r0
+	ldmfd	sp!, {r1 - r9, lr}
+	b	return_error
+
+
+
+	@ Errors
+err_disc_error:
+	.int	0x10000 | (FILING_SYSTEM_NUMBER << 8) | 0xc7
+	.string	"Disc error"
+	.align
+
+err_drive_empty:
+	.int	0x10000 | (FILING_SYSTEM_NUMBER << 8) | 0xd3
+	.string	"Drive empty"
+	.align
+
+err_disc_too_big:
+	.int	0x10000 | (FILING_SYSTEM_NUMBER << 8) | 0xc8
+	.string	"Disc too big for BlockFS, the limit is 256GB"
+	.align
+
+err_bad_op:
+	.int	0x10000 | (FILING_SYSTEM_NUMBER << 8) | 0xb7
+	.string	"Operation not supported by BlockFS"
+	.align
@@ -29,6 +29,7 @@
 #include "mem.h"
 #include "keyboard.h"
 #include "hostfs.h"
+#include "blockdev.h"
 
 #ifdef RPCEMU_NETWORKING
 #include "network.h"
@@ -627,6 +628,10 @@ opSWI(uint32_t opcode)
 		state.Reg = arm.reg;
 		hostfs(&state);
 
+	} else if (swinum == ARCEM_SWI_BLOCKDEV) {
+		blockdev_swi(arm.reg);
+		arm.reg[cpsr] &= ~VFLAG;
+
 	}
 #ifdef RPCEMU_NETWORKING
 	else if (swinum == ARCEM_SWI_NETWORK) {
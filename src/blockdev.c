@@ -0,0 +1,201 @@
+/*
+  RPCEmu - An Acorn system emulator
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Paravirtual block device
+
+   Gives a FileCore driver running in the guest (riscos-progs/BlockFS)
+   access to hard disc images without going through the IDE emulation. A
+   single SWI moves any number of bytes between the image and the guest's
+   buffer, so long transfers run at the speed of the host disc rather than
+   one sector per PIO interrupt.
+
+   The discs are the images blk4.hdf and blk5.hdf in the user directory,
+   used if they exist. They have the same layout as IDE images, so a copy
+   of hd4.hdf can be used. An image must not be used as an IDE disc at the
+   same time, as the two filing systems would each cache its contents.
+
+   SWI ArcEm_BlockDev (ARCEM_SWI_CHUNK + 5)
+
+     r0 = BLOCKDEV_DESCRIBE
+     r1 = drive (0 or 1)
+   returns
+     r0 = result
+     r1 = disc size in bytes, low word
+     r2 = disc size in bytes, high word
+     r3 = sectors per track
+     r4 = heads
+
+     r0 = BLOCKDEV_READ or BLOCKDEV_WRITE
+     r1 = drive
+     r2 = disc address in bytes, low word
+     r3 = disc address in bytes, high word
+     r4 = logical address of buffer
+     r5 = length in bytes
+   returns
+     r0 = result
+
+   Results are the BLOCKDEV_OK and BLOCKDEV_ERR_* values.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "rpcemu.h"
+#include "mem.h"
+#include "hdimage.h"
+#include "hdfile.h"
+#include "blockdev.h"
+
+#define BLOCKDEV_FIRST_HDIMAGE	2	/**< hdimage drive number of block device drive 0 */
+#define BLOCKDEV_CHUNK		(256 * 1024)	/**< Bytes moved through the host buffer at a time */
+
+static struct {
+	int present;		/**< An image is open */
+	int spt, hpc;		/**< Geometry from the disc record */
+	int64_t skip;		/**< Bytes before the start of the disc */
+} blockdev[BLOCKDEV_DRIVES];
+
+static uint8_t blockdev_buffer[BLOCKDEV_CHUNK];
+
+/**
+ * @param drive Block device drive number
+ * @return Size of the disc in bytes, not counting any bytes before its start
+ */
+static int64_t
+blockdev_size(int drive)
+{
+	const int64_t size = hdimage_size(BLOCKDEV_FIRST_HDIMAGE + drive) - blockdev[drive].skip;
+
+	return (size > 0) ? size : 0;
+}
+
+/**
+ * Move data between a disc and the guest.
+ *
+ * @param drive   Block device drive number
+ * @param offset  Disc address in bytes
+ * @param addr    Logical address of the guest's buffer
+ * @param len     Number of bytes
+ * @param writing Write to the disc, rather than read from it
+ * @return BLOCKDEV_OK, BLOCKDEV_ERR_RANGE or BLOCKDEV_ERR_IO
+ */
+static uint32_t
+blockdev_transfer(int drive, int64_t offset, uint32_t addr, uint32_t len, int writing)
+{
+	const int hdrive = BLOCKDEV_FIRST_HDIMAGE + drive;
+	const int64_t size = blockdev_size(drive);
+
+	if (offset < 0 || len > size || offset > size - len) {
+		return BLOCKDEV_ERR_RANGE;
+	}
+	offset += blockdev[drive].skip;
+
+	while (len > 0) {
+		const uint32_t n = (len < BLOCKDEV_CHUNK) ? len : BLOCKDEV_CHUNK;
+
+		if (writing) {
+			mem_copy_from_guest(blockdev_buffer, addr, n);
+			if (!hdimage_write_sync(hdrive, offset, blockdev_buffer, n)) {
+				return BLOCKDEV_ERR_IO;
+			}
+		} else {
+			if (!hdimage_read_sync(hdrive, offset, blockdev_buffer, n)) {
+				return BLOCKDEV_ERR_IO;
+			}
+			mem_copy_to_guest(addr, blockdev_buffer, n);
+		}
+
+		offset += n;
+		addr += n;
+		len -= n;
+	}
+	return BLOCKDEV_OK;
+}
+
+/**
+ * Handle the ArcEm_BlockDev SWI.
+ *
+ * @param reg ARM registers, updated with the results
+ */
+void
+blockdev_swi(uint32_t *reg)
+{
+	const uint32_t drive = reg[1];
+	int64_t size;
+
+	if (reg[0] > BLOCKDEV_WRITE) {
+		reg[0] = BLOCKDEV_ERR_BAD_REASON;
+		return;
+	}
+	if (drive >= BLOCKDEV_DRIVES || !blockdev[drive].present) {
+		reg[0] = BLOCKDEV_ERR_NO_DRIVE;
+		return;
+	}
+
+	switch (reg[0]) {
+	case BLOCKDEV_DESCRIBE:
+		size = blockdev_size((int) drive);
+		reg[0] = BLOCKDEV_OK;
+		reg[1] = (uint32_t) size;
+		reg[2] = (uint32_t) (size >> 32);
+		reg[3] = (uint32_t) blockdev[drive].spt;
+		reg[4] = (uint32_t) blockdev[drive].hpc;
+		break;
+
+	case BLOCKDEV_READ:
+	case BLOCKDEV_WRITE:
+		reg[0] = blockdev_transfer((int) drive, (int64_t) (((uint64_t) reg[3] << 32) | reg[2]),
+		                           reg[4], reg[5], reg[0] == BLOCKDEV_WRITE);
+		break;
+	}
+}
+
+/**
+ * Open the block device's images, closing any that were open.
+ */
+void
+blockdev_reset(void)
+{
+	int d;
+
+	for (d = 0; d < BLOCKDEV_DRIVES; d++) {
+		char pathname[512];
+		struct stat st;
+		int skip;
+
+		hdimage_close(BLOCKDEV_FIRST_HDIMAGE + d);
+		blockdev[d].present = 0;
+
+		/* Unlike IDE discs, the images are not created if missing */
+		snprintf(pathname, sizeof(pathname), "%sblk%d.hdf", rpcemu_get_userdir(), d + 4);
+		if (stat(pathname, &st) != 0) {
+			continue;
+		}
+
+		if (!hdimage_open(BLOCKDEV_FIRST_HDIMAGE + d, pathname)) {
+			error("BlockDev: drive %d not available: %s", d + 4, hdfile_error());
+			continue;
+		}
+		hdimage_geometry(BLOCKDEV_FIRST_HDIMAGE + d, &blockdev[d].spt, &blockdev[d].hpc, &skip);
+		blockdev[d].skip = (int64_t) skip * HDIMAGE_SECTOR_SIZE;
+		blockdev[d].present = 1;
+		rpclog("BlockDev: drive %d is '%s'\n", d + 4, pathname);
+	}
+}
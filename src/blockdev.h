@@ -0,0 +1,49 @@
+/*
+  RPCEmu - An Acorn system emulator
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef BLOCKDEV_H
+#define BLOCKDEV_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#define BLOCKDEV_DRIVES	2
+
+/* Reason codes, passed in r0 */
+#define BLOCKDEV_DESCRIBE	0
+#define BLOCKDEV_READ		1
+#define BLOCKDEV_WRITE		2
+
+/* Results, returned in r0 */
+#define BLOCKDEV_OK		0
+#define BLOCKDEV_ERR_NO_DRIVE	1	/**< No image for this drive */
+#define BLOCKDEV_ERR_IO		2	/**< Host failed to read or write the image */
+#define BLOCKDEV_ERR_BAD_REASON	3	/**< Unknown reason code */
+#define BLOCKDEV_ERR_RANGE	4	/**< Transfer runs past the end of the disc */
+
+extern void blockdev_swi(uint32_t *reg);
+extern void blockdev_reset(void);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* BLOCKDEV_H */
@@ -0,0 +1,677 @@
+/*
+  RPCEmu - An Acorn system emulator
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Capture of the emulated machine's sound and video output to files
+
+   A capture writes into a directory chosen by the user:
+
+   audio.wav      The sound stream as sent to the host, after conversion to
+                  the host's sample rate (16-bit stereo PCM).
+   video-NNN.y4m  The frames completed by the video thread, as uncompressed
+                  YUV 4:4:4. A new file is started whenever the screen mode
+                  changes size, as Y4M cannot change size mid-stream.
+   timing.txt     One line per audio block, audio underrun and video frame,
+                  with the time in microseconds since the capture started.
+                  Frame pacing, frames skipped by the emulator and gaps in
+                  the sound can be found from this afterwards.
+
+   Audio is written from the sound thread, under capture_mutex. Completed
+   frames are copied into a short queue while the video mutex is held, and
+   converted and written to the Y4M files by a capture writer thread, so the
+   emulator never waits for the conversion or the disc. A frame that arrives
+   while the queue is full is dropped, and recorded as such in timing.txt.
+
+   The capture stops by itself if writing to any of the files fails, or if
+   audio.wav reaches the 4GB limit of the WAV format.
+*/
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rpcemu.h"
+#include "capture.h"
+
+#define WAV_HEADER_SIZE	44
+#define WAV_DATA_MAX	(0xffffffffu - (WAV_HEADER_SIZE - 8))	/**< Largest data chunk the RIFF sizes can describe */
+
+#define CAPTURE_QUEUE	2	/**< Frames that can wait for the writer thread */
+
+/** A completed frame waiting to be written by the writer thread */
+typedef struct {
+	uint32_t *bitmap;	/**< Copy of the frame's pixels */
+	size_t bitmap_size;	/**< Allocated size of bitmap, in pixels */
+	int xsize;
+	int ysize;
+	int double_size;
+	int refresh;		/**< Nominal frame rate, for the Y4M header */
+	int new_file;		/**< Non-zero to start a new Y4M file with this frame */
+	unsigned file_index;	/**< Number of the video-NNN.y4m this frame belongs in */
+} CaptureFrame;
+
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t capture_cond = PTHREAD_COND_INITIALIZER;	/**< Signalled when a frame is queued or the capture stops */
+static atomic_int capture_active = 0;	/**< Quick check made outside the mutex */
+
+static char *capture_dir = NULL;	/**< Directory the files are written to, freed once the writer thread has finished */
+static struct timespec capture_epoch;	/**< Time the capture started */
+static FILE *capture_timing = NULL;
+
+static FILE *capture_wav = NULL;
+static uint32_t capture_wav_rate = 0;	/**< Sample rate of the data in audio.wav */
+static uint64_t capture_wav_frames = 0;	/**< Stereo samples written to audio.wav */
+
+static unsigned capture_y4m_index = 0;	/**< Number of Y4M files started */
+static int capture_y4m_xsize, capture_y4m_ysize, capture_y4m_double;	/**< Size of frames in the current Y4M file */
+static uint32_t capture_frames = 0;	/**< Frames queued, across all files */
+
+static CaptureFrame capture_queue[CAPTURE_QUEUE];
+static unsigned capture_queue_head = 0;	/**< Index of the oldest queued frame */
+static unsigned capture_queue_count = 0;	/**< Frames queued, including the one being written */
+
+static pthread_t capture_writer;
+static int capture_writer_running = 0;	/**< Writer thread needs joining, only used by the GUI thread */
+
+/**
+ * Return the time since the capture started.
+ *
+ * @return Time in microseconds
+ */
+static uint64_t
+capture_time(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) (now.tv_sec - capture_epoch.tv_sec) * 1000000 +
+	       (now.tv_nsec - capture_epoch.tv_nsec) / 1000;
+}
+
+/**
+ * Store a 16 or 32-bit value in little-endian order.
+ *
+ * @param p     Destination
+ * @param value Value to store
+ * @param bytes Size of value in bytes
+ */
+static void
+capture_put_le(uint8_t *p, uint32_t value, int bytes)
+{
+	int i;
+
+	for (i = 0; i < bytes; i++) {
+		p[i] = (uint8_t) (value >> (i * 8));
+	}
+}
+
+/**
+ * Write (or rewrite) the header of audio.wav from the data written so far.
+ *
+ * @return Non-zero on success
+ */
+static int
+capture_wav_header(void)
+{
+	const uint32_t data_size = (uint32_t) (capture_wav_frames * 4);
+	uint8_t header[WAV_HEADER_SIZE];
+
+	assert(capture_wav_frames * 4 <= WAV_DATA_MAX);
+
+	memcpy(&header[0], "RIFF", 4);
+	capture_put_le(&header[4], data_size + WAV_HEADER_SIZE - 8, 4);
+	memcpy(&header[8], "WAVE", 4);
+	memcpy(&header[12], "fmt ", 4);
+	capture_put_le(&header[16], 16, 4);			/* Format chunk size */
+	capture_put_le(&header[20], 1, 2);			/* PCM */
+	capture_put_le(&header[22], 2, 2);			/* Channels */
+	capture_put_le(&header[24], capture_wav_rate, 4);
+	capture_put_le(&header[28], capture_wav_rate * 4, 4);	/* Bytes per second */
+	capture_put_le(&header[32], 4, 2);			/* Bytes per frame */
+	capture_put_le(&header[34], 16, 2);			/* Bits per sample */
+	memcpy(&header[36], "data", 4);
+	capture_put_le(&header[40], data_size, 4);
+
+	return fseek(capture_wav, 0, SEEK_SET) == 0 &&
+	       fwrite(header, 1, sizeof(header), capture_wav) == sizeof(header) &&
+	       fseek(capture_wav, 0, SEEK_END) == 0;
+}
+
+/**
+ * Open a file within the capture directory.
+ *
+ * @param name Leafname of file
+ * @return File handle, or NULL on failure
+ */
+static FILE *
+capture_open(const char *name)
+{
+	char path[1024];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", capture_dir, name);
+	f = fopen(path, "wb");
+	if (f == NULL) {
+		error("Unable to create capture file '%s'", path);
+	}
+	return f;
+}
+
+/**
+ * Close all the capture files. Must be called with capture_mutex held.
+ * The writer thread finishes any frames already queued and then exits.
+ */
+static void
+capture_close_locked(void)
+{
+	if (!atomic_load(&capture_active)) {
+		return;
+	}
+	atomic_store(&capture_active, 0);
+	pthread_cond_signal(&capture_cond);
+
+	if (capture_wav != NULL) {
+		if (!capture_wav_header() || fclose(capture_wav) != 0) {
+			error("Unable to complete capture file '%s/audio.wav'", capture_dir);
+		}
+		capture_wav = NULL;
+	}
+	if (capture_timing != NULL) {
+		if (fclose(capture_timing) != 0) {
+			error("Unable to complete capture file '%s/timing.txt'", capture_dir);
+		}
+		capture_timing = NULL;
+	}
+
+	rpclog("capture: stopped, %u frames and %llu audio samples written to '%s'\n",
+	       capture_frames, (unsigned long long) capture_wav_frames, capture_dir);
+}
+
+/**
+ * Stop the capture after writing to one of its files failed. Must be called
+ * with capture_mutex held.
+ *
+ * @param name Leafname of file that could not be written
+ */
+static void
+capture_write_failed(const char *name)
+{
+	if (!atomic_load(&capture_active)) {
+		return;
+	}
+	error("Writing to capture file '%s/%s' failed, capture stopped", capture_dir, name);
+	capture_close_locked();
+}
+
+/**
+ * Wait for the writer thread of the previous capture to finish, and free
+ * what it was using. Called from the GUI thread, without capture_mutex held.
+ */
+static void
+capture_finish(void)
+{
+	unsigned i;
+
+	if (capture_writer_running) {
+		pthread_join(capture_writer, NULL);
+		capture_writer_running = 0;
+	}
+
+	for (i = 0; i < CAPTURE_QUEUE; i++) {
+		free(capture_queue[i].bitmap);
+		capture_queue[i].bitmap = NULL;
+		capture_queue[i].bitmap_size = 0;
+	}
+	capture_queue_head = 0;
+	capture_queue_count = 0;
+
+	free(capture_dir);
+	capture_dir = NULL;
+}
+
+/**
+ * Write one queued frame to its Y4M file, starting the file first if
+ * needed. Called from the writer thread without capture_mutex held; the
+ * frame is not touched by anyone else until it is removed from the queue.
+ *
+ * @param frame    Frame to write
+ * @param y4m      Current Y4M file, updated when a new one is started
+ * @param yuv      Conversion buffer, reallocated as needed
+ * @param yuv_size Size of conversion buffer
+ * @return Non-zero on success
+ */
+static int
+capture_write_frame(const CaptureFrame *frame, FILE **y4m, uint8_t **yuv, size_t *yuv_size)
+{
+	const size_t plane = (size_t) frame->xsize * frame->ysize;
+	uint8_t *y, *u, *v;
+	size_t i;
+
+	if (frame->new_file) {
+		char name[32];
+		int aspect_x = 1, aspect_y = 1;
+
+		if (*y4m != NULL) {
+			FILE *old = *y4m;
+
+			*y4m = NULL;
+			if (fclose(old) != 0) {
+				return 0;
+			}
+		}
+
+		snprintf(name, sizeof(name), "video-%03u.y4m", frame->file_index);
+		*y4m = capture_open(name);
+		if (*y4m == NULL) {
+			return 0;
+		}
+
+		/* Pixels of modes that are doubled in one direction are not square */
+		if (frame->double_size == VIDC_DOUBLE_X) {
+			aspect_x = 2;
+		} else if (frame->double_size == VIDC_DOUBLE_Y) {
+			aspect_y = 2;
+		}
+
+		/* The nominal rate is the host refresh rate, timing.txt has the
+		   actual time of each frame */
+		if (fprintf(*y4m, "YUV4MPEG2 W%d H%d F%d:1 Ip A%d:%d C444\n",
+		            frame->xsize, frame->ysize, frame->refresh, aspect_x, aspect_y) < 0)
+		{
+			return 0;
+		}
+	}
+
+	if (plane * 3 > *yuv_size) {
+		free(*yuv);
+		*yuv = malloc(plane * 3);
+		if (*yuv == NULL) {
+			fatal("Out of memory for capture");
+		}
+		*yuv_size = plane * 3;
+	}
+
+	/* Convert from host RGB to BT.601 studio range YUV, full resolution
+	   in all three planes */
+	y = *yuv;
+	u = y + plane;
+	v = u + plane;
+	for (i = 0; i < plane; i++) {
+		const int r = (frame->bitmap[i] >> 16) & 0xff;
+		const int g = (frame->bitmap[i] >> 8) & 0xff;
+		const int b = frame->bitmap[i] & 0xff;
+
+		y[i] = (uint8_t) (((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+		u[i] = (uint8_t) (((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+		v[i] = (uint8_t) (((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+	}
+
+	return fputs("FRAME\n", *y4m) >= 0 &&
+	       fwrite(*yuv, 1, plane * 3, *y4m) == plane * 3;
+}
+
+/**
+ * Capture writer thread. Writes queued frames until the capture stops and
+ * the queue is empty.
+ *
+ * @param arg Unused
+ * @return NULL
+ */
+static void *
+capture_writer_thread(void *arg)
+{
+	FILE *y4m = NULL;
+	uint8_t *yuv = NULL;
+	size_t yuv_size = 0;
+	unsigned file_index = 0;
+
+	NOT_USED(arg);
+
+	pthread_mutex_lock(&capture_mutex);
+	for (;;) {
+		const CaptureFrame *frame;
+		int ok;
+
+		while (capture_queue_count == 0 && atomic_load(&capture_active)) {
+			pthread_cond_wait(&capture_cond, &capture_mutex);
+		}
+		if (capture_queue_count == 0) {
+			break;
+		}
+		frame = &capture_queue[capture_queue_head];
+		file_index = frame->file_index;
+		pthread_mutex_unlock(&capture_mutex);
+
+		ok = capture_write_frame(frame, &y4m, &yuv, &yuv_size);
+
+		pthread_mutex_lock(&capture_mutex);
+		capture_queue_head = (capture_queue_head + 1) % CAPTURE_QUEUE;
+		capture_queue_count--;
+		if (!ok) {
+			char name[32];
+
+			snprintf(name, sizeof(name), "video-%03u.y4m", file_index);
+			capture_write_failed(name);
+
+			/* Nothing more can be written, drop anything still queued */
+			capture_queue_count = 0;
+		}
+	}
+	pthread_mutex_unlock(&capture_mutex);
+
+	if (y4m != NULL && fclose(y4m) != 0) {
+		error("Unable to complete capture file '%s/video-%03u.y4m'", capture_dir, file_index);
+	}
+	free(yuv);
+
+	return NULL;
+}
+
+/**
+ * Start capturing sound and video into the given directory. Any files
+ * from an earlier capture in the same directory are overwritten.
+ *
+ * @param dir Directory to write the capture files to
+ * @return 1 on success, 0 if the files could not be created
+ */
+int
+capture_start(const char *dir)
+{
+	assert(dir);
+
+	pthread_mutex_lock(&capture_mutex);
+	capture_close_locked();
+	pthread_mutex_unlock(&capture_mutex);
+	capture_finish();
+
+	pthread_mutex_lock(&capture_mutex);
+
+	capture_dir = strdup(dir);
+	if (capture_dir == NULL) {
+		fatal("Out of memory for capture");
+	}
+
+	capture_timing = capture_open("timing.txt");
+	capture_wav = capture_open("audio.wav");
+	if (capture_timing == NULL || capture_wav == NULL) {
+		if (capture_timing != NULL) {
+			fclose(capture_timing);
+			capture_timing = NULL;
+		}
+		if (capture_wav != NULL) {
+			fclose(capture_wav);
+			capture_wav = NULL;
+		}
+		free(capture_dir);
+		capture_dir = NULL;
+		pthread_mutex_unlock(&capture_mutex);
+		return 0;
+	}
+
+	/* Reserve space for the header, filled in when the capture stops */
+	capture_wav_rate = 0;
+	capture_wav_frames = 0;
+
+	if (fprintf(capture_timing,
+	            "# RPCEmu capture, times in microseconds since start\n"
+	            "# A time first_sample samples\n"
+	            "# U time sample\n"
+	            "# V time frame seq file width height first_row last_row\n"
+	            "# D time seq (frame dropped, writer thread behind)\n") < 0 ||
+	    !capture_wav_header())
+	{
+		error("Writing to capture files in '%s' failed", capture_dir);
+		fclose(capture_timing);
+		capture_timing = NULL;
+		fclose(capture_wav);
+		capture_wav = NULL;
+		free(capture_dir);
+		capture_dir = NULL;
+		pthread_mutex_unlock(&capture_mutex);
+		return 0;
+	}
+
+	capture_y4m_index = 0;
+	capture_y4m_xsize = 0;
+	capture_y4m_ysize = 0;
+	capture_y4m_double = 0;
+	capture_frames = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &capture_epoch);
+	atomic_store(&capture_active, 1);
+
+	if (pthread_create(&capture_writer, NULL, capture_writer_thread, NULL)) {
+		fatal("Couldn't create capture thread");
+	}
+	capture_writer_running = 1;
+
+	rpclog("capture: started, writing to '%s'\n", capture_dir);
+
+	pthread_mutex_unlock(&capture_mutex);
+	return 1;
+}
+
+/**
+ * Stop capturing, completing and closing all the files.
+ */
+void
+capture_stop(void)
+{
+	pthread_mutex_lock(&capture_mutex);
+	capture_close_locked();
+	pthread_mutex_unlock(&capture_mutex);
+	capture_finish();
+}
+
+/**
+ * Is a capture in progress?
+ *
+ * @return Non-zero if capturing
+ */
+int
+capture_is_active(void)
+{
+	return atomic_load_explicit(&capture_active, memory_order_relaxed);
+}
+
+/**
+ * Record a block of sound as it is passed to the host. Called from the
+ * sound thread.
+ *
+ * @param samples Interleaved stereo 16-bit samples
+ * @param frames  Number of stereo samples
+ * @param rate    Sample rate in Hz
+ */
+void
+capture_audio(const int16_t *samples, uint32_t frames, uint32_t rate)
+{
+	if (!capture_is_active()) {
+		return;
+	}
+
+	pthread_mutex_lock(&capture_mutex);
+	if (capture_wav == NULL) {
+		pthread_mutex_unlock(&capture_mutex);
+		return;
+	}
+
+	if ((capture_wav_frames + frames) * 4 > WAV_DATA_MAX) {
+		error("Capture file '%s/audio.wav' reached the 4GB limit of the WAV format, capture stopped",
+		      capture_dir);
+		capture_close_locked();
+		pthread_mutex_unlock(&capture_mutex);
+		return;
+	}
+
+	if (capture_wav_rate == 0) {
+		capture_wav_rate = rate;
+	} else if (rate != capture_wav_rate) {
+		/* The host rate is fixed once the sound device is open */
+		rpclog("capture: sound rate changed from %u to %u, audio.wav will play at the wrong speed\n",
+		       capture_wav_rate, rate);
+		capture_wav_rate = rate;
+	}
+
+	if (fprintf(capture_timing, "A %llu %llu %u\n", (unsigned long long) capture_time(),
+	            (unsigned long long) capture_wav_frames, frames) < 0)
+	{
+		capture_write_failed("timing.txt");
+		pthread_mutex_unlock(&capture_mutex);
+		return;
+	}
+
+#ifdef _RPCEMU_BIG_ENDIAN
+	{
+		uint8_t le[256 * 4];
+		uint32_t done = 0;
+
+		while (done < frames) {
+			uint32_t run = frames - done;
+			uint32_t i;
+
+			if (run > 256) {
+				run = 256;
+			}
+			for (i = 0; i < run * 2; i++) {
+				capture_put_le(&le[i * 2], (uint16_t) samples[done * 2 + i], 2);
+			}
+			if (fwrite(le, 4, run, capture_wav) != run) {
+				break;
+			}
+			done += run;
+		}
+		capture_wav_frames += done;
+		if (done != frames) {
+			capture_write_failed("audio.wav");
+		}
+	}
+#else
+	{
+		const size_t done = fwrite(samples, 4, frames, capture_wav);
+
+		capture_wav_frames += done;
+		if (done != frames) {
+			capture_write_failed("audio.wav");
+		}
+	}
+#endif
+
+	pthread_mutex_unlock(&capture_mutex);
+}
+
+/**
+ * Record that the host ran out of sound to play. Called from the sound
+ * thread.
+ */
+void
+capture_audio_underrun(void)
+{
+	if (!capture_is_active()) {
+		return;
+	}
+
+	pthread_mutex_lock(&capture_mutex);
+	if (capture_timing != NULL) {
+		if (fprintf(capture_timing, "U %llu %llu\n", (unsigned long long) capture_time(),
+		            (unsigned long long) capture_wav_frames) < 0)
+		{
+			capture_write_failed("timing.txt");
+		}
+	}
+	pthread_mutex_unlock(&capture_mutex);
+}
+
+/**
+ * Record a completed frame. Called when holding the video mutex, before the
+ * frame is handed to the GUI. The frame is copied into the queue for the
+ * writer thread, which does the conversion and writing.
+ *
+ * @param frame Completed frame
+ */
+void
+capture_video(const VideoFrame *frame)
+{
+	const size_t pixels = (size_t) frame->xsize * frame->ysize;
+	CaptureFrame *queued;
+
+	if (!capture_is_active()) {
+		return;
+	}
+
+	pthread_mutex_lock(&capture_mutex);
+	if (capture_timing == NULL) {
+		pthread_mutex_unlock(&capture_mutex);
+		return;
+	}
+
+	if (capture_queue_count == CAPTURE_QUEUE) {
+		if (fprintf(capture_timing, "D %llu %u\n", (unsigned long long) capture_time(),
+		            frame->seq) < 0)
+		{
+			capture_write_failed("timing.txt");
+		}
+		pthread_mutex_unlock(&capture_mutex);
+		return;
+	}
+
+	queued = &capture_queue[(capture_queue_head + capture_queue_count) % CAPTURE_QUEUE];
+
+	if (pixels > queued->bitmap_size) {
+		free(queued->bitmap);
+		queued->bitmap = malloc(pixels * sizeof(uint32_t));
+		if (queued->bitmap == NULL) {
+			fatal("Out of memory for capture");
+		}
+		queued->bitmap_size = pixels;
+	}
+
+	queued->new_file = 0;
+	if (capture_y4m_index == 0 || frame->xsize != capture_y4m_xsize ||
+	    frame->ysize != capture_y4m_ysize || frame->double_size != capture_y4m_double)
+	{
+		queued->new_file = 1;
+		capture_y4m_index++;
+		capture_y4m_xsize = frame->xsize;
+		capture_y4m_ysize = frame->ysize;
+		capture_y4m_double = frame->double_size;
+	}
+	queued->file_index = capture_y4m_index - 1;
+	queued->xsize = frame->xsize;
+	queued->ysize = frame->ysize;
+	queued->double_size = frame->double_size;
+	queued->refresh = config.refresh;
+
+	if (fprintf(capture_timing, "V %llu %u %u %u %d %d %d %d\n", (unsigned long long) capture_time(),
+	            capture_frames, frame->seq, queued->file_index,
+	            frame->xsize, frame->ysize, frame->yl, frame->yh) < 0)
+	{
+		capture_write_failed("timing.txt");
+		pthread_mutex_unlock(&capture_mutex);
+		return;
+	}
+
+	memcpy(queued->bitmap, frame->bitmap, pixels * sizeof(uint32_t));
+	capture_queue_count++;
+	capture_frames++;
+	pthread_cond_signal(&capture_cond);
+
+	pthread_mutex_unlock(&capture_mutex);
+}
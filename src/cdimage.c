@@ -0,0 +1,1349 @@
+/*
+  RPCEmu - An Acorn system emulator
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* CD-ROM image file formats
+
+   ISO images hold the 2048 bytes of user data of each sector of a single
+   data track.
+
+   BIN/CUE images are a text cue sheet (recognised by a .cue extension)
+   describing one or more tracks held in one or more binary files. Files
+   of type BINARY and MOTOROLA (big-endian audio) are supported, with
+   tracks of type MODE1/2048, MODE1/2352, MODE2/2336, MODE2/2352 (form 1
+   data) and AUDIO. PREGAP adds silence that is not held in the file;
+   INDEX 01 gives the start of each track and other indexes are ignored.
+
+   Compressed images hold the tracks as one stream of sectors, 2048 bytes
+   for each data sector and 2352 for each audio sector, divided into
+   hunks that are each compressed on their own with the scheme in lz.c.
+   The file is laid out as:
+
+   0           Header: magic, version, hunk size, track and hunk counts,
+               stream length, offset of the hunk index, and the track
+               table at COMPRESSED_TRACKS_OFFSET.
+   2KB...      Compressed hunks, in order.
+   End         Hunk index: an 8-byte file offset and 4-byte length for
+               each hunk. A length of 0 is a hunk of zeros, and a length
+               equal to the hunk size means the hunk is stored uncompressed.
+
+   All values are little-endian. Decompressed hunks are kept in a small
+   LRU cache.
+
+   Reads from plain files (ISO and BIN) are read ahead: once reading is
+   sequential, a window of sectors is fetched with one read. Alternatively
+   the files can be mapped into memory.
+
+   This file does not depend on the rest of the emulator, so it can be
+   built into the cdcompress tool.
+*/
+#define _FILE_OFFSET_BITS 64
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined WIN32 || defined _WIN32
+#include <io.h>
+#define fsync(fd) _commit(fd)
+#elif !defined __EMSCRIPTEN__
+#define CDIMAGE_MMAP
+#include <sys/mman.h>
+#endif
+
+#include "cdimage.h"
+#include "hostio.h"
+#include "lz.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define COMPRESSED_MAGIC	"RPCEmuCD"
+#define COMPRESSED_VERSION	1
+#define COMPRESSED_HUNK_SIZE	65536
+#define COMPRESSED_TRACKS_OFFSET 64	/**< Offset of track table in header */
+#define COMPRESSED_TRACK_ENTRY	16	/**< Bytes per track table entry */
+#define COMPRESSED_HEADER_SIZE	2048
+#define COMPRESSED_INDEX_ENTRY	12	/**< Bytes per hunk index entry */
+#define COMPRESSED_CACHE	8	/**< Decompressed hunks held in memory */
+
+#define CDIMAGE_READAHEAD_MAX	1024	/**< Limit on the read-ahead window, in sectors */
+#define CDIMAGE_FRAMES_PER_SECOND 75
+
+typedef enum {
+	CDIMAGE_PLAIN,
+	CDIMAGE_COMPRESSED
+} CdImageType;
+
+/** Where and how a track is stored */
+typedef struct {
+	CdTrackInfo info;
+	int file;		/**< Index into files[], plain images only */
+	int64_t offset;		/**< Offset of the first sector in its file, or in the compressed stream */
+	int sector_size;	/**< Bytes stored for each sector */
+	int data_offset;	/**< Offset of the user data within a stored sector */
+	int swap;		/**< Audio samples are stored big-endian */
+} CdTrack;
+
+/** A file holding tracks of a plain image */
+typedef struct {
+	int fd;
+	int64_t size;
+	uint8_t *map;		/**< Mapping of the file, NULL if not mapped */
+} CdFile;
+
+/** A decompressed hunk of a compressed image */
+typedef struct {
+	int64_t hunk;		/**< Hunk number held, or -1 if unused */
+	uint32_t used;		/**< Value of cache_clock when last used */
+	uint8_t *data;
+} CdCacheHunk;
+
+struct CdImage {
+	CdImageType type;
+	CdTrack tracks[CDIMAGE_MAX_TRACKS];
+	int ntracks;
+	CdFile files[CDIMAGE_MAX_TRACKS];
+	int nfiles;
+
+	/* Plain images only */
+	uint8_t *window;	/**< Data read ahead */
+	size_t window_size;	/**< Capacity of window */
+	int window_file;	/**< File the window holds data from, -1 if empty */
+	int64_t window_start;	/**< Offset in the file of the window */
+	size_t window_len;	/**< Bytes held in the window */
+	int64_t last_end;	/**< End of the last read, to detect sequential access */
+
+	/* Compressed images only */
+	int fd;
+	uint32_t hunk_size;
+	uint32_t nhunks;
+	int64_t stream_size;	/**< Length of the decompressed stream */
+	uint64_t *hunk_offset;
+	uint32_t *hunk_length;
+	CdCacheHunk cache[COMPRESSED_CACHE];
+	uint32_t cache_clock;	/**< Incremented on each cache access */
+	uint8_t *scratch;	/**< Compressed data of a hunk being loaded */
+};
+
+static _Thread_local char cdimage_errmsg[1280];	/**< Description of the last failure */
+
+/**
+ * Record a description of a failure, for cdimage_error().
+ *
+ * @param format printf-style format
+ */
+static void
+cdimage_set_error(const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	vsnprintf(cdimage_errmsg, sizeof(cdimage_errmsg), format, ap);
+	va_end(ap);
+}
+
+/**
+ * Return a description of the last failure.
+ *
+ * @return Message
+ */
+const char *
+cdimage_error(void)
+{
+	return cdimage_errmsg;
+}
+
+/**
+ * Read from a file, retrying short reads. Data beyond the end of the file
+ * reads as zeros.
+ *
+ * @param fd     File descriptor
+ * @param buf    Buffer to fill
+ * @param len    Number of bytes to read
+ * @param offset Offset within the file
+ * @return 0 on success, -1 on error
+ */
+static int
+cdimage_pread(int fd, void *buf, size_t len, int64_t offset)
+{
+	const ssize_t done = hostio_read(fd, buf, len, offset);
+
+	if (done < 0) {
+		cdimage_set_error("Read failed: %s", strerror(errno));
+		return -1;
+	}
+
+	memset((uint8_t *) buf + done, 0, len - (size_t) done);
+	return 0;
+}
+
+/**
+ * Write to a file, retrying short writes.
+ *
+ * @param fd  File descriptor
+ * @param buf Data to write
+ * @param len Number of bytes to write
+ * @return 0 on success, -1 on error
+ */
+static int
+cdimage_write(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t ret = write(fd, p + done, len - done);
+
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret <= 0) {
+			cdimage_set_error("Write failed: %s", strerror(errno));
+			return -1;
+		}
+		done += (size_t) ret;
+	}
+	return 0;
+}
+
+static void
+put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = (uint8_t) v;
+	p[1] = (uint8_t) (v >> 8);
+	p[2] = (uint8_t) (v >> 16);
+	p[3] = (uint8_t) (v >> 24);
+}
+
+static void
+put_le64(uint8_t *p, uint64_t v)
+{
+	put_le32(p, (uint32_t) v);
+	put_le32(p + 4, (uint32_t) (v >> 32));
+}
+
+static uint32_t
+get_le32(const uint8_t *p)
+{
+	return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+	       ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t
+get_le64(const uint8_t *p)
+{
+	return (uint64_t) get_le32(p) | ((uint64_t) get_le32(p + 4) << 32);
+}
+
+/**
+ * Open one of the files holding a plain image.
+ *
+ * @param img      Image
+ * @param pathname Path of file
+ * @return Index into img->files, or -1 on error
+ */
+static int
+cdimage_add_file(CdImage *img, const char *pathname)
+{
+	CdFile *file;
+	struct stat st;
+
+	if (img->nfiles == CDIMAGE_MAX_TRACKS) {
+		cdimage_set_error("Too many files in CD-ROM image");
+		return -1;
+	}
+	file = &img->files[img->nfiles];
+
+	file->fd = open(pathname, O_RDONLY | O_BINARY);
+	if (file->fd == -1) {
+		cdimage_set_error("Cannot open CD-ROM image '%s': %s", pathname, strerror(errno));
+		return -1;
+	}
+	if (fstat(file->fd, &st) != 0) {
+		cdimage_set_error("Unable to read size of '%s': %s", pathname, strerror(errno));
+		close(file->fd);
+		return -1;
+	}
+	file->size = st.st_size;
+	file->map = NULL;
+
+	return img->nfiles++;
+}
+
+/**
+ * Parse a time in the form mm:ss:ff from a cue sheet.
+ *
+ * @param s      Text
+ * @param frames Filled in with the time in frames (sectors)
+ * @return 0 on success, -1 if malformed
+ */
+static int
+cdimage_cue_time(const char *s, int32_t *frames)
+{
+	unsigned m, sec, f;
+
+	if (s == NULL || sscanf(s, "%u:%u:%u", &m, &sec, &f) != 3 || sec >= 60 ||
+	    f >= CDIMAGE_FRAMES_PER_SECOND || m > 99)
+	{
+		return -1;
+	}
+	*frames = (int32_t) ((m * 60 + sec) * CDIMAGE_FRAMES_PER_SECOND + f);
+	return 0;
+}
+
+/**
+ * Split the next word from a line of a cue sheet, which may be quoted.
+ *
+ * @param p Position in line, updated
+ * @return Word, terminated in place, or NULL at the end of the line
+ */
+static char *
+cdimage_cue_word(char **p)
+{
+	char *s = *p, *word;
+
+	while (isspace((unsigned char) *s)) {
+		s++;
+	}
+	if (*s == '\0') {
+		return NULL;
+	}
+	if (*s == '"') {
+		word = ++s;
+		while (*s != '\0' && *s != '"') {
+			s++;
+		}
+	} else {
+		word = s;
+		while (*s != '\0' && !isspace((unsigned char) *s)) {
+			s++;
+		}
+	}
+	if (*s != '\0') {
+		*s++ = '\0';
+	}
+	*p = s;
+	return word;
+}
+
+/**
+ * Finish the last track held in a file of a BIN/CUE image, once it is
+ * known that the file holds no more tracks.
+ *
+ * @param img        Image
+ * @param first      Index of the first track in the file
+ * @param file_base  Sector at which the file starts, updated to where the
+ *                   next file starts
+ * @param last_frame Frame within the file at which the last track starts
+ * @return 0 on success, -1 on error
+ */
+static int
+cdimage_cue_end_file(CdImage *img, int first, int32_t *file_base, int32_t last_frame)
+{
+	CdTrack *t;
+	int64_t size;
+
+	if (img->ntracks == first) {
+		cdimage_set_error("CD-ROM cue sheet has a FILE with no tracks");
+		return -1;
+	}
+	t = &img->tracks[img->ntracks - 1];
+	size = img->files[t->file].size;
+
+	if (t->offset >= size) {
+		cdimage_set_error("Track %d starts beyond the end of its file", t->info.number);
+		return -1;
+	}
+	t->info.length = (int32_t) ((size - t->offset + t->sector_size - 1) / t->sector_size);
+	*file_base += last_frame + t->info.length;
+	return 0;
+}
+
+/**
+ * Open a BIN/CUE image, filling in the image's tracks and files.
+ *
+ * @param img      Image
+ * @param pathname Path of the cue sheet
+ * @return 0 on success, -1 on error
+ */
+static int
+cdimage_open_cue(CdImage *img, const char *pathname)
+{
+	const char *slash = strrchr(pathname, '/');
+	char line[1024], path[1280];
+	int32_t file_base = 0;	/* Sector at which the current file starts */
+	int32_t shift = 0;	/* Sectors of PREGAP so far, not held in files */
+	int32_t frame = 0;	/* Frame in the file of the last track's INDEX 01 */
+	int file = -1, first = 0, swap = 0, indexed = 1;
+	int line_no = 0, ret = 0;
+	FILE *f;
+
+#if defined WIN32 || defined _WIN32
+	const char *backslash = strrchr(pathname, '\\');
+
+	if (backslash != NULL && (slash == NULL || backslash > slash)) {
+		slash = backslash;
+	}
+#endif
+
+	f = fopen(pathname, "r");
+	if (f == NULL) {
+		cdimage_set_error("Cannot open cue sheet '%s': %s", pathname, strerror(errno));
+		return -1;
+	}
+
+	while (ret == 0 && fgets(line, sizeof(line), f) != NULL) {
+		char *p = line;
+		char *cmd = cdimage_cue_word(&p);
+
+		line_no++;
+		if (cmd == NULL) {
+			continue;
+		}
+
+		if (strcasecmp(cmd, "FILE") == 0) {
+			const char *name = cdimage_cue_word(&p);
+			const char *type = cdimage_cue_word(&p);
+			int absolute;
+
+			if (name == NULL || type == NULL) {
+				ret = -1;
+				break;
+			}
+			if (strcasecmp(type, "BINARY") == 0) {
+				swap = 0;
+			} else if (strcasecmp(type, "MOTOROLA") == 0) {
+				swap = 1;
+			} else {
+				cdimage_set_error("Unsupported file type '%s' in cue sheet", type);
+				ret = -1;
+				break;
+			}
+			if (file != -1) {
+				if (!indexed) {
+					ret = -1;
+					break;
+				}
+				if (cdimage_cue_end_file(img, first, &file_base, frame) != 0) {
+					ret = -2;
+					break;
+				}
+			}
+
+			/* Names are relative to the cue sheet's directory */
+			absolute = (name[0] == '/');
+#if defined WIN32 || defined _WIN32
+			absolute = absolute || name[0] == '\\' || (name[0] != '\0' && name[1] == ':');
+#endif
+			if (absolute || slash == NULL) {
+				snprintf(path, sizeof(path), "%s", name);
+			} else {
+				snprintf(path, sizeof(path), "%.*s/%s", (int) (slash - pathname), pathname, name);
+			}
+			file = cdimage_add_file(img, path);
+			if (file == -1) {
+				ret = -2;
+				break;
+			}
+			first = img->ntracks;
+
+		} else if (strcasecmp(cmd, "TRACK") == 0) {
+			const char *number = cdimage_cue_word(&p);
+			const char *mode = cdimage_cue_word(&p);
+			CdTrack *t;
+
+			if (file == -1 || number == NULL || mode == NULL || !indexed) {
+				ret = -1;
+				break;
+			}
+			if (img->ntracks == CDIMAGE_MAX_TRACKS) {
+				cdimage_set_error("Too many tracks in cue sheet");
+				ret = -2;
+				break;
+			}
+			t = &img->tracks[img->ntracks];
+			memset(t, 0, sizeof(CdTrack));
+			t->info.number = atoi(number);
+			t->file = file;
+			t->swap = swap;
+			if (t->info.number < 1 || t->info.number > CDIMAGE_MAX_TRACKS ||
+			    (img->ntracks > 0 && t->info.number <= img->tracks[img->ntracks - 1].info.number))
+			{
+				ret = -1;
+				break;
+			}
+
+			if (strcasecmp(mode, "AUDIO") == 0) {
+				t->info.audio = 1;
+				t->sector_size = CDIMAGE_AUDIO_SECTOR_SIZE;
+			} else if (strcasecmp(mode, "MODE1/2048") == 0) {
+				t->sector_size = 2048;
+			} else if (strcasecmp(mode, "MODE1/2352") == 0) {
+				t->sector_size = 2352;
+				t->data_offset = 16;	/* Sync and header */
+			} else if (strcasecmp(mode, "MODE2/2352") == 0) {
+				t->sector_size = 2352;
+				t->data_offset = 24;	/* Sync, header and subheader */
+			} else if (strcasecmp(mode, "MODE2/2336") == 0) {
+				t->sector_size = 2336;
+				t->data_offset = 8;	/* Subheader */
+			} else {
+				cdimage_set_error("Unsupported track type '%s' in cue sheet", mode);
+				ret = -2;
+				break;
+			}
+			img->ntracks++;
+			indexed = 0;
+
+		} else if (strcasecmp(cmd, "INDEX") == 0) {
+			const char *number = cdimage_cue_word(&p);
+			CdTrack *t;
+			int32_t index;
+
+			if (img->ntracks == first || number == NULL ||
+			    cdimage_cue_time(cdimage_cue_word(&p), &index) != 0)
+			{
+				ret = -1;
+				break;
+			}
+			if (atoi(number) != 1 || indexed) {
+				continue;
+			}
+			t = &img->tracks[img->ntracks - 1];
+
+			if (img->ntracks - 1 > first) {
+				/* The previous track in this file runs up to here */
+				CdTrack *prev = t - 1;
+
+				if (index <= frame) {
+					ret = -1;
+					break;
+				}
+				prev->info.length = index - frame;
+				t->offset = prev->offset + (int64_t) prev->info.length * prev->sector_size;
+			} else {
+				t->offset = (int64_t) index * t->sector_size;
+			}
+			t->info.start = file_base + index + shift;
+			frame = index;
+			indexed = 1;
+
+		} else if (strcasecmp(cmd, "PREGAP") == 0) {
+			int32_t gap;
+
+			if (cdimage_cue_time(cdimage_cue_word(&p), &gap) != 0) {
+				ret = -1;
+				break;
+			}
+			shift += gap;
+		}
+		/* Other commands (REM, TITLE, FLAGS, POSTGAP...) are ignored */
+	}
+	fclose(f);
+
+	if (ret == -1) {
+		cdimage_set_error("Error in cue sheet '%s' at line %d", pathname, line_no);
+		return -1;
+	}
+	if (ret == 0 && (file == -1 || !indexed)) {
+		cdimage_set_error("CD-ROM cue sheet '%s' is incomplete", pathname);
+		return -1;
+	}
+	if (ret == 0 && cdimage_cue_end_file(img, first, &file_base, frame) != 0) {
+		return -1;
+	}
+	return (ret == 0) ? 0 : -1;
+}
+
+/**
+ * Open a compressed image, reading its header, track table and hunk index.
+ *
+ * @param img      Image
+ * @param pathname Path of image
+ * @param fd       Open descriptor of the image, owned by img from now on
+ * @return 0 on success, -1 on error
+ */
+static int
+cdimage_open_compressed(CdImage *img, const char *pathname, int fd)
+{
+	uint8_t header[COMPRESSED_HEADER_SIZE];
+	uint8_t *index;
+	uint64_t index_offset;
+	int64_t offset = 0;
+	struct stat st;
+	uint32_t i;
+
+	img->type = CDIMAGE_COMPRESSED;
+	img->fd = fd;
+
+	if (fstat(fd, &st) != 0) {
+		cdimage_set_error("Unable to read size of '%s': %s", pathname, strerror(errno));
+		return -1;
+	}
+	if (cdimage_pread(fd, header, sizeof(header), 0) != 0) {
+		return -1;
+	}
+	if (get_le32(header + 8) != COMPRESSED_VERSION) {
+		cdimage_set_error("Compressed CD-ROM image '%s' has unsupported version %u",
+		                  pathname, get_le32(header + 8));
+		return -1;
+	}
+	img->hunk_size = get_le32(header + 12);
+	img->ntracks = (int) get_le32(header + 16);
+	img->nhunks = get_le32(header + 20);
+	img->stream_size = (int64_t) get_le64(header + 24);
+	index_offset = get_le64(header + 32);
+
+	if (img->hunk_size < CDIMAGE_AUDIO_SECTOR_SIZE || img->hunk_size > (16u << 20) ||
+	    img->ntracks < 1 || img->ntracks > CDIMAGE_MAX_TRACKS || img->stream_size < 0 ||
+	    (uint64_t) img->nhunks != ((uint64_t) img->stream_size + img->hunk_size - 1) / img->hunk_size ||
+	    index_offset < COMPRESSED_HEADER_SIZE ||
+	    index_offset + (uint64_t) img->nhunks * COMPRESSED_INDEX_ENTRY > (uint64_t) st.st_size)
+	{
+		cdimage_set_error("Compressed CD-ROM image '%s' is corrupt", pathname);
+		return -1;
+	}
+
+	/* Tracks are held in the stream in order */
+	for (i = 0; i < (uint32_t) img->ntracks; i++) {
+		const uint8_t *entry = header + COMPRESSED_TRACKS_OFFSET + i * COMPRESSED_TRACK_ENTRY;
+		CdTrack *t = &img->tracks[i];
+
+		t->info.number = entry[0];
+		t->info.audio = entry[1] & 1;
+		t->info.start = (int32_t) get_le32(entry + 4);
+		t->info.length = (int32_t) get_le32(entry + 8);
+		t->sector_size = t->info.audio ? CDIMAGE_AUDIO_SECTOR_SIZE : CDIMAGE_SECTOR_SIZE;
+		t->offset = offset;
+		if (t->info.start < 0 || t->info.length <= 0 ||
+		    (i > 0 && t->info.start < t[-1].info.start + t[-1].info.length))
+		{
+			cdimage_set_error("Compressed CD-ROM image '%s' has a bad track table", pathname);
+			return -1;
+		}
+		offset += (int64_t) t->info.length * t->sector_size;
+	}
+	if (offset != img->stream_size) {
+		cdimage_set_error("Compressed CD-ROM image '%s' has a bad track table", pathname);
+		return -1;
+	}
+
+	img->hunk_offset = calloc(img->nhunks + 1, sizeof(uint64_t));
+	img->hunk_length = calloc(img->nhunks + 1, sizeof(uint32_t));
+	index = malloc((size_t) img->nhunks * COMPRESSED_INDEX_ENTRY + 1);
+	img->scratch = malloc(img->hunk_size);
+	if (img->hunk_offset == NULL || img->hunk_length == NULL || index == NULL ||
+	    img->scratch == NULL)
+	{
+		cdimage_set_error("Out of memory");
+		free(index);
+		return -1;
+	}
+	if (cdimage_pread(fd, index, (size_t) img->nhunks * COMPRESSED_INDEX_ENTRY,
+	                  (int64_t) index_offset) != 0)
+	{
+		free(index);
+		return -1;
+	}
+	for (i = 0; i < img->nhunks; i++) {
+		img->hunk_offset[i] = get_le64(index + i * COMPRESSED_INDEX_ENTRY);
+		img->hunk_length[i] = get_le32(index + i * COMPRESSED_INDEX_ENTRY + 8);
+		if (img->hunk_length[i] > img->hunk_size ||
+		    img->hunk_offset[i] + img->hunk_length[i] > (uint64_t) st.st_size)
+		{
+			cdimage_set_error("Compressed CD-ROM image '%s' has a bad hunk index", pathname);
+			free(index);
+			return -1;
+		}
+	}
+	free(index);
+
+	for (i = 0; i < COMPRESSED_CACHE; i++) {
+		img->cache[i].data = malloc(img->hunk_size);
+		if (img->cache[i].data == NULL) {
+			cdimage_set_error("Out of memory");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Open a CD-ROM image: a cue sheet, a compressed image or an ISO image.
+ *
+ * @param pathname  Path of image
+ * @param readahead Size of the read-ahead window for plain images, in
+ *                  sectors, or 0 to read only what is asked for
+ * @param map       Non-zero to map plain images into memory, where
+ *                  supported, instead of reading ahead
+ * @return Image, or NULL on error (see cdimage_error())
+ */
+CdImage *
+cdimage_open(const char *pathname, int readahead, int map)
+{
+	const size_t len = strlen(pathname);
+	CdImage *img;
+	int i, ret;
+
+	assert(pathname);
+
+	img = calloc(1, sizeof(CdImage));
+	if (img == NULL) {
+		cdimage_set_error("Out of memory");
+		return NULL;
+	}
+	img->fd = -1;
+	img->window_file = -1;
+	img->last_end = -1;
+	for (i = 0; i < COMPRESSED_CACHE; i++) {
+		img->cache[i].hunk = -1;
+	}
+
+	if (len >= 4 && strcasecmp(pathname + len - 4, ".cue") == 0) {
+		ret = cdimage_open_cue(img, pathname);
+	} else {
+		char magic[8];
+		int fd = open(pathname, O_RDONLY | O_BINARY);
+
+		if (fd == -1) {
+			cdimage_set_error("Cannot open CD-ROM image '%s': %s", pathname, strerror(errno));
+			free(img);
+			return NULL;
+		}
+		if (cdimage_pread(fd, magic, sizeof(magic), 0) == 0 &&
+		    memcmp(magic, COMPRESSED_MAGIC, sizeof(magic)) == 0)
+		{
+			ret = cdimage_open_compressed(img, pathname, fd);
+		} else {
+			/* ISO image: one data track of 2048-byte sectors */
+			close(fd);
+			ret = (cdimage_add_file(img, pathname) == -1) ? -1 : 0;
+			if (ret == 0) {
+				img->tracks[0].info.number = 1;
+				img->tracks[0].info.length = (int32_t) (img->files[0].size / CDIMAGE_SECTOR_SIZE);
+				img->tracks[0].sector_size = CDIMAGE_SECTOR_SIZE;
+				img->ntracks = 1;
+			}
+		}
+	}
+	if (ret != 0) {
+		cdimage_close(img);
+		return NULL;
+	}
+
+	if (img->type == CDIMAGE_PLAIN) {
+#ifdef CDIMAGE_MMAP
+		if (map) {
+			for (i = 0; i < img->nfiles; i++) {
+				void *p;
+
+				if (img->files[i].size <= 0 || (uint64_t) img->files[i].size > SIZE_MAX) {
+					continue;
+				}
+				p = mmap(NULL, (size_t) img->files[i].size, PROT_READ, MAP_SHARED,
+				         img->files[i].fd, 0);
+				if (p != MAP_FAILED) {
+					img->files[i].map = p;
+				}
+			}
+		}
+#else
+		(void) map;
+#endif
+		if (readahead > CDIMAGE_READAHEAD_MAX) {
+			readahead = CDIMAGE_READAHEAD_MAX;
+		}
+		if (readahead > 0) {
+			img->window_size = (size_t) readahead * CDIMAGE_AUDIO_SECTOR_SIZE;
+			img->window = malloc(img->window_size);
+			if (img->window == NULL) {
+				img->window_size = 0;
+			}
+		}
+	}
+
+	return img;
+}
+
+/**
+ * Close an image, freeing it.
+ *
+ * @param img Image, or NULL
+ */
+void
+cdimage_close(CdImage *img)
+{
+	int i;
+
+	if (img == NULL) {
+		return;
+	}
+	for (i = 0; i < img->nfiles; i++) {
+#ifdef CDIMAGE_MMAP
+		if (img->files[i].map != NULL) {
+			munmap(img->files[i].map, (size_t) img->files[i].size);
+		}
+#endif
+		close(img->files[i].fd);
+	}
+	if (img->fd != -1) {
+		close(img->fd);
+	}
+	for (i = 0; i < COMPRESSED_CACHE; i++) {
+		free(img->cache[i].data);
+	}
+	free(img->window);
+	free(img->hunk_offset);
+	free(img->hunk_length);
+	free(img->scratch);
+	free(img);
+}
+
+/**
+ * Return the number of tracks on an image.
+ *
+ * @param img Image
+ * @return Number of tracks
+ */
+int
+cdimage_track_count(const CdImage *img)
+{
+	return img->ntracks;
+}
+
+/**
+ * Describe a track of an image.
+ *
+ * @param img   Image
+ * @param index Index of track, from 0 to cdimage_track_count() - 1
+ * @return Track description
+ */
+const CdTrackInfo *
+cdimage_track(const CdImage *img, int index)
+{
+	assert(index >= 0 && index < img->ntracks);
+
+	return &img->tracks[index].info;
+}
+
+/**
+ * Find the track holding a sector.
+ *
+ * @param img Image
+ * @param lba Sector
+ * @return Index of track, or -1 if the sector is in a gap or beyond the
+ *         end of the disc
+ */
+int
+cdimage_find_track(const CdImage *img, int32_t lba)
+{
+	int i;
+
+	for (i = 0; i < img->ntracks; i++) {
+		const CdTrackInfo *info = &img->tracks[i].info;
+
+		if (lba >= info->start && lba < info->start + info->length) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Return the first sector after the last track.
+ *
+ * @param img Image
+ * @return Lead-out sector
+ */
+int32_t
+cdimage_leadout(const CdImage *img)
+{
+	const CdTrackInfo *last = &img->tracks[img->ntracks - 1].info;
+
+	return last->start + last->length;
+}
+
+/**
+ * Read from one of the files of a plain image, through the read-ahead
+ * window or the mapping.
+ *
+ * @param img    Image
+ * @param file   Index into img->files
+ * @param buf    Buffer to fill
+ * @param len    Number of bytes to read
+ * @param offset Offset within the file
+ * @return 0 on success, -1 on error
+ */
+static int
+cdimage_read_plain(CdImage *img, int file, uint8_t *buf, size_t len, int64_t offset)
+{
+	const CdFile *f = &img->files[file];
+	int sequential;
+
+	if (f->map != NULL) {
+		size_t n = 0;
+
+		if (offset < f->size) {
+			n = ((int64_t) len < f->size - offset) ? len : (size_t) (f->size - offset);
+			memcpy(buf, f->map + offset, n);
+		}
+		memset(buf + n, 0, len - n);
+		return 0;
+	}
+
+	if (img->window_file == file && offset >= img->window_start &&
+	    offset + (int64_t) len <= img->window_start + (int64_t) img->window_len)
+	{
+		memcpy(buf, img->window + (offset - img->window_start), len);
+		img->last_end = offset + (int64_t) len;
+		return 0;
+	}
+
+	/* Only read ahead once the reader shows it is streaming */
+	sequential = (offset == img->last_end);
+	img->last_end = offset + (int64_t) len;
+
+	if (sequential && img->window_size >= len && offset < f->size) {
+		size_t n = img->window_size;
+
+		if ((int64_t) n > f->size - offset) {
+			n = (size_t) (f->size - offset);
+		}
+		if (n < len) {
+			n = len;
+		}
+		if (cdimage_pread(f->fd, img->window, n, offset) != 0) {
+			img->window_file = -1;
+			return -1;
+		}
+		img->window_file = file;
+		img->window_start = offset;
+		img->window_len = n;
+		memcpy(buf, img->window, len);
+		return 0;
+	}
+
+	return cdimage_pread(f->fd, buf, len, offset);
+}
+
+/**
+ * Return a decompressed hunk of a compressed image, loading it into the
+ * cache if necessary.
+ *
+ * @param img  Image
+ * @param hunk Hunk number
+ * @return Hunk data, or NULL on error
+ */
+static const uint8_t *
+cdimage_load_hunk(CdImage *img, uint32_t hunk)
+{
+	CdCacheHunk *victim = &img->cache[0];
+	size_t raw = img->hunk_size;
+	uint32_t length;
+	int i;
+
+	img->cache_clock++;
+	for (i = 0; i < COMPRESSED_CACHE; i++) {
+		CdCacheHunk *c = &img->cache[i];
+
+		if (c->hunk == (int64_t) hunk) {
+			c->used = img->cache_clock;
+			return c->data;
+		}
+		if (c->hunk == -1 || (victim->hunk != -1 &&
+		    img->cache_clock - c->used > img->cache_clock - victim->used))
+		{
+			victim = c;
+		}
+	}
+
+	if ((int64_t) hunk * img->hunk_size + (int64_t) raw > img->stream_size) {
+		raw = (size_t) (img->stream_size - (int64_t) hunk * img->hunk_size);
+	}
+	length = img->hunk_length[hunk];
+	victim->hunk = -1;
+
+	if (length == 0) {
+		memset(victim->data, 0, raw);
+	} else if (length == raw) {
+		if (cdimage_pread(img->fd, victim->data, raw, (int64_t) img->hunk_offset[hunk]) != 0) {
+			return NULL;
+		}
+	} else {
+		if (cdimage_pread(img->fd, img->scratch, length, (int64_t) img->hunk_offset[hunk]) != 0) {
+			return NULL;
+		}
+		if (lz_decompress(img->scratch, length, victim->data, raw) != 0) {
+			cdimage_set_error("Compressed CD-ROM image is corrupt at hunk %u", hunk);
+			return NULL;
+		}
+	}
+
+	victim->hunk = hunk;
+	victim->used = img->cache_clock;
+	return victim->data;
+}
+
+/**
+ * Read from the decompressed stream of a compressed image.
+ *
+ * @param img    Image
+ * @param buf    Buffer to fill
+ * @param len    Number of bytes to read
+ * @param offset Offset within the stream
+ * @return 0 on success, -1 on error
+ */
+static int
+cdimage_read_stream(CdImage *img, uint8_t *buf, size_t len, int64_t offset)
+{
+	while (len > 0) {
+		const uint32_t hunk = (uint32_t) (offset / img->hunk_size);
+		const size_t start = (size_t) (offset % img->hunk_size);
+		size_t n = img->hunk_size - start;
+		const uint8_t *data;
+
+		if (n > len) {
+			n = len;
+		}
+		data = cdimage_load_hunk(img, hunk);
+		if (data == NULL) {
+			return -1;
+		}
+		memcpy(buf, data + start, n);
+		buf += n;
+		offset += (int64_t) n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * Read a sector of a track, in the form it is stored.
+ *
+ * @param img    Image
+ * @param t      Track holding the sector
+ * @param lba    Sector
+ * @param buf    Buffer to fill
+ * @param len    Number of bytes to read
+ * @param skip   Offset within a plain image's stored sector to read from
+ * @return 0 on success, -1 on error
+ */
+static int
+cdimage_read_sector(CdImage *img, const CdTrack *t, int32_t lba, uint8_t *buf, size_t len,
+                    int skip)
+{
+	const int64_t sector = lba - t->info.start;
+
+	if (img->type == CDIMAGE_COMPRESSED) {
+		return cdimage_read_stream(img, buf, len, t->offset + sector * t->sector_size);
+	}
+	return cdimage_read_plain(img, t->file, buf, len,
+	                          t->offset + sector * t->sector_size + skip);
+}
+
+/**
+ * Read the user data of a data sector.
+ *
+ * @param img Image
+ * @param lba Sector
+ * @param buf Buffer to fill with CDIMAGE_SECTOR_SIZE bytes
+ * @return 0 on success, -1 on error or if the sector is not in a data track
+ */
+int
+cdimage_read_data(CdImage *img, int32_t lba, uint8_t *buf)
+{
+	const int i = cdimage_find_track(img, lba);
+	const CdTrack *t;
+
+	if (i == -1 || img->tracks[i].info.audio) {
+		cdimage_set_error("Sector %d is not a data sector", lba);
+		return -1;
+	}
+	t = &img->tracks[i];
+	return cdimage_read_sector(img, t, lba, buf, CDIMAGE_SECTOR_SIZE, t->data_offset);
+}
+
+/**
+ * Read the samples of an audio sector. Sectors in gaps between tracks read
+ * as silence.
+ *
+ * @param img Image
+ * @param lba Sector
+ * @param buf Buffer to fill with CDIMAGE_AUDIO_SECTOR_SIZE bytes of
+ *            little-endian 16-bit stereo samples
+ * @return 0 on success, -1 on error, or if the sector is in a data track or
+ *         beyond the end of the disc
+ */
+int
+cdimage_read_audio(CdImage *img, int32_t lba, uint8_t *buf)
+{
+	const int i = cdimage_find_track(img, lba);
+	const CdTrack *t;
+	int j;
+
+	if (i == -1) {
+		if (lba < 0 || lba >= cdimage_leadout(img)) {
+			cdimage_set_error("Sector %d is beyond the end of the disc", lba);
+			return -1;
+		}
+		memset(buf, 0, CDIMAGE_AUDIO_SECTOR_SIZE);
+		return 0;
+	}
+	t = &img->tracks[i];
+	if (!t->info.audio) {
+		cdimage_set_error("Sector %d is not an audio sector", lba);
+		return -1;
+	}
+	if (cdimage_read_sector(img, t, lba, buf, CDIMAGE_AUDIO_SECTOR_SIZE, 0) != 0) {
+		return -1;
+	}
+	if (t->swap) {
+		for (j = 0; j < CDIMAGE_AUDIO_SECTOR_SIZE; j += 2) {
+			const uint8_t b = buf[j];
+
+			buf[j] = buf[j + 1];
+			buf[j + 1] = b;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Check whether an open file is a given file.
+ *
+ * @param fd File descriptor, or -1
+ * @param st Status of the other file
+ * @return Non-zero if they are the same file
+ */
+static int
+cdimage_same_file(int fd, const struct stat *st)
+{
+	struct stat st_fd;
+
+	return fd != -1 && fstat(fd, &st_fd) == 0 && st_fd.st_dev == st->st_dev &&
+	       st_fd.st_ino == st->st_ino;
+}
+
+/**
+ * Compress and write out one hunk of a compressed image, and fill in its
+ * entry in the hunk index. Hunks of zeros are not written at all, and those
+ * that do not compress are stored as they are.
+ *
+ * @param fd          Image, positioned at file_offset
+ * @param raw         Hunk data
+ * @param len         Length of hunk data
+ * @param packed      Buffer of at least len bytes for the compressed data
+ * @param entry       Index entry to fill in
+ * @param file_offset Offset in the image of the hunk, advanced past it
+ * @return 0 on success, -1 on error
+ */
+static int
+cdimage_compress_hunk(int fd, const uint8_t *raw, size_t len, uint8_t *packed,
+                      uint8_t *entry, int64_t *file_offset)
+{
+	const uint8_t *data = packed;
+	size_t stored = 0, i;
+	int ret = 0;
+
+	for (i = 0; i < len; i++) {
+		if (raw[i] != 0) {
+			/* Must be shorter than len, as that length means stored */
+			stored = lz_compress(raw, len, packed, len - 1);
+			if (stored == 0) {
+				stored = len;
+				data = raw;
+			}
+			ret = cdimage_write(fd, data, stored);
+			break;
+		}
+	}
+
+	put_le64(entry, (uint64_t) *file_offset);
+	put_le32(entry + 8, (uint32_t) stored);
+	*file_offset += (int64_t) stored;
+	return ret;
+}
+
+/**
+ * Convert a CD-ROM image of any supported format to a compressed image.
+ *
+ * @param pathname Path of source image
+ * @param dest     Path of compressed image to create
+ * @return 0 on success, -1 on error (see cdimage_error())
+ */
+int
+cdimage_compress(const char *pathname, const char *dest)
+{
+	uint8_t header[COMPRESSED_HEADER_SIZE];
+	uint8_t *raw = NULL, *packed = NULL, *index = NULL;
+	struct stat st_dest;
+	CdImage *src;
+	int64_t stream_size = 0, file_offset = COMPRESSED_HEADER_SIZE;
+	uint32_t nhunks, hunk = 0;
+	size_t fill = 0;
+	int fd, i, ret = 0;
+
+	assert(pathname);
+	assert(dest);
+
+	src = cdimage_open(pathname, CDIMAGE_READAHEAD_MAX, 0);
+	if (src == NULL) {
+		return -1;
+	}
+
+	/* Refuse to overwrite any of the files being read */
+	if (stat(dest, &st_dest) == 0 && st_dest.st_ino != 0) {
+		int same = cdimage_same_file(src->fd, &st_dest);
+
+		for (i = 0; i < src->nfiles; i++) {
+			same = same || cdimage_same_file(src->files[i].fd, &st_dest);
+		}
+		if (same) {
+			cdimage_set_error("Cannot convert '%s' onto itself", pathname);
+			cdimage_close(src);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < src->ntracks; i++) {
+		const CdTrack *t = &src->tracks[i];
+
+		stream_size += (int64_t) t->info.length *
+		               (t->info.audio ? CDIMAGE_AUDIO_SECTOR_SIZE : CDIMAGE_SECTOR_SIZE);
+	}
+	nhunks = (uint32_t) ((stream_size + COMPRESSED_HUNK_SIZE - 1) / COMPRESSED_HUNK_SIZE);
+
+	raw = malloc(COMPRESSED_HUNK_SIZE);
+	packed = malloc(COMPRESSED_HUNK_SIZE);
+	index = malloc((size_t) nhunks * COMPRESSED_INDEX_ENTRY + 1);
+	if (raw == NULL || packed == NULL || index == NULL) {
+		cdimage_set_error("Out of memory");
+		free(raw);
+		free(packed);
+		free(index);
+		cdimage_close(src);
+		return -1;
+	}
+
+	fd = open(dest, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0666);
+	if (fd == -1) {
+		cdimage_set_error("Cannot create image '%s': %s", dest, strerror(errno));
+		free(raw);
+		free(packed);
+		free(index);
+		cdimage_close(src);
+		return -1;
+	}
+
+	/* The header is written last, so an incomplete image is not valid */
+	memset(header, 0, sizeof(header));
+	if (lseek(fd, COMPRESSED_HEADER_SIZE, SEEK_SET) < 0) {
+		cdimage_set_error("Unable to seek in image: %s", strerror(errno));
+		ret = -1;
+	}
+
+	for (i = 0; i < src->ntracks && ret == 0; i++) {
+		const CdTrack *t = &src->tracks[i];
+		const size_t size = t->info.audio ? CDIMAGE_AUDIO_SECTOR_SIZE : CDIMAGE_SECTOR_SIZE;
+		int32_t lba;
+
+		for (lba = t->info.start; lba < t->info.start + t->info.length && ret == 0; lba++) {
+			uint8_t sector[CDIMAGE_AUDIO_SECTOR_SIZE];
+			size_t done = 0;
+
+			if (t->info.audio) {
+				ret = cdimage_read_audio(src, lba, sector);
+			} else {
+				ret = cdimage_read_data(src, lba, sector);
+			}
+
+			/* Sectors straddle hunks, so the last hunk may be short */
+			while (ret == 0 && done < size) {
+				size_t n = COMPRESSED_HUNK_SIZE - fill;
+				int last;
+
+				if (n > size - done) {
+					n = size - done;
+				}
+				memcpy(raw + fill, sector + done, n);
+				fill += n;
+				done += n;
+				last = (i == src->ntracks - 1 &&
+				        lba == t->info.start + t->info.length - 1 && done == size);
+				if (fill < COMPRESSED_HUNK_SIZE && !last) {
+					continue;
+				}
+
+				ret = cdimage_compress_hunk(fd, raw, fill, packed,
+				                            index + hunk * COMPRESSED_INDEX_ENTRY,
+				                            &file_offset);
+				hunk++;
+				fill = 0;
+			}
+		}
+	}
+
+	if (ret == 0) {
+		ret = cdimage_write(fd, index, (size_t) nhunks * COMPRESSED_INDEX_ENTRY);
+	}
+	if (ret == 0) {
+		memcpy(header, COMPRESSED_MAGIC, 8);
+		put_le32(header + 8, COMPRESSED_VERSION);
+		put_le32(header + 12, COMPRESSED_HUNK_SIZE);
+		put_le32(header + 16, (uint32_t) src->ntracks);
+		put_le32(header + 20, nhunks);
+		put_le64(header + 24, (uint64_t) stream_size);
+		put_le64(header + 32, (uint64_t) file_offset);
+		for (i = 0; i < src->ntracks; i++) {
+			uint8_t *entry = header + COMPRESSED_TRACKS_OFFSET + i * COMPRESSED_TRACK_ENTRY;
+			const CdTrackInfo *info = &src->tracks[i].info;
+
+			entry[0] = (uint8_t) info->number;
+			entry[1] = (uint8_t) info->audio;
+			put_le32(entry + 4, (uint32_t) info->start);
+			put_le32(entry + 8, (uint32_t) info->length);
+		}
+		if (lseek(fd, 0, SEEK_SET) < 0) {
+			cdimage_set_error("Unable to seek in image: %s", strerror(errno));
+			ret = -1;
+		} else {
+			ret = cdimage_write(fd, header, sizeof(header));
+		}
+	}
+	if (ret == 0 && fsync(fd) != 0) {
+		cdimage_set_error("Unable to flush image: %s", strerror(errno));
+		ret = -1;
+	}
+
+	close(fd);
+	free(raw);
+	free(packed);
+	free(index);
+	cdimage_close(src);
+	return ret;
+}
@@ -0,0 +1,59 @@
+/*
+  RPCEmu - An Acorn system emulator
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef CDIMAGE_H
+#define CDIMAGE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#define CDIMAGE_SECTOR_SIZE	2048	/**< User data in a data sector */
+#define CDIMAGE_AUDIO_SECTOR_SIZE 2352	/**< Samples in an audio sector, 588 stereo 16-bit frames */
+#define CDIMAGE_MAX_TRACKS	99
+
+/** An open CD-ROM image, in any of the supported formats */
+typedef struct CdImage CdImage;
+
+/** Description of one track of an image */
+typedef struct {
+	int number;		/**< Track number, from 1 */
+	int audio;		/**< Audio track, rather than data */
+	int32_t start;		/**< First sector (LBA) */
+	int32_t length;		/**< Number of sectors */
+} CdTrackInfo;
+
+extern CdImage *cdimage_open(const char *pathname, int readahead, int map);
+extern void cdimage_close(CdImage *img);
+extern int cdimage_track_count(const CdImage *img);
+extern const CdTrackInfo *cdimage_track(const CdImage *img, int index);
+extern int cdimage_find_track(const CdImage *img, int32_t lba);
+extern int32_t cdimage_leadout(const CdImage *img);
+extern int cdimage_read_data(CdImage *img, int32_t lba, uint8_t *buf);
+extern int cdimage_read_audio(CdImage *img, int32_t lba, uint8_t *buf);
+extern const char *cdimage_error(void);
+
+extern int cdimage_compress(const char *pathname, const char *dest);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* CDIMAGE_H */
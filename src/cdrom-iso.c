@@ -18,19 +18,58 @@
   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
-#define _LARGEFILE_SOURCE
-#define _LARGEFILE64_SOURCE
+/* CD-ROM image access
+
+   Images are opened through cdimage.c, which handles ISO, BIN/CUE and
+   compressed images and reads plain images ahead once access is
+   sequential (see config.cdrom_readahead and config.cdrom_mmap).
+
+   Audio tracks are played by the sound thread, which pulls samples with
+   iso_audio_read() and mixes them into the emulator's output. It reads
+   through its own handle on the image, so data reads on the emulator
+   thread never wait for it; that handle and the play state are shared
+   under iso_mutex.
+*/
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "rpcemu.h"
 #include "ide.h"
+#include "cdimage.h"
 #include "cdrom-iso.h"
 
+/* Audio status values reported by READ SUB-CHANNEL */
+#define ISO_AUDIO_PLAYING	0x11
+#define ISO_AUDIO_PAUSED	0x12
+#define ISO_AUDIO_COMPLETED	0x13
+#define ISO_AUDIO_ERROR		0x14
+#define ISO_AUDIO_NONE		0x15
+
+#define ISO_AUDIO_FRAMES	(CDIMAGE_AUDIO_SECTOR_SIZE / 4)	/**< Stereo samples per sector */
+
 static ATAPI iso_atapi;
 
 static int iso_discchanged = 0;
-static FILE *iso_file;
 static int iso_empty = 0;
 
+static CdImage *iso_image;		/**< Image, used only by the emulator thread */
+
+static pthread_mutex_t iso_mutex = PTHREAD_MUTEX_INITIALIZER; /**< Protects the audio image and state */
+static CdImage *iso_audio_image;	/**< Second handle on the image, to play audio from */
+
+/** State of audio playback */
+static struct {
+	uint8_t status;		/**< ISO_AUDIO_* */
+	int32_t pos;		/**< Next sector to play */
+	int32_t end;		/**< Sector after the last to play */
+	uint32_t frame;		/**< Samples of sector[] already played */
+	uint8_t sector[CDIMAGE_AUDIO_SECTOR_SIZE];
+} iso_audio;
+
+static atomic_int iso_audio_playing;	/**< Non-zero while playing, read without the lock */
+
 static int iso_ready(void)
 {
         if (iso_empty) return 0;
@@ -45,55 +84,74 @@ static int iso_ready(void)
 
 static void iso_readsector(uint8_t *b, int sector)
 {
-        if (iso_empty) return;
-        fseeko64(iso_file, (off64_t) sector * 2048, SEEK_SET);
-        fread(b,2048,1,iso_file);
+	if (iso_empty) return;
+
+	if (iso_image == NULL || cdimage_read_data(iso_image, sector, b) != 0) {
+		memset(b, 0, CDIMAGE_SECTOR_SIZE);
+	}
+}
+
+/**
+ * Write an address in a TOC or sub-channel response.
+ *
+ * @param b       Buffer to write 4 bytes to
+ * @param sector  Address, as an LBA
+ * @param msf     Non-zero for minute/second/frame form
+ * @param absolute Non-zero if an absolute address, which in MSF form
+ *                includes the 2 second lead-in
+ */
+static void
+iso_put_address(uint8_t *b, int32_t sector, int msf, int absolute)
+{
+	if (msf) {
+		if (absolute) {
+			sector += 150;
+		}
+		if (sector < 0) {
+			sector = 0;
+		}
+		b[0] = 0; // reserved
+		b[1] = (uint8_t) ((sector / 75) / 60); // minute
+		b[2] = (uint8_t) ((sector / 75) % 60); // second
+		b[3] = (uint8_t) (sector % 75); // frame
+	} else {
+		b[0] = (uint8_t) (sector >> 24);
+		b[1] = (uint8_t) (sector >> 16);
+		b[2] = (uint8_t) (sector >> 8);
+		b[3] = (uint8_t) sector;
+	}
 }
 
 static int iso_readtoc(unsigned char *b, unsigned char starttrack, int msf)
 {
         int len=4;
-        int blocks;
+        int i, ntracks;
         if (iso_empty) return 0;
-        fseeko64(iso_file, 0, SEEK_END);
-        blocks = (int) (ftello64(iso_file) / 2048);
-        if (starttrack <= 1) {
-          b[len++] = 0; // Reserved
-          b[len++] = 0x14; // ADR, control
-          b[len++] = 1; // Track number
-          b[len++] = 0; // Reserved
 
-          // Start address
-          if (msf) {
-            b[len++] = 0; // reserved
-            b[len++] = 0; // minute
-            b[len++] = 2; // second
-            b[len++] = 0; // frame
-          } else {
-            b[len++] = 0;
-            b[len++] = 0;
-            b[len++] = 0;
-            b[len++] = 0; // logical sector 0
+        ntracks = cdimage_track_count(iso_image);
+        for (i = 0; i < ntracks; i++) {
+          const CdTrackInfo *info = cdimage_track(iso_image, i);
+
+          if (info->number < starttrack) {
+            continue;
           }
+          b[len++] = 0; // Reserved
+          b[len++] = info->audio ? 0x10 : 0x14; // ADR, control
+          b[len++] = (uint8_t) info->number; // Track number
+          b[len++] = 0; // Reserved
+          iso_put_address(&b[len], info->start, msf, 1); // Start address
+          len += 4;
         }
 
-        b[2]=b[3]=1; /*First and last track numbers*/
+        b[2] = (uint8_t) cdimage_track(iso_image, 0)->number; /*First and last track numbers*/
+        b[3] = (uint8_t) cdimage_track(iso_image, ntracks - 1)->number;
         b[len++] = 0; // Reserved
         b[len++] = 0x16; // ADR, control
         b[len++] = 0xaa; // Track number
         b[len++] = 0; // Reserved
+        iso_put_address(&b[len], cdimage_leadout(iso_image), msf, 1);
+        len += 4;
 
-        if (msf) {
-          b[len++] = 0; // reserved
-          b[len++] = (uint8_t)(((blocks + 150) / 75) / 60); // minute
-          b[len++] = (uint8_t)(((blocks + 150) / 75) % 60); // second
-          b[len++] = (uint8_t)((blocks + 150) % 75); // frame;
-        } else {
-          b[len++] = (uint8_t)((blocks >> 24) & 0xff);
-          b[len++] = (uint8_t)((blocks >> 16) & 0xff);
-          b[len++] = (uint8_t)((blocks >> 8) & 0xff);
-          b[len++] = (uint8_t)((blocks >> 0) & 0xff);
-        }
         b[0] = (uint8_t)(((len-4) >> 8) & 0xff);
         b[1] = (uint8_t)((len-4) & 0xff);
         return len;
@@ -101,56 +159,251 @@ static int iso_readtoc(unsigned char *b, unsigned char starttrack, int msf)
 
 static uint8_t iso_getcurrentsubchannel(uint8_t *b, int msf)
 {
-	NOT_USED(msf);
+	const CdTrackInfo *info = NULL;
+	uint8_t status;
+	int32_t pos;
+	int track;
+
+	memset(b, 0, 11);
+	if (iso_empty) return ISO_AUDIO_NONE;
+
+	pthread_mutex_lock(&iso_mutex);
+	pos = iso_audio.pos;
+	track = cdimage_find_track(iso_image, pos);
+	if (track != -1) {
+		info = cdimage_track(iso_image, track);
+	}
+
+	/* Completion and errors are only reported once */
+	status = iso_audio.status;
+	if (status == ISO_AUDIO_COMPLETED || status == ISO_AUDIO_ERROR) {
+		iso_audio.status = ISO_AUDIO_NONE;
+	}
+	pthread_mutex_unlock(&iso_mutex);
 
-        memset(b,0,2048);
-        return 0;
+	b[0] = (info == NULL || info->audio) ? 0x10 : 0x14; // ADR, control
+	b[1] = (info != NULL) ? (uint8_t) info->number : 0; // Track number
+	b[2] = 1; // Index
+	iso_put_address(&b[3], pos, msf, 1);
+	iso_put_address(&b[7], (info != NULL) ? pos - info->start : 0, msf, 0);
+	return status;
+}
+
+/**
+ * Return the current audio position, without reporting (and so clearing)
+ * the completion status as reading the sub-channel does.
+ *
+ * @return Logical block address
+ */
+static uint32_t
+iso_getposition(void)
+{
+	uint32_t pos;
+
+	if (iso_empty) return 0;
+
+	pthread_mutex_lock(&iso_mutex);
+	pos = (uint32_t) iso_audio.pos;
+	pthread_mutex_unlock(&iso_mutex);
+	return pos;
+}
+
+/**
+ * Stop audio playback, with the lock held.
+ *
+ * @param status New audio status
+ */
+static void
+iso_audio_stop(uint8_t status)
+{
+	iso_audio.status = status;
+	atomic_store(&iso_audio_playing, 0);
 }
 
 static void iso_playaudio(uint32_t pos, uint32_t len)
 {
-	NOT_USED(pos);
-	NOT_USED(len);
+	int track;
+
+	if (iso_empty) return;
 
-	UNIMPLEMENTED("cdrom-iso", "iso_playaudio");
+	pthread_mutex_lock(&iso_mutex);
+	if (pos == 0xffffffff) {
+		/* Play from the current position */
+		pos = (uint32_t) iso_audio.pos;
+	}
+	track = cdimage_find_track(iso_image, (int32_t) pos);
+	if (len == 0) {
+		/* Not an error, but nothing to play */
+		iso_audio.pos = (int32_t) pos;
+		iso_audio_stop(ISO_AUDIO_NONE);
+	} else if (pos >= (uint32_t) cdimage_leadout(iso_image) ||
+	           (track != -1 && !cdimage_track(iso_image, track)->audio))
+	{
+		rpclog("cdrom-iso: cannot play audio from sector %u\n", pos);
+		iso_audio_stop(ISO_AUDIO_ERROR);
+	} else {
+		iso_audio.pos = (int32_t) pos;
+		iso_audio.end = (int32_t) (((uint64_t) pos + len > INT32_MAX) ? INT32_MAX : pos + len);
+		iso_audio.frame = ISO_AUDIO_FRAMES;
+		iso_audio.status = ISO_AUDIO_PLAYING;
+		atomic_store(&iso_audio_playing, 1);
+	}
+	pthread_mutex_unlock(&iso_mutex);
 }
 
 static void iso_seek(uint32_t pos)
 {
-	NOT_USED(pos);
+	if (iso_empty) return;
 
-	UNIMPLEMENTED("cdrom-iso", "iso_seek");
+	/* Seeking ends any audio play */
+	pthread_mutex_lock(&iso_mutex);
+	iso_audio.pos = (int32_t) pos;
+	iso_audio_stop(ISO_AUDIO_NONE);
+	pthread_mutex_unlock(&iso_mutex);
 }
 
-static void iso_null(void)
+static void iso_pause(void)
+{
+	pthread_mutex_lock(&iso_mutex);
+	if (iso_audio.status == ISO_AUDIO_PLAYING) {
+		iso_audio_stop(ISO_AUDIO_PAUSED);
+	}
+	pthread_mutex_unlock(&iso_mutex);
+}
+
+static void iso_resume(void)
 {
+	pthread_mutex_lock(&iso_mutex);
+	if (iso_audio.status == ISO_AUDIO_PAUSED) {
+		iso_audio.status = ISO_AUDIO_PLAYING;
+		atomic_store(&iso_audio_playing, 1);
+	}
+	pthread_mutex_unlock(&iso_mutex);
+}
+
+static void iso_stop(void)
+{
+	pthread_mutex_lock(&iso_mutex);
+	iso_audio_stop(ISO_AUDIO_NONE);
+	pthread_mutex_unlock(&iso_mutex);
+}
+
+/**
+ * Fetch the next samples of audio being played from the image.
+ *
+ * @param buf    Buffer to fill with 44100Hz 16-bit stereo samples
+ * @param frames Number of stereo samples wanted
+ * @return Number of stereo samples written, less than frames if play
+ *         stopped or is not in progress
+ * @thread sound
+ */
+uint32_t
+iso_audio_read(int16_t *buf, uint32_t frames)
+{
+	uint32_t done = 0;
+
+	if (!atomic_load_explicit(&iso_audio_playing, memory_order_relaxed)) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&iso_mutex);
+	while (done < frames && iso_audio.status == ISO_AUDIO_PLAYING) {
+		const uint8_t *p;
+		uint32_t n, i;
+
+		if (iso_audio.frame == ISO_AUDIO_FRAMES) {
+			if (iso_audio.pos >= iso_audio.end) {
+				iso_audio_stop(ISO_AUDIO_COMPLETED);
+				break;
+			}
+			if (iso_audio_image == NULL ||
+			    cdimage_read_audio(iso_audio_image, iso_audio.pos, iso_audio.sector) != 0)
+			{
+				rpclog("cdrom-iso: audio play stopped: %s\n", cdimage_error());
+				iso_audio_stop(ISO_AUDIO_ERROR);
+				break;
+			}
+			iso_audio.pos++;
+			iso_audio.frame = 0;
+		}
+
+		n = ISO_AUDIO_FRAMES - iso_audio.frame;
+		if (n > frames - done) {
+			n = frames - done;
+		}
+		p = &iso_audio.sector[iso_audio.frame * 4];
+		for (i = 0; i < n * 2; i++, p += 2) {
+			buf[done * 2 + i] = (int16_t) (p[0] | (p[1] << 8));
+		}
+		iso_audio.frame += n;
+		done += n;
+	}
+	pthread_mutex_unlock(&iso_mutex);
+
+	return done;
 }
 
 int
 iso_open(const char *fn)
 {
+	CdImage *img, *audio_img;
+
 	atapi = &iso_atapi;
 
-	iso_file = fopen64(fn, "rb");
-	if (iso_file != NULL) {
-		/* Successfully opened ISO file */
-		iso_empty = 0;
-	} else {
-		/* Failed to open ISO file - behave as if drive empty */
+	img = cdimage_open(fn, config.cdrom_readahead, config.cdrom_mmap);
+	if (img == NULL) {
+		/* Failed to open image - behave as if drive empty */
+		rpclog("cdrom-iso: %s\n", cdimage_error());
 		iso_empty = 1;
+		iso_discchanged = 1;
+		return 0;
+	}
+
+	audio_img = cdimage_open(fn, config.cdrom_readahead, config.cdrom_mmap);
+	if (audio_img == NULL) {
+		/* Data can still be read, but audio will not play */
+		rpclog("cdrom-iso: %s\n", cdimage_error());
 	}
+
+	pthread_mutex_lock(&iso_mutex);
+	cdimage_close(iso_audio_image);
+	iso_audio_image = audio_img;
+	iso_audio.pos = 0;
+	iso_audio_stop(ISO_AUDIO_NONE);
+	pthread_mutex_unlock(&iso_mutex);
+
+	cdimage_close(iso_image);
+	iso_image = img;
+
+	iso_empty = 0;
 	iso_discchanged = 1;
 	return 0;
 }
 
+/**
+ * Close the image, if one is open.
+ */
 void iso_close(void)
 {
-        if (iso_file) fclose(iso_file);
+	pthread_mutex_lock(&iso_mutex);
+	iso_audio_stop(ISO_AUDIO_NONE);
+	cdimage_close(iso_audio_image);
+	iso_audio_image = NULL;
+	pthread_mutex_unlock(&iso_mutex);
+
+	cdimage_close(iso_image);
+	iso_image = NULL;
+
+	iso_empty = 1;
 }
 
 static void iso_exit(void)
 {
-        if (iso_file) fclose(iso_file);
+	iso_close();
+}
+
+static void iso_null(void)
+{
 }
 
 void iso_init(void)
@@ -164,9 +417,13 @@ static ATAPI iso_atapi=
         iso_ready,
         iso_readtoc,
         iso_getcurrentsubchannel,
+        iso_getposition,
         iso_readsector,
         iso_playaudio,
         iso_seek,
-        iso_null,iso_null,iso_null,iso_null,iso_null,
+        iso_null,iso_null,
+        iso_pause,
+        iso_resume,
+        iso_stop,
         iso_exit
 };
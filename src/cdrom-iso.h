@@ -21,11 +21,15 @@
 #ifndef CDROM_ISO_H
 #define CDROM_ISO_H
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif /* __cplusplus */
 
 extern int iso_open(const char *fn);
+extern void iso_close(void);
+extern uint32_t iso_audio_read(int16_t *buf, uint32_t frames);
 
 void iso_init(void);
 
@@ -119,6 +119,11 @@ static uint8_t ioctl_getcurrentsubchannel(uint8_t *b, int msf)
         return 0;
 }
 
+static uint32_t ioctl_getposition(void)
+{
+	return 0;
+}
+
 static void ioctl_playaudio(uint32_t pos, uint32_t len)
 {
 	NOT_USED(pos);
@@ -165,6 +170,7 @@ static ATAPI ioctl_atapi=
         ioctl_ready,
         ioctl_readtoc,
         ioctl_getcurrentsubchannel,
+        ioctl_getposition,
         ioctl_readsector,
         ioctl_playaudio,
         ioctl_seek,
@@ -0,0 +1,1551 @@
+/*
+  RPCEmu - An Acorn system emulator
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Hard disc image file formats
+
+   Plain images are a raw copy of the disc, read and written in place.
+
+   Overlay images hold only the blocks of the disc that have been written,
+   and read everything else from a base image, which is never modified.
+   Many machines can then share one base image, each with its own overlay.
+   The overlay file is laid out as:
+
+   Block 0     Header: magic, version, block size, image size, base image
+               path (relative to the overlay's directory unless absolute),
+               and the L1 index at OVERLAY_L1_OFFSET.
+   Block 1...  L2 index tables and data blocks, in the order allocated.
+
+   Each L1 entry is the file offset of an L2 table, and each L2 entry the
+   file offset of a data block, or 0 if not yet allocated. All values are
+   little-endian. When a block is first written the rest of it is copied
+   from the base image, then the data is written before the index entries
+   pointing at it, so an interrupted write never exposes a partial block.
+
+   Compressed images hold each 64KB block of the disc compressed on its
+   own, so mostly empty or repetitive discs take up a fraction of their
+   size on the host. The file is laid out as:
+
+   0           Header: magic, version, block size, image size, and the
+               L1 index at COMPRESSED_L1_OFFSET.
+   8KB...      L2 index tables and compressed blocks, in the order written,
+               each starting on a 512 byte boundary.
+
+   The index has the same two-level shape as an overlay's, but each L2
+   entry holds the offset of the compressed data (in 512 byte units) in
+   its top 40 bits and its length in the bottom 24. An entry of 0 is a
+   block of zeros, and a length equal to the block size means the block
+   is stored uncompressed. Decompressed blocks are kept in a small LRU
+   cache, and modified blocks are only compressed and written back when
+   evicted or when hdfile_sync() is called. A rewritten block always goes
+   to space no index entry points at, either appended or reused from
+   earlier rewrites, and only once its entry has been updated is its old
+   space reused, so an interrupted write never leaves an entry describing
+   data it does not match. Space freed in earlier sessions is recovered by
+   compressing the image again.
+
+   Blocks are compressed with the LZ77 scheme in lz.c.
+
+   This file does not depend on the rest of the emulator, so it can be
+   built into the hdoverlay and hdcompress tools.
+*/
+#define _FILE_OFFSET_BITS 64
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined WIN32 || defined _WIN32
+#include <io.h>
+#define fsync(fd) _commit(fd)
+#endif
+
+#include "hdfile.h"
+#include "hostio.h"
+#include "lz.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define OVERLAY_MAGIC		"RPCEmuOV"
+#define OVERLAY_VERSION		1
+#define OVERLAY_BLOCK_SIZE	65536
+#define OVERLAY_PATH_OFFSET	24	/**< Offset of base image path in header */
+#define OVERLAY_PATH_MAX	1024	/**< Space for base image path, including terminator */
+#define OVERLAY_L1_OFFSET	2048	/**< Offset of L1 index in header */
+
+#define COMPRESSED_MAGIC	"RPCEmuCZ"
+#define COMPRESSED_VERSION	1
+#define COMPRESSED_BLOCK_SIZE	65536
+#define COMPRESSED_L1_OFFSET	512	/**< Offset of L1 index in header */
+#define COMPRESSED_HEADER_SIZE	8192
+#define COMPRESSED_UNIT		512	/**< Alignment of data in the file */
+#define COMPRESSED_CACHE	32	/**< Decompressed blocks held in memory */
+#define COMPRESSED_FREE_MAX	256	/**< Free extents remembered for reuse */
+
+/* Both formats share the shape of their index. Each L2 table occupies one
+   64KB block and covers 512MB, so the L1 index covers 256GB */
+#define INDEX_TABLE_SIZE	65536
+#define INDEX_L1_ENTRIES	512
+#define INDEX_L2_ENTRIES	(INDEX_TABLE_SIZE / 8)
+
+typedef enum {
+	HDFILE_PLAIN,
+	HDFILE_OVERLAY,
+	HDFILE_COMPRESSED
+} HdFileType;
+
+/** Space in a compressed image that no index entry points at */
+typedef struct {
+	uint64_t unit;			/**< Start, in COMPRESSED_UNITs */
+	uint64_t units;			/**< Length, in COMPRESSED_UNITs */
+} HdFreeExtent;
+
+/** A decompressed block of a compressed image */
+typedef struct {
+	int64_t block;			/**< Block number held, or -1 if unused */
+	int dirty;			/**< Modified since written back */
+	uint32_t used;			/**< Value of cache_clock when last used */
+	uint8_t *data;
+} HdCacheBlock;
+
+struct HdFile {
+	HdFileType type;
+	int fd;				/**< Image, or overlay, file */
+
+	/* Overlay and compressed images only */
+	int64_t size;			/**< Length of image, as written so far */
+	int64_t end;			/**< End of the file, where blocks are allocated */
+	int64_t l1_offset;		/**< Offset of the L1 index in the file */
+	uint64_t l1[INDEX_L1_ENTRIES];
+	uint64_t *l2[INDEX_L1_ENTRIES]; /**< Loaded L2 tables, NULL if not allocated */
+	uint8_t *block;			/**< Scratch space for copying a block */
+
+	/* Overlay images only */
+	int base_fd;			/**< Base image, opened read only */
+
+	/* Compressed images only */
+	HdCacheBlock cache[COMPRESSED_CACHE];
+	uint32_t cache_clock;		/**< Incremented on each cache access */
+	HdFreeExtent free_space[COMPRESSED_FREE_MAX]; /**< Space left by rewritten blocks */
+	int free_count;
+};
+
+static _Thread_local char hdfile_errmsg[1280];	/**< Description of the last failure */
+
+/**
+ * Record a description of a failure, for hdfile_error().
+ *
+ * @param format printf-style format
+ */
+static void
+hdfile_set_error(const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	vsnprintf(hdfile_errmsg, sizeof(hdfile_errmsg), format, ap);
+	va_end(ap);
+}
+
+/**
+ * Return a description of the last failure.
+ *
+ * @return Message
+ */
+const char *
+hdfile_error(void)
+{
+	return hdfile_errmsg;
+}
+
+/**
+ * Read from a file, retrying short reads. Data beyond the end of the file
+ * reads as zeros.
+ *
+ * @param fd     File descriptor
+ * @param buf    Buffer to fill
+ * @param len    Number of bytes to read
+ * @param offset Offset within the file
+ * @return 0 on success, -1 on error
+ */
+static int
+hdfile_pread(int fd, void *buf, size_t len, int64_t offset)
+{
+	const ssize_t done = hostio_read(fd, buf, len, offset);
+
+	if (done < 0) {
+		hdfile_set_error("Read failed: %s", strerror(errno));
+		return -1;
+	}
+
+	memset((uint8_t *) buf + done, 0, len - (size_t) done);
+	return 0;
+}
+
+/**
+ * Write to a file, retrying short writes.
+ *
+ * @param fd     File descriptor
+ * @param buf    Data to write
+ * @param len    Number of bytes to write
+ * @param offset Offset within the file
+ * @return 0 on success, -1 on error
+ */
+static int
+hdfile_pwrite(int fd, const void *buf, size_t len, int64_t offset)
+{
+	if (hostio_write(fd, buf, len, offset) != 0) {
+		hdfile_set_error("Write failed: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void
+put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = (uint8_t) v;
+	p[1] = (uint8_t) (v >> 8);
+	p[2] = (uint8_t) (v >> 16);
+	p[3] = (uint8_t) (v >> 24);
+}
+
+static void
+put_le64(uint8_t *p, uint64_t v)
+{
+	put_le32(p, (uint32_t) v);
+	put_le32(p + 4, (uint32_t) (v >> 32));
+}
+
+static uint32_t
+get_le32(const uint8_t *p)
+{
+	return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+	       ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t
+get_le64(const uint8_t *p)
+{
+	return (uint64_t) get_le32(p) | ((uint64_t) get_le32(p + 4) << 32);
+}
+
+/**
+ * Write one little-endian 64-bit value to a file.
+ *
+ * @param fd     File descriptor
+ * @param offset Offset within the file
+ * @param v      Value
+ * @return 0 on success, -1 on error
+ */
+static int
+hdfile_write_le64(int fd, int64_t offset, uint64_t v)
+{
+	uint8_t buf[8];
+
+	put_le64(buf, v);
+	return hdfile_pwrite(fd, buf, sizeof(buf), offset);
+}
+
+/**
+ * Return the length of a file.
+ *
+ * @param fd File descriptor
+ * @return Length in bytes, or -1 on error
+ */
+static int64_t
+hdfile_length(int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) != 0) {
+		hdfile_set_error("Unable to read file size: %s", strerror(errno));
+		return -1;
+	}
+	return st.st_size;
+}
+
+/**
+ * Work out the path of an overlay's base image. A relative path is taken
+ * to be relative to the directory holding the overlay.
+ *
+ * @param pathname Path of overlay
+ * @param base     Base image path as stored in the overlay
+ * @param out      Buffer for resulting path
+ * @param out_len  Size of out
+ */
+static void
+hdfile_base_path(const char *pathname, const char *base, char *out, size_t out_len)
+{
+	const char *slash = strrchr(pathname, '/');
+	int absolute = (base[0] == '/');
+
+#if defined WIN32 || defined _WIN32
+	const char *backslash = strrchr(pathname, '\\');
+
+	if (backslash != NULL && (slash == NULL || backslash > slash)) {
+		slash = backslash;
+	}
+	absolute = absolute || base[0] == '\\' || (base[0] != '\0' && base[1] == ':');
+#endif
+
+	if (absolute || slash == NULL) {
+		snprintf(out, out_len, "%s", base);
+	} else {
+		snprintf(out, out_len, "%.*s/%s", (int) (slash - pathname), pathname, base);
+	}
+}
+
+/**
+ * Load the L2 tables referred to by an image's L1 index, which must
+ * already be in f->l1.
+ *
+ * @param f Overlay or compressed image
+ * @return 0 on success, -1 on error
+ */
+static int
+hdfile_index_load(HdFile *f)
+{
+	int i, j;
+
+	for (i = 0; i < INDEX_L1_ENTRIES; i++) {
+		if (f->l1[i] == 0) {
+			continue;
+		}
+		f->l2[i] = malloc(INDEX_L2_ENTRIES * sizeof(uint64_t));
+		if (f->l2[i] == NULL) {
+			hdfile_set_error("Out of memory for image index");
+			return -1;
+		}
+		if (hdfile_pread(f->fd, f->block, INDEX_TABLE_SIZE, (int64_t) f->l1[i]) != 0) {
+			return -1;
+		}
+		for (j = 0; j < INDEX_L2_ENTRIES; j++) {
+			f->l2[i][j] = get_le64(f->block + j * 8);
+		}
+	}
+	return 0;
+}
+
+/**
+ * Return the index entry of a block.
+ *
+ * @param f     Overlay or compressed image
+ * @param block Block number within the image
+ * @return Entry, or 0 if the block has none
+ */
+static uint64_t
+hdfile_index_lookup(const HdFile *f, uint64_t block)
+{
+	const uint64_t l1 = block / INDEX_L2_ENTRIES;
+
+	if (l1 >= INDEX_L1_ENTRIES || f->l2[l1] == NULL) {
+		return 0;
+	}
+	return f->l2[l1][block % INDEX_L2_ENTRIES];
+}
+
+/**
+ * Set the index entry of a block, adding an L2 table if needed. Uses
+ * f->block as scratch space.
+ *
+ * @param f     Overlay or compressed image
+ * @param block Block number within the image
+ * @param entry New entry
+ * @return 0 on success, -1 on error
+ */
+static int
+hdfile_index_set(HdFile *f, uint64_t block, uint64_t entry)
+{
+	const uint64_t l1 = block / INDEX_L2_ENTRIES;
+	const uint64_t l2 = block % INDEX_L2_ENTRIES;
+
+	if (l1 >= INDEX_L1_ENTRIES) {
+		hdfile_set_error("Write beyond the largest size supported by the image format");
+		return -1;
+	}
+
+	if (f->l2[l1] == NULL) {
+		/* Add a new, empty, L2 table */
+		const uint64_t table = (uint64_t) f->end;
+
+		f->l2[l1] = calloc(INDEX_L2_ENTRIES, sizeof(uint64_t));
+		if (f->l2[l1] == NULL) {
+			hdfile_set_error("Out of memory for image index");
+			return -1;
+		}
+		memset(f->block, 0, INDEX_TABLE_SIZE);
+		if (hdfile_pwrite(f->fd, f->block, INDEX_TABLE_SIZE, (int64_t) table) != 0 ||
+		    hdfile_write_le64(f->fd, f->l1_offset + (int64_t) l1 * 8, table) != 0)
+		{
+			return -1;
+		}
+		f->l1[l1] = table;
+		f->end += INDEX_TABLE_SIZE;
+	}
+
+	if (hdfile_write_le64(f->fd, (int64_t) (f->l1[l1] + l2 * 8), entry) != 0) {
+		return -1;
+	}
+	f->l2[l1][l2] = entry;
+	return 0;
+}
+
+/**
+ * Check whether a block is all zeros.
+ *
+ * @param data Block
+ * @param len  Length of block
+ * @return Non-zero if all zeros
+ */
+static int
+hdfile_is_zero(const uint8_t *data, size_t len)
+{
+	return len == 0 || (data[0] == 0 && memcmp(data, data + 1, len - 1) == 0);
+}
+
+/**
+ * Allocate space for compressed data, reusing space left by rewritten
+ * blocks if an extent is big enough, otherwise at the end of the file.
+ *
+ * @param f     Compressed image
+ * @param units Length needed, in COMPRESSED_UNITs
+ * @return Start of the space, in COMPRESSED_UNITs
+ */
+static uint64_t
+hdfile_compressed_alloc(HdFile *f, uint64_t units)
+{
+	uint64_t unit;
+	int i;
+
+	for (i = 0; i < f->free_count; i++) {
+		HdFreeExtent *e = &f->free_space[i];
+
+		if (e->units >= units) {
+			unit = e->unit;
+			e->unit += units;
+			e->units -= units;
+			if (e->units == 0) {
+				*e = f->free_space[--f->free_count];
+			}
+			return unit;
+		}
+	}
+
+	unit = (uint64_t) f->end / COMPRESSED_UNIT;
+	f->end += (int64_t) (units * COMPRESSED_UNIT);
+	return unit;
+}
+
+/**
+ * Make the space of an index entry that has been replaced available for
+ * reuse. If too many extents are already remembered the space is left
+ * until the image is next compressed.
+ *
+ * @param f     Compressed image
+ * @param entry Old index entry, no longer in the index
+ */
+static void
+hdfile_compressed_release(HdFile *f, uint64_t entry)
+{
+	const uint64_t unit = entry >> 24;
+	const uint64_t units = ((entry & 0xffffff) + COMPRESSED_UNIT - 1) / COMPRESSED_UNIT;
+	int i;
+
+	if (entry == 0) {
+		return;
+	}
+
+	/* Join the extent to a neighbour if possible */
+	for (i = 0; i < f->free_count; i++) {
+		HdFreeExtent *e = &f->free_space[i];
+
+		if (e->unit + e->units == unit) {
+			e->units += units;
+			return;
+		}
+		if (unit + units == e->unit) {
+			e->unit = unit;
+			e->units += units;
+			return;
+		}
+	}
+
+	if (f->free_count < COMPRESSED_FREE_MAX) {
+		f->free_space[f->free_count].unit = unit;
+		f->free_space[f->free_count].units = units;
+		f->free_count++;
+	}
+}
+
+/**
+ * Compress a cached block and write it to the image, updating the index.
+ * Uses f->block as scratch space.
+ *
+ * The data always goes to space the index does not point at, and the old
+ * space is only released for reuse once the index entry has been updated.
+ *
+ * @param f Compressed image
+ * @param c Cached block
+ * @return 0 on success, -1 on error
+ */
+static int
+hdfile_compressed_writeback(HdFile *f, HdCacheBlock *c)
+{
+	const uint64_t old = hdfile_index_lookup(f, (uint64_t) c->block);
+	const uint8_t *out = f->block;
+	uint64_t unit;
+	size_t len;
+
+	if (hdfile_is_zero(c->data, COMPRESSED_BLOCK_SIZE)) {
+		/* Nothing need be stored */
+		if (old != 0) {
+			if (hdfile_index_set(f, (uint64_t) c->block, 0) != 0) {
+				return -1;
+			}
+			hdfile_compressed_release(f, old);
+		}
+		c->dirty = 0;
+		return 0;
+	}
+
+	len = lz_compress(c->data, COMPRESSED_BLOCK_SIZE, f->block, COMPRESSED_BLOCK_SIZE - 1);
+	if (len == 0) {
+		len = COMPRESSED_BLOCK_SIZE;
+		out = c->data;
+	}
+
+	unit = hdfile_compressed_alloc(f, (len + COMPRESSED_UNIT - 1) / COMPRESSED_UNIT);
+
+	/* hdfile_index_set() needs f->block, so write the data first */
+	if (hdfile_pwrite(f->fd, out, len, (int64_t) (unit * COMPRESSED_UNIT)) != 0 ||
+	    hdfile_index_set(f, (uint64_t) c->block, unit << 24 | len) != 0)
+	{
+		return -1;
+	}
+	hdfile_compressed_release(f, old);
+	c->dirty = 0;
+	return 0;
+}
+
+/**
+ * Find a block of a compressed image in the cache.
+ *
+ * @param f     Compressed image
+ * @param block Block number within the image
+ * @return Cached block, or NULL if not cached
+ */
+static HdCacheBlock *
+hdfile_compressed_find(HdFile *f, uint64_t block)
+{
+	int i;
+
+	for (i = 0; i < COMPRESSED_CACHE; i++) {
+		if (f->cache[i].block == (int64_t) block) {
+			return &f->cache[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Find a block of a compressed image in the cache, loading it if needed.
+ *
+ * @param f     Compressed image
+ * @param block Block number within the image
+ * @param load  Fill in the block's current contents; otherwise the caller
+ *              is about to overwrite all of it
+ * @return Cached block, or NULL on error
+ */
+static HdCacheBlock *
+hdfile_compressed_get(HdFile *f, uint64_t block, int load)
+{
+	HdCacheBlock *c;
+	uint64_t entry;
+	int64_t data;
+	size_t len;
+	int i;
+
+	f->cache_clock++;
+
+	c = hdfile_compressed_find(f, block);
+	if (c != NULL) {
+		c->used = f->cache_clock;
+		return c;
+	}
+
+	for (i = 0; i < COMPRESSED_CACHE; i++) {
+		HdCacheBlock *e = &f->cache[i];
+
+		/* Prefer an unused entry, otherwise the least recently used */
+		if (c == NULL || (c->block != -1 && (e->block == -1 ||
+		    f->cache_clock - e->used > f->cache_clock - c->used)))
+		{
+			c = e;
+		}
+	}
+
+	if (c->block != -1 && c->dirty && hdfile_compressed_writeback(f, c) != 0) {
+		return NULL;
+	}
+	c->block = -1;
+	c->dirty = 0;
+
+	entry = hdfile_index_lookup(f, block);
+	data = (int64_t) ((entry >> 24) * COMPRESSED_UNIT);
+	len = (size_t) (entry & 0xffffff);
+	if (!load || entry == 0) {
+		memset(c->data, 0, COMPRESSED_BLOCK_SIZE);
+	} else if (len == COMPRESSED_BLOCK_SIZE) {
+		if (hdfile_pread(f->fd, c->data, len, data) != 0) {
+			return NULL;
+		}
+	} else if (len < COMPRESSED_BLOCK_SIZE) {
+		if (hdfile_pread(f->fd, f->block, len, data) != 0) {
+			return NULL;
+		}
+		if (lz_decompress(f->block, len, c->data, COMPRESSED_BLOCK_SIZE) != 0) {
+			hdfile_set_error("Compressed block %llu is corrupt", (unsigned long long) block);
+			return NULL;
+		}
+	} else {
+		hdfile_set_error("Compressed block %llu has a bad index entry", (unsigned long long) block);
+		return NULL;
+	}
+
+	c->block = (int64_t) block;
+	c->used = f->cache_clock;
+	return c;
+}
+
+/**
+ * Load a compressed image's header and index. f->fd must be open on the
+ * image.
+ *
+ * @param f        Image
+ * @param pathname Path of image, for messages
+ * @return 0 on success, -1 on error
+ */
+static int
+hdfile_compressed_load(HdFile *f, const char *pathname)
+{
+	uint8_t *header = f->block;
+	int i;
+
+	if (hdfile_pread(f->fd, header, COMPRESSED_HEADER_SIZE, 0) != 0) {
+		return -1;
+	}
+	if (get_le32(header + 8) != COMPRESSED_VERSION ||
+	    get_le32(header + 12) != COMPRESSED_BLOCK_SIZE)
+	{
+		hdfile_set_error("Compressed image '%s' is of an unsupported version", pathname);
+		return -1;
+	}
+	f->size = (int64_t) get_le64(header + 16);
+	for (i = 0; i < INDEX_L1_ENTRIES; i++) {
+		f->l1[i] = get_le64(header + COMPRESSED_L1_OFFSET + i * 8);
+	}
+
+	f->end = hdfile_length(f->fd);
+	if (f->end < 0) {
+		return -1;
+	}
+	if (f->end < COMPRESSED_HEADER_SIZE) {
+		f->end = COMPRESSED_HEADER_SIZE;
+	}
+	f->end = (f->end + COMPRESSED_UNIT - 1) & ~((int64_t) COMPRESSED_UNIT - 1);
+
+	for (i = 0; i < COMPRESSED_CACHE; i++) {
+		f->cache[i].block = -1;
+		f->cache[i].data = malloc(COMPRESSED_BLOCK_SIZE);
+		if (f->cache[i].data == NULL) {
+			hdfile_set_error("Out of memory for compressed image cache");
+			return -1;
+		}
+	}
+
+	f->l1_offset = COMPRESSED_L1_OFFSET;
+	return hdfile_index_load(f);
+}
+
+/**
+ * Load an overlay's header and index. f->fd must be open on the overlay.
+ *
+ * @param f        Image
+ * @param pathname Path of overlay, used to locate the base image
+ * @param base_rw  Open the base image for writing as well as reading
+ * @return 0 on success, -1 on error
+ */
+static int
+hdfile_overlay_load(HdFile *f, const char *pathname, int base_rw)
+{
+	uint8_t *header = f->block;
+	char base[OVERLAY_PATH_MAX], base_path[OVERLAY_PATH_MAX + 1024];
+	int i;
+
+	if (hdfile_pread(f->fd, header, OVERLAY_BLOCK_SIZE, 0) != 0) {
+		return -1;
+	}
+	if (get_le32(header + 8) != OVERLAY_VERSION ||
+	    get_le32(header + 12) != OVERLAY_BLOCK_SIZE)
+	{
+		hdfile_set_error("Overlay '%s' is of an unsupported version", pathname);
+		return -1;
+	}
+	f->size = (int64_t) get_le64(header + 16);
+
+	memcpy(base, header + OVERLAY_PATH_OFFSET, OVERLAY_PATH_MAX);
+	base[OVERLAY_PATH_MAX - 1] = '\0';
+	for (i = 0; i < INDEX_L1_ENTRIES; i++) {
+		f->l1[i] = get_le64(header + OVERLAY_L1_OFFSET + i * 8);
+	}
+
+	f->end = hdfile_length(f->fd);
+	if (f->end < 0) {
+		return -1;
+	}
+	f->end = (f->end + OVERLAY_BLOCK_SIZE - 1) & ~((int64_t) OVERLAY_BLOCK_SIZE - 1);
+
+	f->l1_offset = OVERLAY_L1_OFFSET;
+	if (hdfile_index_load(f) != 0) {
+		return -1;
+	}
+
+	hdfile_base_path(pathname, base, base_path, sizeof(base_path));
+	f->base_fd = open(base_path, (base_rw ? O_RDWR : O_RDONLY) | O_BINARY);
+	if (f->base_fd == -1) {
+		hdfile_set_error("Cannot open base image '%s' of overlay '%s': %s",
+		                 base_path, pathname, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Open an image file, detecting its format.
+ *
+ * @param pathname Path of image
+ * @param base_rw  For an overlay, open the base image for writing as well
+ * @return Image, or NULL on failure (see hdfile_error())
+ */
+static HdFile *
+hdfile_open_internal(const char *pathname, int base_rw)
+{
+	char magic[8];
+	HdFile *f;
+
+	assert(pathname);
+
+	f = calloc(1, sizeof(HdFile));
+	if (f == NULL) {
+		hdfile_set_error("Out of memory");
+		return NULL;
+	}
+	f->type = HDFILE_PLAIN;
+	f->base_fd = -1;
+
+	f->fd = open(pathname, O_RDWR | O_CREAT | O_BINARY, 0666);
+	if (f->fd == -1) {
+		hdfile_set_error("Cannot open file '%s': %s", pathname, strerror(errno));
+		free(f);
+		return NULL;
+	}
+
+	if (hdfile_pread(f->fd, magic, sizeof(magic), 0) != 0) {
+		hdfile_close(f);
+		return NULL;
+	}
+	if (memcmp(magic, OVERLAY_MAGIC, sizeof(magic)) == 0) {
+		f->type = HDFILE_OVERLAY;
+	} else if (memcmp(magic, COMPRESSED_MAGIC, sizeof(magic)) == 0) {
+		f->type = HDFILE_COMPRESSED;
+	} else {
+		return f;
+	}
+
+	/* Index tables, overlay blocks and compressed blocks all fit */
+	f->block = malloc(INDEX_TABLE_SIZE);
+	if (f->block == NULL) {
+		hdfile_set_error("Out of memory");
+		hdfile_close(f);
+		return NULL;
+	}
+	if ((f->type == HDFILE_OVERLAY && hdfile_overlay_load(f, pathname, base_rw) != 0) ||
+	    (f->type == HDFILE_COMPRESSED && hdfile_compressed_load(f, pathname) != 0))
+	{
+		hdfile_close(f);
+		return NULL;
+	}
+
+	return f;
+}
+
+/**
+ * Open an image file, creating an empty plain image if it does not exist.
+ * The format is detected from the contents.
+ *
+ * @param pathname Path of image
+ * @return Image, or NULL on failure (see hdfile_error())
+ */
+HdFile *
+hdfile_open(const char *pathname)
+{
+	return hdfile_open_internal(pathname, 0);
+}
+
+/**
+ * Close an image.
+ *
+ * @param f Image
+ */
+void
+hdfile_close(HdFile *f)
+{
+	int i;
+
+	if (f == NULL) {
+		return;
+	}
+
+	if (f->fd != -1) {
+		hdfile_sync(f);
+		close(f->fd);
+	}
+	if (f->base_fd != -1) {
+		close(f->base_fd);
+	}
+	for (i = 0; i < INDEX_L1_ENTRIES; i++) {
+		free(f->l2[i]);
+	}
+	for (i = 0; i < COMPRESSED_CACHE; i++) {
+		free(f->cache[i].data);
+	}
+	free(f->block);
+	free(f);
+}
+
+/**
+ * Write back any modified data held in memory. Only compressed images
+ * hold any.
+ *
+ * @param f Image
+ * @return 0 on success, -1 on error (see hdfile_error())
+ */
+int
+hdfile_sync(HdFile *f)
+{
+	int i;
+
+	if (f->type != HDFILE_COMPRESSED) {
+		return 0;
+	}
+	for (i = 0; i < COMPRESSED_CACHE; i++) {
+		HdCacheBlock *c = &f->cache[i];
+
+		if (c->block != -1 && c->dirty && hdfile_compressed_writeback(f, c) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Return the length of an image.
+ *
+ * @param f Image
+ * @return Length in bytes, or -1 on error (see hdfile_error())
+ */
+int64_t
+hdfile_size(const HdFile *f)
+{
+	return (f->type == HDFILE_PLAIN) ? hdfile_length(f->fd) : f->size;
+}
+
+/**
+ * Return the file descriptor of a plain image, which can be accessed
+ * directly (e.g. mapped into memory).
+ *
+ * @param f Image
+ * @return File descriptor, or -1 if the image is not a plain image
+ */
+int
+hdfile_fd(const HdFile *f)
+{
+	return (f->type == HDFILE_PLAIN) ? f->fd : -1;
+}
+
+/**
+ * Add a block to an overlay, filled with its current contents from the
+ * base image.
+ *
+ * @param f     Overlay image
+ * @param block Block number within the image
+ * @return Offset of the block's data in the overlay, or 0 on error
+ */
+static uint64_t
+hdfile_overlay_allocate(HdFile *f, uint64_t block)
+{
+	const uint64_t data = (uint64_t) f->end;
+
+	if (block / INDEX_L2_ENTRIES >= INDEX_L1_ENTRIES) {
+		hdfile_set_error("Write beyond the largest size supported by an overlay");
+		return 0;
+	}
+
+	/* Copy the block from the base image, then make the index refer to it */
+	if (hdfile_pread(f->base_fd, f->block, OVERLAY_BLOCK_SIZE, (int64_t) (block * OVERLAY_BLOCK_SIZE)) != 0 ||
+	    hdfile_pwrite(f->fd, f->block, OVERLAY_BLOCK_SIZE, (int64_t) data) != 0)
+	{
+		return 0;
+	}
+	f->end += OVERLAY_BLOCK_SIZE;
+	if (hdfile_index_set(f, block, data) != 0) {
+		return 0;
+	}
+	return data;
+}
+
+/**
+ * Read from a compressed image.
+ *
+ * @param f      Compressed image
+ * @param buf    Buffer to fill
+ * @param len    Number of bytes to read
+ * @param offset Offset within the image
+ * @return 0 on success, -1 on error
+ */
+static int
+hdfile_compressed_read(HdFile *f, void *buf, size_t len, int64_t offset)
+{
+	uint8_t *p = buf;
+
+	while (len > 0) {
+		const uint64_t block = (uint64_t) offset / COMPRESSED_BLOCK_SIZE;
+		const size_t within = (size_t) ((uint64_t) offset % COMPRESSED_BLOCK_SIZE);
+		size_t n = COMPRESSED_BLOCK_SIZE - within;
+
+		if (n > len) {
+			n = len;
+		}
+		if (hdfile_index_lookup(f, block) == 0 && hdfile_compressed_find(f, block) == NULL) {
+			/* A block of zeros, no need to cache it */
+			memset(p, 0, n);
+		} else {
+			const HdCacheBlock *c = hdfile_compressed_get(f, block, 1);
+
+			if (c == NULL) {
+				return -1;
+			}
+			memcpy(p, c->data + within, n);
+		}
+
+		p += n;
+		offset += (int64_t) n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * Read from an image. Data beyond the end of the image reads as zeros.
+ *
+ * @param f      Image
+ * @param buf    Buffer to fill
+ * @param len    Number of bytes to read
+ * @param offset Offset within the image
+ * @return 0 on success, -1 on error (see hdfile_error())
+ */
+int
+hdfile_read(HdFile *f, void *buf, size_t len, int64_t offset)
+{
+	uint8_t *p = buf;
+
+	if (f->type == HDFILE_PLAIN) {
+		return hdfile_pread(f->fd, buf, len, offset);
+	}
+	if (f->type == HDFILE_COMPRESSED) {
+		return hdfile_compressed_read(f, buf, len, offset);
+	}
+
+	while (len > 0) {
+		const uint64_t block = (uint64_t) offset / OVERLAY_BLOCK_SIZE;
+		const size_t within = (size_t) ((uint64_t) offset % OVERLAY_BLOCK_SIZE);
+		const uint64_t data = hdfile_index_lookup(f, block);
+		size_t n = OVERLAY_BLOCK_SIZE - within;
+		int ret;
+
+		if (n > len) {
+			n = len;
+		}
+		if (data != 0) {
+			ret = hdfile_pread(f->fd, p, n, (int64_t) (data + within));
+		} else {
+			ret = hdfile_pread(f->base_fd, p, n, offset);
+		}
+		if (ret != 0) {
+			return -1;
+		}
+
+		p += n;
+		offset += (int64_t) n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * Write to an image. For an overlay image, the base image is not altered.
+ * For a compressed image, the data may be held in memory until
+ * hdfile_sync() or hdfile_close() is called.
+ *
+ * @param f      Image
+ * @param buf    Data to write
+ * @param len    Number of bytes to write
+ * @param offset Offset within the image
+ * @return 0 on success, -1 on error (see hdfile_error())
+ */
+int
+hdfile_write(HdFile *f, const void *buf, size_t len, int64_t offset)
+{
+	const uint8_t *p = buf;
+
+	if (f->type == HDFILE_PLAIN) {
+		return hdfile_pwrite(f->fd, buf, len, offset);
+	}
+
+	while (len > 0) {
+		const uint64_t block = (uint64_t) offset / OVERLAY_BLOCK_SIZE;
+		const size_t within = (size_t) ((uint64_t) offset % OVERLAY_BLOCK_SIZE);
+		uint64_t data = hdfile_index_lookup(f, block);
+		size_t n = OVERLAY_BLOCK_SIZE - within;
+
+		if (n > len) {
+			n = len;
+		}
+		if (f->type == HDFILE_COMPRESSED) {
+			HdCacheBlock *c;
+
+			if (block / INDEX_L2_ENTRIES >= INDEX_L1_ENTRIES) {
+				hdfile_set_error("Write beyond the largest size supported by a compressed image");
+				return -1;
+			}
+			c = hdfile_compressed_get(f, block, n != COMPRESSED_BLOCK_SIZE);
+			if (c == NULL) {
+				return -1;
+			}
+			memcpy(c->data + within, p, n);
+			c->dirty = 1;
+			p += n;
+			offset += (int64_t) n;
+			len -= n;
+			continue;
+		}
+		if (data == 0) {
+			data = hdfile_overlay_allocate(f, block);
+			if (data == 0) {
+				return -1;
+			}
+		}
+		if (hdfile_pwrite(f->fd, p, n, (int64_t) (data + within)) != 0) {
+			return -1;
+		}
+
+		p += n;
+		offset += (int64_t) n;
+		len -= n;
+	}
+
+	if (offset > f->size) {
+		f->size = offset;
+		if (hdfile_write_le64(f->fd, 16, (uint64_t) f->size) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Write a new, empty, overlay header.
+ *
+ * @param fd   Overlay file, which is truncated to just the header
+ * @param base Base image path to store
+ * @param size Length of the image
+ * @return 0 on success, -1 on error (see hdfile_error())
+ */
+static int
+hdfile_overlay_init(int fd, const char *base, int64_t size)
+{
+	uint8_t *header;
+	int ret;
+
+	if (strlen(base) >= OVERLAY_PATH_MAX) {
+		hdfile_set_error("Base image path '%s' is too long", base);
+		return -1;
+	}
+
+	header = calloc(1, OVERLAY_BLOCK_SIZE);
+	if (header == NULL) {
+		hdfile_set_error("Out of memory");
+		return -1;
+	}
+	memcpy(header, OVERLAY_MAGIC, 8);
+	put_le32(header + 8, OVERLAY_VERSION);
+	put_le32(header + 12, OVERLAY_BLOCK_SIZE);
+	put_le64(header + 16, (uint64_t) size);
+	strcpy((char *) header + OVERLAY_PATH_OFFSET, base);
+
+	ret = hdfile_pwrite(fd, header, OVERLAY_BLOCK_SIZE, 0);
+	free(header);
+	if (ret == 0 && ftruncate(fd, OVERLAY_BLOCK_SIZE) != 0) {
+		hdfile_set_error("Unable to truncate overlay: %s", strerror(errno));
+		ret = -1;
+	}
+	if (ret == 0 && fsync(fd) != 0) {
+		hdfile_set_error("Unable to flush overlay: %s", strerror(errno));
+		ret = -1;
+	}
+	return ret;
+}
+
+/**
+ * Create an empty overlay on a base image. Any existing file at the
+ * overlay's path is replaced.
+ *
+ * @param pathname Path of overlay to create
+ * @param base     Path of base image, relative paths are taken to be
+ *                 relative to the overlay's directory
+ * @return 0 on success, -1 on error (see hdfile_error())
+ */
+int
+hdfile_overlay_create(const char *pathname, const char *base)
+{
+	char base_path[OVERLAY_PATH_MAX + 1024];
+	char magic[8];
+	int64_t size;
+	int fd, base_fd, ret;
+
+	assert(pathname);
+	assert(base);
+
+	hdfile_base_path(pathname, base, base_path, sizeof(base_path));
+	base_fd = open(base_path, O_RDONLY | O_BINARY);
+	if (base_fd == -1) {
+		hdfile_set_error("Cannot open base image '%s': %s", base_path, strerror(errno));
+		return -1;
+	}
+	size = hdfile_length(base_fd);
+	if (size >= 0 && hdfile_pread(base_fd, magic, sizeof(magic), 0) == 0 &&
+	    (memcmp(magic, OVERLAY_MAGIC, sizeof(magic)) == 0 ||
+	     memcmp(magic, COMPRESSED_MAGIC, sizeof(magic)) == 0))
+	{
+		hdfile_set_error("Base image '%s' must be a plain image", base_path);
+		size = -1;
+	}
+	close(base_fd);
+	if (size < 0) {
+		return -1;
+	}
+
+	fd = open(pathname, O_RDWR | O_CREAT | O_BINARY, 0666);
+	if (fd == -1) {
+		hdfile_set_error("Cannot create overlay '%s': %s", pathname, strerror(errno));
+		return -1;
+	}
+	ret = hdfile_overlay_init(fd, base, size);
+	close(fd);
+	return ret;
+}
+
+/**
+ * Open an existing overlay.
+ *
+ * @param pathname Path of overlay
+ * @param base_rw  Open the base image for writing as well as reading
+ * @return Image, or NULL on failure (see hdfile_error())
+ */
+static HdFile *
+hdfile_overlay_open(const char *pathname, int base_rw)
+{
+	HdFile *f;
+	int fd;
+
+	/* Check it exists first, as hdfile_open() would create it */
+	fd = open(pathname, O_RDONLY | O_BINARY);
+	if (fd == -1) {
+		hdfile_set_error("Cannot open overlay '%s': %s", pathname, strerror(errno));
+		return NULL;
+	}
+	close(fd);
+
+	f = hdfile_open_internal(pathname, base_rw);
+	if (f != NULL && f->type != HDFILE_OVERLAY) {
+		hdfile_set_error("'%s' is not an overlay", pathname);
+		hdfile_close(f);
+		return NULL;
+	}
+	return f;
+}
+
+/**
+ * Reset an open overlay to hold no blocks.
+ *
+ * @param f Overlay image
+ * @return 0 on success, -1 on error (see hdfile_error())
+ */
+static int
+hdfile_overlay_reset(HdFile *f)
+{
+	char base[OVERLAY_PATH_MAX];
+	int64_t size;
+
+	/* Keep the base image path as originally given */
+	if (hdfile_pread(f->fd, base, sizeof(base), OVERLAY_PATH_OFFSET) != 0) {
+		return -1;
+	}
+	base[OVERLAY_PATH_MAX - 1] = '\0';
+
+	size = hdfile_length(f->base_fd);
+	if (size < 0) {
+		return -1;
+	}
+	return hdfile_overlay_init(f->fd, base, size);
+}
+
+/**
+ * Write the blocks held in an overlay back into its base image, then empty
+ * the overlay. Nothing else may be using the base image at the time.
+ *
+ * @param pathname Path of overlay
+ * @return 0 on success, -1 on error (see hdfile_error())
+ */
+int
+hdfile_overlay_commit(const char *pathname)
+{
+	HdFile *f;
+	int i, j, ret = 0;
+
+	f = hdfile_overlay_open(pathname, 1);
+	if (f == NULL) {
+		return -1;
+	}
+
+	for (i = 0; i < INDEX_L1_ENTRIES && ret == 0; i++) {
+		if (f->l2[i] == NULL) {
+			continue;
+		}
+		for (j = 0; j < INDEX_L2_ENTRIES && ret == 0; j++) {
+			const int64_t offset = ((int64_t) i * INDEX_L2_ENTRIES + j) * OVERLAY_BLOCK_SIZE;
+			int64_t len = f->size - offset;
+
+			if (f->l2[i][j] == 0 || len <= 0) {
+				continue;
+			}
+			/* Do not extend the base image with the padding of the
+			   final block */
+			if (len > OVERLAY_BLOCK_SIZE) {
+				len = OVERLAY_BLOCK_SIZE;
+			}
+			ret = hdfile_pread(f->fd, f->block, (size_t) len, (int64_t) f->l2[i][j]);
+			if (ret == 0) {
+				ret = hdfile_pwrite(f->base_fd, f->block, (size_t) len, offset);
+			}
+		}
+	}
+
+	if (ret == 0 && fsync(f->base_fd) != 0) {
+		hdfile_set_error("Unable to flush base image: %s", strerror(errno));
+		ret = -1;
+	}
+	if (ret == 0) {
+		ret = hdfile_overlay_reset(f);
+	}
+
+	hdfile_close(f);
+	return ret;
+}
+
+/**
+ * Throw away the blocks held in an overlay, returning the image to the
+ * contents of its base image.
+ *
+ * @param pathname Path of overlay
+ * @return 0 on success, -1 on error (see hdfile_error())
+ */
+int
+hdfile_overlay_discard(const char *pathname)
+{
+	HdFile *f;
+	int ret;
+
+	f = hdfile_overlay_open(pathname, 0);
+	if (f == NULL) {
+		return -1;
+	}
+	ret = hdfile_overlay_reset(f);
+	hdfile_close(f);
+	return ret;
+}
+
+/**
+ * Describe an overlay.
+ *
+ * @param pathname Path of overlay
+ * @param base     Buffer for the path of the base image, as stored
+ * @param base_len Size of base
+ * @param size     Filled in with length of image
+ * @param blocks   Filled in with number of blocks held in the overlay
+ * @return 0 on success, -1 on error (see hdfile_error())
+ */
+int
+hdfile_overlay_info(const char *pathname, char *base, size_t base_len,
+                    int64_t *size, uint32_t *blocks)
+{
+	HdFile *f;
+	int i, j;
+
+	f = hdfile_overlay_open(pathname, 0);
+	if (f == NULL) {
+		return -1;
+	}
+
+	if (hdfile_pread(f->fd, f->block, OVERLAY_PATH_MAX, OVERLAY_PATH_OFFSET) != 0) {
+		hdfile_close(f);
+		return -1;
+	}
+	f->block[OVERLAY_PATH_MAX - 1] = '\0';
+	snprintf(base, base_len, "%s", (const char *) f->block);
+
+	*size = f->size;
+	*blocks = 0;
+	for (i = 0; i < INDEX_L1_ENTRIES; i++) {
+		if (f->l2[i] == NULL) {
+			continue;
+		}
+		for (j = 0; j < INDEX_L2_ENTRIES; j++) {
+			if (f->l2[i][j] != 0) {
+				(*blocks)++;
+			}
+		}
+	}
+
+	hdfile_close(f);
+	return 0;
+}
+
+/**
+ * Write a new, empty, compressed image header.
+ *
+ * @param fd   Image file, which is truncated to just the header
+ * @param size Length of the image
+ * @return 0 on success, -1 on error (see hdfile_error())
+ */
+static int
+hdfile_compressed_init(int fd, int64_t size)
+{
+	uint8_t header[COMPRESSED_HEADER_SIZE];
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, COMPRESSED_MAGIC, 8);
+	put_le32(header + 8, COMPRESSED_VERSION);
+	put_le32(header + 12, COMPRESSED_BLOCK_SIZE);
+	put_le64(header + 16, (uint64_t) size);
+
+	if (ftruncate(fd, 0) != 0) {
+		hdfile_set_error("Unable to truncate image: %s", strerror(errno));
+		return -1;
+	}
+	return hdfile_pwrite(fd, header, sizeof(header), 0);
+}
+
+/**
+ * Copy an image, in any format, to a new plain or compressed image. Blocks
+ * of zeros are not stored, so the result is sparse where the host allows.
+ * Compressing a compressed image recovers space left by rewritten blocks.
+ *
+ * @param pathname Path of image to copy, which must exist
+ * @param dest     Path of new image, any existing file is replaced
+ * @param compress Create a compressed image, rather than a plain one
+ * @return 0 on success, -1 on error (see hdfile_error())
+ */
+int
+hdfile_convert(const char *pathname, const char *dest, int compress)
+{
+	struct stat st_src, st_dest;
+	HdFile *src, *out = NULL;
+	uint8_t *buf;
+	int64_t size, offset;
+	int fd, ret = 0;
+
+	assert(pathname);
+	assert(dest);
+
+	/* Check it exists first, as hdfile_open() would create it */
+	if (stat(pathname, &st_src) != 0) {
+		hdfile_set_error("Cannot open image '%s': %s", pathname, strerror(errno));
+		return -1;
+	}
+	if (stat(dest, &st_dest) == 0 && st_dest.st_ino != 0 &&
+	    st_dest.st_dev == st_src.st_dev && st_dest.st_ino == st_src.st_ino)
+	{
+		hdfile_set_error("Cannot convert '%s' onto itself", pathname);
+		return -1;
+	}
+
+	src = hdfile_open(pathname);
+	if (src == NULL) {
+		return -1;
+	}
+	size = hdfile_size(src);
+	if (size < 0) {
+		hdfile_close(src);
+		return -1;
+	}
+	buf = malloc(COMPRESSED_BLOCK_SIZE);
+	if (buf == NULL) {
+		hdfile_set_error("Out of memory");
+		hdfile_close(src);
+		return -1;
+	}
+	fd = open(dest, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0666);
+	if (fd == -1) {
+		hdfile_set_error("Cannot create image '%s': %s", dest, strerror(errno));
+		free(buf);
+		hdfile_close(src);
+		return -1;
+	}
+
+	if (compress) {
+		ret = hdfile_compressed_init(fd, size);
+		close(fd);
+		fd = -1;
+		if (ret == 0) {
+			out = hdfile_open(dest);
+			ret = (out != NULL) ? 0 : -1;
+		}
+	}
+
+	for (offset = 0; offset < size && ret == 0; offset += COMPRESSED_BLOCK_SIZE) {
+		size_t n = COMPRESSED_BLOCK_SIZE;
+
+		if (size - offset < (int64_t) n) {
+			n = (size_t) (size - offset);
+		}
+		ret = hdfile_read(src, buf, n, offset);
+		if (ret != 0 || hdfile_is_zero(buf, n)) {
+			continue;
+		}
+		if (out != NULL) {
+			ret = hdfile_write(out, buf, n, offset);
+		} else {
+			ret = hdfile_pwrite(fd, buf, n, offset);
+		}
+	}
+
+	if (out != NULL) {
+		/* Record the full size, even if the image ends in zeros */
+		if (ret == 0 && size > out->size) {
+			out->size = size;
+			ret = hdfile_write_le64(out->fd, 16, (uint64_t) size);
+		}
+		if (ret == 0) {
+			ret = hdfile_sync(out);
+		}
+		if (ret == 0 && fsync(out->fd) != 0) {
+			hdfile_set_error("Unable to flush image: %s", strerror(errno));
+			ret = -1;
+		}
+		hdfile_close(out);
+	} else if (fd != -1) {
+		if (ret == 0 && ftruncate(fd, size) != 0) {
+			hdfile_set_error("Unable to set length of image: %s", strerror(errno));
+			ret = -1;
+		}
+		if (ret == 0 && fsync(fd) != 0) {
+			hdfile_set_error("Unable to flush image: %s", strerror(errno));
+			ret = -1;
+		}
+		close(fd);
+	}
+
+	free(buf);
+	hdfile_close(src);
+	return ret;
+}
+
+/**
+ * Describe a compressed image.
+ *
+ * @param pathname Path of image
+ * @param size     Filled in with length of image
+ * @param blocks   Filled in with number of blocks stored, excluding blocks
+ *                 of zeros
+ * @param stored   Filled in with total length of the stored blocks
+ * @return 0 on success, -1 on error (see hdfile_error())
+ */
+int
+hdfile_compressed_info(const char *pathname, int64_t *size, uint32_t *blocks,
+                       int64_t *stored)
+{
+	HdFile *f;
+	int fd, i, j;
+
+	/* Check it exists first, as hdfile_open() would create it */
+	fd = open(pathname, O_RDONLY | O_BINARY);
+	if (fd == -1) {
+		hdfile_set_error("Cannot open image '%s': %s", pathname, strerror(errno));
+		return -1;
+	}
+	close(fd);
+
+	f = hdfile_open(pathname);
+	if (f == NULL) {
+		return -1;
+	}
+	if (f->type != HDFILE_COMPRESSED) {
+		hdfile_set_error("'%s' is not a compressed image", pathname);
+		hdfile_close(f);
+		return -1;
+	}
+
+	*size = f->size;
+	*blocks = 0;
+	*stored = 0;
+	for (i = 0; i < INDEX_L1_ENTRIES; i++) {
+		if (f->l2[i] == NULL) {
+			continue;
+		}
+		for (j = 0; j < INDEX_L2_ENTRIES; j++) {
+			if (f->l2[i][j] != 0) {
+				(*blocks)++;
+				*stored += (int64_t) (f->l2[i][j] & 0xffffff);
+			}
+		}
+	}
+
+	hdfile_close(f);
+	return 0;
+}
@@ -0,0 +1,55 @@
+/*
+  RPCEmu - An Acorn system emulator
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef HDFILE_H
+#define HDFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/** An open hard disc image, in any of the supported formats */
+typedef struct HdFile HdFile;
+
+extern HdFile *hdfile_open(const char *pathname);
+extern void hdfile_close(HdFile *f);
+extern int hdfile_read(HdFile *f, void *buf, size_t len, int64_t offset);
+extern int hdfile_write(HdFile *f, const void *buf, size_t len, int64_t offset);
+extern int hdfile_sync(HdFile *f);
+extern int64_t hdfile_size(const HdFile *f);
+extern int hdfile_fd(const HdFile *f);
+extern const char *hdfile_error(void);
+
+extern int hdfile_overlay_create(const char *pathname, const char *base);
+extern int hdfile_overlay_commit(const char *pathname);
+extern int hdfile_overlay_discard(const char *pathname);
+extern int hdfile_overlay_info(const char *pathname, char *base, size_t base_len,
+                               int64_t *size, uint32_t *blocks);
+
+extern int hdfile_convert(const char *pathname, const char *dest, int compress);
+extern int hdfile_compressed_info(const char *pathname, int64_t *size, uint32_t *blocks,
+                                  int64_t *stored);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* HDFILE_H */
@@ -0,0 +1,953 @@
+/*
+  RPCEmu - An Acorn system emulator
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Hard disc image access for the IDE emulation
+
+   Sector reads and writes are passed to a worker thread, so the emulator
+   thread never waits on the host disc. Requests are serviced strictly in
+   the order they were made, which keeps reads consistent with earlier
+   writes.
+
+   Writes are queued and reported as complete straight away, in the manner
+   of a drive's write cache. Reads are satisfied from per-drive read-ahead
+   windows; if the sector is not in a window, a read is queued and the
+   caller polls until it arrives. Once a sequential transfer is halfway
+   through a window, the following window is fetched in the background.
+   Image formats that hold written data in memory (compressed images) are
+   told to write it back once the worker has been idle for a moment.
+
+   Alternatively, if config.hd_mmap is set, the image is mapped into memory
+   and sectors are copied to and from the mapping directly on the emulator
+   thread, with no system calls in the common case. A mapped image is
+   extended in large steps as the guest writes beyond its end, and cut back
+   to its real length when closed.
+
+   All functions other than the worker itself are called from the emulator
+   thread only.
+*/
+#define _FILE_OFFSET_BITS 64
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rpcemu.h"
+#include "hdfile.h"
+#include "hdimage.h"
+
+#if !defined(RPCEMU_WIN) && !defined(__EMSCRIPTEN__)
+#define HDIMAGE_MMAP
+#include <sys/mman.h>
+#endif
+
+#define HDIMAGE_READAHEAD	128	/**< Sectors in a read-ahead window (64KB) */
+#define HDIMAGE_WINDOWS		2	/**< Read-ahead windows per drive */
+#define HDIMAGE_QUEUE		64	/**< Requests that can be outstanding */
+#define HDIMAGE_MAP_STEP	(1024 * 1024)	/**< Granularity of growing a mapped image */
+#define HDIMAGE_SYNC_DELAY	1	/**< Seconds idle before writing back cached image data */
+
+typedef enum {
+	WINDOW_EMPTY,
+	WINDOW_PENDING,		/**< Being filled by the worker */
+	WINDOW_READY
+} WindowState;
+
+/** A run of sectors read ahead from an image */
+typedef struct {
+	atomic_int state;	/**< WindowState, set to WINDOW_READY by the worker */
+	int stale;		/**< Written to while pending, discard when read */
+	int64_t start;		/**< First sector held */
+	int count;		/**< Number of sectors held */
+	uint8_t *data;
+} ReadWindow;
+
+typedef enum {
+	IO_READ,		/**< Fill a read-ahead window */
+	IO_WRITE,		/**< Write one sector */
+	IO_ZERO			/**< Write 'count' sectors of zeros */
+} IoOp;
+
+typedef struct {
+	IoOp op;
+	int drive;
+	int64_t sector;
+	int count;
+	ReadWindow *window;	/**< Window to fill, for IO_READ */
+	uint8_t data[HDIMAGE_SECTOR_SIZE]; /**< Sector to write, for IO_WRITE */
+} IoRequest;
+
+static struct {
+	HdFile *file;		/**< NULL if no image is open */
+	int fd;			/**< Descriptor of a plain image, for mapping */
+	ReadWindow windows[HDIMAGE_WINDOWS];
+	int64_t last_sector;	/**< Last sector read, to detect sequential access */
+	int mapped;		/**< Image is accessed through map rather than the worker */
+	uint8_t *map;		/**< Mapping of the image, NULL if map_size is 0 */
+	int64_t map_size;	/**< Length of the mapping, the file is extended to match */
+	int64_t size;		/**< Length of the image data, the file is cut back to this on close */
+} hd[HDIMAGE_DRIVES];
+
+static pthread_t io_thread;
+static int io_thread_running = 0;
+static pthread_mutex_t io_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_work_cond = PTHREAD_COND_INITIALIZER;	/**< Signalled when a request is queued */
+static pthread_cond_t io_idle_cond = PTHREAD_COND_INITIALIZER;	/**< Signalled when the queue empties */
+
+/* Requests are added at io_head by the emulator thread, and removed from
+   io_tail by the worker once complete. Both are protected by io_mutex */
+static IoRequest io_queue[HDIMAGE_QUEUE];
+static unsigned io_head = 0, io_tail = 0;
+static int io_quit = 0;
+static int io_syncing = 0;	/**< Worker is writing back cached data, protected by io_mutex */
+static int io_unsynced = 0;	/**< Images written since last write back, set by the worker or while it is idle */
+
+/**
+ * Carry out one request. Called on the worker thread.
+ *
+ * @param req Request
+ */
+static void
+hdimage_service(IoRequest *req)
+{
+	static const uint8_t zeros[HDIMAGE_SECTOR_SIZE];
+	HdFile *file = hd[req->drive].file;
+	const int64_t offset = req->sector * HDIMAGE_SECTOR_SIZE;
+	int i;
+
+	switch (req->op) {
+	case IO_READ:
+		if (hdfile_read(file, req->window->data, (size_t) req->count * HDIMAGE_SECTOR_SIZE, offset) != 0) {
+			rpclog("hdimage: drive %d: %s\n", req->drive, hdfile_error());
+			memset(req->window->data, 0, (size_t) req->count * HDIMAGE_SECTOR_SIZE);
+		}
+		atomic_store_explicit(&req->window->state, WINDOW_READY, memory_order_release);
+		break;
+
+	case IO_WRITE:
+		if (hdfile_write(file, req->data, HDIMAGE_SECTOR_SIZE, offset) != 0) {
+			error("Failed to write to hard disc image: %s", hdfile_error());
+		}
+		io_unsynced = 1;
+		break;
+
+	case IO_ZERO:
+		for (i = 0; i < req->count; i++) {
+			if (hdfile_write(file, zeros, HDIMAGE_SECTOR_SIZE, offset + (int64_t) i * HDIMAGE_SECTOR_SIZE) != 0) {
+				error("Failed to write to hard disc image: %s", hdfile_error());
+				break;
+			}
+		}
+		io_unsynced = 1;
+		break;
+	}
+}
+
+/**
+ * Write back data that the image formats hold in memory (see
+ * hdfile_sync()). Called on the worker thread with io_mutex held, which
+ * is released meanwhile.
+ */
+static void
+hdimage_sync(void)
+{
+	HdFile *files[HDIMAGE_DRIVES];
+	int d;
+
+	/* hdimage_close() waits for io_syncing to clear before closing */
+	for (d = 0; d < HDIMAGE_DRIVES; d++) {
+		files[d] = hd[d].file;
+	}
+	io_syncing = 1;
+	io_unsynced = 0;
+	pthread_mutex_unlock(&io_mutex);
+
+	for (d = 0; d < HDIMAGE_DRIVES; d++) {
+		if (files[d] != NULL && hdfile_sync(files[d]) != 0) {
+			error("Failed to write to hard disc image: %s", hdfile_error());
+		}
+	}
+
+	pthread_mutex_lock(&io_mutex);
+	io_syncing = 0;
+	pthread_cond_broadcast(&io_idle_cond);
+}
+
+/**
+ * Worker thread, services requests in the order they were queued.
+ *
+ * @param p Unused
+ * @return Unused
+ */
+static void *
+hdimage_thread(void *p)
+{
+	NOT_USED(p);
+
+	pthread_mutex_lock(&io_mutex);
+	for (;;) {
+		while (io_head == io_tail && !io_quit) {
+			struct timespec ts;
+
+			if (!io_unsynced) {
+				pthread_cond_wait(&io_work_cond, &io_mutex);
+				continue;
+			}
+
+			/* Once writes have stopped for a while, write back any
+			   data the image holds in memory */
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += HDIMAGE_SYNC_DELAY;
+			if (pthread_cond_timedwait(&io_work_cond, &io_mutex, &ts) == ETIMEDOUT &&
+			    io_head == io_tail && !io_quit)
+			{
+				hdimage_sync();
+			}
+		}
+		if (io_head == io_tail) {
+			break;
+		}
+
+		/* The slot is not reused until io_tail moves past it, so can
+		   be accessed without the lock */
+		pthread_mutex_unlock(&io_mutex);
+		hdimage_service(&io_queue[io_tail % HDIMAGE_QUEUE]);
+		pthread_mutex_lock(&io_mutex);
+
+		io_tail++;
+		if (io_head == io_tail) {
+			pthread_cond_broadcast(&io_idle_cond);
+		}
+	}
+	pthread_mutex_unlock(&io_mutex);
+
+	return NULL;
+}
+
+/**
+ * Start the worker thread, if not already running.
+ */
+static void
+hdimage_thread_start(void)
+{
+	if (io_thread_running) {
+		return;
+	}
+
+	io_quit = 0;
+	if (pthread_create(&io_thread, NULL, hdimage_thread, NULL)) {
+		fatal("Couldn't create hard disc thread");
+	}
+	io_thread_running = 1;
+}
+
+/**
+ * Obtain a free request slot. It is not visible to the worker until
+ * passed to hdimage_submit().
+ *
+ * @return Request, or NULL if the queue is full
+ */
+static IoRequest *
+hdimage_request(void)
+{
+	IoRequest *req = NULL;
+
+	pthread_mutex_lock(&io_mutex);
+	if (io_head - io_tail < HDIMAGE_QUEUE) {
+		req = &io_queue[io_head % HDIMAGE_QUEUE];
+	}
+	pthread_mutex_unlock(&io_mutex);
+
+	return req;
+}
+
+/**
+ * Pass the request obtained from hdimage_request() to the worker.
+ */
+static void
+hdimage_submit(void)
+{
+	pthread_mutex_lock(&io_mutex);
+	io_head++;
+	pthread_cond_signal(&io_work_cond);
+	pthread_mutex_unlock(&io_mutex);
+}
+
+/**
+ * Wait until the worker is idle. Called with io_mutex held.
+ */
+static void
+hdimage_wait_idle(void)
+{
+	while (io_head != io_tail || io_syncing) {
+		pthread_cond_wait(&io_idle_cond, &io_mutex);
+	}
+}
+
+/**
+ * Wait until all queued requests have been carried out.
+ */
+void
+hdimage_flush(void)
+{
+	pthread_mutex_lock(&io_mutex);
+	hdimage_wait_idle();
+	pthread_mutex_unlock(&io_mutex);
+}
+
+#ifdef HDIMAGE_MMAP
+/**
+ * Map the image file into memory, replacing any previous mapping.
+ *
+ * @param drive Drive number
+ * @param size  Length to map, the file must be at least this long
+ * @return Non-zero on success
+ */
+static int
+hdimage_map(int drive, int64_t size)
+{
+	void *map = NULL;
+
+	if (hd[drive].map != NULL) {
+		munmap(hd[drive].map, (size_t) hd[drive].map_size);
+		hd[drive].map = NULL;
+	}
+
+	if (size > 0) {
+		if ((uint64_t) size > SIZE_MAX) {
+			return 0;
+		}
+		map = mmap(NULL, (size_t) size, PROT_READ | PROT_WRITE, MAP_SHARED, hd[drive].fd, 0);
+		if (map == MAP_FAILED) {
+			rpclog("hdimage: unable to map drive %d: %s\n", drive, strerror(errno));
+			return 0;
+		}
+	}
+
+	hd[drive].map = map;
+	hd[drive].map_size = size;
+	return 1;
+}
+
+/**
+ * Write back and remove the mapping of an image, leaving the file at the
+ * real length of the image.
+ *
+ * @param drive Drive number
+ */
+static void
+hdimage_unmap(int drive)
+{
+	if (hd[drive].map != NULL) {
+		if (msync(hd[drive].map, (size_t) hd[drive].map_size, MS_SYNC) != 0) {
+			error("Failed to write hard disc image: %s", strerror(errno));
+		}
+		munmap(hd[drive].map, (size_t) hd[drive].map_size);
+		hd[drive].map = NULL;
+	}
+	if (hd[drive].map_size != hd[drive].size) {
+		if (ftruncate(hd[drive].fd, (off_t) hd[drive].size) != 0) {
+			rpclog("hdimage: unable to truncate drive %d: %s\n", drive, strerror(errno));
+		}
+	}
+	hd[drive].map_size = 0;
+	hd[drive].mapped = 0;
+}
+
+/**
+ * Extend a mapped image so that it covers the given length. If that is
+ * not possible the image reverts to being accessed through the worker.
+ *
+ * @param drive Drive number
+ * @param end   Length the mapping must cover
+ * @return Non-zero if the mapping now covers end
+ */
+static int
+hdimage_map_grow(int drive, int64_t end)
+{
+	int64_t size = hd[drive].map_size + hd[drive].map_size / 4;
+
+	if (size < end) {
+		size = end;
+	}
+	size = (size + HDIMAGE_MAP_STEP - 1) & ~((int64_t) HDIMAGE_MAP_STEP - 1);
+
+	if (ftruncate(hd[drive].fd, (off_t) size) == 0 && hdimage_map(drive, size)) {
+		return 1;
+	}
+
+	rpclog("hdimage: unable to extend mapping of drive %d, no longer mapping it\n", drive);
+	hdimage_unmap(drive);
+	return 0;
+}
+#endif /* HDIMAGE_MMAP */
+
+/**
+ * Copy from a mapped image. Data beyond the end of the image reads as zeros.
+ *
+ * @param drive  Drive number
+ * @param offset Offset in bytes within the image
+ * @param buf    Buffer to fill
+ * @param len    Number of bytes to read
+ * @return Number of bytes read from the image, before any zero filling
+ */
+static size_t
+hdimage_map_read(int drive, int64_t offset, void *buf, size_t len)
+{
+	size_t avail = 0;
+
+	if (offset < hd[drive].size) {
+		avail = (size_t) (hd[drive].size - offset);
+		if (avail > len) {
+			avail = len;
+		}
+		memcpy(buf, hd[drive].map + offset, avail);
+	}
+	memset((uint8_t *) buf + avail, 0, len - avail);
+	return avail;
+}
+
+/**
+ * Return the read-ahead window holding a sector, if there is one.
+ *
+ * @param drive  Drive number
+ * @param sector Sector number
+ * @return Window (which may still be pending), or NULL
+ */
+static ReadWindow *
+hdimage_find_window(int drive, int64_t sector)
+{
+	int i;
+
+	for (i = 0; i < HDIMAGE_WINDOWS; i++) {
+		ReadWindow *w = &hd[drive].windows[i];
+		const int state = atomic_load_explicit(&w->state, memory_order_acquire);
+
+		if (w->stale && state != WINDOW_PENDING) {
+			/* Read has arrived, but is out of date */
+			w->stale = 0;
+			atomic_store_explicit(&w->state, WINDOW_EMPTY, memory_order_relaxed);
+			continue;
+		}
+		if (state != WINDOW_EMPTY && !w->stale &&
+		    sector >= w->start && sector < w->start + w->count)
+		{
+			return w;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Queue a read into a free read-ahead window.
+ *
+ * @param drive  Drive number
+ * @param sector First sector to read
+ * @param count  Number of sectors to read
+ * @param keep   Window that must not be replaced, or NULL
+ * @return Non-zero if the read was queued
+ */
+static int
+hdimage_readahead(int drive, int64_t sector, int count, const ReadWindow *keep)
+{
+	ReadWindow *victim = NULL;
+	IoRequest *req;
+	int i;
+
+	if (hdimage_find_window(drive, sector) != NULL) {
+		return 1;
+	}
+
+	/* Prefer an empty window, otherwise replace the one furthest behind */
+	for (i = 0; i < HDIMAGE_WINDOWS; i++) {
+		ReadWindow *w = &hd[drive].windows[i];
+		const int state = atomic_load_explicit(&w->state, memory_order_acquire);
+
+		if (w == keep || state == WINDOW_PENDING) {
+			continue;
+		}
+		if (state == WINDOW_EMPTY) {
+			victim = w;
+			break;
+		}
+		if (victim == NULL || w->start < victim->start) {
+			victim = w;
+		}
+	}
+	if (victim == NULL) {
+		return 0;
+	}
+
+	req = hdimage_request();
+	if (req == NULL) {
+		return 0;
+	}
+
+	victim->start = sector;
+	victim->count = count;
+	victim->stale = 0;
+	atomic_store_explicit(&victim->state, WINDOW_PENDING, memory_order_relaxed);
+
+	req->op = IO_READ;
+	req->drive = drive;
+	req->sector = sector;
+	req->count = count;
+	req->window = victim;
+	hdimage_submit();
+	return 1;
+}
+
+/**
+ * Read a sector. If it is not yet available, a read from the image is
+ * started and the caller should try again later.
+ *
+ * @param drive      Drive number
+ * @param sector     Sector number
+ * @param buf        Buffer to receive HDIMAGE_SECTOR_SIZE bytes
+ * @param count_hint Number of sectors the guest has asked for, from this one
+ *                   on; 0 if unknown
+ * @return Non-zero if buf was filled, zero if the read is still in progress
+ */
+int
+hdimage_read_sector(int drive, int64_t sector, void *buf, int count_hint)
+{
+	const int sequential = (sector == hd[drive].last_sector + 1);
+	ReadWindow *w;
+
+	assert(drive >= 0 && drive < HDIMAGE_DRIVES);
+	assert(hd[drive].file != NULL);
+
+	if (hd[drive].mapped) {
+		hdimage_map_read(drive, sector * HDIMAGE_SECTOR_SIZE, buf, HDIMAGE_SECTOR_SIZE);
+		return 1;
+	}
+
+	w = hdimage_find_window(drive, sector);
+	if (w == NULL) {
+		/* Fetch what the guest asked for, or a whole window if it is
+		   reading through the disc sequentially */
+		int count = count_hint;
+
+		if (sequential || count <= 0 || count > HDIMAGE_READAHEAD) {
+			count = HDIMAGE_READAHEAD;
+		}
+		hdimage_readahead(drive, sector, count, NULL);
+		return 0;
+	}
+
+	if (atomic_load_explicit(&w->state, memory_order_acquire) != WINDOW_READY) {
+		return 0;
+	}
+
+	memcpy(buf, w->data + (sector - w->start) * HDIMAGE_SECTOR_SIZE, HDIMAGE_SECTOR_SIZE);
+	hd[drive].last_sector = sector;
+
+	/* Fetch the next window in the background once a sequential transfer
+	   that will run past this window is halfway through it */
+	if (sequential && (sector - w->start) >= w->count / 2 &&
+	    (w->count == HDIMAGE_READAHEAD || sector + count_hint > w->start + w->count))
+	{
+		hdimage_readahead(drive, w->start + w->count, HDIMAGE_READAHEAD, w);
+	}
+
+	return 1;
+}
+
+/**
+ * Write one or more sectors. The data is copied, and written to the image
+ * by the worker thread later.
+ *
+ * @param drive  Drive number
+ * @param sector First sector to write
+ * @param count  Number of sectors; must be 1 unless buf is NULL
+ * @param buf    HDIMAGE_SECTOR_SIZE bytes of data, or NULL to write zeros
+ * @return Non-zero if queued, zero if the queue is full and the caller
+ *         should try again later
+ */
+int
+hdimage_write_sectors(int drive, int64_t sector, int count, const void *buf)
+{
+	IoRequest *req;
+	int i;
+
+	assert(drive >= 0 && drive < HDIMAGE_DRIVES);
+	assert(hd[drive].file != NULL);
+	assert(buf == NULL || count == 1);
+
+#ifdef HDIMAGE_MMAP
+	if (hd[drive].mapped) {
+		const int64_t offset = sector * HDIMAGE_SECTOR_SIZE;
+		const int64_t end = offset + (int64_t) count * HDIMAGE_SECTOR_SIZE;
+
+		if (end <= hd[drive].map_size || hdimage_map_grow(drive, end)) {
+			if (buf != NULL) {
+				memcpy(hd[drive].map + offset, buf, HDIMAGE_SECTOR_SIZE);
+			} else {
+				memset(hd[drive].map + offset, 0, (size_t) (end - offset));
+			}
+			if (end > hd[drive].size) {
+				hd[drive].size = end;
+			}
+			return 1;
+		}
+		/* Mapping abandoned, fall through to use the worker */
+	}
+#endif /* HDIMAGE_MMAP */
+
+	req = hdimage_request();
+	if (req == NULL) {
+		return 0;
+	}
+
+	/* Keep the read-ahead windows consistent with the image */
+	for (i = 0; i < HDIMAGE_WINDOWS; i++) {
+		ReadWindow *w = &hd[drive].windows[i];
+		const int state = atomic_load_explicit(&w->state, memory_order_acquire);
+		int64_t first, last, s;
+
+		if (state == WINDOW_EMPTY || w->stale) {
+			continue;
+		}
+		first = (sector > w->start) ? sector : w->start;
+		last = (sector + count < w->start + w->count) ? (sector + count) : (w->start + w->count);
+		if (first >= last) {
+			continue;
+		}
+
+		if (state == WINDOW_PENDING) {
+			/* The worker will fill it with the old data */
+			w->stale = 1;
+			continue;
+		}
+		for (s = first; s < last; s++) {
+			uint8_t *dest = w->data + (s - w->start) * HDIMAGE_SECTOR_SIZE;
+
+			if (buf != NULL) {
+				memcpy(dest, buf, HDIMAGE_SECTOR_SIZE);
+			} else {
+				memset(dest, 0, HDIMAGE_SECTOR_SIZE);
+			}
+		}
+	}
+
+	req->op = (buf != NULL) ? IO_WRITE : IO_ZERO;
+	req->drive = drive;
+	req->sector = sector;
+	req->count = count;
+	if (buf != NULL) {
+		memcpy(req->data, buf, HDIMAGE_SECTOR_SIZE);
+	}
+	hdimage_submit();
+	return 1;
+}
+
+/**
+ * Read directly from an image, waiting for the data. Used for inspecting
+ * the image when it is opened, and by the paravirtual block device.
+ *
+ * @param drive  Drive number
+ * @param offset Offset in bytes within the image
+ * @param buf    Buffer to fill
+ * @param len    Number of bytes to read
+ * @return Non-zero on success. On failure buf is filled with zeros
+ */
+int
+hdimage_read_sync(int drive, int64_t offset, void *buf, size_t len)
+{
+	int ret = 1;
+
+	assert(drive >= 0 && drive < HDIMAGE_DRIVES);
+	assert(hd[drive].file != NULL);
+
+	if (hd[drive].mapped) {
+		hdimage_map_read(drive, offset, buf, len);
+		return 1;
+	}
+
+	/* Ensure the worker is not using the image */
+	pthread_mutex_lock(&io_mutex);
+	hdimage_wait_idle();
+	if (hdfile_read(hd[drive].file, buf, len, offset) != 0) {
+		rpclog("hdimage: drive %d: %s\n", drive, hdfile_error());
+		memset(buf, 0, len);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&io_mutex);
+
+	return ret;
+}
+
+/**
+ * Write directly to an image, waiting until the data has been passed to
+ * the image format. Used by the paravirtual block device, which transfers
+ * long runs of sectors at a time.
+ *
+ * @param drive  Drive number
+ * @param offset Offset in bytes within the image
+ * @param buf    Data to write
+ * @param len    Number of bytes to write
+ * @return Non-zero on success
+ */
+int
+hdimage_write_sync(int drive, int64_t offset, const void *buf, size_t len)
+{
+	const int64_t end = offset + (int64_t) len;
+	int i, ret = 1;
+
+	assert(drive >= 0 && drive < HDIMAGE_DRIVES);
+	assert(hd[drive].file != NULL);
+
+#ifdef HDIMAGE_MMAP
+	if (hd[drive].mapped) {
+		if (end <= hd[drive].map_size || hdimage_map_grow(drive, end)) {
+			memcpy(hd[drive].map + offset, buf, len);
+			if (end > hd[drive].size) {
+				hd[drive].size = end;
+			}
+			return 1;
+		}
+		/* Mapping abandoned, fall through to write the file */
+	}
+#endif /* HDIMAGE_MMAP */
+
+	pthread_mutex_lock(&io_mutex);
+	hdimage_wait_idle();
+
+	/* With the worker idle no window is pending, so any that overlap
+	   can simply be dropped */
+	for (i = 0; i < HDIMAGE_WINDOWS; i++) {
+		ReadWindow *w = &hd[drive].windows[i];
+
+		if (offset < (w->start + w->count) * HDIMAGE_SECTOR_SIZE &&
+		    end > w->start * HDIMAGE_SECTOR_SIZE)
+		{
+			w->stale = 0;
+			atomic_store_explicit(&w->state, WINDOW_EMPTY, memory_order_relaxed);
+		}
+	}
+
+	if (hdfile_write(hd[drive].file, buf, len, offset) != 0) {
+		rpclog("hdimage: drive %d: %s\n", drive, hdfile_error());
+		ret = 0;
+	}
+
+	/* Have the worker write back any data the image holds in memory */
+	io_unsynced = 1;
+	pthread_cond_signal(&io_work_cond);
+	pthread_mutex_unlock(&io_mutex);
+
+	return ret;
+}
+
+/**
+ * Return the length of an image.
+ *
+ * @param drive Drive number
+ * @return Length in bytes
+ */
+int64_t
+hdimage_size(int drive)
+{
+	int64_t size;
+
+	assert(drive >= 0 && drive < HDIMAGE_DRIVES);
+	assert(hd[drive].file != NULL);
+
+	if (hd[drive].mapped) {
+		return hd[drive].size;
+	}
+
+	pthread_mutex_lock(&io_mutex);
+	hdimage_wait_idle();
+	size = hdfile_size(hd[drive].file);
+	pthread_mutex_unlock(&io_mutex);
+
+	return size;
+}
+
+/**
+ * Work out the geometry of a RISC OS hard disc from the disc record in its
+ * boot block. Some images begin with an extra sector, which is skipped.
+ *
+ * @param drive Drive number
+ * @param spt   Filled in with the sectors per track
+ * @param hpc   Filled in with the number of heads
+ * @param skip  Filled in with the number of sectors before the disc starts
+ */
+void
+hdimage_geometry(int drive, int *spt, int *hpc, int *skip)
+{
+	uint8_t geometry[2];
+
+	hdimage_read_sync(drive, 0xfc1, geometry, sizeof(geometry));
+	*spt = geometry[0];
+	*hpc = geometry[1];
+	*skip = 1;
+	if (*spt == 0 || *hpc == 0) {
+		hdimage_read_sync(drive, 0xdc1, geometry, sizeof(geometry));
+		*spt = geometry[0];
+		*hpc = geometry[1];
+		*skip = 0;
+		if (*spt == 0 || *hpc == 0) {
+			/* Unformatted, use a default */
+			*spt = 63;
+			*hpc = 16;
+			*skip = 1;
+		}
+	}
+}
+
+/**
+ * Open a hard disc image, creating it if it does not exist.
+ *
+ * @param drive    Drive number
+ * @param pathname Full path of the image
+ * @return 1 on success, 0 if the image could not be opened, in which case
+ *         hdfile_error() describes why
+ */
+int
+hdimage_open(int drive, const char *pathname)
+{
+	HdFile *file;
+	int i;
+
+	assert(drive >= 0 && drive < HDIMAGE_DRIVES);
+	assert(pathname);
+
+	hdimage_close(drive);
+
+	/* Open existing hard disk image, or create new one */
+	file = hdfile_open(pathname);
+	if (file == NULL) {
+		return 0;
+	}
+	pthread_mutex_lock(&io_mutex);
+	hd[drive].file = file;
+	pthread_mutex_unlock(&io_mutex);
+	hd[drive].fd = hdfile_fd(hd[drive].file);
+	hd[drive].last_sector = -2;
+
+	if (config.hd_mmap && hd[drive].fd == -1) {
+		rpclog("hdimage: '%s' is not a plain image, so cannot be mapped\n", pathname);
+	} else if (config.hd_mmap) {
+#ifdef HDIMAGE_MMAP
+		struct stat st;
+
+		if (fstat(hd[drive].fd, &st) == 0) {
+			hd[drive].size = st.st_size;
+			hd[drive].mapped = hdimage_map(drive, st.st_size);
+		}
+		if (!hd[drive].mapped) {
+			rpclog("hdimage: unable to map '%s', using file I/O\n", pathname);
+		}
+#else
+		rpclog("hdimage: mapping hard disc images is not supported on this platform\n");
+#endif /* HDIMAGE_MMAP */
+	}
+
+	for (i = 0; i < HDIMAGE_WINDOWS; i++) {
+		ReadWindow *w = &hd[drive].windows[i];
+
+		if (w->data == NULL) {
+			w->data = malloc(HDIMAGE_READAHEAD * HDIMAGE_SECTOR_SIZE);
+			if (w->data == NULL) {
+				fatal("Out of memory for hard disc read-ahead");
+			}
+		}
+		w->stale = 0;
+		atomic_store(&w->state, WINDOW_EMPTY);
+	}
+
+	hdimage_thread_start();
+	return 1;
+}
+
+/**
+ * Complete any outstanding writes and close an image, if one is open.
+ *
+ * @param drive Drive number
+ */
+void
+hdimage_close(int drive)
+{
+	int i, ret;
+
+	assert(drive >= 0 && drive < HDIMAGE_DRIVES);
+
+	if (hd[drive].file == NULL) {
+		return;
+	}
+
+	hdimage_flush();
+#ifdef HDIMAGE_MMAP
+	if (hd[drive].mapped) {
+		hdimage_unmap(drive);
+	}
+#endif /* HDIMAGE_MMAP */
+
+	/* Hold the lock so the worker cannot start writing back meanwhile */
+	pthread_mutex_lock(&io_mutex);
+	hdimage_wait_idle();
+	ret = hdfile_sync(hd[drive].file);
+	hdfile_close(hd[drive].file);
+	hd[drive].file = NULL;
+	pthread_mutex_unlock(&io_mutex);
+	hd[drive].fd = -1;
+
+	if (ret != 0) {
+		error("Failed to write to hard disc image: %s", hdfile_error());
+	}
+
+	for (i = 0; i < HDIMAGE_WINDOWS; i++) {
+		atomic_store(&hd[drive].windows[i].state, WINDOW_EMPTY);
+	}
+}
+
+/**
+ * Close all images and stop the worker thread.
+ */
+void
+hdimage_end(void)
+{
+	int d, i;
+
+	for (d = 0; d < HDIMAGE_DRIVES; d++) {
+		hdimage_close(d);
+		for (i = 0; i < HDIMAGE_WINDOWS; i++) {
+			free(hd[d].windows[i].data);
+			hd[d].windows[i].data = NULL;
+		}
+	}
+
+	if (io_thread_running) {
+		pthread_mutex_lock(&io_mutex);
+		io_quit = 1;
+		pthread_cond_signal(&io_work_cond);
+		pthread_mutex_unlock(&io_mutex);
+		pthread_join(io_thread, NULL);
+		io_thread_running = 0;
+	}
+}
@@ -0,0 +1,49 @@
+/*
+  RPCEmu - An Acorn system emulator
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef HDIMAGE_H
+#define HDIMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Drives 0 and 1 are the IDE discs, 2 and 3 the paravirtual block device */
+#define HDIMAGE_DRIVES		4
+#define HDIMAGE_SECTOR_SIZE	512
+
+extern int hdimage_open(int drive, const char *pathname);
+extern void hdimage_close(int drive);
+extern void hdimage_end(void);
+
+extern int hdimage_read_sync(int drive, int64_t offset, void *buf, size_t len);
+extern int hdimage_write_sync(int drive, int64_t offset, const void *buf, size_t len);
+extern int64_t hdimage_size(int drive);
+extern void hdimage_geometry(int drive, int *spt, int *hpc, int *skip);
+extern int hdimage_read_sector(int drive, int64_t sector, void *buf, int count_hint);
+extern int hdimage_write_sectors(int drive, int64_t sector, int count, const void *buf);
+extern void hdimage_flush(void);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* HDIMAGE_H */
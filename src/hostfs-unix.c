@@ -6,8 +6,19 @@
 #include <utime.h>
 #include <sys/stat.h>
 
+#if defined __linux__ && !defined __EMSCRIPTEN__
+#define HOSTFS_INOTIFY
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
+
 #include "hostfs_internal.h"
 
+#ifdef HOSTFS_INOTIFY
+static int hostfs_inotify_fd = -1;	/**< inotify instance, -1 if not yet created */
+static int hostfs_inotify_failed = 0;	/**< Creating the instance failed, don't retry */
+#endif
+
 /**
  * Convert ADFS time-stamped Load-Exec addresses to the equivalent time_t.
  *
@@ -113,3 +124,108 @@ hostfs_object_set_timestamp_platform(const char *host_path, uint32_t load, uint3
 	utime(host_path, &t);
 	/* TODO handle error in utime() */
 }
+
+/**
+ * Start watching a directory for changes to its entries.
+ *
+ * @param host_dir_path Full Host path to directory
+ * @return Watch, or -1 if the directory can not be watched
+ */
+int
+hostfs_dir_watch_add_platform(const char *host_dir_path)
+{
+#ifdef HOSTFS_INOTIFY
+	int watch;
+
+	assert(host_dir_path != NULL);
+
+	if (hostfs_inotify_fd == -1 && !hostfs_inotify_failed) {
+		hostfs_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (hostfs_inotify_fd == -1) {
+			fprintf(stderr, "HostFS could not create inotify instance: %s %d\n",
+			        strerror(errno), errno);
+			hostfs_inotify_failed = 1;
+		}
+	}
+	if (hostfs_inotify_fd == -1) {
+		return -1;
+	}
+
+	/* Changes to the entries themselves, to their contents and to their
+	   attributes all affect what is returned for the directory */
+	watch = inotify_add_watch(hostfs_inotify_fd, host_dir_path,
+	                          IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+	                          IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+	                          IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+	return (watch < 0) ? -1 : watch;
+#else
+	(void) host_dir_path;
+	return -1;
+#endif
+}
+
+/**
+ * Stop watching a directory.
+ *
+ * @param watch Watch returned by hostfs_dir_watch_add_platform()
+ */
+void
+hostfs_dir_watch_remove_platform(int watch)
+{
+#ifdef HOSTFS_INOTIFY
+	if (hostfs_inotify_fd != -1) {
+		inotify_rm_watch(hostfs_inotify_fd, watch);
+	}
+#else
+	(void) watch;
+#endif
+}
+
+/**
+ * Report the watched directories that have changed since the last call.
+ *
+ * @param changed Function called with the watch of each directory that may
+ *                have changed, or with -1 if any of them may have, and
+ *                non-zero if the watch has ended because the directory
+ *                was deleted or renamed
+ */
+void
+hostfs_dir_watch_poll_platform(void (*changed)(int watch, int ended))
+{
+#ifdef HOSTFS_INOTIFY
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+
+	assert(changed != NULL);
+
+	if (hostfs_inotify_fd == -1) {
+		return;
+	}
+
+	while ((len = read(hostfs_inotify_fd, buf, sizeof(buf))) > 0) {
+		const char *p = buf;
+
+		while (p < buf + len) {
+			const struct inotify_event *event = (const struct inotify_event *) p;
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				/* If events were lost, anything may have changed */
+				changed(-1, 0);
+			} else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+				/* The watch no longer describes the directory at
+				   its path. A renamed directory is still watched
+				   under its new name, so stop that */
+				if (event->mask & IN_MOVE_SELF) {
+					inotify_rm_watch(hostfs_inotify_fd, event->wd);
+				}
+				changed(event->wd, 1);
+			} else {
+				changed(event->wd, 0);
+			}
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+#else
+	(void) changed;
+#endif
+}
@@ -212,3 +212,42 @@ hostfs_object_set_timestamp_platform(const char *host_path, uint32_t load, uint3
 		CloseHandle(handle);
 	}
 }
+
+/**
+ * Start watching a directory for changes to its entries. Not supported on
+ * Windows, where changes are found from the directory's modification time.
+ *
+ * @param host_dir_path Full Host path to directory
+ * @return -1, as the directory can not be watched
+ */
+int
+hostfs_dir_watch_add_platform(const char *host_dir_path)
+{
+	(void) host_dir_path;
+	return -1;
+}
+
+/**
+ * Stop watching a directory.
+ *
+ * @param watch Watch returned by hostfs_dir_watch_add_platform()
+ */
+void
+hostfs_dir_watch_remove_platform(int watch)
+{
+	(void) watch;
+}
+
+/**
+ * Report the watched directories that have changed since the last call.
+ *
+ * @param changed Function called with the watch of each directory that may
+ *                have changed, or with -1 if any of them may have, and
+ *                non-zero if the watch has ended because the directory
+ *                was deleted or renamed
+ */
+void
+hostfs_dir_watch_poll_platform(void (*changed)(int watch, int ended))
+{
+	(void) changed;
+}
@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <dirent.h>
 #ifdef _MSC_VER
@@ -31,7 +32,9 @@
 #else
 #include <unistd.h>
 #endif
+#include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdint.h>
 
@@ -39,6 +42,7 @@
 #include "mem.h"
 #include "hostfs.h"
 #include "hostfs_internal.h"
+#include "hostio.h"
 
 #define HOSTFS_PROTOCOL_VERSION	3
 
@@ -51,6 +55,14 @@
 # define mkdir(name, mode) _mkdir(name)
 #endif
 
+#if defined WIN32 || defined _WIN32
+#include <io.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 typedef int bool;
 
 #define true  ((bool) 1)
@@ -100,10 +112,46 @@ enum RISC_OS_FILE_TYPE {
  * Contains name and RISC OS object info
  */
 typedef struct {
-  unsigned name_offset; /**< Offset within cache_names[] */
+  unsigned name_offset; /**< Offset within the directory's names[] */
+  unsigned host_name_offset; /**< Offset of the Host name within names[] */
   risc_os_object_info object_info;
 } cache_directory_entry;
 
+/**
+ * Cached contents of one host directory, kept until a change to the
+ * directory is seen.
+ */
+typedef struct {
+  char *path;                       /**< Host path of directory, NULL if slot unused */
+  cache_directory_entry *entries;   /**< Entries, sorted by name */
+  unsigned count;                   /**< Number of valid entries in \a entries */
+  unsigned entries_capacity;        /**< Capacity of \a entries */
+  char *names;                      /**< Names of entries, each terminated */
+  unsigned names_capacity;          /**< Capacity of \a names */
+  unsigned *index;                  /**< Hash table of entries by case-folded
+                                         name, holding entry number + 1 */
+  unsigned index_size;              /**< Size of \a index, a power of 2 */
+  bool valid;                       /**< Contents match the host directory */
+  int watch;                        /**< Platform watch for changes, or -1 if
+                                         changes are found from the mtime */
+  time_t mtime;                     /**< Modification time when read */
+  time_t read_time;                 /**< Time when read */
+  unsigned last_used;               /**< Value of dir_cache_clock when last used */
+} cache_directory;
+
+/** A host file opened by RISC OS */
+typedef struct {
+  int fd;                 /**< Host file descriptor, or -1 if the handle is free */
+  unsigned next_free;     /**< Next free handle, when this one is free */
+  int64_t extent;         /**< Length of the file, including unwritten data */
+  int64_t pos;            /**< File offset following the last transfer */
+  uint8_t *buf;           /**< Read-ahead or write-behind data, allocated on
+                               first use */
+  int64_t buf_offset;     /**< File offset of buf[0] */
+  size_t buf_len;         /**< Number of bytes held in buf */
+  bool buf_dirty;         /**< buf holds data not yet written to the file */
+} open_file_entry;
+
 /* TODO Avoid duplicate macro with extnrom.c */
 #define ROUND_UP_TO_4(x) (((x) + 3) & (~3))
 
@@ -112,7 +160,7 @@ typedef struct {
 
 #define MIN(x,y) (((x) < (y)) ? (x) : (y))
 
-#define MAX_OPEN_FILES 255
+#define OPEN_FILE_BUFFER_SIZE 65536 /**< Read-ahead/write-behind per open file */
 
 #define NOT_IMPLEMENTED 255
 
@@ -120,19 +168,24 @@ typedef struct {
 #define DEFAULT_FILE_TYPE   RISC_OS_FILE_TYPE_TEXT
 #define MINIMUM_BUFFER_SIZE 32768
 
+#define DIR_CACHE_SIZE 64 /**< Number of directories whose contents are cached */
+
 /** Disc name of default disc or if no disc name is present */
 static const char *disc_name_default = "HostFS";
 
 static char HOSTFS_ROOT[512];
 
-static FILE *open_file[MAX_OPEN_FILES + 1]; /* array subscript 0 is never used */
+static open_file_entry *open_file = NULL; /* array subscript 0 is never used */
+static unsigned open_file_count = 0;     /**< Entries allocated in open_file[] */
+static unsigned open_file_free = 0;      /**< First free handle, or 0 if none */
+static unsigned open_file_dirty = 0;     /**< Handles with write-behind data */
 
 static unsigned char *buffer = NULL;
 static size_t buffer_size = 0;
 
-static cache_directory_entry *cache_entries = NULL;
-static unsigned cache_entries_count = 0; /**< Number of valid entries in \a cache_entries */
-static char *cache_names = NULL;
+static cache_directory dir_cache[DIR_CACHE_SIZE];
+static unsigned dir_cache_clock = 0; /**< Incremented on each use of dir_cache[] */
+static const char *dir_cache_sort_names = NULL; /**< Names of the directory being sorted */
 
 /** Current registration state of HostFS module with backend code */
 static HostFSState hostfs_state = HOSTFS_STATE_UNREGISTERED;
@@ -500,83 +553,466 @@ hostfs_read_object_info(const char *host_pathname,
 }
 
 /**
- * @param host_dir_path Full Host path to directory to scan
- * @param object        Object name to search for
- * @param host_name     Return Host name of object (filled-in if object found)
- * @param object_info   Return object info (filled-in)
+ * Compare two elements of type \a cache_directory_entry by comparing their
+ * names in a case-insensitive manner.
+ *
+ * @param e1 Pointer to first \a cache_directory_entry
+ * @param e2 Pointer to second \a cache_directory_entry
+ * @return Returns an integer less than, equal to, or greater than zero if
+ *         e1's name is found, respectively, to be earlier than, to match, or
+ *         be later than e2's name.
+ */
+static int
+hostfs_directory_entry_compare(const void *e1, const void *e2)
+{
+  const cache_directory_entry *entry1 = e1;
+  const cache_directory_entry *entry2 = e2;
+  const char *name1 = dir_cache_sort_names + entry1->name_offset;
+  const char *name2 = dir_cache_sort_names + entry2->name_offset;
+
+  return strcasecmp(name1, name2);
+}
+
+/**
+ * Hash a name for the directory index, ignoring case. A '/' in a RISC OS
+ * leaf name is treated as the '.' it stands for on the Host.
+ *
+ * @param name Name
+ * @return Hash
+ */
+static unsigned
+hostfs_name_hash(const char *name)
+{
+  unsigned hash = 2166136261u; /* FNV-1a */
+
+  for (; *name; name++) {
+    const int c = (*name == '/') ? '.' : tolower((unsigned char) *name);
+
+    hash = (hash ^ (unsigned char) c) * 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * Compare a RISC OS leaf name from the directory cache with an object name
+ * from a path, ignoring case.
+ *
+ * @param leaf   Leaf name, with '/' standing for the Host's '.'
+ * @param object Object name, with '.' for the Host's '.'
+ * @return Whether the names match
+ */
+static bool
+hostfs_name_match(const char *leaf, const char *object)
+{
+  for (; *leaf && *object; leaf++, object++) {
+    const int c = (*leaf == '/') ? '.' : *leaf;
+
+    if (tolower((unsigned char) c) != tolower((unsigned char) *object)) {
+      return false;
+    }
+  }
+  return *leaf == *object;
+}
+
+/**
+ * Build the hash index of a directory's entries by name. Where names
+ * differ only in case, the first in sorted order is found.
+ *
+ * @param dir Cache slot, with entries filled in
  */
 static void
-hostfs_path_scan(const char *host_dir_path,
-                 const char *object,
-                 char *host_name,
-                 risc_os_object_info *object_info)
+hostfs_dir_index(cache_directory *dir)
 {
-  DIR *d;
-  struct dirent *entry;
-  size_t c;
+  unsigned size = 16, i;
 
-  assert(host_dir_path && object);
-  assert(host_name);
-  assert(object_info);
+  while (size < dir->count * 2) {
+    size *= 2;
+  }
+  if (size > dir->index_size) {
+    free(dir->index);
+    dir->index = malloc(size * sizeof(unsigned));
+    if (!dir->index) {
+      fprintf(stderr, "hostfs_dir_index(): Out of memory\n");
+      exit(1);
+    }
+    dir->index_size = size;
+  }
+  memset(dir->index, 0, dir->index_size * sizeof(unsigned));
 
-  d = opendir(host_dir_path);
-  if (!d) {
-    switch (errno) {
-    case ENOENT: /* Object not found */
-    case ENOTDIR: /* Object not a directory */
-      object_info->type = OBJECT_TYPE_NOT_FOUND;
-      break;
+  for (i = 0; i < dir->count; i++) {
+    const char *name = dir->names + dir->entries[i].name_offset;
+    unsigned slot = hostfs_name_hash(name) & (dir->index_size - 1);
+    bool duplicate = false;
 
-    default:
-      fprintf(stderr, "hostfs_path_scan() could not opendir() \'%s\': %s %d\n",
-              host_dir_path, strerror(errno), errno);
-      object_info->type = OBJECT_TYPE_NOT_FOUND;
+    /* Linear probing */
+    while (dir->index[slot] != 0) {
+      if (hostfs_name_match(dir->names + dir->entries[dir->index[slot] - 1].name_offset, name)) {
+        duplicate = true;
+        break;
+      }
+      slot = (slot + 1) & (dir->index_size - 1);
+    }
+    if (!duplicate) {
+      dir->index[slot] = i + 1;
+    }
+  }
+}
+
+/**
+ * Find an entry of a cached directory by name, ignoring case.
+ *
+ * @param dir    Cache slot
+ * @param object Object name, with '.' for the Host's '.'
+ * @return Entry, or NULL if not found
+ */
+static const cache_directory_entry *
+hostfs_dir_lookup(const cache_directory *dir, const char *object)
+{
+  unsigned slot;
+
+  if (!dir->valid || dir->count == 0) {
+    return NULL;
+  }
+
+  slot = hostfs_name_hash(object) & (dir->index_size - 1);
+  while (dir->index[slot] != 0) {
+    const cache_directory_entry *entry = &dir->entries[dir->index[slot] - 1];
+
+    if (hostfs_name_match(dir->names + entry->name_offset, object)) {
+      return entry;
     }
+    slot = (slot + 1) & (dir->index_size - 1);
+  }
+  return NULL;
+}
 
+/**
+ * Reads the entries of a directory into its cache slot, sorted in
+ * case-insensitive order of name, and indexes them by name.
+ *
+ * @param dir Cache slot, with the path of the directory filled in
+ */
+static void
+hostfs_cache_dir(cache_directory *dir)
+{
+  unsigned entry_ptr = 0;
+  unsigned name_ptr = 0;
+  DIR *d;
+  const struct dirent *entry;
+
+  assert(dir);
+  assert(dir->path);
+
+  /* Allocate memory initially */
+  if (!dir->entries) {
+    dir->entries_capacity = 128;
+    dir->entries = malloc(dir->entries_capacity * sizeof(cache_directory_entry));
+  }
+  if (!dir->names) {
+    dir->names_capacity = 2048;
+    dir->names = malloc(dir->names_capacity);
+  }
+  if ((!dir->entries) || (!dir->names)) {
+    fprintf(stderr, "hostfs_cache_dir(): Out of memory\n");
+    exit(1);
+  }
+
+  dir->count = 0;
+  dir->valid = false;
+
+  /* Read each of the directory entries one at a time.
+   * Fill in the entries[] and names[] arrays,
+   *    resizing these dynamically if required.
+   */
+  d = opendir(dir->path);
+  if (!d) {
+    /* Not existing, or not being a directory, is reported by the caller */
+    if (errno != ENOENT && errno != ENOTDIR) {
+      fprintf(stderr, "HostFS could not read directory \'%s\': %s %d\n",
+              dir->path, strerror(errno), errno);
+    }
     return;
   }
 
   while ((entry = readdir(d)) != NULL) {
     char entry_path[PATH_MAX], ro_leaf[PATH_MAX];
+    unsigned string_space;
 
     /* Ignore the current directory and it's parent */
     if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
       continue;
     }
 
-    strcpy(entry_path, host_dir_path);
-    strcat(entry_path, "/");
-    strcat(entry_path, entry->d_name);
-
-    hostfs_read_object_info(entry_path, ro_leaf, object_info);
+    snprintf(entry_path, sizeof(entry_path), "%s/%s", dir->path, entry->d_name);
 
-        for (c=0;c<strlen(ro_leaf);c++)
-        {
-                if (ro_leaf[c]=='/')
-                   ro_leaf[c]='.';
-        }
+    hostfs_read_object_info(entry_path, ro_leaf,
+                            &dir->entries[entry_ptr].object_info);
 
     /* Ignore entries we can not read information about,
        or which are neither regular files or directories */
-    if (object_info->type == OBJECT_TYPE_NOT_FOUND) {
+    if (dir->entries[entry_ptr].object_info.type == OBJECT_TYPE_NOT_FOUND) {
       continue;
     }
 
-    /* Compare leaf and object names in case-insensitive manner */
-    if (!STRCASEEQ(ro_leaf, object)) {
-      /* Names do not match */
-      continue;
+    /* Calculate space required to store both names (+ terminators) */
+    string_space = strlen(ro_leaf) + 1 + strlen(entry->d_name) + 1;
+
+    /* Check whether names[] is large enough; increase if required */
+    while (string_space > (dir->names_capacity - name_ptr)) {
+      dir->names_capacity *= 2;
+      dir->names = realloc(dir->names, dir->names_capacity);
+      if (!dir->names) {
+        fprintf(stderr, "hostfs_cache_dir(): Out of memory\n");
+        exit(1);
+      }
     }
 
-    /* A match has been found - exit the function early */
-    strcpy(host_name, entry->d_name);
-    closedir(d);
-    return;
+    /* Copy strings into names[]. Put offset ptrs into entries[] */
+    strcpy(dir->names + name_ptr, ro_leaf);
+    dir->entries[entry_ptr].name_offset = name_ptr;
+    strcpy(dir->names + name_ptr + strlen(ro_leaf) + 1, entry->d_name);
+    dir->entries[entry_ptr].host_name_offset = name_ptr + (unsigned) strlen(ro_leaf) + 1;
+
+    /* Advance name_ptr */
+    name_ptr += string_space;
+
+    /* Advance entry_ptr, increasing space of entries[] if required */
+    entry_ptr++;
+    if (entry_ptr == dir->entries_capacity) {
+      dir->entries_capacity *= 2;
+      dir->entries = realloc(dir->entries, dir->entries_capacity * sizeof(cache_directory_entry));
+      if (!dir->entries) {
+        fprintf(stderr, "hostfs_cache_dir(): Out of memory\n");
+        exit(1);
+      }
+    }
   }
 
   closedir(d);
 
-  object_info->type = OBJECT_TYPE_NOT_FOUND;
+  /* Sort the directory entries, case-insensitive */
+  dir_cache_sort_names = dir->names;
+  qsort(dir->entries, entry_ptr, sizeof(cache_directory_entry),
+        hostfs_directory_entry_compare);
+
+  /* Store the number of directory entries found */
+  dir->count = entry_ptr;
+  dir->valid = true;
+
+  hostfs_dir_index(dir);
+}
+
+/**
+ * Called by the platform code when a watched directory may have changed.
+ *
+ * @param watch Watch of the directory, or -1 if any directory may have
+ *              changed
+ * @param ended Non-zero if the watch has ended, as the directory was
+ *              deleted or renamed
+ */
+static void
+hostfs_dir_cache_changed(int watch, int ended)
+{
+  unsigned i;
+
+  for (i = 0; i < DIR_CACHE_SIZE; i++) {
+    if (watch == -1 || dir_cache[i].watch == watch) {
+      dir_cache[i].valid = false;
+      if (ended && watch != -1) {
+        /* Watched again if the directory reappears */
+        dir_cache[i].watch = -1;
+      }
+    }
+  }
+}
+
+/**
+ * Collect changes to watched directories from the platform code.
+ */
+static void
+hostfs_dir_cache_poll(void)
+{
+  hostfs_dir_watch_poll_platform(hostfs_dir_cache_changed);
+}
+
+/**
+ * Forget the cached contents of directories that are not watched by the
+ * platform code, following a change made through HostFS.
+ *
+ * A change to a file's contents does not update the mtime of its
+ * directory, so unwatched directories could otherwise report stale
+ * lengths and timestamps.
+ */
+static void
+hostfs_dir_cache_unwatched_changed(void)
+{
+  unsigned i;
+
+  for (i = 0; i < DIR_CACHE_SIZE; i++) {
+    if (dir_cache[i].watch == -1) {
+      dir_cache[i].valid = false;
+    }
+  }
+}
+
+/**
+ * Free a directory cache slot.
+ *
+ * @param dir Cache slot
+ */
+static void
+hostfs_dir_cache_free(cache_directory *dir)
+{
+  unsigned i;
+
+  if (dir->watch != -1) {
+    /* Two paths to the same directory share a watch */
+    bool shared = false;
+
+    for (i = 0; i < DIR_CACHE_SIZE; i++) {
+      if (&dir_cache[i] != dir && dir_cache[i].path && dir_cache[i].watch == dir->watch) {
+        shared = true;
+      }
+    }
+    if (!shared) {
+      hostfs_dir_watch_remove_platform(dir->watch);
+    }
+  }
+
+  free(dir->path);
+  free(dir->entries);
+  free(dir->names);
+  free(dir->index);
+  memset(dir, 0, sizeof(cache_directory));
+  dir->watch = -1;
+}
+
+/**
+ * Get the contents of a directory, from the cache if they are known to be
+ * unchanged.
+ *
+ * Directories are watched for changes by the platform code where it is
+ * able to, which costs nothing when there are none. Otherwise the mtime
+ * of the directory is compared, which misses changes made within the
+ * same second as the directory was read; contents read within a second
+ * of the directory changing are therefore not trusted.
+ *
+ * Changes reported by the platform code must first be collected with
+ * hostfs_dir_cache_poll().
+ *
+ * @param host_pathname Full path to host directory
+ * @param check         Whether to check unwatched directories for changes,
+ *                      false when the guest is continuing an enumeration
+ * @return Cache slot holding the directory
+ */
+static cache_directory *
+hostfs_dir_cache_get(const char *host_pathname, bool check)
+{
+  cache_directory *dir = NULL;
+  struct stat info;
+  unsigned i;
+
+  assert(host_pathname);
+
+  dir_cache_clock++;
+
+  for (i = 0; i < DIR_CACHE_SIZE; i++) {
+    if (dir_cache[i].path && STREQ(dir_cache[i].path, host_pathname)) {
+      dir = &dir_cache[i];
+      break;
+    }
+  }
+
+  if (dir && dir->valid) {
+    dir->last_used = dir_cache_clock;
+    if (!check || dir->watch != -1) {
+      return dir;
+    }
+    if (stat(host_pathname, &info) == 0 && info.st_mtime == dir->mtime &&
+        dir->mtime < dir->read_time - 1)
+    {
+      return dir;
+    }
+  }
+
+  if (!dir) {
+    /* Reuse the least recently used slot */
+    dir = &dir_cache[0];
+    for (i = 0; i < DIR_CACHE_SIZE; i++) {
+      if (!dir_cache[i].path) {
+        dir = &dir_cache[i];
+        break;
+      }
+      if (dir_cache_clock - dir_cache[i].last_used > dir_cache_clock - dir->last_used) {
+        dir = &dir_cache[i];
+      }
+    }
+    if (dir->path) {
+      hostfs_dir_cache_free(dir);
+    }
+
+    dir->path = strdup(host_pathname);
+    if (!dir->path) {
+      fprintf(stderr, "hostfs_dir_cache_get(): Out of memory\n");
+      exit(1);
+    }
+  }
+
+  /* Start watching before reading, so no change is missed. This also
+     watches a directory again after its watch ended because it was
+     deleted or renamed, once something exists at its path again */
+  if (dir->watch == -1) {
+    dir->watch = hostfs_dir_watch_add_platform(host_pathname);
+  }
+
+  dir->last_used = dir_cache_clock;
+  dir->mtime = (stat(host_pathname, &info) == 0) ? info.st_mtime : 0;
+  dir->read_time = time(NULL);
+  hostfs_cache_dir(dir);
+
+  return dir;
+}
+
+/**
+ * Find an object in a directory, through the directory cache.
+ *
+ * @param host_dir_path Full Host path to directory to scan
+ * @param object        Object name to search for
+ * @param host_name     Return Host name of object (filled-in if object found)
+ * @param object_info   Return object info (filled-in)
+ */
+static void
+hostfs_path_scan(const char *host_dir_path,
+                 const char *object,
+                 char *host_name,
+                 risc_os_object_info *object_info)
+{
+  const cache_directory *dir;
+  const cache_directory_entry *entry;
+
+  assert(host_dir_path && object);
+  assert(host_name);
+  assert(object_info);
+
+  dir = hostfs_dir_cache_get(host_dir_path, true);
+  entry = hostfs_dir_lookup(dir, object);
+  if (!entry) {
+    object_info->type = OBJECT_TYPE_NOT_FOUND;
+    return;
+  }
+
+  strcpy(host_name, dir->names + entry->host_name_offset);
+
+  if (dir->watch != -1) {
+    *object_info = entry->object_info;
+  } else {
+    /* The contents of a file can change without changing the mtime of
+       its directory, so read the object's details afresh */
+    char entry_path[PATH_MAX];
+
+    snprintf(entry_path, sizeof(entry_path), "%s/%s", host_dir_path, host_name);
+    hostfs_read_object_info(entry_path, NULL, object_info);
+  }
 }
 
 /**
@@ -602,6 +1038,9 @@ hostfs_path_process(const char *ro_path,
   /* Initialise Host pathname */
   host_pathname[0] = '\0';
 
+  /* Pick up changes to the directories that will be searched */
+  hostfs_dir_cache_poll();
+
   /* Initialise working Host component */
   component = &component_name[0];
   *component = '\0';
@@ -721,25 +1160,58 @@ hostfs_path_process(const char *ro_path,
   return 0;
 }
 
-/* Search through the open_file[] array, and allocate an index.
-   A valid index will be >0 and <=MAX_OPEN_FILES
-   A return of 0 indicates that no array index could be allocated.
+/**
+ * Allocate a handle in the open_file[] array, growing the array if all
+ * handles are in use. Handle 0 is never allocated.
+ *
+ * @return Handle, or 0 if memory could not be allocated
  */
 static unsigned
 hostfs_open_allocate_index(void)
 {
-  unsigned i;
+  unsigned idx;
 
-  /* TODO Use the buffer in a circular manner for improved performance */
+  if (open_file_free == 0) {
+    const unsigned new_count = (open_file_count == 0) ? 64 : open_file_count * 2;
+    open_file_entry *new_open_file;
+    unsigned i;
 
-  /* Start our search at array index 1.
-     Reserve a return of 0 for a special meaning: no free entry */
-  for (i = 1; i < (MAX_OPEN_FILES + 1); i++) {
-    if (open_file[i] == NULL) {
-      return i;
+    new_open_file = realloc(open_file, new_count * sizeof(open_file_entry));
+    if (new_open_file == NULL) {
+      return 0;
     }
+    open_file = new_open_file;
+
+    /* Link the new entries into the free list, lowest handle first */
+    for (i = new_count; i-- > open_file_count; ) {
+      memset(&open_file[i], 0, sizeof(open_file_entry));
+      open_file[i].fd = -1;
+      if (i != 0) {
+        open_file[i].next_free = open_file_free;
+        open_file_free = i;
+      }
+    }
+    open_file_count = new_count;
   }
-  return 0;
+
+  idx = open_file_free;
+  open_file_free = open_file[idx].next_free;
+  return idx;
+}
+
+/**
+ * Return a handle to the free list of the open_file[] array.
+ *
+ * @param idx Handle
+ */
+static void
+hostfs_open_free_index(unsigned idx)
+{
+  assert(idx > 0 && idx < open_file_count);
+
+  open_file[idx].fd = -1;
+  open_file[idx].next_free = open_file_free;
+  open_file_free = idx;
 }
 
 static void
@@ -747,7 +1219,10 @@ hostfs_open(ARMul_State *state)
 {
   char ro_path[PATH_MAX], host_pathname[PATH_MAX];
   risc_os_object_info object_info;
+  struct stat info;
+  open_file_entry *of;
   unsigned idx;
+  int fd = -1;
 
   assert(state);
 
@@ -771,19 +1246,10 @@ hostfs_open(ARMul_State *state)
   /* TODO Handle the case that a file exists to be replaced, (and the filetype is
      not data - the recommeded default for new files) */
 
-  idx = hostfs_open_allocate_index();
-  if (idx == 0) {
-    /* No more space in the open_file[] array.
-       This should never occur, because RISC OS is constraining the max
-       number of open files */
-    abort();
-  }
-
-
   switch (state->Reg[0]) {
   case OPEN_MODE_READ:
     dbug_hostfs("\tOpen for read\n");
-    open_file[idx] = fopen(host_pathname, "rb");
+    fd = open(host_pathname, O_RDONLY | O_BINARY);
     state->Reg[0] = FILE_INFO_WORD_READ_OK;
     break;
 
@@ -793,13 +1259,13 @@ hostfs_open(ARMul_State *state)
 
   case OPEN_MODE_UPDATE:
     dbug_hostfs("\tOpen for update\n");
-    open_file[idx] = fopen(host_pathname, "rb+");
+    fd = open(host_pathname, O_RDWR | O_BINARY);
     state->Reg[0] = (uint32_t) (FILE_INFO_WORD_READ_OK | FILE_INFO_WORD_WRITE_OK);
     break;
   }
 
   /* Check for errors from opening the file */
-  if (open_file[idx] == NULL) {
+  if (fd < 0) {
     switch (errno) {
     case ENOMEM: /* Out of memory */
       fprintf(stderr, "HostFS out of memory in hostfs_open(): \'%s\'\n",
@@ -819,23 +1285,219 @@ hostfs_open(ARMul_State *state)
     }
   }
 
+  idx = hostfs_open_allocate_index();
+  if (idx == 0) {
+    rpclog("HostFS: No handle available to open \'%s\'\n", host_pathname);
+    close(fd);
+    state->Reg[1] = 0; /* Signal to RISC OS file not found */
+    return;
+  }
+
   /* Find the extent of the file */
-  fseek(open_file[idx], 0L, SEEK_END);
-  state->Reg[3] = ftell(open_file[idx]);
-  rewind(open_file[idx]); /* Return to start */
+  if (fstat(fd, &info) != 0) {
+    info.st_size = 0;
+  }
+
+  of = &open_file[idx];
+  of->fd = fd;
+  of->extent = (int64_t) info.st_size;
+  of->pos = 0;
+  of->buf_offset = 0;
+  of->buf_len = 0;
+  of->buf_dirty = false;
 
   state->Reg[1] = idx; /* Our filing system's handle */
   state->Reg[2] = 1024; /* Buffer size to use in range 64-1024.
                            Must be power of 2 */
+  state->Reg[3] = (ARMword) of->extent;
   state->Reg[4] = 0; /* Space allocated to file */
 }
 
+/**
+ * Read from a host file, retrying short reads. Bytes beyond the end of
+ * the file read as zero.
+ *
+ * @param fd     Host file descriptor
+ * @param buf    Buffer to fill
+ * @param len    Number of bytes to read
+ * @param offset Offset within the file
+ * @return Number of bytes read from the file, the remainder being zeros
+ */
+static size_t
+hostfs_file_read(int fd, void *buf, size_t len, int64_t offset)
+{
+  ssize_t done = hostio_read(fd, buf, len, offset);
+
+  if (done < 0) {
+    fprintf(stderr, "HostFS read failed: %s\n", strerror(errno));
+    done = 0;
+  }
+
+  memset((uint8_t *) buf + done, 0, len - (size_t) done);
+  return (size_t) done;
+}
+
+/**
+ * Write to a host file, retrying short writes.
+ *
+ * @param fd     Host file descriptor
+ * @param buf    Data to write
+ * @param len    Number of bytes to write
+ * @param offset Offset within the file
+ * @return true if all the data was written
+ */
+static bool
+hostfs_file_write(int fd, const void *buf, size_t len, int64_t offset)
+{
+  if (hostio_write(fd, buf, len, offset) != 0) {
+    rpclog("HostFS: Write of %lu bytes at offset %lld failed: %s\n",
+           (unsigned long) len, (long long) offset, strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Write any write-behind data held for an open file to the host file. If
+ * the write fails the data is kept, so that a later flush can try again.
+ *
+ * @param of Open file
+ * @return true if no write-behind data remains
+ */
+static bool
+hostfs_file_flush(open_file_entry *of)
+{
+  assert(of);
+
+  if (of->buf_dirty) {
+    if (!hostfs_file_write(of->fd, of->buf, of->buf_len, of->buf_offset)) {
+      return false;
+    }
+    of->buf_dirty = false;
+    open_file_dirty--;
+  }
+  return true;
+}
+
+/**
+ * Write the write-behind data of all open files to the host files, so
+ * that other operations see the files as RISC OS has written them.
+ */
+static void
+hostfs_file_flush_all(void)
+{
+  unsigned i;
+
+  for (i = 1; i < open_file_count && open_file_dirty != 0; i++) {
+    if (open_file[i].fd != -1) {
+      hostfs_file_flush(&open_file[i]);
+    }
+  }
+}
+
+/**
+ * Discard the buffered data of an open file, after writing it to the host
+ * file if necessary. Write-behind data that still cannot be written is
+ * lost.
+ *
+ * @param of Open file
+ */
+static void
+hostfs_file_discard_buffer(open_file_entry *of)
+{
+  assert(of);
+
+  if (!hostfs_file_flush(of)) {
+    rpclog("HostFS: Discarding %lu bytes that could not be written\n",
+           (unsigned long) of->buf_len);
+    of->buf_dirty = false;
+    open_file_dirty--;
+  }
+  of->buf_len = 0;
+}
+
+/**
+ * Read from a host file straight into emulated memory. Data is transferred
+ * directly to RAM where possible, in runs of pages that are contiguous in
+ * host memory. Bytes beyond the end of the file read as zero.
+ *
+ * @param fd      Host file descriptor
+ * @param offset  Offset within the file
+ * @param address Address in emulated memory
+ * @param len     Number of bytes to read
+ */
+static void
+hostfs_read_to_guest(int fd, int64_t offset, ARMword address, ARMword len)
+{
+  while (len > 0) {
+    size_t chunk;
+    uint8_t *p = mem_write_run(address, len, &chunk);
+
+    if (p != NULL) {
+      hostfs_file_read(fd, p, chunk, offset);
+    } else {
+      hostfs_ensure_buffer_size(chunk);
+      hostfs_file_read(fd, buffer, chunk, offset);
+      mem_copy_to_guest(address, buffer, chunk);
+    }
+
+    address += chunk;
+    offset += chunk;
+    len -= chunk;
+  }
+}
+
+/**
+ * Write from emulated memory straight to a host file. Data is transferred
+ * directly from RAM where possible, in runs of pages that are contiguous
+ * in host memory.
+ *
+ * @param fd      Host file descriptor
+ * @param offset  Offset within the file
+ * @param address Address in emulated memory
+ * @param len     Number of bytes to write
+ */
+static void
+hostfs_write_from_guest(int fd, int64_t offset, ARMword address, ARMword len)
+{
+  while (len > 0) {
+    size_t chunk;
+    const uint8_t *p = mem_read_run(address, len, &chunk);
+
+    if (p == NULL) {
+      hostfs_ensure_buffer_size(chunk);
+      mem_copy_from_guest(buffer, address, chunk);
+      p = buffer;
+    }
+    hostfs_file_write(fd, p, chunk, offset);
+
+    address += chunk;
+    offset += chunk;
+    len -= chunk;
+  }
+}
+
+/**
+ * Ensure an open file has a buffer for read-ahead or write-behind data.
+ *
+ * @param of Open file
+ * @return true if the buffer is available
+ */
+static bool
+hostfs_file_ensure_buffer(open_file_entry *of)
+{
+  if (of->buf == NULL) {
+    of->buf = malloc(OPEN_FILE_BUFFER_SIZE);
+  }
+  return of->buf != NULL;
+}
+
 static void
 hostfs_getbytes(ARMul_State *state)
 {
-  FILE *f = open_file[state->Reg[1]];
-  ARMword ptr = state->Reg[2];
-  ARMword i;
+  open_file_entry *of;
+  ARMword address, len;
+  int64_t offset;
 
   assert(state);
 
@@ -846,23 +1508,41 @@ hostfs_getbytes(ARMul_State *state)
   dbug_hostfs("\tr4 = %u (file offset from which to get data)\n",
               state->Reg[4]);
 
-  hostfs_ensure_buffer_size(state->Reg[3]);
-
-  fseek(f, (long) state->Reg[4], SEEK_SET);
+  of = &open_file[state->Reg[1]];
+  address = state->Reg[2];
+  len = state->Reg[3];
+  offset = (int64_t) state->Reg[4];
 
-  fread(buffer, 1, state->Reg[3], f);
+  /* Reads must see any data written so far. Data that could not be
+     written stays in the buffer, so must not be replaced by read-ahead */
+  hostfs_file_flush(of);
 
-  for (i = 0; i < state->Reg[3]; i++) {
-    ARMul_StoreByte(state, ptr++, buffer[i]);
+  if (offset >= of->buf_offset &&
+      offset + len <= of->buf_offset + (int64_t) of->buf_len)
+  {
+    /* Satisfied by data already read ahead */
+    mem_copy_to_guest(address, of->buf + (offset - of->buf_offset), len);
+  } else if (!of->buf_dirty && offset == of->pos &&
+             len < OPEN_FILE_BUFFER_SIZE && hostfs_file_ensure_buffer(of))
+  {
+    /* Sequential reading, so read ahead to serve the following requests */
+    of->buf_offset = offset;
+    of->buf_len = hostfs_file_read(of->fd, of->buf, OPEN_FILE_BUFFER_SIZE,
+                                   offset);
+    mem_copy_to_guest(address, of->buf, len);
+  } else {
+    hostfs_read_to_guest(of->fd, offset, address, len);
   }
+
+  of->pos = offset + len;
 }
 
 static void
 hostfs_putbytes(ARMul_State *state)
 {
-  FILE *f = open_file[state->Reg[1]];
-  ARMword ptr = state->Reg[2];
-  ARMword i;
+  open_file_entry *of;
+  ARMword address, len;
+  int64_t offset;
 
   assert(state);
 
@@ -873,106 +1553,115 @@ hostfs_putbytes(ARMul_State *state)
   dbug_hostfs("\tr4 = %u (file offset at which to put data)\n",
               state->Reg[4]);
 
-  hostfs_ensure_buffer_size(state->Reg[3]);
+  of = &open_file[state->Reg[1]];
+  address = state->Reg[2];
+  len = state->Reg[3];
+  offset = (int64_t) state->Reg[4];
 
-  fseek(f, (long) state->Reg[4], SEEK_SET);
-
-  for (i = 0; i < state->Reg[3]; i++) {
-    buffer[i] = ARMul_LoadByte(state, ptr);
-    ptr++;
+  if (of->buf_dirty && offset == of->buf_offset + (int64_t) of->buf_len &&
+      of->buf_len + len <= OPEN_FILE_BUFFER_SIZE)
+  {
+    /* Continues the data already held back */
+    mem_copy_from_guest(of->buf + of->buf_len, address, len);
+    of->buf_len += len;
+  } else {
+    /* Any read-ahead data may now be out of date */
+    hostfs_file_discard_buffer(of);
+
+    if (len < OPEN_FILE_BUFFER_SIZE && hostfs_file_ensure_buffer(of)) {
+      /* Hold back the data, in case more follows */
+      mem_copy_from_guest(of->buf, address, len);
+      of->buf_offset = offset;
+      of->buf_len = len;
+      of->buf_dirty = true;
+      open_file_dirty++;
+    } else {
+      hostfs_write_from_guest(of->fd, offset, address, len);
+    }
   }
 
-  fwrite(buffer, 1, state->Reg[3], f);
+  of->pos = offset + len;
+  if (of->pos > of->extent) {
+    of->extent = of->pos;
+  }
 }
 
 static void
 hostfs_args_3_write_file_extent(ARMul_State *state)
 {
-  FILE *f;
-  int fd;
+  open_file_entry *of;
 
   assert(state);
 
-  f = open_file[state->Reg[1]];
+  of = &open_file[state->Reg[1]];
 
   dbug_hostfs("\tWrite file extent\n");
   dbug_hostfs("\tr1 = %u (our file handle)\n", state->Reg[1]);
   dbug_hostfs("\tr2 = %u (new extent)\n", state->Reg[2]);
 
-  /* Flush any pending I/O before moving to low-level I/O functions */
-  if (fflush(f)) {
-    fprintf(stderr, "hostfs_args_3_write_file_extent() bad fflush(): %s %d\n",
-            strerror(errno), errno);
-    return;
-  }
-
-  /* Obtain underlying file descriptor for this FILE* */
-  fd = fileno(f);
-  if (fd < 0) {
-    fprintf(stderr, "hostfs_args_3_write_file_extent() bad fd: %s %d\n",
-            strerror(errno), errno);
-    return;
-  }
+  /* Write any pending data before changing the length underneath it */
+  hostfs_file_discard_buffer(of);
 
   /* Set file to required extent */
   /* FIXME Not defined if file is increased in size */
-  if (ftruncate(fd, (off_t) state->Reg[2])) {
+  if (ftruncate(of->fd, (off_t) state->Reg[2])) {
     fprintf(stderr, "hostfs_args_3_write_file_extent() bad ftruncate(): %s %d\n",
             strerror(errno), errno);
     return;
   }
+  of->extent = (int64_t) state->Reg[2];
 }
 
 static void
 hostfs_args_7_ensure_file_size(ARMul_State *state)
 {
-  FILE *f;
+  open_file_entry *of;
 
   assert(state);
 
-  f = open_file[state->Reg[1]];
+  of = &open_file[state->Reg[1]];
 
   dbug_hostfs("\tEnsure file size\n");
   dbug_hostfs("\tr1 = %u (our file handle)\n", state->Reg[1]);
   dbug_hostfs("\tr2 = %u (size of file to ensure)\n", state->Reg[2]);
 
-  fseek(f, 0L, SEEK_END);
-
-  state->Reg[2] = (ARMword) ftell(f);
+  state->Reg[2] = (ARMword) of->extent;
 }
 
 static void
 hostfs_args_8_write_zeros(ARMul_State *state)
 {
   const unsigned BUFSIZE = MINIMUM_BUFFER_SIZE;
-  FILE *f;
+  open_file_entry *of;
+  int64_t offset;
   ARMword length;
 
   assert(state);
 
-  f = open_file[state->Reg[1]];
+  of = &open_file[state->Reg[1]];
 
   dbug_hostfs("\tWrite zeros to file\n");
   dbug_hostfs("\tr1 = %u (our file handle)\n", state->Reg[1]);
   dbug_hostfs("\tr2 = %u (file offset at which to write)\n", state->Reg[2]);
   dbug_hostfs("\tr3 = %u (number of zero bytes to write)\n", state->Reg[3]);
 
-  fseek(f, (long) state->Reg[2], SEEK_SET);
+  hostfs_file_discard_buffer(of);
 
   hostfs_ensure_buffer_size(BUFSIZE);
   memset(buffer, 0, BUFSIZE);
 
+  offset = (int64_t) state->Reg[2];
   length = state->Reg[3];
   while (length > 0) {
     size_t buffer_amount = MIN(length, BUFSIZE);
-    size_t written;
 
-    written = fwrite(buffer, 1, buffer_amount, f);
-    if (written < buffer_amount) {
-      fprintf(stderr, "fwrite(): %s\n", strerror(errno));
-      return;
-    }
-    length -= written;
+    hostfs_file_write(of->fd, buffer, buffer_amount, offset);
+    offset += buffer_amount;
+    length -= buffer_amount;
+  }
+
+  if (offset > of->extent) {
+    of->extent = offset;
   }
 }
 
@@ -1012,12 +1701,12 @@ hostfs_args(ARMul_State *state)
 static void
 hostfs_close(ARMul_State *state)
 {
-  FILE *f;
+  open_file_entry *of;
   ARMword load, exec;
 
   assert(state);
 
-  f = open_file[state->Reg[1]];
+  of = &open_file[state->Reg[1]];
   load = state->Reg[2];
   exec = state->Reg[3];
 
@@ -1027,10 +1716,11 @@ hostfs_close(ARMul_State *state)
   dbug_hostfs("\tr3 = 0x%08x (new exec address)\n", state->Reg[3]);
 
   /* Close the file */
-  fclose(f);
+  hostfs_file_discard_buffer(of);
+  close(of->fd);
 
   /* Free up the open_file[] entry */
-  open_file[state->Reg[1]] = NULL;
+  hostfs_open_free_index(state->Reg[1]);
 
   /* If load and exec addresses are both 0, then nothing to do */
   if (load == 0 && exec == 0) {
@@ -1050,12 +1740,11 @@ hostfs_close(ARMul_State *state)
 static void
 hostfs_write_file(ARMul_State *state, bool with_data)
 {
-  const unsigned BUFSIZE = MINIMUM_BUFFER_SIZE;
   char ro_path[PATH_MAX];
   char host_pathname[PATH_MAX], new_pathname[PATH_MAX];
-  ARMword length, ptr;
+  ARMword length;
   risc_os_object_info object_info;
-  FILE *f;
+  int fd;
   enum FILECORE_ERROR error_detail;
 
   assert(state);
@@ -1069,7 +1758,6 @@ hostfs_write_file(ARMul_State *state, bool with_data)
               state->Reg[6]);
 
   length = state->Reg[5] - state->Reg[4];
-  ptr = state->Reg[4];
 
   get_string(state, state->Reg[1], ro_path, sizeof(ro_path));
   dbug_hostfs("\tPATH = %s\n", ro_path);
@@ -1109,43 +1797,26 @@ hostfs_write_file(ARMul_State *state, bool with_data)
     return;
   }
 
-  hostfs_ensure_buffer_size(BUFSIZE);
-
-  f = fopen(new_pathname, "wb");
-  if (!f) {
+  fd = open(new_pathname, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+  if (fd < 0) {
     /* TODO handle errors */
     fprintf(stderr, "HostFS could not create file \'%s\': %s %d\n",
             new_pathname, strerror(errno), errno);
     return;
   }
 
-  /* Fill the data buffer with 0's if we are not saving supplied data */
-  if (!with_data) {
-    memset(buffer, 0, BUFSIZE);
-  }
-
-  /* Save file in blocks of up to BUFSIZE */
-  while (length > 0) {
-    size_t buffer_amount = MIN(length, BUFSIZE);
-    size_t bytes_written;
-
-    if (with_data) {
-      unsigned i;
-
-      /* Copy the correct amount of data into the buffer */
-      for (i = 0; i < buffer_amount; i++) {
-        buffer[i] = ARMul_LoadByte(state, ptr);
-        ptr++;
-      }
+  if (with_data) {
+    /* Save the whole block in one pass, straight from guest RAM */
+    hostfs_write_from_guest(fd, 0, state->Reg[4], length);
+  } else if (length != 0) {
+    /* Create the file full of zeros by setting its length */
+    if (ftruncate(fd, (off_t) length)) {
+      fprintf(stderr, "HostFS could not set length of \'%s\': %s %d\n",
+              new_pathname, strerror(errno), errno);
     }
-
-    /* TODO check for errors */
-    bytes_written = fwrite(buffer, 1, buffer_amount, f);
-    length -= bytes_written;
   }
 
-
-  fclose(f); /* TODO check for errors */
+  close(fd); /* TODO check for errors */
 
   state->Reg[6] = 0; /* TODO */
 
@@ -1406,12 +2077,11 @@ hostfs_file_8_create_dir(ARMul_State *state)
 static void
 hostfs_file_255_load_file(ARMul_State *state)
 {
-  const unsigned BUFSIZE = MINIMUM_BUFFER_SIZE;
   char ro_path[PATH_MAX], host_pathname[PATH_MAX];
   risc_os_object_info object_info;
-  FILE *f;
-  size_t bytes_read;
+  struct stat info;
   ARMword ptr;
+  int fd;
 
   assert(state);
 
@@ -1434,26 +2104,19 @@ hostfs_file_255_load_file(ARMul_State *state)
   state->Reg[5] = object_info.attribs;
   state->Reg[6] = 0; /* TODO */
 
-  f = fopen(host_pathname, "rb");
-  if (!f) {
+  fd = open(host_pathname, O_RDONLY | O_BINARY);
+  if (fd < 0) {
     fprintf(stderr, "HostFS could not open file (File_255) \'%s\': %s %d\n",
             host_pathname, strerror(errno), errno);
     return;
   }
 
-  hostfs_ensure_buffer_size(BUFSIZE);
-
-  do {
-    unsigned i;
-
-    bytes_read = fread(buffer, 1, BUFSIZE, f);
-
-    for (i = 0; i < bytes_read; i++) {
-      ARMul_StoreByte(state, ptr++, buffer[i]);
-    }
-  } while (bytes_read == BUFSIZE);
+  /* Load the whole file in one pass, straight into guest RAM */
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    hostfs_read_to_guest(fd, 0, ptr, (ARMword) info.st_size);
+  }
 
-  fclose(f);
+  close(fd);
 }
 
 static void
@@ -1587,129 +2250,6 @@ hostfs_func_8_rename(ARMul_State *state)
   state->Reg[1] = 0; /* zero indicates successful rename */
 }
 
-/**
- * Compare two elements of type \a cache_directory_entry by comparing their
- * names in a case-insensitive manner.
- *
- * @param e1 Pointer to first \a cache_directory_entry
- * @param e2 Pointer to second \a cache_directory_entry
- * @return Returns an integer less than, equal to, or greater than zero if
- *         e1's name is found, respectively, to be earlier than, to match, or
- *         be later than e2's name.
- */
-static int
-hostfs_directory_entry_compare(const void *e1, const void *e2)
-{
-  const cache_directory_entry *entry1 = e1;
-  const cache_directory_entry *entry2 = e2;
-  const char *name1 = cache_names + entry1->name_offset;
-  const char *name2 = cache_names + entry2->name_offset;
-
-  return strcasecmp(name1, name2);
-}
-
-/**
- * Reads the entries in the directory \a directory_name. Stores them in the
- * cache, sorted in case-insensitive order of name.
- *
- * @param directory_name Full path to host directory to be read and cached
- */
-static void
-hostfs_cache_dir(const char *directory_name)
-{
-  static unsigned cache_entries_capacity = 128; /* Initial capacity of cache_entries[] */
-  static unsigned cache_names_capacity = 2048; /* Initial capacity of cache_names[] */
-
-  unsigned entry_ptr = 0;
-  unsigned name_ptr = 0;
-  DIR *d;
-  const struct dirent *entry;
-
-  assert(directory_name);
-
-  /* Allocate memory initially */
-  if (!cache_entries) {
-    cache_entries = malloc(cache_entries_capacity * sizeof(cache_directory_entry));
-  }
-  if (!cache_names) {
-    cache_names = malloc(cache_names_capacity);
-  }
-  if ((!cache_entries) || (!cache_names)) {
-    fprintf(stderr, "hostfs_cache_dir(): Out of memory\n");
-    exit(1);
-  }
-
-  /* Read each of the directory entries one at a time.
-   * Fill in the cache_entries[] and cache_names[] arrays,
-   *    resizing these dynamically if required.
-   */
-  d = opendir(directory_name);
-  assert(d); /* FIXME */
-
-  while ((entry = readdir(d)) != NULL) {
-    char entry_path[PATH_MAX], ro_leaf[PATH_MAX];
-    unsigned string_space;
-
-    /* Ignore the current directory and it's parent */
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-      continue;
-    }
-
-    strcpy(entry_path, directory_name);
-    strcat(entry_path, "/");
-    strcat(entry_path, entry->d_name);
-
-    hostfs_read_object_info(entry_path, ro_leaf,
-                            &cache_entries[entry_ptr].object_info);
-
-    /* Ignore entries we can not read information about,
-       or which are neither regular files or directories */
-    if (cache_entries[entry_ptr].object_info.type == OBJECT_TYPE_NOT_FOUND) {
-      continue;
-    }
-
-    /* Calculate space required to store name (+ terminator) */
-    string_space = strlen(ro_leaf) + 1;
-
-    /* Check whether cache_names[] is large enough; increase if required */
-    if (string_space > (cache_names_capacity - name_ptr)) {
-      cache_names_capacity *= 2;
-      cache_names = realloc(cache_names, cache_names_capacity);
-      if (!cache_names) {
-        fprintf(stderr, "hostfs_cache_dir(): Out of memory\n");
-        exit(1);
-      }
-    }
-
-    /* Copy string into cache_names[]. Put offset ptr into local_entries[] */
-    strcpy(cache_names + name_ptr, ro_leaf);
-    cache_entries[entry_ptr].name_offset = name_ptr;
-
-    /* Advance name_ptr */
-    name_ptr += string_space;
-
-    /* Advance entry_ptr, increasing space of cache_entries[] if required */
-    entry_ptr++;
-    if (entry_ptr == cache_entries_capacity) {
-      cache_entries_capacity *= 2;
-      cache_entries = realloc(cache_entries, cache_entries_capacity * sizeof(cache_directory_entry));
-      if (!cache_entries) {
-        fprintf(stderr, "hostfs_cache_dir(): Out of memory\n");
-        exit(1);
-      }
-    }
-  }
-
-  closedir(d);
-
-  /* Sort the directory entries, case-insensitive */
-  qsort(cache_entries, entry_ptr, sizeof(cache_directory_entry),
-        hostfs_directory_entry_compare);
-
-  /* Store the number of directory entries found */
-  cache_entries_count = entry_ptr;
-}
-
 /**
  * Return directory information for FSEntry_Func 14, 15 and 19.
  * Uses and updates the cached directory information.
@@ -1723,9 +2263,9 @@ hostfs_cache_dir(const char *directory_name)
 static void
 hostfs_read_dir(ARMul_State *state, bool with_info, bool with_timestamp)
 {
-  static char cached_directory[PATH_MAX] = { '\0' }; /* Directory stored in the cache */
   char ro_path[PATH_MAX], host_pathname[PATH_MAX];
   risc_os_object_info object_info;
+  const cache_directory *dir;
 
   assert(state);
 
@@ -1751,10 +2291,12 @@ hostfs_read_dir(ARMul_State *state, bool with_info, bool with_timestamp)
     return;
   }
 
-  /* Determine if we should use the cached directory contents or should re-read */
-  if (!STREQ(host_pathname, cached_directory) || (state->Reg[4] == 0)) {
-    hostfs_cache_dir(host_pathname);
+  /* Only check for changes at the start of an enumeration, so that it
+     sees a consistent list of entries */
+  if (state->Reg[4] == 0) {
+    hostfs_dir_cache_poll();
   }
+  dir = hostfs_dir_cache_get(host_pathname, state->Reg[4] == 0);
 
   {
     const ARMword num_objects_to_read = state->Reg[3];
@@ -1763,11 +2305,11 @@ hostfs_read_dir(ARMul_State *state, bool with_info, bool with_timestamp)
     ARMword offset = state->Reg[4]; /* Offset of item to read */
     ARMword ptr = state->Reg[2]; /* Pointer to return buffer */
 
-    while ((count < num_objects_to_read) && (offset < cache_entries_count)) {
+    while ((count < num_objects_to_read) && (offset < dir->count)) {
       unsigned string_space, entry_space;
 
       /* Calculate space required to return name and (optionally) info */
-      string_space = (unsigned) strlen(cache_names + cache_entries[offset].name_offset) + 1;
+      string_space = (unsigned) strlen(dir->names + dir->entries[offset].name_offset) + 1;
       if (with_info) {
         if (with_timestamp) {
           /* Space required for info with timestamp:
@@ -1789,21 +2331,21 @@ hostfs_read_dir(ARMul_State *state, bool with_info, bool with_timestamp)
 
       /* Fill in this entry */
       if (with_info) {
-        ARMul_StoreWordS(state, ptr + 0,  cache_entries[offset].object_info.load);
-        ARMul_StoreWordS(state, ptr + 4,  cache_entries[offset].object_info.exec);
-        ARMul_StoreWordS(state, ptr + 8,  cache_entries[offset].object_info.length);
-        ARMul_StoreWordS(state, ptr + 12, cache_entries[offset].object_info.attribs);
-        ARMul_StoreWordS(state, ptr + 16, cache_entries[offset].object_info.type);
+        ARMul_StoreWordS(state, ptr + 0,  dir->entries[offset].object_info.load);
+        ARMul_StoreWordS(state, ptr + 4,  dir->entries[offset].object_info.exec);
+        ARMul_StoreWordS(state, ptr + 8,  dir->entries[offset].object_info.length);
+        ARMul_StoreWordS(state, ptr + 12, dir->entries[offset].object_info.attribs);
+        ARMul_StoreWordS(state, ptr + 16, dir->entries[offset].object_info.type);
 
         if (with_timestamp) {
           ARMul_StoreWordS(state, ptr + 20, 0); /* Always 0 */
           /* Test if Load and Exec contain timestamp */
-          if ((cache_entries[offset].object_info.load & 0xfff00000u) == 0xfff00000u) {
+          if ((dir->entries[offset].object_info.load & 0xfff00000u) == 0xfff00000u) {
             ARMul_StoreWordS(state, ptr + 24,
-                             (cache_entries[offset].object_info.load << 24) |
-                             (cache_entries[offset].object_info.exec >> 8));
+                             (dir->entries[offset].object_info.load << 24) |
+                             (dir->entries[offset].object_info.exec >> 8));
             ARMul_StoreByte(state, ptr + 28,
-                            cache_entries[offset].object_info.exec & 0xff);
+                            dir->entries[offset].object_info.exec & 0xff);
           } else {
             ARMul_StoreWordS(state, ptr + 24, 0);
             ARMul_StoreByte(state, ptr + 28, 0);
@@ -1813,7 +2355,7 @@ hostfs_read_dir(ARMul_State *state, bool with_info, bool with_timestamp)
           ptr += 20;
         }
       }
-      put_string(state, ptr, cache_names + cache_entries[offset].name_offset);
+      put_string(state, ptr, dir->names + dir->entries[offset].name_offset);
 
       ptr += string_space;
       if (with_info) {
@@ -1825,7 +2367,7 @@ hostfs_read_dir(ARMul_State *state, bool with_info, bool with_timestamp)
     }
 
     /* Find out whether we have now completed the directory */
-    if (offset >= cache_entries_count && count == 0) {
+    if (offset >= dir->count && count == 0) {
       /* We have completed the directory - return this fact */
       dbug_hostfs("HostFS completed directory\n");
       state->Reg[4] = (uint32_t) -1;
@@ -2093,6 +2635,10 @@ hostfs_init(void)
 {
   int c;
 
+  for (c = 0; c < DIR_CACHE_SIZE; c++) {
+    dir_cache[c].watch = -1;
+  }
+
   snprintf(HOSTFS_ROOT, sizeof(HOSTFS_ROOT), "%shostfs", rpcemu_get_datadir());
   for (c = 0; c < 511; c++) {
     if (HOSTFS_ROOT[c] == '\\') {
@@ -2112,14 +2658,36 @@ hostfs_reset(void)
   hostfs_state = HOSTFS_STATE_UNREGISTERED;
 
   /* Close any open files */
-  for (i = 1; i < (MAX_OPEN_FILES + 1); i++) {
-    if (open_file[i] != NULL) {
-      fclose(open_file[i]);
-      open_file[i] = NULL;
+  for (i = 1; i < open_file_count; i++) {
+    if (open_file[i].fd != -1) {
+      hostfs_file_discard_buffer(&open_file[i]);
+      close(open_file[i].fd);
+      hostfs_open_free_index(i);
     }
   }
 }
 
+/**
+ * Determine whether a HostFS operation may change the contents of a
+ * directory, or the information about its entries.
+ *
+ * @param state Emulator state
+ * @return Whether the operation may make a change
+ */
+static bool
+hostfs_op_may_modify(const ARMul_State *state)
+{
+  switch (state->Reg[9]) {
+  case 0: return state->Reg[0] != OPEN_MODE_READ; /* Open */
+  case 2: return true;  /* PutBytes */
+  case 3: return true;  /* Args */
+  case 4: return true;  /* Close */
+  case 5: return state->Reg[0] != 5 && state->Reg[0] != 255; /* File */
+  case 6: return state->Reg[0] == 8; /* Func, rename */
+  default: return false;
+  }
+}
+
 /**
  * Entry point when the HostFS SWI is issued. The ARM register R0 must contain
  * the HostFS operation.
@@ -2129,6 +2697,8 @@ hostfs_reset(void)
 void
 hostfs(ARMul_State *state)
 {
+  bool modifies;
+
   assert(state);
 
   /* Allow attempts to register regardless of current state */
@@ -2140,6 +2710,14 @@ hostfs(ARMul_State *state)
   /* Other HostFS operations depend on the current registration state */
   switch (hostfs_state) {
   case HOSTFS_STATE_REGISTERED:
+    modifies = hostfs_op_may_modify(state);
+
+    /* Operations other than those on open files look at the host files
+       directly, so must see the data held back from them */
+    if (open_file_dirty != 0 && state->Reg[9] > 4) {
+      hostfs_file_flush_all();
+    }
+
     switch (state->Reg[9]) {
     case 0: hostfs_open(state);     break;
     case 1: hostfs_getbytes(state); break;
@@ -2153,6 +2731,11 @@ hostfs(ARMul_State *state)
       error("!!! ERROR !!! - unknown op in R9\n");
       break;
     }
+
+    /* Directories read during the operation may now be out of date */
+    if (modifies) {
+      hostfs_dir_cache_unwatched_changed();
+    }
     break;
 
   case HOSTFS_STATE_UNREGISTERED:
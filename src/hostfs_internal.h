@@ -21,4 +21,8 @@ extern void hostfs_read_object_info_platform(const char *host_pathname, risc_os_
 
 extern void hostfs_object_set_timestamp_platform(const char *host_path, uint32_t load, uint32_t exec);
 
+extern int hostfs_dir_watch_add_platform(const char *host_dir_path);
+extern void hostfs_dir_watch_remove_platform(int watch);
+extern void hostfs_dir_watch_poll_platform(void (*changed)(int watch, int ended));
+
 #endif
@@ -0,0 +1,134 @@
+/*
+  RPCEmu - An Acorn system emulator
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Positioned transfers to and from host files
+
+   Used by the hard disc and CD-ROM images and by HostFS, which all read
+   and write files at given offsets and need whole transfers. This file
+   does not depend on the rest of the emulator, so it can be built into
+   the tools.
+*/
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#if defined WIN32 || defined _WIN32
+#include <io.h>
+#endif
+
+#include "hostio.h"
+
+#if defined WIN32 || defined _WIN32
+/* Windows has no pread()/pwrite(). Each descriptor is only used by one
+   thread at a time, so an lseek() followed by the transfer is equivalent.
+   Offsets stay 64-bit, as off_t is 32-bit there */
+static ssize_t
+host_pread(int fd, void *buf, size_t count, int64_t offset)
+{
+	if (_lseeki64(fd, offset, SEEK_SET) < 0) {
+		return -1;
+	}
+	return _read(fd, buf, (unsigned) count);
+}
+
+static ssize_t
+host_pwrite(int fd, const void *buf, size_t count, int64_t offset)
+{
+	if (_lseeki64(fd, offset, SEEK_SET) < 0) {
+		return -1;
+	}
+	return _write(fd, buf, (unsigned) count);
+}
+#else
+#define host_pread(fd, buf, count, offset)	pread(fd, buf, count, (off_t) (offset))
+#define host_pwrite(fd, buf, count, offset)	pwrite(fd, buf, count, (off_t) (offset))
+#endif /* _WIN32 */
+
+/**
+ * Read from a file at the given offset, retrying short and interrupted
+ * reads until all the data has been read or the end of the file is
+ * reached.
+ *
+ * @param fd     File descriptor
+ * @param buf    Buffer to fill
+ * @param len    Number of bytes to read
+ * @param offset Offset within the file
+ * @return Number of bytes read, less than len only at the end of the file,
+ *         or -1 on error with errno set
+ */
+ssize_t
+hostio_read(int fd, void *buf, size_t len, int64_t offset)
+{
+	uint8_t *p = buf;
+	size_t done = 0;
+
+	while (done < len) {
+		const ssize_t ret = host_pread(fd, p + done, len - done, offset + (int64_t) done);
+
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret < 0) {
+			return -1;
+		}
+		if (ret == 0) {
+			break;
+		}
+		done += (size_t) ret;
+	}
+	return (ssize_t) done;
+}
+
+/**
+ * Write to a file at the given offset, retrying short and interrupted
+ * writes until all the data has been written.
+ *
+ * @param fd     File descriptor
+ * @param buf    Data to write
+ * @param len    Number of bytes to write
+ * @param offset Offset within the file
+ * @return 0 on success, -1 on error with errno set
+ */
+int
+hostio_write(int fd, const void *buf, size_t len, int64_t offset)
+{
+	const uint8_t *p = buf;
+	size_t done = 0;
+
+	while (done < len) {
+		const ssize_t ret = host_pwrite(fd, p + done, len - done, offset + (int64_t) done);
+
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret < 0) {
+			return -1;
+		}
+		if (ret == 0) {
+			/* No progress and no reason given */
+			errno = EIO;
+			return -1;
+		}
+		done += (size_t) ret;
+	}
+	return 0;
+}
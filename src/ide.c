@@ -37,6 +37,8 @@ void callbackide(void);
 #include "mem.h"
 #include "iomd.h"
 #include "ide.h"
+#include "hdimage.h"
+#include "hdfile.h"
 #include "arm.h"
 
 /* Bits of 'atastat' */
@@ -69,7 +71,9 @@ void callbackide(void);
 #define GPCMD_MODE_SELECT_10		0x55
 #define GPCMD_MODE_SENSE_10		0x5a
 #define GPCMD_PAUSE_RESUME		0x4b
+#define GPCMD_PLAY_AUDIO_10		0x45
 #define GPCMD_PLAY_AUDIO_12		0xa5
+#define GPCMD_PLAY_AUDIO_MSF		0x47
 #define GPCMD_READ_CD			0xbe
 #define GPCMD_READ_HEADER		0x44
 #define GPCMD_READ_SUBCHANNEL		0x42
@@ -79,6 +83,7 @@ void callbackide(void);
 #define GPCMD_SEND_DVD_STRUCTURE	0xad
 #define GPCMD_SET_SPEED			0xbb
 #define GPCMD_START_STOP_UNIT		0x1b
+#define GPCMD_STOP_PLAY_SCAN		0x4e
 #define GPCMD_TEST_UNIT_READY		0x00
 
 /* Mode page codes for mode sense/set */
@@ -97,6 +102,10 @@ void callbackide(void);
 #define ASC_ILLEGAL_OPCODE		0x20
 #define ASC_MEDIUM_NOT_PRESENT		0x3a
 
+/* Callback delay used to check again for the completion of a hard disc
+   transfer running on the I/O thread */
+#define IDE_IO_POLL	10
+
 /* Tell RISC OS that we have a 4x CD-ROM drive (600kb/sec data, 706kb/sec raw).
    Not that it means anything */
 #define CDROM_SPEED	706
@@ -126,7 +135,6 @@ static struct
         unsigned char asc;
         int discchanged;
         int reset;
-        FILE *hdfile[2];
         int skip512[2];
         uint16_t buffer[65536];
 } ide;
@@ -225,6 +233,22 @@ ide_atapi_identify(void)
 	ide.buffer[49] = 0x200; /* LBA supported */
 }
 
+/**
+ * Convert a minute/second/frame address, which includes the 2 second
+ * lead-in, to a logical block address
+ *
+ * @param msf Minute, second and frame bytes
+ *
+ * @return Logical block address, 0 for addresses within the lead-in
+ */
+static uint32_t
+ide_atapi_msf_to_lba(const uint8_t *msf)
+{
+	const uint32_t frames = (msf[0] * 60u + msf[1]) * 75u + msf[2];
+
+	return (frames > 150) ? frames - 150 : 0;
+}
+
 /**
  * Fill in ide.buffer with the output of the ATAPI "MODE SENSE" command
  *
@@ -315,47 +339,10 @@ loadhd(int d, const char *filename)
 
 	snprintf(pathname, sizeof(pathname), "%s%s", rpcemu_get_userdir(), filename);
 
-	if (ide.hdfile[d] == NULL) {
-		/* Try to open existing hard disk image */
-		ide.hdfile[d] = fopen64(pathname, "rb+");
-		if (ide.hdfile[d] == NULL) {
-			/* Failed to open existing hard disk image */
-			if (errno == ENOENT) {
-				/* Failed because it does not exist,
-				   so try to create new file */
-				ide.hdfile[d] = fopen64(pathname, "wb+");
-				if (ide.hdfile[d] == NULL) {
-					fatal("Cannot create file '%s': %s",
-					      pathname, strerror(errno));
-				}
-			} else {
-				/* Failed for another reason */
-				fatal("Cannot open file '%s': %s",
-				      pathname, strerror(errno));
-			}
-		}
+	if (!hdimage_open(d, pathname)) {
+		fatal("%s", hdfile_error());
 	}
-
-        fseek(ide.hdfile[d], 0xfc1, SEEK_SET);
-        ide.spt[d] = getc(ide.hdfile[d]);
-        ide.hpc[d] = getc(ide.hdfile[d]);
-        ide.skip512[d] = 1;
-//        rpclog("First check - spt %i hpc %i\n",ide.spt[0],ide.hpc[0]);
-        if (!ide.spt[d] || !ide.hpc[d])
-        {
-                fseek(ide.hdfile[d], 0xdc1, SEEK_SET);
-                ide.spt[d] = getc(ide.hdfile[d]);
-                ide.hpc[d] = getc(ide.hdfile[d]);
-//                rpclog("Second check - spt %i hpc %i\n",ide.spt[0],ide.hpc[0]);
-                ide.skip512[d] = 0;
-                if (!ide.spt[d] || !ide.hpc[d])
-                {
-                        ide.spt[d]=63;
-                        ide.hpc[d]=16;
-                        ide.skip512[d] = 1;
-//        rpclog("Final check - spt %i hpc %i\n",ide.spt[0],ide.hpc[0]);
-                }
-        }
+	hdimage_geometry(d, &ide.spt[d], &ide.hpc[d], &ide.skip512[d]);
 }
 
 void resetide(void)
@@ -364,10 +351,7 @@ void resetide(void)
 
         /* Close hard disk image files (if previously open) */
         for (d = 0; d < 2; d++) {
-                if (ide.hdfile[d] != NULL) {
-                        fclose(ide.hdfile[d]);
-                        ide.hdfile[d] = NULL;
-                }
+                hdimage_close(d);
         }
 
         ide.atastat = READY_STAT;
@@ -378,6 +362,15 @@ void resetide(void)
 	}
 }
 
+/**
+ * Close the hard disc images, completing any outstanding writes
+ */
+void
+ide_close(void)
+{
+	hdimage_end();
+}
+
 void writeidew(uint16_t val)
 {
 #ifdef _RPCEMU_BIG_ENDIAN
@@ -640,8 +633,6 @@ uint16_t readidew(void)
 
 void callbackide(void)
 {
-        off64_t addr;
-        int c;
         if (ide.reset)
         {
                 ide.atastat = READY_STAT;
@@ -681,11 +672,11 @@ void callbackide(void)
                 if (IDE_DRIVE_IS_CDROM(ide)) {
                         goto abort_cmd;
                 }
-                addr = ide_get_sector() * 512;
-                fseeko64(ide.hdfile[ide.drive], addr, SEEK_SET);
-                if (fread(ide.buffer, 1, 512, ide.hdfile[ide.drive]) != 512) {
-                        // Beyond current extent of file - return zero data
-                        memset(ide.buffer, 0, 512);
+                /* Beyond current extent of file returns zero data */
+                if (!hdimage_read_sector(ide.drive, ide_get_sector(), ide.buffer, ide.secount)) {
+                        /* Still being read from the host */
+                        idecallback = IDE_IO_POLL;
+                        return;
                 }
                 ide.pos=0;
                 ide.atastat = DRQ_STAT;
@@ -696,9 +687,11 @@ void callbackide(void)
                 if (IDE_DRIVE_IS_CDROM(ide)) {
                         goto abort_cmd;
                 }
-                addr = ide_get_sector() * 512;
-                fseeko64(ide.hdfile[ide.drive], addr, SEEK_SET);
-                fwrite(ide.buffer, 512, 1, ide.hdfile[ide.drive]);
+                if (!hdimage_write_sectors(ide.drive, ide_get_sector(), 1, ide.buffer)) {
+                        /* I/O queue full, wait for it to drain */
+                        idecallback = IDE_IO_POLL;
+                        return;
+                }
                 ide_irq_raise();
                 ide.secount--;
                 if (ide.secount != 0) {
@@ -723,13 +716,14 @@ void callbackide(void)
                 if (IDE_DRIVE_IS_CDROM(ide)) {
                         goto abort_cmd;
                 }
-                addr = ide_get_sector() * 512;
-                fseeko64(ide.hdfile[ide.drive], addr, SEEK_SET);
-                memset(ide.buffer, 0, 512);
-                for (c=0;c<ide.secount;c++)
+                if (ide.secount > 0 &&
+                    !hdimage_write_sectors(ide.drive, ide_get_sector(), ide.secount, NULL))
                 {
-                        fwrite(ide.buffer, 512, 1, ide.hdfile[ide.drive]);
+                        /* I/O queue full, wait for it to drain */
+                        idecallback = IDE_IO_POLL;
+                        return;
                 }
+                memset(ide.buffer, 0, 512);
                 ide.atastat = READY_STAT;
                 ide_irq_raise();
                 return;
@@ -1050,13 +1044,43 @@ static void atapicommand(void)
                 }
                 return;
 
+        case GPCMD_PLAY_AUDIO_10:
         case GPCMD_PLAY_AUDIO_12:
+        case GPCMD_PLAY_AUDIO_MSF:
                 if (!atapi->ready()) { atapi_notready(); return; }
                 /*This is apparently deprecated in the ATAPI spec, and apparently
                   has been since 1995 (!). Hence I'm having to guess most of it*/
-                pos=(idebufferb[3]<<16)|(idebufferb[4]<<8)|idebufferb[5];
-                len=(idebufferb[7]<<16)|(idebufferb[8]<<8)|idebufferb[9];
-                atapi->playaudio(pos,len);
+                if (idebufferb[0] == GPCMD_PLAY_AUDIO_MSF) {
+                        /* Start and end as minute/second/frame, including
+                           the 2 second lead-in. A start of FF:FF:FF plays
+                           from the current position */
+                        const uint32_t end = ide_atapi_msf_to_lba(&idebufferb[6]);
+                        uint32_t start = ide_atapi_msf_to_lba(&idebufferb[3]);
+
+                        if (idebufferb[3] == 0xff && idebufferb[4] == 0xff && idebufferb[5] == 0xff) {
+                                /* Unlike reading the sub-channel, this leaves
+                                   any completion status to be reported */
+                                start = atapi->getposition();
+                        }
+                        atapi->playaudio(start, (end > start) ? end - start : 0);
+                } else {
+                        const uint32_t start = ((uint32_t) idebufferb[2] << 24) | (idebufferb[3] << 16) |
+                                               (idebufferb[4] << 8) | idebufferb[5];
+                        uint32_t length = (idebufferb[7] << 8) | idebufferb[8];
+
+                        if (idebufferb[0] == GPCMD_PLAY_AUDIO_12) {
+                                length = ((uint32_t) idebufferb[6] << 24) | (idebufferb[7] << 16) |
+                                         (idebufferb[8] << 8) | idebufferb[9];
+                        }
+                        atapi->playaudio(start, length);
+                }
+                ide.packetstatus=2;
+                idecallback=50;
+                break;
+
+        case GPCMD_STOP_PLAY_SCAN:
+                if (!atapi->ready()) { atapi_notready(); return; }
+                atapi->stop();
                 ide.packetstatus=2;
                 idecallback=50;
                 break;
@@ -1075,7 +1099,7 @@ static void atapicommand(void)
                 pos=0;
                 idebufferb[pos++]=0;
                 idebufferb[pos++]=0; /*Audio status*/
-                idebufferb[pos++]=0; idebufferb[pos++]=0; /*Subchannel length*/
+                idebufferb[pos++]=0; idebufferb[pos++]=12; /*Subchannel length*/
                 idebufferb[pos++]=1; /*Format code*/
                 idebufferb[1]=atapi->getcurrentsubchannel(&idebufferb[5],msf);
                 len=11+5;
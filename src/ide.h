@@ -27,6 +27,7 @@ extern uint8_t readide(uint16_t addr);
 extern uint16_t readidew(void);
 extern void callbackide(void);
 extern void resetide(void);
+extern void ide_close(void);
 
 /*ATAPI stuff*/
 typedef struct ATAPI
@@ -34,6 +35,7 @@ typedef struct ATAPI
         int (*ready)(void);
         int (*readtoc)(unsigned char *b, unsigned char starttrack, int msf);
         uint8_t (*getcurrentsubchannel)(uint8_t *b, int msf);
+        uint32_t (*getposition)(void);
         void (*readsector)(uint8_t *b, int sector);
         void (*playaudio)(uint32_t pos, uint32_t len);
         void (*seek)(uint32_t pos);
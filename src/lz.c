@@ -0,0 +1,212 @@
+/*
+  RPCEmu - An Acorn system emulator
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Byte-oriented LZ77 compression of blocks of data
+
+   Each sequence is a token byte holding a literal count and match length
+   in its upper and lower nibbles (15 meaning further length bytes follow),
+   the literals, then a 16-bit little-endian match offset. The final
+   sequence of a block has literals only.
+
+   Used for compressed hard disc and CD-ROM images. This file does not
+   depend on the rest of the emulator, so it can be built into the tools.
+*/
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_HASH_BITS		12
+#define LZ_MIN_MATCH		4
+#define LZ_MAX_OFFSET		65535
+
+/**
+ * Append one LZ sequence to a compressed block.
+ *
+ * @param dst       Output buffer
+ * @param op        Current length of output
+ * @param cap       Size of output buffer
+ * @param lit       Literal bytes
+ * @param lit_len   Number of literal bytes
+ * @param offset    Distance back to the match
+ * @param match_len Length of match, or 0 for the final sequence
+ * @return New length of output, or 0 if it would not fit
+ */
+static size_t
+lz_emit(uint8_t *dst, size_t op, size_t cap, const uint8_t *lit, size_t lit_len,
+               size_t offset, size_t match_len)
+{
+	const size_t extra = (match_len != 0) ? match_len - LZ_MIN_MATCH : 0;
+	size_t n;
+
+	if (op + 1 + lit_len / 255 + 1 + lit_len + 2 + extra / 255 + 1 > cap) {
+		return 0;
+	}
+
+	dst[op++] = (uint8_t) (((lit_len < 15) ? lit_len : 15) << 4 |
+	                       ((extra < 15) ? extra : 15));
+	if (lit_len >= 15) {
+		for (n = lit_len - 15; n >= 255; n -= 255) {
+			dst[op++] = 255;
+		}
+		dst[op++] = (uint8_t) n;
+	}
+	memcpy(dst + op, lit, lit_len);
+	op += lit_len;
+
+	if (match_len != 0) {
+		dst[op++] = (uint8_t) offset;
+		dst[op++] = (uint8_t) (offset >> 8);
+		if (extra >= 15) {
+			for (n = extra - 15; n >= 255; n -= 255) {
+				dst[op++] = 255;
+			}
+			dst[op++] = (uint8_t) n;
+		}
+	}
+	return op;
+}
+
+/**
+ * Compress a block.
+ *
+ * @param src Data to compress
+ * @param len Length of data
+ * @param dst Output buffer
+ * @param cap Size of output buffer
+ * @return Length of compressed data, or 0 if it would not fit in cap
+ */
+size_t
+lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+	uint32_t table[1 << LZ_HASH_BITS];
+	size_t ip = 0, anchor = 0, op = 0;
+
+	memset(table, 0, sizeof(table));
+
+	while (ip + LZ_MIN_MATCH <= len) {
+		uint32_t seq, ref_seq;
+		size_t ref, match_len;
+		uint32_t hash;
+
+		memcpy(&seq, src + ip, sizeof(seq));
+		hash = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+		ref = table[hash];
+		table[hash] = (uint32_t) ip;
+
+		memcpy(&ref_seq, src + ref, sizeof(ref_seq));
+		if (ref >= ip || ip - ref > LZ_MAX_OFFSET || ref_seq != seq) {
+			ip++;
+			continue;
+		}
+
+		match_len = LZ_MIN_MATCH;
+		while (ip + match_len < len && src[ref + match_len] == src[ip + match_len]) {
+			match_len++;
+		}
+		op = lz_emit(dst, op, cap, src + anchor, ip - anchor, ip - ref, match_len);
+		if (op == 0) {
+			return 0;
+		}
+		ip += match_len;
+		anchor = ip;
+	}
+
+	if (anchor < len) {
+		op = lz_emit(dst, op, cap, src + anchor, len - anchor, 0, 0);
+	}
+	return op;
+}
+
+/**
+ * Read an LZ length extension, adding it to a length.
+ *
+ * @param src Compressed data
+ * @param ip  Position in src, updated
+ * @param end Length of src
+ * @param len Length to add to
+ * @return 0 on success, -1 if the data is truncated
+ */
+static int
+lz_length(const uint8_t *src, size_t *ip, size_t end, size_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= end) {
+			return -1;
+		}
+		b = src[(*ip)++];
+		*len += b;
+	} while (b == 255);
+	return 0;
+}
+
+/**
+ * Decompress a block.
+ *
+ * @param src     Compressed data
+ * @param len     Length of compressed data
+ * @param dst     Output buffer
+ * @param out_len Expected length of the decompressed data
+ * @return 0 on success, -1 if the data is corrupt
+ */
+int
+lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t out_len)
+{
+	size_t ip = 0, op = 0;
+
+	while (ip < len) {
+		const uint8_t token = src[ip++];
+		size_t lit_len = token >> 4;
+		size_t match_len = (token & 15u) + LZ_MIN_MATCH;
+		size_t offset;
+
+		if (lit_len == 15 && lz_length(src, &ip, len, &lit_len) != 0) {
+			return -1;
+		}
+		if (lit_len > len - ip || lit_len > out_len - op) {
+			return -1;
+		}
+		memcpy(dst + op, src + ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+		if (ip == len) {
+			break;
+		}
+
+		if (len - ip < 2) {
+			return -1;
+		}
+		offset = (size_t) src[ip] | ((size_t) src[ip + 1] << 8);
+		ip += 2;
+		if (match_len == 15 + LZ_MIN_MATCH && lz_length(src, &ip, len, &match_len) != 0) {
+			return -1;
+		}
+		if (offset == 0 || offset > op || match_len > out_len - op) {
+			return -1;
+		}
+		/* The match may overlap the output, so copy a byte at a time */
+		for (; match_len > 0; match_len--, op++) {
+			dst[op] = dst[op - offset];
+		}
+	}
+
+	return (op == out_len) ? 0 : -1;
+}
@@ -20,6 +20,7 @@
 
 /* Memory handling */
 #include <assert.h>
+#include <string.h>
 
 #include "rpcemu.h"
 #include "vidc20.h"
@@ -879,3 +880,147 @@ writememfb(uint32_t addr, uint8_t val)
 	}
 	mem_phys_write8(phys_addr, val);
 }
+
+/**
+ * Get a host pointer through which a run of guest memory can be read
+ * directly, mapping pages into the read cache as required. The run ends
+ * where the next page is not directly readable or is not contiguous in
+ * host memory.
+ *
+ * @param addr Virtual address
+ * @param len  Maximum length of the run
+ * @param run  Filled in with the length of the run, or with the length up
+ *             to the end of the page if NULL is returned
+ * @return Host pointer to the byte at addr, or NULL if not directly readable
+ */
+const uint8_t *
+mem_read_run(uint32_t addr, size_t len, size_t *run)
+{
+	const uint8_t *p = mem_read_ptr(addr);
+	size_t n = 4096 - (addr & 0xfff);
+
+	assert(run != NULL);
+
+	if (p == NULL) {
+		/* Load the byte the slow way, which maps the page if it is RAM */
+		(void) mem_read8(addr);
+		p = mem_read_ptr(addr);
+	}
+	if (p != NULL) {
+		while (n < len) {
+			if (mem_read_ptr(addr + n) == NULL) {
+				(void) mem_read8(addr + n);
+			}
+			if (mem_read_ptr(addr + n) != p + n) {
+				break;
+			}
+			n += 4096;
+		}
+	}
+
+	*run = (n < len) ? n : len;
+	return p;
+}
+
+/**
+ * Get a host pointer through which a run of guest memory can be written
+ * directly, mapping pages into the write cache as required. The run ends
+ * where the next page is not directly writable or is not contiguous in
+ * host memory.
+ *
+ * @param addr Virtual address
+ * @param len  Maximum length of the run
+ * @param run  Filled in with the length of the run, or with the length up
+ *             to the end of the page if NULL is returned
+ * @return Host pointer to the byte at addr, or NULL if not directly writable
+ */
+uint8_t *
+mem_write_run(uint32_t addr, size_t len, size_t *run)
+{
+	uint8_t *p = mem_write_ptr(addr);
+	size_t n = 4096 - (addr & 0xfff);
+
+	assert(run != NULL);
+
+	if (p == NULL) {
+		/* Rewrite the byte the slow way, which maps the page if it is RAM */
+		mem_write8(addr, (uint8_t) mem_read8(addr));
+		p = mem_write_ptr(addr);
+	}
+	if (p != NULL) {
+		while (n < len) {
+			if (mem_write_ptr(addr + n) == NULL) {
+				mem_write8(addr + n, (uint8_t) mem_read8(addr + n));
+			}
+			if (mem_write_ptr(addr + n) != p + n) {
+				break;
+			}
+			n += 4096;
+		}
+	}
+
+	*run = (n < len) ? n : len;
+	return p;
+}
+
+/**
+ * Copy from the guest's logical address space into host memory, using
+ * memcpy() for each run of directly accessible pages.
+ *
+ * @param dest Host buffer
+ * @param addr Virtual address
+ * @param len  Number of bytes
+ */
+void
+mem_copy_from_guest(void *dest, uint32_t addr, size_t len)
+{
+	uint8_t *d = dest;
+
+	while (len > 0) {
+		size_t run, i;
+		const uint8_t *p = mem_read_run(addr, len, &run);
+
+		if (p != NULL) {
+			memcpy(d, p, run);
+		} else {
+			for (i = 0; i < run; i++) {
+				d[i] = (uint8_t) mem_read8(addr + i);
+			}
+		}
+
+		addr += run;
+		d += run;
+		len -= run;
+	}
+}
+
+/**
+ * Copy from host memory into the guest's logical address space, using
+ * memcpy() for each run of directly accessible pages.
+ *
+ * @param addr Virtual address
+ * @param src  Host buffer
+ * @param len  Number of bytes
+ */
+void
+mem_copy_to_guest(uint32_t addr, const void *src, size_t len)
+{
+	const uint8_t *s = src;
+
+	while (len > 0) {
+		size_t run, i;
+		uint8_t *p = mem_write_run(addr, len, &run);
+
+		if (p != NULL) {
+			memcpy(p, s, run);
+		} else {
+			for (i = 0; i < run; i++) {
+				mem_write8(addr + i, s[i]);
+			}
+		}
+
+		addr += run;
+		s += run;
+		len -= run;
+	}
+}
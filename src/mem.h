@@ -21,6 +21,7 @@
 #ifndef MEM_H
 #define MEM_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "rpcemu.h"
@@ -32,6 +33,11 @@ extern uint32_t readmemfb(uint32_t addr);
 extern void writememfb(uint32_t addr, uint8_t val);
 extern void writememfl(uint32_t addr, uint32_t val);
 
+extern const uint8_t *mem_read_run(uint32_t addr, size_t len, size_t *run);
+extern uint8_t *mem_write_run(uint32_t addr, size_t len, size_t *run);
+extern void mem_copy_from_guest(void *dest, uint32_t addr, size_t len);
+extern void mem_copy_to_guest(uint32_t addr, const void *src, size_t len);
+
 extern void clearmemcache(void);
 extern void mem_init(void);
 extern void mem_reset(uint32_t ramsize, uint32_t vram_size);
@@ -140,6 +146,57 @@ mem_write8(uint32_t addr, uint8_t val)
 	}
 }
 
+/**
+ * Get a host pointer through which guest memory can be read directly, up
+ * to the end of the page holding the address.
+ *
+ * Only pages that have already been accessed, and so have an entry in the
+ * read cache, can be read directly. A caller should access the first byte
+ * through mem_read8() and then try again, or use mem_read_run().
+ *
+ * @param addr Virtual address
+ * @return Host pointer to the byte at addr, or NULL if not directly readable
+ */
+static inline const uint8_t *
+mem_read_ptr(uint32_t addr)
+{
+#ifdef _RPCEMU_BIG_ENDIAN
+	/* Bytes are not in address order within each word */
+	NOT_USED(addr);
+	return NULL;
+#else
+	if (vraddrl[addr >> 12] & 1) {
+		return NULL;
+	}
+	return (const uint8_t *) (addr + vraddrl[addr >> 12]);
+#endif
+}
+
+/**
+ * Get a host pointer through which guest memory can be written directly,
+ * up to the end of the page holding the address.
+ *
+ * Only pages that have already been written, and so have an entry in the
+ * write cache, can be written directly. A caller should write the first
+ * byte through mem_write8() and then try again, or use mem_write_run().
+ *
+ * @param addr Virtual address
+ * @return Host pointer to the byte at addr, or NULL if not directly writable
+ */
+static inline uint8_t *
+mem_write_ptr(uint32_t addr)
+{
+#ifdef _RPCEMU_BIG_ENDIAN
+	NOT_USED(addr);
+	return NULL;
+#else
+	if (vwaddrl[addr >> 12] & 3) {
+		return NULL;
+	}
+	return (uint8_t *) (addr + vwaddrl[addr >> 12]);
+#endif
+}
+
 /**
  * Read a 32-bit word from a virtual address with User mode privileges.
  *
@@ -32,28 +32,54 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pwd.h>
 #include <grp.h>
-#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #ifndef __EMSCRIPTEN__
 #include <linux/if_tun.h>
 #include <linux/sockios.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #endif
 
 #include "rpcemu.h"
 #include "mem.h"
 #include "podules.h"
 #include "network.h"
+#include "network-queue.h"
 
 /* The opened tunnel device */
 static int tunfd = -1;
 
-/* Max packet is 1500 bytes plus headers */
-static unsigned char buffer[1522];
+/* Frames pass between the emulator thread and a worker thread, which waits
+   on the tunnel device with epoll and reads every frame that is ready each
+   time it wakes. Neither thread blocks on the other, and the receive
+   interrupt is raised from network_plt_poll() rather than a signal. */
+static struct {
+    NetworkQueue tx;            /* Frames from the guest, for the device */
+    NetworkQueue rx;            /* Frames from the device, for the guest */
+
+    uint32_t irqstatus;         /* Pointer to a word in RMA, used as the IRQ status register */
+    int irq_raised;             /* IRQ raised and frames not yet all taken by the guest */
+
+    pthread_t thread;
+    int thread_running;
+    atomic_int stop;            /* Worker thread has been asked to exit, or has failed */
+    atomic_int sleeping;        /* Worker thread is waiting, or about to */
+    atomic_int wake_pending;    /* Work for the worker thread since it last looked */
+    atomic_int rx_blocked;      /* Worker thread is waiting for space in the rx queue */
+    int epoll_fd;               /* epoll instance of the worker thread, or -1 */
+    int wake_fd;                /* eventfd used to wake the worker thread, or -1 */
+} tap = {
+    .epoll_fd = -1,
+    .wake_fd = -1,
+};
 
 /**
  * Given a system username, lookup their uid and gid
@@ -207,7 +233,312 @@ static int tun_alloc(void)
 #endif
 }
 
-#define HEADERLEN 18
+/* The tunnel device prefixes each frame with 4 bytes of flags and protocol */
+#define PREAMBLELEN 4
+
+/* Destination and source addresses, and frame type */
+#define HEADERLEN 14
+
+/**
+ * Make sure the worker thread looks for new work, waking it if it is
+ * waiting. Called from the emulator thread.
+ */
+static void
+tap_wake(void)
+{
+    atomic_store(&tap.wake_pending, 1);
+    if (!atomic_exchange(&tap.sleeping, 0)) {
+        return;
+    }
+
+#ifndef __EMSCRIPTEN__
+    {
+        const uint64_t one = 1;
+
+        (void) write(tap.wake_fd, &one, sizeof(one));
+    }
+#endif
+}
+
+#ifndef __EMSCRIPTEN__
+/**
+ * Write the frames sent by the guest to the device. Called on the worker
+ * thread.
+ *
+ * @return 1 if the device cannot take more frames yet, else 0
+ */
+static int
+tap_send_queued(void)
+{
+    static const uint8_t preamble[PREAMBLELEN] = { 0, 0, 0, 0 };
+    const NetworkFrame *frame;
+
+    while ((frame = network_queue_peek(&tap.tx)) != NULL) {
+        struct iovec iov[2];
+
+        iov[0].iov_base = (void *) preamble;
+        iov[0].iov_len = sizeof(preamble);
+        iov[1].iov_base = (void *) frame->data;
+        iov[1].iov_len = frame->len;
+
+        if (writev(tunfd, iov, 2) == -1) {
+            if (errno == EAGAIN) {
+                return 1;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            rpclog("Networking: error sending frame: %s\n", strerror(errno));
+        }
+        network_queue_pop(&tap.tx);
+    }
+
+    return 0;
+}
+
+/**
+ * Read every frame the device has ready into the rx queue. Called on the
+ * worker thread.
+ *
+ * @return 1 if the rx queue is full, -1 on a device error, else 0
+ */
+static int
+tap_receive_queued(void)
+{
+    uint8_t preamble[PREAMBLELEN];
+
+    for (;;) {
+        NetworkFrame *frame = network_queue_space(&tap.rx);
+        struct iovec iov[2];
+        ssize_t ret;
+
+        if (frame == NULL) {
+            // Announce the wait for space before looking again, so that
+            // a frame taken in between is sure to wake the thread
+            atomic_store(&tap.rx_blocked, 1);
+            frame = network_queue_space(&tap.rx);
+            if (frame == NULL) {
+                return 1;
+            }
+            atomic_store(&tap.rx_blocked, 0);
+        }
+
+        iov[0].iov_base = preamble;
+        iov[0].iov_len = sizeof(preamble);
+        iov[1].iov_base = frame->data;
+        iov[1].iov_len = sizeof(frame->data);
+
+        ret = readv(tunfd, iov, 2);
+        if (ret == -1) {
+            if (errno == EAGAIN) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            rpclog("Networking: error receiving frame: %s\n", strerror(errno));
+            return -1;
+        }
+
+        // Frames too short to carry a payload are not passed on
+        if (ret > PREAMBLELEN + HEADERLEN) {
+            frame->len = (uint32_t) (ret - PREAMBLELEN);
+            network_queue_push(&tap.rx);
+        }
+    }
+}
+
+/**
+ * Worker thread: move frames between the device and the queues, sleeping
+ * in epoll until the device or the emulator thread has more for it.
+ */
+static void *
+tap_thread(void *p)
+{
+    uint32_t events = EPOLLIN;
+
+    NOT_USED(p);
+
+    while (!atomic_load(&tap.stop)) {
+        struct epoll_event ev[2];
+        uint32_t want = 0;
+        int timeout = -1;
+        int n, i, rx;
+
+        if (tap_send_queued()) {
+            want |= EPOLLOUT;
+        }
+        rx = tap_receive_queued();
+        if (rx < 0) {
+            break;
+        }
+        if (rx == 0) {
+            want |= EPOLLIN;
+        }
+
+        // Only watch for what can be acted on, as epoll is level-triggered
+        if (want != events) {
+            struct epoll_event mod;
+
+            memset(&mod, 0, sizeof(mod));
+            mod.events = want;
+            mod.data.fd = tunfd;
+            epoll_ctl(tap.epoll_fd, EPOLL_CTL_MOD, tunfd, &mod);
+            events = want;
+        }
+
+        // Announce the wait before the last look for work, so that work
+        // arriving in between is sure to wake the thread
+        atomic_store(&tap.sleeping, 1);
+        if (atomic_exchange(&tap.wake_pending, 0)) {
+            timeout = 0;
+        }
+
+        n = epoll_wait(tap.epoll_fd, ev, 2, timeout);
+        atomic_store(&tap.sleeping, 0);
+
+        for (i = 0; i < n; i++) {
+            if (ev[i].data.fd == tap.wake_fd) {
+                uint64_t count;
+
+                (void) read(tap.wake_fd, &count, sizeof(count));
+            }
+        }
+    }
+
+    // Let the emulator thread know no more frames will be taken
+    atomic_store(&tap.stop, 1);
+    return NULL;
+}
+
+/**
+ * Close the worker thread's event handles, if open.
+ */
+static void
+tap_close_handles(void)
+{
+    if (tap.epoll_fd != -1) {
+        close(tap.epoll_fd);
+        tap.epoll_fd = -1;
+    }
+    if (tap.wake_fd != -1) {
+        close(tap.wake_fd);
+        tap.wake_fd = -1;
+    }
+}
+#endif /* !__EMSCRIPTEN__ */
+
+/**
+ * Start the worker thread, once the device is open.
+ *
+ * @return Non-zero on success
+ */
+static int
+tap_thread_start(void)
+{
+#ifdef __EMSCRIPTEN__
+    return 0;
+#else
+    struct epoll_event ev;
+
+    atomic_store(&tap.stop, 0);
+
+    tap.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    tap.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (tap.epoll_fd < 0 || tap.wake_fd < 0) {
+        error("Networking: unable to create event handles: %s", strerror(errno));
+        tap_close_handles();
+        return 0;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = tap.wake_fd;
+    if (epoll_ctl(tap.epoll_fd, EPOLL_CTL_ADD, tap.wake_fd, &ev) != 0) {
+        error("Networking: unable to create event handles: %s", strerror(errno));
+        tap_close_handles();
+        return 0;
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = tunfd;
+    if (epoll_ctl(tap.epoll_fd, EPOLL_CTL_ADD, tunfd, &ev) != 0) {
+        error("Networking: unable to watch network device: %s", strerror(errno));
+        tap_close_handles();
+        return 0;
+    }
+
+    if (pthread_create(&tap.thread, NULL, tap_thread, NULL)) {
+        error("Networking: unable to create network thread");
+        tap_close_handles();
+        return 0;
+    }
+    tap.thread_running = 1;
+    return 1;
+#endif
+}
+
+/**
+ * Stop the worker thread and release its event handles.
+ */
+static void
+tap_thread_stop(void)
+{
+#ifndef __EMSCRIPTEN__
+    if (tap.thread_running) {
+        const uint64_t one = 1;
+
+        atomic_store(&tap.stop, 1);
+        (void) write(tap.wake_fd, &one, sizeof(one));
+        pthread_join(tap.thread, NULL);
+        tap.thread_running = 0;
+    }
+    tap_close_handles();
+#endif
+
+    atomic_store(&tap.tx.head, 0);
+    atomic_store(&tap.tx.tail, 0);
+    atomic_store(&tap.rx.head, 0);
+    atomic_store(&tap.rx.tail, 0);
+    atomic_store(&tap.rx_blocked, 0);
+    atomic_store(&tap.wake_pending, 0);
+    atomic_store(&tap.sleeping, 0);
+    tap.irq_raised = 0;
+}
+
+/**
+ * Get the slot to fill with the next frame for the device. Called from the
+ * emulator thread, which never waits for the worker thread; if the queue
+ * is full the worker is woken to drain it and the frame is refused.
+ *
+ * @return Slot, or NULL if the queue is full or the worker thread has stopped
+ */
+static NetworkFrame *
+tap_tx_space(void)
+{
+    NetworkFrame *frame;
+
+    if (atomic_load(&tap.stop)) {
+        return NULL;
+    }
+    frame = network_queue_space(&tap.tx);
+    if (frame == NULL) {
+        tap_wake();
+    }
+    return frame;
+}
+
+/**
+ * Free the slot of a frame taken from the rx queue, letting the worker
+ * thread know if it was waiting for space. Called from the emulator thread.
+ */
+static void
+tap_rx_pop(void)
+{
+    network_queue_pop(&tap.rx);
+    if (atomic_exchange(&tap.rx_blocked, 0)) {
+        tap_wake();
+    }
+}
 
 /* Transmit data
    errbuf - pointer to buffer to return error string
@@ -220,36 +551,32 @@ static int tun_alloc(void)
 uint32_t
 network_plt_tx(uint32_t errbuf, uint32_t mbufs, uint32_t dest, uint32_t src, uint32_t frametype)
 {
-    unsigned char *buf = buffer;
+    NetworkFrame *frame;
+    unsigned char *buf;
     struct mbuf txb;
     size_t packetlength;
-    int ret;
-    int i;
 
-    if (tunfd == -1) {
+    if (tunfd == -1 || (frame = tap_tx_space()) == NULL) {
         strcpyfromhost(errbuf, "RPCEmu: Networking not available");
         return errbuf;
     }
+    buf = frame->data;
 
     /* Ethernet packet is
-       4 bytes preamble
        6 bytes destination MAC address
        6 bytes source MAC address
        2 bytes frame type (Ethernet II) or length (IEEE 802.3)
        up to 1500 bytes payload
+       The worker thread adds the 4 byte preamble the device expects.
     */
 
-    for (i = 0; i < 4; i++) *buf++ = 0;
-
     memcpytohost(buf, dest, 6);
     buf += 6;
 
     if (src) {
         memcpytohost(buf, src, 6);
     } else {
-        for (i = 0; i < 6; i++) {
-            buf[i] = network_hwaddr[i];
-        }
+        memcpy(buf, network_hwaddr, 6);
     }
     buf += 6;
 
@@ -258,12 +585,11 @@ network_plt_tx(uint32_t errbuf, uint32_t mbufs, uint32_t dest, uint32_t src, uin
 
     packetlength = HEADERLEN;
 
-
     /* Copy the mbuf chain as the payload */
     while (mbufs) {
         memcpytohost(&txb, mbufs, sizeof(struct mbuf));
         packetlength += txb.m_len;
-        if (packetlength > sizeof(buffer)) {
+        if (packetlength > sizeof(frame->data)) {
             strcpyfromhost(errbuf, "RPCEmu: Packet too large to send");
             return errbuf;
         }
@@ -272,13 +598,9 @@ network_plt_tx(uint32_t errbuf, uint32_t mbufs, uint32_t dest, uint32_t src, uin
         mbufs = txb.m_next;
     }
 
-    do {
-        ret = write(tunfd, buffer, packetlength);
-    } while ((ret == -1) && (errno == EAGAIN));
-    if (ret == -1) {
-        strcpyfromhost(errbuf, strerror(errno));
-        return errbuf;
-    }
+    frame->len = (uint32_t) packetlength;
+    network_queue_push(&tap.tx);
+    tap_wake();
 
     return 0;
 }
@@ -286,9 +608,10 @@ network_plt_tx(uint32_t errbuf, uint32_t mbufs, uint32_t dest, uint32_t src, uin
 uint32_t
 network_plt_rx(uint32_t errbuf, uint32_t mbuf, uint32_t rxhdr, uint32_t *dataavail)
 {
+    const NetworkFrame *frame;
     struct mbuf rxb;
     struct rx_hdr hdr;
-    int packetlength;
+    size_t packetlength;
 
     *dataavail = 0;
 
@@ -297,106 +620,76 @@ network_plt_rx(uint32_t errbuf, uint32_t mbuf, uint32_t rxhdr, uint32_t *dataava
         return errbuf;
     }
 
+    frame = network_queue_peek(&tap.rx);
+    if (frame == NULL) {
+        /* The driver has taken everything, so the next frame needs an IRQ */
+        tap.irq_raised = 0;
+        return 0;
+    }
+
+    if (mbuf == 0) {
+        return 0;
+    }
+
     memset(&hdr, 0, sizeof(hdr));
 
-    packetlength = read(tunfd, buffer, sizeof(buffer));
-    if (packetlength == -1) {
-        if (errno == EAGAIN) return 0;
-        strcpyfromhost(errbuf, strerror(errno));
+    /* Fill in recieved header structure */
+    memcpy(hdr.rx_dst_addr, frame->data + 0, 6);
+    memcpy(hdr.rx_src_addr, frame->data + 6, 6);
+    hdr.rx_frame_type = (frame->data[12] << 8) | frame->data[13];
+    hdr.rx_error_level = 0;
+
+    packetlength = frame->len - HEADERLEN;
+
+    memcpytohost(&rxb, mbuf, sizeof(rxb));
+
+    if (packetlength > rxb.m_inilen) {
+        strcpyfromhost(errbuf, "RPCEmu: Mbuf too small for received packet");
+        tap_rx_pop();
         return errbuf;
     }
-        
-    if (mbuf && packetlength > HEADERLEN) {
-        unsigned char *payload = buffer + HEADERLEN;
 
-        /* Fill in recieved header structure */
-        memcpy(hdr.rx_dst_addr, buffer + 4, 6);
-        memcpy(hdr.rx_src_addr, buffer + 10, 6);
-        hdr.rx_frame_type = (buffer[16] << 8) | buffer[17];
-        hdr.rx_error_level = 0;
-        memcpyfromhost(rxhdr, &hdr, sizeof(hdr));
+    memcpyfromhost(rxhdr, &hdr, sizeof(hdr));
 
-        packetlength -= HEADERLEN;
-        
-        memcpytohost(&rxb, mbuf, sizeof(rxb));
+    /* Copy payload in to the mbuf */
+    rxb.m_off = rxb.m_inioff;
+    memcpyfromhost(mbuf + rxb.m_off, frame->data + HEADERLEN, packetlength);
+    rxb.m_len = packetlength;
+    memcpyfromhost(mbuf, &rxb, sizeof(rxb));
 
-        if ((size_t) packetlength > rxb.m_inilen) {
-            strcpyfromhost(errbuf, "RPCEmu: Mbuf too small for received packet");
-            return errbuf;
-        } else {
-            /* Copy payload in to the mbuf */
-            rxb.m_off = rxb.m_inioff;
-            memcpyfromhost(mbuf + rxb.m_off, payload, packetlength);
-            rxb.m_len = packetlength;
-            memcpyfromhost(mbuf, &rxb, sizeof(rxb));
-
-            *dataavail = 1;
-        }
-    }
+    *dataavail = 1;
+
+    tap_rx_pop();
 
     return 0;
 }
 
-// Pointer to a word in RMA, used as the IRQ status register
-static uint32_t irqstatus = 0;
-
-static void
-sig_io(int sig)
+/**
+ * Raise the receive interrupt if frames have arrived for the guest. Called
+ * regularly from the emulator thread.
+ */
+void
+network_plt_poll(void)
 {
-    NOT_USED(sig);
-
-    mem_write8(irqstatus, 1);
-    if (network_poduleinfo != NULL) {
-        network_poduleinfo->irq = 1;
+    if (tap.irq_raised || tap.irqstatus == 0 || network_poduleinfo == NULL ||
+        network_queue_peek(&tap.rx) == NULL)
+    {
+        return;
     }
+
+    /* The driver takes frames until there are none left, after which
+       the next frame raises the IRQ again */
+    tap.irq_raised = 1;
+    mem_write8(tap.irqstatus, 1);
+    network_poduleinfo->irq = 1;
     rethinkpoduleints();
 }
 
-
 void
 network_plt_setirqstatus(uint32_t address)
 {
-    struct sigaction sa;
-    int flags;
-
-    memset(&sa, 0, sizeof(sa));
-
-    if ((flags = fcntl(tunfd, F_GETFL)) == -1) {
-        error("Error getting flags for network device: %s", strerror(errno));
-        return;
-    }
-
-    if (irqstatus) {
-        if (fcntl(tunfd, F_SETFL, flags & ~O_ASYNC) == -1) {
-            error("Error disabling SIGIO for network device: %s",
-                  strerror(errno));
-            return;
-        }
-
-        sa.sa_handler = SIG_DFL;
-
-        if (sigaction(SIGIO, &sa, NULL) == -1) {
-            error("Error uninstalling SIGIO handler: %s", strerror(errno));
-            return;
-        }
-    }
-
-    irqstatus = address;
-
-    if (irqstatus) {
-        sa.sa_handler = sig_io;
-
-        if (sigaction(SIGIO, &sa, NULL) == -1) {
-            error("Error installing SIGIO handler: %s", strerror(errno));
-            return;
-        }
-
-        if (fcntl(tunfd, F_SETFL, flags | O_ASYNC) == -1) {
-            error("Error enabling SIGIO for network device: %s",
-                  strerror(errno));
-            return;
-        }
-    }
+    tap.irqstatus = address;
+    tap.irq_raised = 0;
 }
 
 int
@@ -438,7 +731,7 @@ network_plt_init(void)
         rpclog("Networking: Dropping runtime privileges back to '%s'\n", user);
     }
 
-    if (tunfd != -1) {
+    if (tunfd != -1 && tap_thread_start()) {
         return 1;
     } else {
         return 0;
@@ -454,6 +747,8 @@ network_plt_init(void)
 void
 network_plt_reset(void)
 {
+	tap_thread_stop();
+
 	if (tunfd != -1) {
 		close(tunfd);
 		tunfd = -1;
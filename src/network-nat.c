@@ -1,17 +1,45 @@
+/* NAT networking through slirp
+
+   Slirp runs on its own thread, so the guest's network traffic does not
+   depend on how often the emulator loop comes round. On Linux the thread
+   waits on its sockets with epoll, for as long as slirp's timers allow.
+   Elsewhere it uses select(), waking at least every millisecond while
+   sockets are open.
+
+   Ethernet frames pass between the emulator thread and the slirp thread
+   through a pair of single-producer single-consumer queues, so neither
+   side takes a lock to send or receive. The emulator thread raises the
+   receive interrupt from network_nat_poll() when frames are waiting.
+
+   Slirp itself is not thread-safe; nat.mutex is held by the slirp thread
+   whenever it is inside slirp, and by the emulator thread while changing
+   port forwarding rules. */
+
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 
+#if defined __linux__ && !defined __EMSCRIPTEN__
+#define NAT_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 #include "rpcemu.h"
 #include "mem.h"
 #include "network.h"
 #include "network-nat.h"
+#include "network-queue.h"
 #include "podules.h"
 
 #include "slirp/libslirp.h"
@@ -20,19 +48,79 @@
 
 #define HEADERLEN	14
 
+#define NAT_EPOLL_EVENTS	64	/**< Events collected by one epoll_wait() */
+#define NAT_SELECT_WAIT_MS	1	/**< Longest wait in select(), which cannot be woken */
+#define NAT_IDLE_WAIT_MS	500	/**< Longest wait when slirp has no timers due */
+
 static struct {
 	Slirp		*slirp;
 
-	uint32_t	irq_status;	///< Address of a word in RAM, used as the IRQ status register
+	atomic_uint	irq_status;	///< Address of a word in RAM, used as the IRQ status register
 
-	uint8_t		buffer[2048];
+	int		irq_raised;	///< IRQ raised and frames not yet all taken by the guest
 
-	size_t		buffer_len;
+	NetworkQueue	tx;		///< Frames from the guest, for slirp
+	NetworkQueue	rx;		///< Frames from slirp, for the guest
 
 	FILE		*capture;	///< Handle for debug capture file, or NULL if not in use
 
 	struct in_addr	forward_addr;	///< Which IP address to apply NAT forward rules to
-} nat;
+
+	pthread_t	thread;
+	int		thread_running;
+	atomic_int	stop;		///< Slirp thread has been asked to exit
+	pthread_mutex_t	mutex;		///< Held while using slirp
+
+	atomic_int	sleeping;	///< Slirp thread is waiting, or about to
+	atomic_int	wake_pending;	///< Work for the slirp thread since it last looked
+	atomic_int	rx_blocked;	///< Slirp has frames waiting for space in the rx queue
+
+#ifdef NAT_EPOLL
+	int		epoll_fd;	///< epoll instance of the slirp thread, or -1
+	int		wake_fd;	///< eventfd used to wake the slirp thread, or -1
+	uint32_t	epoll_mask[FD_SETSIZE]; ///< Events each descriptor is registered for
+	int		epoll_last;	///< Highest descriptor that may be registered
+#else
+	pthread_mutex_t	wake_mutex;
+	pthread_cond_t	wake_cond;
+	int		wake;		///< Set under wake_mutex to end a wait
+#endif
+} nat = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+#ifdef NAT_EPOLL
+	.epoll_fd = -1,
+	.wake_fd = -1,
+#else
+	.wake_mutex = PTHREAD_MUTEX_INITIALIZER,
+	.wake_cond = PTHREAD_COND_INITIALIZER,
+#endif
+};
+
+/**
+ * Make sure the slirp thread looks for new work, waking it if it is
+ * waiting. Called from the emulator thread.
+ */
+static void
+network_nat_wake(void)
+{
+	atomic_store(&nat.wake_pending, 1);
+	if (!atomic_exchange(&nat.sleeping, 0)) {
+		return;
+	}
+
+#ifdef NAT_EPOLL
+	{
+		const uint64_t one = 1;
+
+		(void) write(nat.wake_fd, &one, sizeof(one));
+	}
+#else
+	pthread_mutex_lock(&nat.wake_mutex);
+	nat.wake = 1;
+	pthread_cond_signal(&nat.wake_cond);
+	pthread_mutex_unlock(&nat.wake_mutex);
+#endif
+}
 
 static void
 write16(FILE *f, uint16_t x)
@@ -95,36 +183,372 @@ write_packet(FILE *f, const void *data, size_t data_len)
 }
 
 /**
+ * Called by slirp, on the slirp thread, with a frame for the guest.
  */
 void
 slirp_output(void *opaque, const uint8_t *pkt, int pkt_len)
 {
+	NetworkFrame *frame;
+
 	NOT_USED(opaque);
 
 	// Write to capture file for debug
 	write_packet(nat.capture, pkt, pkt_len);
 
-	if (nat.irq_status == 0 || network_poduleinfo == NULL) {
+	if (atomic_load(&nat.irq_status) == 0) {
 		// Not set-up to generate IRQ
 		return;
 	}
 
-	memcpy(nat.buffer, pkt, pkt_len);
-	nat.buffer_len = pkt_len;
+	frame = network_queue_space(&nat.rx);
+	if (frame == NULL || pkt_len > NETWORK_FRAME_MAX) {
+		return;
+	}
 
-	mem_write8(nat.irq_status, 1);
-	network_poduleinfo->irq = 1;
-	rethinkpoduleints();
+	memcpy(frame->data, pkt, pkt_len);
+	frame->len = (uint32_t) pkt_len;
+	network_queue_push(&nat.rx);
 }
 
 /**
+ * Called by slirp, on the slirp thread, to check whether slirp_output()
+ * can accept a frame.
  */
 int
 slirp_can_output(void *opaque)
 {
 	NOT_USED(opaque);
 
-	return (nat.buffer_len == 0);
+	// Mark as blocked before looking, so that a frame taken by the
+	// emulator thread in between is sure to wake this thread
+	atomic_store(&nat.rx_blocked, 1);
+	if (network_queue_space(&nat.rx) == NULL) {
+		return 0;
+	}
+	atomic_store(&nat.rx_blocked, 0);
+	return 1;
+}
+
+/**
+ * Called by slirp, on the slirp thread, before it closes a socket.
+ *
+ * @param fd Socket descriptor
+ */
+void
+slirp_socket_closed(int fd)
+{
+#ifdef NAT_EPOLL
+	// Closing removes the descriptor from the epoll set, and it may be
+	// reused by the next socket slirp opens
+	if (fd >= 0 && fd < FD_SETSIZE) {
+		nat.epoll_mask[fd] = 0;
+	}
+#else
+	NOT_USED(fd);
+#endif
+}
+
+#ifdef NAT_EPOLL
+/**
+ * Bring the epoll set into line with the descriptors slirp wants watched,
+ * wait for events, and convert them back into descriptor sets for slirp.
+ * Called with nat.mutex held, which is released during the wait.
+ *
+ * @param fd_max  Highest descriptor in the sets, or -1 if none
+ * @param rfds    Descriptors to watch for reading, replaced by those ready
+ * @param wfds    Descriptors to watch for writing, replaced by those ready
+ * @param efds    Descriptors to watch for urgent data, replaced by those ready
+ * @param timeout Longest wait in milliseconds, or -1 for no limit
+ * @return Number of events, 0 on timeout or -1 on error
+ */
+static int
+network_nat_wait(int fd_max, fd_set *rfds, fd_set *wfds, fd_set *efds, int timeout)
+{
+	struct epoll_event events[NAT_EPOLL_EVENTS];
+	const int last = (fd_max > nat.epoll_last) ? fd_max : nat.epoll_last;
+	int fd, ret, i;
+
+	for (fd = 0; fd <= last; fd++) {
+		uint32_t want = 0;
+
+		if (fd <= fd_max) {
+			if (FD_ISSET(fd, rfds)) {
+				want |= EPOLLIN;
+			}
+			if (FD_ISSET(fd, wfds)) {
+				want |= EPOLLOUT;
+			}
+			if (FD_ISSET(fd, efds)) {
+				want |= EPOLLPRI;
+			}
+		}
+		if (want != nat.epoll_mask[fd]) {
+			struct epoll_event ev;
+
+			memset(&ev, 0, sizeof(ev));
+			ev.events = want;
+			ev.data.fd = fd;
+			if (want == 0) {
+				(void) epoll_ctl(nat.epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+			} else if (nat.epoll_mask[fd] == 0 ||
+			           epoll_ctl(nat.epoll_fd, EPOLL_CTL_MOD, fd, &ev) != 0)
+			{
+				(void) epoll_ctl(nat.epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+			}
+			nat.epoll_mask[fd] = want;
+		}
+	}
+	nat.epoll_last = fd_max;
+
+	FD_ZERO(rfds);
+	FD_ZERO(wfds);
+	FD_ZERO(efds);
+
+	pthread_mutex_unlock(&nat.mutex);
+	ret = epoll_wait(nat.epoll_fd, events, NAT_EPOLL_EVENTS, timeout);
+	pthread_mutex_lock(&nat.mutex);
+
+	for (i = 0; i < ret; i++) {
+		const uint32_t got = events[i].events;
+		uint32_t want;
+
+		fd = events[i].data.fd;
+		if (fd == nat.wake_fd) {
+			uint64_t count;
+
+			(void) read(nat.wake_fd, &count, sizeof(count));
+			continue;
+		}
+
+		// Errors and hang-ups show as ready, as they do with select()
+		want = nat.epoll_mask[fd];
+		if ((got & (EPOLLIN | EPOLLERR | EPOLLHUP)) && (want & EPOLLIN)) {
+			FD_SET(fd, rfds);
+		}
+		if ((got & (EPOLLOUT | EPOLLERR | EPOLLHUP)) && (want & EPOLLOUT)) {
+			FD_SET(fd, wfds);
+		}
+		if ((got & EPOLLPRI) && (want & EPOLLPRI)) {
+			FD_SET(fd, efds);
+		}
+	}
+	if (ret < 0 && errno == EINTR) {
+		ret = 0;
+	}
+	return ret;
+}
+#else
+/**
+ * Wait for the descriptors slirp wants watched to become ready. Called
+ * with nat.mutex held, which is released during the wait.
+ *
+ * @param fd_max  Highest descriptor in the sets, or -1 if none
+ * @param rfds    Descriptors to watch for reading, replaced by those ready
+ * @param wfds    Descriptors to watch for writing, replaced by those ready
+ * @param efds    Descriptors to watch for urgent data, replaced by those ready
+ * @param timeout Longest wait in milliseconds, or -1 for no limit
+ * @return Number of descriptors ready, 0 on timeout or -1 on error
+ */
+static int
+network_nat_wait(int fd_max, fd_set *rfds, fd_set *wfds, fd_set *efds, int timeout)
+{
+	struct timespec ts;
+
+	if (fd_max >= 0) {
+		// select() cannot be woken by the emulator thread, so keep the
+		// wait short
+		struct timeval tv;
+		int ret;
+
+		if (timeout < 0 || timeout > NAT_SELECT_WAIT_MS) {
+			timeout = NAT_SELECT_WAIT_MS;
+		}
+		tv.tv_sec = 0;
+		tv.tv_usec = timeout * 1000;
+
+		pthread_mutex_unlock(&nat.mutex);
+		ret = select(fd_max + 1, rfds, wfds, efds, &tv);
+		pthread_mutex_lock(&nat.mutex);
+		return ret;
+	}
+
+	if (timeout < 0) {
+		timeout = NAT_IDLE_WAIT_MS;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout / 1000;
+	ts.tv_nsec += (long) (timeout % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	FD_ZERO(rfds);
+	FD_ZERO(wfds);
+	FD_ZERO(efds);
+
+	pthread_mutex_unlock(&nat.mutex);
+	pthread_mutex_lock(&nat.wake_mutex);
+	while (!nat.wake) {
+		if (pthread_cond_timedwait(&nat.wake_cond, &nat.wake_mutex, &ts) == ETIMEDOUT) {
+			break;
+		}
+	}
+	nat.wake = 0;
+	pthread_mutex_unlock(&nat.wake_mutex);
+	pthread_mutex_lock(&nat.mutex);
+	return 0;
+}
+#endif
+
+/**
+ * Pass the frames sent by the guest to slirp. Called on the slirp thread
+ * with nat.mutex held.
+ */
+static void
+network_nat_send_queued(void)
+{
+	const NetworkFrame *frame;
+
+	while ((frame = network_queue_peek(&nat.tx)) != NULL) {
+		// Write to capture file for debug
+		write_packet(nat.capture, frame->data, frame->len);
+
+		slirp_input(nat.slirp, frame->data, (int) frame->len);
+		network_queue_pop(&nat.tx);
+	}
+}
+
+/**
+ * Slirp thread: service slirp's sockets and timers, and the frames sent
+ * by the guest.
+ */
+static void *
+network_nat_thread(void *p)
+{
+	NOT_USED(p);
+
+	pthread_mutex_lock(&nat.mutex);
+
+	while (!atomic_load(&nat.stop)) {
+		fd_set rfds, wfds, efds;
+		int fd_max = -1;
+		int timeout, ret;
+
+		network_nat_send_queued();
+
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_ZERO(&efds);
+		slirp_select_fill(nat.slirp, &fd_max, &rfds, &wfds, &efds);
+		timeout = slirp_select_timeout(nat.slirp);
+
+		// Announce the wait before the last look for work, so that work
+		// arriving in between is sure to wake the thread
+		atomic_store(&nat.sleeping, 1);
+		if (atomic_exchange(&nat.wake_pending, 0)) {
+			timeout = 0;
+		}
+
+		ret = network_nat_wait(fd_max, &rfds, &wfds, &efds, timeout);
+		atomic_store(&nat.sleeping, 0);
+
+		slirp_select_poll(nat.slirp, &rfds, &wfds, &efds, ret < 0);
+	}
+
+	pthread_mutex_unlock(&nat.mutex);
+	return NULL;
+}
+
+#ifdef NAT_EPOLL
+/**
+ * Close the slirp thread's event handles, if open.
+ */
+static void
+network_nat_close_handles(void)
+{
+	if (nat.epoll_fd != -1) {
+		close(nat.epoll_fd);
+		nat.epoll_fd = -1;
+	}
+	if (nat.wake_fd != -1) {
+		close(nat.wake_fd);
+		nat.wake_fd = -1;
+	}
+	memset(nat.epoll_mask, 0, sizeof(nat.epoll_mask));
+}
+#endif
+
+/**
+ * Start the slirp thread, once slirp has been initialised.
+ *
+ * @return Non-zero on success
+ */
+static int
+network_nat_thread_start(void)
+{
+	if (nat.thread_running) {
+		return 1;
+	}
+
+	atomic_store(&nat.stop, 0);
+
+#ifdef NAT_EPOLL
+	{
+		struct epoll_event ev;
+
+		nat.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		nat.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (nat.epoll_fd < 0 || nat.wake_fd < 0) {
+			error("Networking: unable to create NAT event handles: %s", strerror(errno));
+			network_nat_close_handles();
+			return 0;
+		}
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = nat.wake_fd;
+		if (epoll_ctl(nat.epoll_fd, EPOLL_CTL_ADD, nat.wake_fd, &ev) != 0) {
+			error("Networking: unable to create NAT event handles: %s", strerror(errno));
+			network_nat_close_handles();
+			return 0;
+		}
+		nat.epoll_last = -1;
+	}
+#endif
+
+	if (pthread_create(&nat.thread, NULL, network_nat_thread, NULL)) {
+		error("Networking: unable to create NAT thread");
+#ifdef NAT_EPOLL
+		network_nat_close_handles();
+#endif
+		return 0;
+	}
+	nat.thread_running = 1;
+	return 1;
+}
+
+/**
+ * Ask the slirp thread to exit, wait for it, and release its event
+ * handles. Slirp itself is kept, ready for the thread to be restarted.
+ */
+static void
+network_nat_thread_stop(void)
+{
+	if (nat.thread_running) {
+		atomic_store(&nat.stop, 1);
+		network_nat_wake();
+		pthread_join(nat.thread, NULL);
+		nat.thread_running = 0;
+	}
+
+#ifdef NAT_EPOLL
+	network_nat_close_handles();
+#else
+	nat.wake = 0;
+#endif
+	atomic_store(&nat.sleeping, 0);
+	atomic_store(&nat.wake_pending, 0);
 }
 
 /**
@@ -195,15 +619,13 @@ network_nat_open(void)
 int
 network_nat_init(void)
 {
-	//nat.buffer_len = 0;
-
 	// MAC address
 	network_nat_init_mac_address();
 
 	network_nat_open();
 
 	// Open capture file if requested
-	if (config.network_capture != NULL) {
+	if (config.network_capture != NULL && nat.capture == NULL) {
 		if ((nat.capture = fopen(config.network_capture, "wb")) != NULL) {
 			// Write header
 			write_global_header(nat.capture);
@@ -212,42 +634,73 @@ network_nat_init(void)
 		}
 	}
 
-	return 1;
+	return network_nat_thread_start();
+}
+
+/**
+ * Discard any frames waiting for the guest. Called from the emulator thread.
+ */
+static void
+network_nat_discard_rx(void)
+{
+	while (network_queue_peek(&nat.rx) != NULL) {
+		network_queue_pop(&nat.rx);
+	}
+	nat.irq_raised = 0;
+
+	if (atomic_exchange(&nat.rx_blocked, 0)) {
+		network_nat_wake();
+	}
 }
 
+/**
+ * Stop the slirp thread and discard any frames waiting for the guest.
+ * Called on program shutdown and program reset.
+ */
 void
 network_nat_reset(void)
 {
-	nat.irq_status = 0;
-	nat.buffer_len = 0;
+	network_nat_thread_stop();
+
+	if (nat.slirp != NULL) {
+		struct mbuf_stats stats;
+
+		slirp_get_mbuf_stats(nat.slirp, &stats);
+		rpclog("Networking: mbuf pool misses %u, buffer pool misses %u, "
+		       "oversize buffers %u\n",
+		       stats.pool_misses, stats.ext_misses, stats.ext_oversize);
+	}
+
+	atomic_store(&nat.irq_status, 0);
+	network_nat_discard_rx();
 }
 
+/**
+ * Raise the receive interrupt if frames have arrived for the guest. Called
+ * regularly from the emulator thread.
+ */
 void
 network_nat_poll(void)
 {
-	fd_set rfds, wfds, efds;
-	int fd_max, ret;
-	struct timeval tv;
+	uint32_t irq_status;
 
-	FD_ZERO(&rfds);
-	FD_ZERO(&wfds);
-	FD_ZERO(&efds);
-	fd_max = -1;
-
-	slirp_select_fill(nat.slirp, &fd_max, &rfds, &wfds, &efds);
-	if (fd_max == -1) {
+	if (nat.irq_raised || network_queue_peek(&nat.rx) == NULL) {
 		return;
 	}
 
-	tv.tv_sec = 0;
-	tv.tv_usec = 0;
-
-	ret = select(fd_max + 1, &rfds, &wfds, &efds, &tv);
-	if (ret < 0) {
+	irq_status = atomic_load_explicit(&nat.irq_status, memory_order_relaxed);
+	if (irq_status == 0 || network_poduleinfo == NULL) {
+		// Not set-up to generate IRQ
+		network_nat_discard_rx();
 		return;
 	}
 
-	slirp_select_poll(nat.slirp, &rfds, &wfds, &efds, ret <= 0);
+	// The driver takes frames until there are none left, after which
+	// the next frame raises the IRQ again
+	nat.irq_raised = 1;
+	mem_write8(irq_status, 1);
+	network_poduleinfo->irq = 1;
+	rethinkpoduleints();
 }
 
 /**
@@ -264,10 +717,19 @@ network_nat_poll(void)
 uint32_t
 network_nat_tx(uint32_t errbuf, uint32_t mbufs, uint32_t dest, uint32_t src, uint32_t frametype)
 {
-	uint8_t *buf = nat.buffer;
+	NetworkFrame *frame;
+	uint8_t *buf;
 	struct mbuf txb;
 	uint32_t packet_length;
 
+	// Wait for the slirp thread to make space; it drains the whole queue
+	// each time it runs
+	while ((frame = network_queue_space(&nat.tx)) == NULL) {
+		network_nat_wake();
+		sched_yield();
+	}
+	buf = frame->data;
+
 	memcpytohost(buf, dest, 6);
 	buf += 6;
 
@@ -285,7 +747,7 @@ network_nat_tx(uint32_t errbuf, uint32_t mbufs, uint32_t dest, uint32_t src, uin
 	while (mbufs != 0) {
 		memcpytohost(&txb, mbufs, sizeof(struct mbuf));
 		packet_length += txb.m_len;
-		if (packet_length > sizeof(nat.buffer)) {
+		if (packet_length > sizeof(frame->data)) {
 			strcpyfromhost(errbuf, "RPCEmu: Packet too large to send");
 			return errbuf;
 		}
@@ -294,10 +756,9 @@ network_nat_tx(uint32_t errbuf, uint32_t mbufs, uint32_t dest, uint32_t src, uin
 		mbufs = txb.m_next;
 	}
 
-	// Write to capture file for debug
-	write_packet(nat.capture, nat.buffer, packet_length);
-
-	slirp_input(nat.slirp, nat.buffer, packet_length);
+	frame->len = packet_length;
+	network_queue_push(&nat.tx);
+	network_nat_wake();
 
 	return 0;
 }
@@ -305,59 +766,72 @@ network_nat_tx(uint32_t errbuf, uint32_t mbufs, uint32_t dest, uint32_t src, uin
 /**
  * Receive data from the network
  *
- * @param errbuf
- * @param mbuf
- * @param rxhdr
- * @param data_avail
+ * @param errbuf     Address of buffer to return error string
+ * @param mbuf       Address of mbuf to fill with the frame's payload
+ * @param rxhdr      Address of rx_hdr structure to fill in
+ * @param data_avail Set to 1 if a frame was returned, 0 if none are waiting
  *
- * @return
+ * @return errbuf on error, else zero
  */
 uint32_t
 network_nat_rx(uint32_t errbuf, uint32_t mbuf, uint32_t rxhdr, uint32_t *data_avail)
 {
+	const NetworkFrame *frame;
 	struct mbuf rxb;
 	struct rx_hdr hdr;
 	size_t packet_length;
 
 	*data_avail = 0;
 
-	if (nat.buffer_len == 0) {
-		return errbuf;
+	// Frames too short to carry a payload are not passed on
+	while ((frame = network_queue_peek(&nat.rx)) != NULL && frame->len <= HEADERLEN) {
+		network_queue_pop(&nat.rx);
 	}
 
-	memset(&hdr, 0, sizeof(hdr));
+	if (frame == NULL) {
+		// The driver has taken everything, so the next frame needs an IRQ
+		nat.irq_raised = 0;
+		if (atomic_exchange(&nat.rx_blocked, 0)) {
+			network_nat_wake();
+		}
+		return 0;
+	}
 
-	packet_length = nat.buffer_len;
+	if (mbuf == 0) {
+		return 0;
+	}
 
-	if (mbuf != 0 && packet_length > HEADERLEN) {
-		const uint8_t *payload = nat.buffer + HEADERLEN;
+	memset(&hdr, 0, sizeof(hdr));
 
-		// Fill in received header structure
-		memcpy(hdr.rx_dst_addr, nat.buffer + 0, 6);
-		memcpy(hdr.rx_src_addr, nat.buffer + 6, 6);
-		hdr.rx_frame_type = (nat.buffer[12] << 8) | nat.buffer[13];
-		hdr.rx_error_level = 0;
-		memcpyfromhost(rxhdr, &hdr, sizeof(hdr));
+	packet_length = frame->len - HEADERLEN;
 
-		packet_length -= HEADERLEN;
+	memcpytohost(&rxb, mbuf, sizeof(rxb));
 
-		memcpytohost(&rxb, mbuf, sizeof(rxb));
+	if (packet_length > rxb.m_inilen) {
+		fprintf(stderr, "\tmbuff too small for received packet\n");
+		strcpyfromhost(errbuf, "RPCEmu: Mbuf too small for received packet");
+		network_queue_pop(&nat.rx);
+		return errbuf;
+	}
 
-		if (packet_length > rxb.m_inilen) {
-			fprintf(stderr, "\tmbuff too small for received packet\n");
-			strcpyfromhost(errbuf, "RPCEmu: Mbuf too small for received packet");
-			return errbuf;
-		}
+	// Fill in received header structure
+	memcpy(hdr.rx_dst_addr, frame->data + 0, 6);
+	memcpy(hdr.rx_src_addr, frame->data + 6, 6);
+	hdr.rx_frame_type = (frame->data[12] << 8) | frame->data[13];
+	hdr.rx_error_level = 0;
+	memcpyfromhost(rxhdr, &hdr, sizeof(hdr));
 
-		// Copy payload in to the mbuf
-		rxb.m_off = rxb.m_inioff;
-		memcpyfromhost(mbuf + rxb.m_off, payload, packet_length);
-		rxb.m_len = packet_length;
-		memcpyfromhost(mbuf, &rxb, sizeof(rxb));
+	// Copy payload in to the mbuf
+	rxb.m_off = rxb.m_inioff;
+	memcpyfromhost(mbuf + rxb.m_off, frame->data + HEADERLEN, packet_length);
+	rxb.m_len = packet_length;
+	memcpyfromhost(mbuf, &rxb, sizeof(rxb));
 
-		*data_avail = 1;
+	*data_avail = 1;
 
-		nat.buffer_len = 0;
+	network_queue_pop(&nat.rx);
+	if (atomic_exchange(&nat.rx_blocked, 0)) {
+		network_nat_wake();
 	}
 
 	return 0;
@@ -369,7 +843,7 @@ network_nat_rx(uint32_t errbuf, uint32_t mbuf, uint32_t rxhdr, uint32_t *data_av
 void
 network_nat_setirqstatus(uint32_t address)
 {
-	nat.irq_status = address;
+	atomic_store(&nat.irq_status, address);
 }
 
 /**
@@ -384,13 +858,18 @@ network_nat_forward_add(PortForwardRule rule)
 	int retval;
 
 	// Inform SLIRP of the rule added
+	pthread_mutex_lock(&nat.mutex);
 	retval = slirp_add_hostfwd(nat.slirp, rule.type == PORT_FORWARD_UDP ? 1 : 0,
 	    bind, rule.host_port, nat.forward_addr, rule.emu_port);
+	pthread_mutex_unlock(&nat.mutex);
 	if (retval != 0) {
 		error("Failed to add NAT Network port forwarding rule, %s emu_port %u host_port %u, %d %d %s",
 		    rule.type == PORT_FORWARD_UDP ? "UDP" : "TCP", rule.emu_port, rule.host_port,
 		    retval, errno, strerror(errno));
 	}
+
+	// Have the slirp thread watch the new socket
+	network_nat_wake();
 }
 
 /**
@@ -404,8 +883,10 @@ network_nat_forward_remove(PortForwardRule rule)
 	struct in_addr bind = { 0 };
 
 	// Inform SLIRP of the rule removal
+	pthread_mutex_lock(&nat.mutex);
 	slirp_remove_hostfwd(nat.slirp, rule.type == PORT_FORWARD_UDP ? 1 : 0,
 	    bind, rule.host_port);
+	pthread_mutex_unlock(&nat.mutex);
 }
 
 /**
@@ -0,0 +1,105 @@
+/*
+  RPCEmu - An Acorn system emulator
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ network-queue.h - queue of Ethernet frames passed between the emulator
+ thread and a network backend's thread
+ */
+
+#ifndef NETWORK_QUEUE_H
+#define NETWORK_QUEUE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NETWORK_FRAME_MAX	2048	/**< Largest frame passed in either direction */
+#define NETWORK_QUEUE_FRAMES	64	/**< Frames queued in each direction, a power of 2 */
+
+typedef struct {
+	uint32_t	len;
+	uint8_t		data[NETWORK_FRAME_MAX];
+} NetworkFrame;
+
+/** Queue of frames with one producer thread and one consumer thread */
+typedef struct {
+	atomic_uint	head;		///< Next slot to fill, advanced by the producer
+	atomic_uint	tail;		///< Next slot to empty, advanced by the consumer
+	NetworkFrame	frames[NETWORK_QUEUE_FRAMES];
+} NetworkQueue;
+
+/**
+ * Get the slot to fill with the next frame of a queue.
+ *
+ * @param queue Queue, of which the caller is the producer
+ * @return Slot, or NULL if the queue is full
+ */
+static inline NetworkFrame *
+network_queue_space(NetworkQueue *queue)
+{
+	const unsigned head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	const unsigned tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+
+	if (head - tail == NETWORK_QUEUE_FRAMES) {
+		return NULL;
+	}
+	return &queue->frames[head & (NETWORK_QUEUE_FRAMES - 1)];
+}
+
+/**
+ * Pass the frame filled in the slot from network_queue_space() to the
+ * consumer.
+ *
+ * @param queue Queue, of which the caller is the producer
+ */
+static inline void
+network_queue_push(NetworkQueue *queue)
+{
+	atomic_fetch_add(&queue->head, 1);
+}
+
+/**
+ * Get the oldest frame in a queue.
+ *
+ * @param queue Queue, of which the caller is the consumer
+ * @return Frame, or NULL if the queue is empty
+ */
+static inline const NetworkFrame *
+network_queue_peek(NetworkQueue *queue)
+{
+	const unsigned tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	const unsigned head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+	if (head == tail) {
+		return NULL;
+	}
+	return &queue->frames[tail & (NETWORK_QUEUE_FRAMES - 1)];
+}
+
+/**
+ * Free the slot of the frame from network_queue_peek().
+ *
+ * @param queue Queue, of which the caller is the consumer
+ */
+static inline void
+network_queue_pop(NetworkQueue *queue)
+{
+	atomic_fetch_add(&queue->tail, 1);
+}
+
+#endif /* NETWORK_QUEUE_H */
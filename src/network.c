@@ -161,12 +161,7 @@ readpoduleetherrpcem(podule *p, int easi, uint32_t addr)
 void
 memcpytohost(void *dest, uint32_t src, uint32_t len)
 {
-	char *dst = dest;
-
-	while (len--) {
-		*dst++ = mem_read8(src);
-		src++;
-	}
+	mem_copy_from_guest(dest, src, len);
 }
 
 /**
@@ -179,13 +174,7 @@ memcpytohost(void *dest, uint32_t src, uint32_t len)
 void
 memcpyfromhost(uint32_t dest, const void *source, uint32_t len)
 {
-	const char *src = source;
-
-	while (len--) {
-		mem_write8(dest, *src);
-		src++;
-		dest++;
-	}
+	mem_copy_to_guest(dest, source, len);
 }
 
 /**
@@ -322,16 +311,49 @@ network_init(void)
 void
 network_reset(void)
 {
-	if (config.network_type == NetworkType_NAT) {
-		// Call NAT reset code
-		network_nat_reset();
-	} else {
+	// Stop the NAT thread even if the configuration has just moved away
+	// from NAT
+	network_nat_reset();
+
+	if (config.network_type != NetworkType_NAT) {
 		// Call platform's reset code
 		network_plt_reset();
 	}
 }
 
 
+/**
+ * Receive one frame from whichever network backend is in use
+ *
+ * @param errbuf     Address of buffer to return error string
+ * @param mbuf       Address of mbuf to fill with the frame's payload
+ * @param rxhdr      Address of rx_hdr structure to fill in
+ * @param dataavail  Set to 1 if a frame was returned
+ * @return errbuf on error, else zero
+ */
+static uint32_t
+network_rx(uint32_t errbuf, uint32_t mbuf, uint32_t rxhdr, uint32_t *dataavail)
+{
+	if (config.network_type == NetworkType_NAT) {
+		return network_nat_rx(errbuf, mbuf, rxhdr, dataavail);
+	}
+	return network_plt_rx(errbuf, mbuf, rxhdr, dataavail);
+}
+
+/**
+ * Raise the IRQ for any frames the network backend has received. Called
+ * regularly from the emulator thread.
+ */
+void
+network_poll(void)
+{
+	if (config.network_type == NetworkType_NAT) {
+		network_nat_poll();
+	} else {
+		network_plt_poll();
+	}
+}
+
 /**
  * @param      r0    Reason code in r0
  * @param      r1    Pointer to buffer for any error string
@@ -359,11 +381,7 @@ network_swi(uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3, uint32_t r4, uin
 		}
 		break;
 	case 1:
-		if (config.network_type == NetworkType_NAT) {
-			*retr0 = network_nat_rx(r1, r2, r3, retr1);
-		} else {
-			*retr0 = network_plt_rx(r1, r2, r3, retr1);
-		}
+		*retr0 = network_rx(r1, r2, r3, retr1);
 		break;
 	case 2:
 		if (config.network_type == NetworkType_NAT) {
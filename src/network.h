@@ -39,6 +39,7 @@ void network_swi(uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3,
 
 void network_init(void);
 void network_reset(void);
+void network_poll(void);
 
 /* Functions shared between each platform, in network.c */
 void memcpytohost(void *dest, uint32_t src, uint32_t len);
@@ -55,6 +56,7 @@ int network_plt_init(void);
 uint32_t network_plt_tx(uint32_t errbuf, uint32_t mbufs, uint32_t dest, uint32_t src, uint32_t frametype);
 uint32_t network_plt_rx(uint32_t errbuf, uint32_t mbuf, uint32_t rxhdr, uint32_t *dataavail);
 void network_plt_setirqstatus(uint32_t address);
+void network_plt_poll(void);
 
 /* Structures and variables shared between each host platform's network code */
 extern podule *network_poduleinfo;
@@ -114,8 +114,14 @@ ConfigureDialog::ConfigureDialog(Emulator &emulator, Config *config_copy, Model
 	refresh_hbox->addWidget(refresh_slider);
 	refresh_hbox->addWidget(refresh_label);
 
+	frameskip_checkbox = new QCheckBox("Skip frames when the emulator is falling behind");
+
+	refresh_vbox = new QVBoxLayout();
+	refresh_vbox->addLayout(refresh_hbox);
+	refresh_vbox->addWidget(frameskip_checkbox);
+
 	refresh_group_box = new QGroupBox("Video refresh rate");
-	refresh_group_box->setLayout(refresh_hbox);
+	refresh_group_box->setLayout(refresh_vbox);
 
 	// Create Buttons
 	buttons_box = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel);
@@ -205,6 +211,13 @@ ConfigureDialog::dialog_accepted()
 	// Video Refresh Rate
 	new_config.refresh = refresh_slider->value();
 
+	// Adaptive Frame Skipping
+	if (frameskip_checkbox->isChecked()) {
+		new_config.adaptive_frameskip = 1;
+	} else {
+		new_config.adaptive_frameskip = 0;
+	}
+
 	// Compare against existing config and see if it will cause a reboot
 	if(rpcemu_config_is_reset_required(&new_config, new_model)) {
 		int ret = MainWindow::reset_question(parentWidget());
@@ -298,4 +311,7 @@ ConfigureDialog::applyConfig()
 	// Video Refresh Rate
 	refresh_slider->setValue(config_copy->refresh);
 	refresh_label->setText(QString::number(config_copy->refresh) + " Hz");
+
+	// Adaptive Frame Skipping
+	frameskip_checkbox->setChecked(config_copy->adaptive_frameskip != 0);
 }
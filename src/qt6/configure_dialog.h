@@ -74,6 +74,8 @@ private:
 	QSlider *refresh_slider;
 	QLabel *refresh_label;
 	QHBoxLayout *refresh_hbox;
+	QCheckBox *frameskip_checkbox;
+	QVBoxLayout *refresh_vbox;
 	QGroupBox *refresh_group_box;
 
 	QDialogButtonBox *buttons_box;
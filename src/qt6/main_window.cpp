@@ -38,6 +38,7 @@
 #endif /* Q_OS_WASM */
 
 #include "rpcemu.h"
+#include "capture.h"
 #include "keyboard.h"
 #include "main_window.h"
 #include "rpc-qt6.h"
@@ -65,6 +66,7 @@
 MainDisplay::MainDisplay(Emulator &emulator, QWidget *parent)
     : QWidget(parent),
       emulator(emulator),
+      frame_seq(0),
       double_size(VIDC_DOUBLE_NONE),
       full_screen(false)
 {
@@ -232,26 +234,28 @@ MainDisplay::set_full_screen(bool full_screen)
 }
 
 void
-MainDisplay::update_image(const QImage& img, int yl, int yh, int double_size)
+MainDisplay::update_image(const VideoFrame *frame)
 {
 	bool recalculate_needed = false;
+	int yl = frame->yl;
+	int yh = frame->yh;
+	const int double_size = frame->double_size;
 
-	if (img.size() != image->size()) {
-		// Re-create image with new size and copy of data
-		*(this->image) = img.copy();
-
+	if (frame->xsize != image->width() || frame->ysize != image->height()) {
 		recalculate_needed = true;
+	}
 
-	} else {
-		// Copy just the data that has changed
-		const void *src = img.scanLine(yl);
-		void *dest = image->scanLine(yl);
-
-		const int lines = yh - yl;
-		const int bytes = img.bytesPerLine() * lines;
+	// Paint directly from the frame, which stays unchanged until the next
+	// one is acquired
+	*(this->image) = QImage((const uchar *) frame->bitmap,
+	    frame->xsize, frame->ysize, QImage::Format_RGB32);
 
-		memcpy(dest, src, (size_t) bytes);
+	// The changes in any skipped frames are not covered by this frame's range
+	if (frame->seq != frame_seq + 1) {
+		yl = 0;
+		yh = frame->ysize;
 	}
+	frame_seq = frame->seq;
 
 	if (double_size != this->double_size) {
 		this->double_size = double_size;
@@ -742,6 +746,31 @@ MainWindow::menu_screenshot()
 #endif /* Q_OS_WASM */
 }
 
+#ifndef Q_OS_WASM
+/**
+ * Start or stop capturing the machine's sound and video to files
+ */
+void
+MainWindow::menu_capture()
+{
+	if (capture_is_active()) {
+		capture_stop();
+		capture_action->setChecked(false);
+		return;
+	}
+
+	QString dir = QFileDialog::getExistingDirectory(this,
+	                                                tr("Choose Directory for Capture"));
+
+	// dir is NULL if user hit cancel
+	if (dir.isNull() || !capture_start(dir.toLocal8Bit().constData())) {
+		capture_action->setChecked(false);
+		return;
+	}
+	capture_action->setChecked(true);
+}
+#endif /* !Q_OS_WASM */
+
 #ifdef Q_OS_WASM
 void
 MainWindow::menu_rom_upload()
@@ -1163,9 +1192,9 @@ MainWindow::menu_cdrom_iso()
 	load_disc(DEV_CDROM);
 #else
 	QString fileName = QFileDialog::getOpenFileName(this,
-	                                                tr("Open ISO Image"),
+	                                                tr("Open CD-ROM Image"),
 	                                                "",
-	                                                tr("ISO CD-ROM Image (*.iso);;All Files (*.*)"));
+	                                                tr("CD-ROM Image (*.iso *.cue *.cdz);;All Files (*.*)"));
 
 	/* fileName is NULL if user hit cancel */
 	if(!fileName.isNull()) {
@@ -1316,6 +1345,11 @@ MainWindow::menu_aboutToShow()
 {
 	release_held_keys();
 	this->menu_open = true;
+
+#ifndef Q_OS_WASM
+	// A capture stops by itself if writing to the files fails
+	capture_action->setChecked(capture_is_active());
+#endif /* !Q_OS_WASM */
 }
 
 /**
@@ -1334,6 +1368,12 @@ MainWindow::create_actions()
 	// Actions on File menu
 	screenshot_action = new QAction(tr("Take Screenshot..."), this);
 	connect(screenshot_action, &QAction::triggered, this, &MainWindow::menu_screenshot);
+#ifndef Q_OS_WASM
+	capture_action = new QAction(tr("Capture Sound and Video..."), this);
+	capture_action->setCheckable(true);
+	capture_action->setStatusTip(tr("Record sound, video and frame timings to files"));
+	connect(capture_action, &QAction::triggered, this, &MainWindow::menu_capture);
+#endif /* !Q_OS_WASM */
 #ifdef Q_OS_WASM
 	rom_upload_action = new QAction(tr("Replace ROM Image..."), this);
 	connect(rom_upload_action, &QAction::triggered, this, &MainWindow::menu_rom_upload);
@@ -1432,8 +1472,7 @@ MainWindow::create_actions()
 	about_action->setStatusTip(tr("Show the application's About box"));
 	connect(about_action, &QAction::triggered, this, &MainWindow::menu_about);
 
-	connect(this, &MainWindow::main_display_signal, this, &MainWindow::main_display_update, Qt::BlockingQueuedConnection);
-//	connect(this, &MainWindow::main_display_signal, this, &MainWindow::main_display_update);
+	connect(this, &MainWindow::main_display_signal, this, &MainWindow::main_display_update, Qt::QueuedConnection);
 	connect(this, &MainWindow::move_host_mouse_signal, this, &MainWindow::move_host_mouse);
 	connect(this, &MainWindow::send_nat_rule_to_gui_signal, this, &MainWindow::send_nat_rule_to_gui);
 
@@ -1448,6 +1487,9 @@ MainWindow::create_menus()
 	// File menu
 	file_menu = menuBar()->addMenu(tr("File"));
 	file_menu->addAction(screenshot_action);
+#ifndef Q_OS_WASM
+	file_menu->addAction(capture_action);
+#endif /* !Q_OS_WASM */
 	file_menu->addSeparator();
 #ifdef Q_OS_WASM
 	file_menu->addAction(rom_upload_action);
@@ -1578,23 +1620,28 @@ MainWindow::writeSettings()
 }
 
 void
-MainWindow::main_display_update(VideoUpdate video_update)
+MainWindow::main_display_update()
 {
-	if (video_update.host_xsize != display->width() ||
-	    video_update.host_ysize != display->height())
+	// Collect the latest frame, if it was not collected by an earlier update
+	const VideoFrame *frame = vidc_frame_acquire();
+	if (frame == NULL) {
+		return;
+	}
+
+	if (frame->host_xsize != display->width() ||
+	    frame->host_ysize != display->height())
 	{
 		if (!full_screen) {
 			// Resize Widget containing image
-			display->setFixedSize(video_update.host_xsize, video_update.host_ysize);
+			display->setFixedSize(frame->host_xsize, frame->host_ysize);
 
 			// Resize Window
 			this->setFixedSize(this->sizeHint());
 		}
 	}
 
-	// Copy image data
-	display->update_image(video_update.image, video_update.yl, video_update.yh,
-	    video_update.double_size);
+	// Display the frame
+	display->update_image(frame);
 }
 
 /**
@@ -1700,12 +1747,19 @@ MainWindow::mips_timer_timeout()
 	}
 #endif /* Q_OS_WASM */
 
+	// Read (and zero atomically) the count of frames skipped by adaptive frame skipping
+	const int skipped = video_skip_count.fetchAndStoreRelease(0);
+	QString skip_text;
+	if (pconfig_copy->adaptive_frameskip) {
+		skip_text = QString(" SKIP: %1%").arg((skipped * 100) / pconfig_copy->refresh);
+	}
+
 #if 1
 	// Update window title
-	window_title = QString("RPCEmu - MIPS: %1 AVG: %2%3")
+	window_title = QString("RPCEmu - MIPS: %1 AVG: %2%3%4")
 	    .arg(mips, 0, 'f', 1)
 	    .arg(average, 0, 'f', 1)
-	    .arg(capture_text);
+	    .arg(skip_text, capture_text);
 
 #else
 	// Read  (and zero atomically) the IOMD timer count from the emulator core
@@ -1715,12 +1769,12 @@ MainWindow::mips_timer_timeout()
 	const int vcount = video_timer_count.fetchAndStoreRelease(0);
 
 	// Update window title (including timer information, for debug purposes)
-	window_title = QString("RPCEmu - MIPS: %1 AVG: %2, ITimer: %3, VTimer: %4%5")
+	window_title = QString("RPCEmu - MIPS: %1 AVG: %2, ITimer: %3, VTimer: %4%5%6")
 	    .arg(mips, 0, 'f', 1)
 	    .arg(average, 0, 'f', 1)
 	    .arg(icount)
 	    .arg(vcount)
-	    .arg(capture_text);
+	    .arg(skip_text, capture_text);
 #endif
 
 #ifdef Q_OS_WASM
@@ -32,22 +32,9 @@
 #include "rpc-qt6.h"
 
 #include "rpcemu.h"
+#include "vidc20.h"
 
 
-/**
- * Used to pass data from Emulator thread to GUI thread
- * when the main display needs to be updated
- */
-struct VideoUpdate {
-	QImage		image;
-	int		yl;
-	int		yh;
-
-	int		double_size;
-	int		host_xsize;
-	int		host_ysize;
-};
-
 /**
  * Used to pass data from Emulator thread to GUI thread
  * when in mousehack wants to move the host mouse
@@ -66,7 +53,7 @@ public:
 
 	void get_host_size(int& host_xsize, int& host_ysize) const;
 	void set_full_screen(bool full_screen);
-	void update_image(const QImage& img, int yl, int yh, int double_size);
+	void update_image(const VideoFrame *frame);
 	int get_double_size();
 	bool save_screenshot(QString filename);
 	void save_screenshot_wasm();
@@ -84,7 +71,8 @@ private:
 
 	Emulator &emulator;
 
-	QImage *image;
+	QImage *image;		///< Wraps the frame currently displayed, without a copy
+	uint32_t frame_seq;	///< Sequence number of the frame currently displayed
 	int double_size;
 
 	bool full_screen;
@@ -123,6 +111,9 @@ protected:
 	
 private slots:
 	void menu_screenshot();
+#ifndef Q_OS_WASM
+	void menu_capture();
+#endif /* !Q_OS_WASM */
 #ifdef Q_OS_WASM
 	void menu_rom_upload();
 	void menu_rom_default();
@@ -162,7 +153,7 @@ private slots:
 	void menu_aboutToShow();
 	void menu_aboutToHide();
 
-	void main_display_update(VideoUpdate video_update);
+	void main_display_update();
 	void move_host_mouse(MouseMoveUpdate mouse_update);
 	void send_nat_rule_to_gui(PortForwardRule rule);
 
@@ -174,7 +165,7 @@ private slots:
 	void screen_resized(const QRect &newGeometry);
 #endif /* Q_OS_WASM */
 signals:
-	void main_display_signal(VideoUpdate video_update);
+	void main_display_signal();
 	void move_host_mouse_signal(MouseMoveUpdate mouse_update);
 	void send_nat_rule_to_gui_signal(PortForwardRule rule);
 
@@ -229,6 +220,9 @@ private:
 
 	// Actions on File menu
 	QAction *screenshot_action;
+#ifndef Q_OS_WASM
+	QAction *capture_action;
+#endif /* !Q_OS_WASM */
 #ifdef Q_OS_WASM
 	QAction *rom_upload_action;
 	QAction *rom_default_action;
@@ -35,6 +35,8 @@ extern "C" void plt_sound_init(uint32_t bufferlen);
 extern "C" void plt_sound_restart(void);
 extern "C" void plt_sound_pause(void);
 extern "C" int32_t plt_sound_buffer_free(void);
+extern "C" int32_t plt_sound_buffer_size(void);
+extern "C" uint32_t plt_sound_samplerate(void);
 extern "C" void plt_sound_buffer_play(uint32_t samplerate, const char *buffer, uint32_t length);
 
 AudioOut *audio_out; /**< Our class used to hold QT sound variables */
@@ -70,8 +72,13 @@ AudioOut::AudioOut(uint32_t bufferlen)
 	}
 	*/
 
-	// Start the audio device for the first time to work around timing issues
-	this->changeSampleRate(41666);
+	// Open the audio device at its native rate. The core converts the
+	// guest's sound to this rate, so the device never needs reopening
+	int native_rate = info.preferredFormat().sampleRate();
+	if (native_rate <= 0) {
+		native_rate = 48000;
+	}
+	this->changeSampleRate((uint32_t) native_rate);
 }
 
 AudioOut::~AudioOut()
@@ -196,6 +203,39 @@ plt_sound_buffer_free(void)
 	}
 }
 
+/**
+ * Return the sample rate the platforms audio output is running at,
+ * all data passed to plt_sound_buffer_play() should be at this rate
+ *
+ * @returns Sample rate in Hz
+ */
+uint32_t
+plt_sound_samplerate(void)
+{
+	assert(audio_out);
+
+	return audio_out->samplerate;
+}
+
+/**
+ * Return the total size of the platforms audio buffer, when
+ * plt_sound_buffer_free() returns this the buffer has run dry
+ *
+ * @returns Size in bytes of platform audio buffer
+ */
+int32_t
+plt_sound_buffer_size(void)
+{
+	assert(audio_out);
+
+	if(audio_out->audio_output) {
+		return (int32_t) audio_out->audio_output->bufferSize();
+	} else {
+		// Nothing has been played yet, so there is nothing to run out of
+		return INT32_MAX;
+	}
+}
+
 /**
  * Write some audio data into this platforms audio output 
  * 
@@ -53,11 +53,6 @@
 
 #if defined(Q_OS_WIN32)
 #include "cdrom-ioctl.h"
-
-extern "C" {
-extern int handle_sigio; /**< bool to indicate new network data is received  (windows only) */
-extern void sig_io(int sig);
-} /* extern "C" */
 #endif /* win32 */
 
 #if defined(Q_OS_LINUX)
@@ -73,6 +68,7 @@ static QThread *emu_thread = NULL; ///< Reference to emulator thread (nullptr)
 QAtomicInt instruction_count; ///< Instruction counter shared between Emulator and GUI threads
 QAtomicInt iomd_timer_count;  ///< IOMD timer  counter shared between Emulator and GUI threads
 QAtomicInt video_timer_count; ///< Video timer counter shared between Emulator and GUI threads
+QAtomicInt video_skip_count;  ///< Skipped frame counter shared between Emulator and GUI threads
 
 static pthread_t sound_thread;
 static pthread_cond_t sound_cond = PTHREAD_COND_INITIALIZER;
@@ -344,35 +340,14 @@ vidcreleasemutex(void)
 }
 
 /**
- * Prepare and send a video update message to the GUI.
- *
- * @param buffer      Pointer to image buffer
- * @param xsize       X size of buffer
- * @param ysize       Y size of buffer
- * @param yl          Y low range of area to update
- * @param yh          Y high range of area to update
- * @param double_size Current state of doubling X/Y values
- * @param host_xsize  X pixel size of display including any double_size doubling
- * @param host_ysize  Y pixel size of display including any double_size doubling
+ * Notify the GUI that a new frame has been published, which the GUI then
+ * collects with vidc_frame_acquire(). Does not wait for the GUI.
  */
 void
-rpcemu_video_update(const uint32_t *buffer, int xsize, int ysize,
-                    int yl, int yh, int double_size, int host_xsize, int host_ysize)
+rpcemu_video_update(void)
 {
-	VideoUpdate video_update;
-
-	// Prepare update message
-	//   Wrap the buffer in a QImage container:
-	video_update.image = QImage((uchar *) buffer,
-	    xsize, ysize, QImage::Format_RGB32);
-	video_update.yl = yl;
-	video_update.yh = yh;
-	video_update.double_size = double_size;
-	video_update.host_xsize = host_xsize;
-	video_update.host_ysize = host_ysize;
-
 	// Send update message to GUI
-	emit pMainWin->main_display_signal(video_update);
+	emit pMainWin->main_display_signal();
 
 	// Send flyback message to emulator thread
 	emit emulator->video_flyback_signal();
@@ -470,7 +445,6 @@ void main_init()
 
 	// Allow additional types to be passed in slots and signals
 	qRegisterMetaType<Model>("Model");
-	qRegisterMetaType<VideoUpdate>("VideoUpdate");
 	qRegisterMetaType<MouseMoveUpdate>("MouseMoveUpdate");
 	qRegisterMetaType<NetworkType>("NetworkType");
 	qRegisterMetaType<PortForwardRule>("PortForwardRule");
@@ -518,6 +492,10 @@ void main_init()
  * Connect up QT signals
  */
 Emulator::Emulator()
+    : frame_skip(0),
+      frame_skip_count(0),
+      frame_skip_frames(0),
+      frame_skip_lag(0)
 {
 	// "Internal" signals from non-GUI threads
 	connect(this, &Emulator::video_flyback_signal, this, &Emulator::video_flyback);
@@ -574,8 +552,6 @@ Emulator::mainemuloop()
 
 	elapsed_timer.start();
 
-	unsigned network_nat_rate = 0;
-
 	while (!quited) {
 		// Handle qt events and messages
 		QCoreApplication::processEvents();
@@ -583,14 +559,6 @@ Emulator::mainemuloop()
 		// Run some instructions in the emulator
 		execrpcemu();
 
-		// Handle windows networking receiving data
-#if defined(Q_OS_WIN32)
-		if (handle_sigio) {
-			handle_sigio = 0;
-			sig_io(1);
-		}
-#endif // defined(Q_OS_WIN32);
-		
 		const qint64 elapsed = elapsed_timer.nsecsElapsed();
 
 		// If we have passed the time the IOMD timer event should occur, trigger it
@@ -602,9 +570,7 @@ Emulator::mainemuloop()
 
 		// If we have passed the time the Video timer event should occur, trigger it
 		if (elapsed >= video_timer_next) {
-			video_timer_count.fetchAndAddRelease(1);
-			vblupdate();
-			video_timer_next += (qint64) video_timer_interval;
+			video_timer_event(elapsed);
 		}
 
 		// If the instruction count is greater than or equal to 0x20000, update the shared counter
@@ -614,12 +580,9 @@ Emulator::mainemuloop()
 			inscount &= 0xffff;
 		}
 
-		// If NAT networking, poll, but not too often
-		if (config.network_type == NetworkType_NAT) {
-			network_nat_rate++;
-			if ((network_nat_rate & 0x3) == 0) {
-				network_nat_poll();
-			}
+		// Raise an IRQ for any frames received by the network backend
+		if (config.network_type != NetworkType_Off) {
+			network_poll();
 		}
 	}
 
@@ -648,10 +611,86 @@ Emulator::idle_process_events()
 
 	// If we have passed the time the Video timer event should occur, trigger it
 	if (elapsed >= video_timer_next) {
-		video_timer_count.fetchAndAddRelease(1);
+		video_timer_event(elapsed);
+	}
+}
+
+/**
+ * Handle a video timer event, either drawing the frame or skipping it.
+ *
+ * A drawn frame takes flyback low in drawscr() and high again, raising the
+ * flyback interrupt, once the video thread has finished with it and
+ * video_flyback() runs from the event loop. A skipped frame does the same
+ * without the drawing, so the guest sees the same flyback signal either way.
+ *
+ * @param elapsed Real time since the emulator started (in nanoseconds)
+ */
+void
+Emulator::video_timer_event(qint64 elapsed)
+{
+	video_timer_count.fetchAndAddRelease(1);
+
+	if (frame_skip_check(elapsed)) {
+		video_skip_count.fetchAndAddRelease(1);
+		iomd_flyback(0);
+		QMetaObject::invokeMethod(this, &Emulator::video_flyback, Qt::QueuedConnection);
+	} else {
 		vblupdate();
-		video_timer_next += (qint64) video_timer_interval;
 	}
+
+	video_timer_next += (qint64) video_timer_interval;
+}
+
+/**
+ * Decide whether to skip drawing this frame, called on each video timer event.
+ *
+ * In adaptive frame skip mode, emulated time (as given by the IOMD timer) is
+ * compared with real time. If the IOMD timer is running late the emulator is
+ * not keeping up, so more frames are skipped to leave more host time for
+ * running the guest. Once it has caught up, fewer frames are skipped.
+ *
+ * @param elapsed Real time since the emulator started (in nanoseconds)
+ * @return true if this frame should not be drawn
+ */
+bool
+Emulator::frame_skip_check(qint64 elapsed)
+{
+	const int frame_skip_max = 4;			// Always draw at least one frame in five
+	const int frame_skip_period = 8;		// Frames between adjustments of frame_skip
+	const qint64 frame_skip_lag_limit = 4000000;	// 4000000 ns = 4 ms (two IOMD timer events)
+
+	if (!config.adaptive_frameskip) {
+		frame_skip = 0;
+		frame_skip_count = 0;
+		return false;
+	}
+
+	// How far the IOMD timer is behind real time
+	const qint64 lag = elapsed - iomd_timer_next;
+	if (lag > frame_skip_lag) {
+		frame_skip_lag = lag;
+	}
+
+	frame_skip_frames++;
+	if (frame_skip_frames >= frame_skip_period) {
+		if (frame_skip_lag > frame_skip_lag_limit) {
+			if (frame_skip < frame_skip_max) {
+				frame_skip++;
+			}
+		} else if (frame_skip > 0) {
+			frame_skip--;
+		}
+		frame_skip_frames = 0;
+		frame_skip_lag = 0;
+	}
+
+	// Draw one frame, then skip 'frame_skip' frames
+	if (frame_skip_count < frame_skip) {
+		frame_skip_count++;
+		return true;
+	}
+	frame_skip_count = 0;
+	return false;
 }
 
 /**
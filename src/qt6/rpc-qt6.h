@@ -32,6 +32,7 @@
 extern QAtomicInt instruction_count;
 extern QAtomicInt iomd_timer_count; ///< IOMD timer counter shared between Emulator and GUI threads
 extern QAtomicInt video_timer_count; ///< Video timer counter shared between Emulator and GUI threads
+extern QAtomicInt video_skip_count; ///< Skipped frame counter shared between Emulator and GUI threads
 
 extern int mouse_captured;
 extern Config *pconfig_copy;
@@ -120,10 +121,19 @@ public slots:
 	void nat_rule_remove(PortForwardRule rule);
 
 private:
+	void video_timer_event(qint64 elapsed);
+	bool frame_skip_check(qint64 elapsed);
+
 	QElapsedTimer elapsed_timer;
 	int32_t video_timer_interval;		///< Interval between video timer events (in nanoseconds)
 	qint64 iomd_timer_next;			///< Time after which the IOMD timer should trigger
 	qint64 video_timer_next;		///< Time after which the video timer should trigger
+
+	// Adaptive frame skipping
+	int frame_skip;				///< Number of frames skipped for each frame drawn
+	int frame_skip_count;			///< Frames skipped since the last frame drawn
+	int frame_skip_frames;			///< Frames since frame_skip was last adjusted
+	qint64 frame_skip_lag;			///< Largest lag behind real time since frame_skip was last adjusted
 };
 
 #endif /* RPC_QT6_H */
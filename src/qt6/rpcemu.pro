@@ -18,16 +18,24 @@ QMAKE_CXXFLAGS += -Werror=switch -fno-common -std=gnu++17
 
 HEADERS =	../superio.h \
 		../cdrom-iso.h \
+		../cdimage.h \
 		../cmos.h \
 		../cp15.h \
 		../fdc.h \
 		../hostfs.h \
 		../hostfs_internal.h \
 		../ide.h \
+		../hdimage.h \
+		../hdfile.h \
+		../lz.h \
+		../hostio.h \
+		../blockdev.h \
 		../iomd.h \
 		../keyboard.h \
 		../mem.h \
 		../sound.h \
+		../resample.h \
+		../capture.h \
 		../vidc20.h \
 		../arm_common.h \
 		../arm.h \
@@ -43,18 +51,26 @@ HEADERS =	../superio.h \
 
 SOURCES =	../superio.c \
 		../cdrom-iso.c \
+		../cdimage.c \
 		../cmos.c \
 		../cp15.c \
 		../fdc.c \
 		../fpa.c \
 		../hostfs.c \
 		../ide.c \
+		../hdimage.c \
+		../hdfile.c \
+		../lz.c \
+		../hostio.c \
+		../blockdev.c \
 		../iomd.c \
 		../keyboard.c \
 		../mem.c \
 		../romload.c \
 		../rpcemu.c \
 		../sound.c \
+		../resample.c \
+		../capture.c \
 		../vidc20.c \
 		../podules.c \
 		../podulerom.c \
@@ -76,6 +92,7 @@ SOURCES =	../superio.c \
 # NAT Networking
 linux | win32 | wasm {
 	HEADERS +=	../network-nat.h \
+			../network-queue.h \
 			nat_edit_dialog.h \
 			nat_list_dialog.h
 	SOURCES += 	../network-nat.c \
@@ -173,7 +190,7 @@ wasm {
 }
 
 wasm {
-	QT_WASM_PTHREAD_POOL_SIZE = 3
+	QT_WASM_PTHREAD_POOL_SIZE = 4
 
 	QMAKE_LFLAGS += -no-mimetype-database -lidbfs.js \
 			--preload-file ../../roms/riscos@/roms/riscos \
@@ -170,9 +170,15 @@ config_load(Config * config)
 	}
 
 	config->soundenabled = settings.value("sound_enabled", "1").toInt();
+	config->sound_periods     = settings.value("sound_periods", "4").toInt();
+	config->sound_period_size = settings.value("sound_period_size", "2205").toInt();
+	config->hd_mmap      = settings.value("hd_mmap", "0").toInt();
 	config->refresh      = settings.value("refresh_rate", "60").toInt();
+	config->adaptive_frameskip = settings.value("adaptive_frameskip", "0").toInt();
 	config->cdromenabled = settings.value("cdrom_enabled", "0").toInt();
 	config->cdromtype    = settings.value("cdrom_type", "0").toInt();
+	config->cdrom_readahead = settings.value("cdrom_readahead", "32").toInt();
+	config->cdrom_mmap   = settings.value("cdrom_mmap", "0").toInt();
 
 	sText = settings.value("cdrom_iso", "").toString();
 	ba = sText.toUtf8();
@@ -283,9 +289,15 @@ config_save(Config *config)
 	}
 
 	settings.setValue("sound_enabled",   config->soundenabled);
+	settings.setValue("sound_periods",   config->sound_periods);
+	settings.setValue("sound_period_size", config->sound_period_size);
+	settings.setValue("hd_mmap",         config->hd_mmap);
 	settings.setValue("refresh_rate",    config->refresh);
+	settings.setValue("adaptive_frameskip", config->adaptive_frameskip);
 	settings.setValue("cdrom_enabled",   config->cdromenabled);
 	settings.setValue("cdrom_type",      config->cdromtype);
+	settings.setValue("cdrom_readahead", config->cdrom_readahead);
+	settings.setValue("cdrom_mmap",      config->cdrom_mmap);
 	settings.setValue("cdrom_iso",       QString(config->isoname));
 	settings.setValue("mouse_following", config->mousehackon);
 	settings.setValue("mouse_twobutton", config->mousetwobutton);
@@ -0,0 +1,277 @@
+/*
+  RPCEmu - An Acorn system emulator
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Sample rate conversion of the guest's sound output to the host's rate
+
+   A polyphase windowed-sinc filter. The filter bank holds RESAMPLE_PHASES
+   sets of RESAMPLE_TAPS coefficients, one for each fractional position
+   between two input samples; output samples falling between two phases are
+   linearly interpolated from both. The cut-off frequency is placed below
+   the lower of the two Nyquist frequencies, so the same filter serves for
+   both upsampling and downsampling.
+*/
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+#include "rpcemu.h"
+#include "resample.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/**
+ * Dot product of RESAMPLE_TAPS input samples with a set of coefficients.
+ *
+ * @param x Input samples
+ * @param h Filter coefficients
+ * @return Filtered sample
+ */
+static inline float
+resample_dot(const float *x, const float *h)
+{
+#if defined(__SSE__)
+	__m128 acc = _mm_mul_ps(_mm_loadu_ps(x), _mm_loadu_ps(h));
+	int j;
+
+	for (j = 4; j < RESAMPLE_TAPS; j += 4) {
+		acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(x + j), _mm_loadu_ps(h + j)));
+	}
+
+	/* Horizontal sum of the four lanes */
+	acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+	acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 0x55));
+	return _mm_cvtss_f32(acc);
+#else
+	/* Four independent sums, so the compiler can vectorise this */
+	float acc[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	int j, k;
+
+	for (j = 0; j < RESAMPLE_TAPS; j += 4) {
+		for (k = 0; k < 4; k++) {
+			acc[k] += x[j + k] * h[j + k];
+		}
+	}
+	return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+#endif
+}
+
+/**
+ * Convert a filtered sample back to 16-bit, with saturation.
+ *
+ * @param v Sample value
+ * @return 16-bit sample
+ */
+static inline int16_t
+resample_clip(float v)
+{
+	if (v >= 32767.0f) {
+		return 32767;
+	}
+	if (v <= -32768.0f) {
+		return -32768;
+	}
+	return (int16_t) lrintf(v);
+}
+
+/**
+ * Initialise a resampler. It will convert between equal rates until
+ * resample_set_rates() is called.
+ *
+ * @param rs            Resampler to initialise
+ * @param max_in_frames Largest number of frames passed to one call of
+ *                      resample_process()
+ */
+void
+resample_init(Resampler *rs, uint32_t max_in_frames)
+{
+	int ch;
+
+	assert(rs);
+
+	memset(rs, 0, sizeof(Resampler));
+
+	rs->work_frames = (RESAMPLE_TAPS - 1) + max_in_frames;
+	for (ch = 0; ch < 2; ch++) {
+		rs->work[ch] = calloc(rs->work_frames, sizeof(float));
+		if (rs->work[ch] == NULL) {
+			fatal("Out of memory for sound resampler");
+		}
+	}
+
+	resample_set_rates(rs, 44100, 44100);
+}
+
+/**
+ * Free the memory used by a resampler.
+ *
+ * @param rs Resampler
+ */
+void
+resample_free(Resampler *rs)
+{
+	assert(rs);
+
+	free(rs->work[0]);
+	free(rs->work[1]);
+	rs->work[0] = NULL;
+	rs->work[1] = NULL;
+}
+
+/**
+ * Change the input and output rates, recalculating the filter bank.
+ * Samples already held in the history are kept, so the change is smooth.
+ *
+ * @param rs       Resampler
+ * @param in_rate  Input sample rate in Hz
+ * @param out_rate Output sample rate in Hz
+ */
+void
+resample_set_rates(Resampler *rs, uint32_t in_rate, uint32_t out_rate)
+{
+	double cutoff;
+	int phase, j;
+
+	assert(rs);
+	assert(in_rate > 0);
+	assert(out_rate > 0);
+
+	rs->in_rate = in_rate;
+	rs->out_rate = out_rate;
+	rs->step = ((uint64_t) in_rate << 32) / out_rate;
+
+	/* Cut-off as a fraction of the input rate, a little below the lower
+	   Nyquist frequency to leave room for the transition band */
+	cutoff = 0.45;
+	if (out_rate < in_rate) {
+		cutoff *= (double) out_rate / (double) in_rate;
+	}
+
+	for (phase = 0; phase <= RESAMPLE_PHASES; phase++) {
+		const double frac = (double) phase / (double) RESAMPLE_PHASES;
+		double sum = 0.0;
+
+		for (j = 0; j < RESAMPLE_TAPS; j++) {
+			/* Distance in input samples from the output position,
+			   which lies 'frac' after tap (RESAMPLE_TAPS / 2 - 1) */
+			const double x = (double) (j - (RESAMPLE_TAPS / 2 - 1)) - frac;
+			const double t = 2.0 * M_PI * cutoff * x;
+			const double sinc = (x == 0.0) ? 1.0 : sin(t) / t;
+			/* Blackman window, centred on the output position */
+			const double w = (x + RESAMPLE_TAPS / 2) / RESAMPLE_TAPS;
+			const double window = 0.42 - 0.5 * cos(2.0 * M_PI * w) + 0.08 * cos(4.0 * M_PI * w);
+			const double h = sinc * window;
+
+			rs->coeffs[phase][j] = (float) h;
+			sum += h;
+		}
+
+		/* Normalise to unity gain */
+		for (j = 0; j < RESAMPLE_TAPS; j++) {
+			rs->coeffs[phase][j] = (float) (rs->coeffs[phase][j] / sum);
+		}
+	}
+}
+
+/**
+ * Return the most frames that can be produced from the given number of input
+ * frames at the current rates.
+ *
+ * @param rs        Resampler
+ * @param in_frames Number of input frames
+ * @return Maximum number of output frames
+ */
+uint32_t
+resample_max_output(const Resampler *rs, uint32_t in_frames)
+{
+	assert(rs);
+
+	return (uint32_t) (((uint64_t) in_frames * rs->out_rate) / rs->in_rate) + 2;
+}
+
+/**
+ * Convert a block of interleaved stereo 16-bit samples.
+ *
+ * @param rs         Resampler
+ * @param in         Input samples
+ * @param in_frames  Number of input frames (sample pairs)
+ * @param out        Buffer for output samples
+ * @param out_frames Capacity of out in frames, at least
+ *                   resample_max_output(rs, in_frames)
+ * @return Number of frames written to out
+ */
+uint32_t
+resample_process(Resampler *rs, const int16_t *in, uint32_t in_frames,
+                 int16_t *out, uint32_t out_frames)
+{
+	const uint32_t total = (RESAMPLE_TAPS - 1) + in_frames;
+	const uint32_t frac_bits = 32 - RESAMPLE_PHASE_BITS;
+	float *left, *right;
+	uint64_t pos;
+	uint32_t written = 0;
+	uint32_t base, i;
+
+	assert(rs);
+	assert(in_frames <= rs->work_frames - (RESAMPLE_TAPS - 1));
+	assert(out_frames >= resample_max_output(rs, in_frames));
+	NOT_USED(out_frames);
+
+	left = rs->work[0];
+	right = rs->work[1];
+	pos = rs->pos;
+
+	/* Append the new input, deinterleaved, after the history */
+	for (i = 0; i < in_frames; i++) {
+		left[(RESAMPLE_TAPS - 1) + i] = (float) in[i * 2];
+		right[(RESAMPLE_TAPS - 1) + i] = (float) in[i * 2 + 1];
+	}
+
+	/* Produce output while all the taps are within the available input */
+	while ((uint32_t) (pos >> 32) + RESAMPLE_TAPS <= total) {
+		const uint32_t index = (uint32_t) (pos >> 32);
+		const uint32_t frac = (uint32_t) pos;
+		const uint32_t phase = frac >> frac_bits;
+		/* Position between this phase and the next, 0.0 to 1.0 */
+		const float t = (float) (frac & ((1u << frac_bits) - 1)) * (1.0f / (float) (1u << frac_bits));
+		const float l0 = resample_dot(&left[index], rs->coeffs[phase]);
+		const float l1 = resample_dot(&left[index], rs->coeffs[phase + 1]);
+		const float r0 = resample_dot(&right[index], rs->coeffs[phase]);
+		const float r1 = resample_dot(&right[index], rs->coeffs[phase + 1]);
+
+		out[written * 2]     = resample_clip(l0 + (l1 - l0) * t);
+		out[written * 2 + 1] = resample_clip(r0 + (r1 - r0) * t);
+		written++;
+
+		pos += rs->step;
+	}
+
+	/* Keep the last (RESAMPLE_TAPS - 1) frames as history for next time */
+	base = total - (RESAMPLE_TAPS - 1);
+	memmove(left, &left[base], (RESAMPLE_TAPS - 1) * sizeof(float));
+	memmove(right, &right[base], (RESAMPLE_TAPS - 1) * sizeof(float));
+	rs->pos = pos - ((uint64_t) base << 32);
+
+	return written;
+}
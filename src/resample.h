@@ -0,0 +1,54 @@
+/*
+  RPCEmu - An Acorn system emulator
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#define RESAMPLE_TAPS	16	/**< Filter taps per phase, must be a multiple of 4 */
+#define RESAMPLE_PHASE_BITS	7	/**< log2 of the number of filter phases */
+#define RESAMPLE_PHASES	(1 << RESAMPLE_PHASE_BITS) /**< Number of filter phases between two input samples */
+
+/** State of a stereo 16-bit sample rate converter */
+typedef struct {
+	uint32_t in_rate;	/**< Input sample rate in Hz */
+	uint32_t out_rate;	/**< Output sample rate in Hz */
+	uint64_t step;		/**< Input frames advanced per output frame (32.32 fixed point) */
+	uint64_t pos;		/**< Position of next output frame in work[] (32.32 fixed point) */
+	float coeffs[RESAMPLE_PHASES + 1][RESAMPLE_TAPS]; /**< Polyphase filter bank */
+	float *work[2];		/**< Per-channel history followed by new input */
+	uint32_t work_frames;	/**< Capacity of each work[] array in frames */
+} Resampler;
+
+extern void resample_init(Resampler *rs, uint32_t max_in_frames);
+extern void resample_free(Resampler *rs);
+extern void resample_set_rates(Resampler *rs, uint32_t in_rate, uint32_t out_rate);
+extern uint32_t resample_max_output(const Resampler *rs, uint32_t in_frames);
+extern uint32_t resample_process(Resampler *rs, const int16_t *in, uint32_t in_frames,
+                                 int16_t *out, uint32_t out_frames);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* RESAMPLE_H */
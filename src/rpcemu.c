@@ -38,6 +38,7 @@
 #include "vidc20.h"
 #include "keyboard.h"
 #include "sound.h"
+#include "capture.h"
 #include "mem.h"
 #include "iomd.h"
 #include "ide.h"
@@ -52,6 +53,7 @@
 #include "podules.h"
 #include "fdc.h"
 #include "hostfs.h"
+#include "blockdev.h"
 #include "disc.h"
 #include "disc_adf.h"
 #include "disc_hfe.h"
@@ -85,10 +87,16 @@ Config config = {
 	NULL,			/* macaddress */
 	NULL,			/* bridgename */
 	0,			/* refresh */
+	0,			/* adaptive_frameskip */
 	1,			/* soundenabled */
+	4,			/* sound_periods */
+	2205,			/* sound_period_size */
+	0,			/* hd_mmap */
 	1,			/* cdromenabled */
 	0,			/* cdromtype  -- Only used on Windows build */
 	"",			/* isoname */
+	32,			/* cdrom_readahead */
+	0,			/* cdrom_mmap */
 	1,			/* mousehackon */
 	0,			/* mousetwobutton */
 	NetworkType_Off,	/* network_type */
@@ -210,6 +218,7 @@ resetrpc(void)
 
         reseti2c(machine.i2c_devices);
         resetide();
+        blockdev_reset();
         superio_reset(machine.super_type);
 	i8042_reset();
 	cmos_reset();
@@ -476,8 +485,10 @@ rpcemu_idle(void)
 void
 endrpcemu(void)
 {
-        sound_thread_close();
+        capture_stop();
+        sound_close();
         closevideo();
+        ide_close();
         iomd_end();
         fdc_image_save(discname[0], 0);
         fdc_image_save(discname[1], 1);
@@ -122,10 +122,16 @@ typedef struct {
 	char *macaddress;
 	char *bridgename;
 	int refresh;		/**< Video refresh rate */
+	int adaptive_frameskip;	/**< Skip drawing frames when the emulator is falling behind */
 	int soundenabled;
+	int sound_periods;	/**< Number of periods in the sound buffer ring */
+	int sound_period_size;	/**< Size of each sound buffer period, in stereo samples */
+	int hd_mmap;		/**< Map hard disc images into memory, rather than reading and writing them */
 	int cdromenabled;
 	int cdromtype;
 	char isoname[512];
+	int cdrom_readahead;	/**< Sectors read ahead from CD-ROM images once reading is sequential */
+	int cdrom_mmap;		/**< Map CD-ROM images into memory, rather than reading them */
 	int mousehackon;
 	int mousetwobutton;	/**< Swap the behaviour of the right and middle
 	                             buttons, for mice with two buttons */
@@ -228,7 +234,7 @@ extern int rpcemu_config_is_reset_required(const Config *new_config, Model new_m
 extern void rpcemu_config_apply_new_settings(Config *new_config, Model new_model);
 
 /* rpc-qt6.cpp */
-extern void rpcemu_video_update(const uint32_t *buffer, int xsize, int ysize, int yl, int yh, int double_size, int host_xsize, int host_ysize);
+extern void rpcemu_video_update(void);
 extern void rpcemu_move_host_mouse(uint16_t x, uint16_t y);
 extern void rpcemu_idle_process_events(void);
 extern void rpcemu_send_nat_rule_to_gui(PortForwardRule rule);
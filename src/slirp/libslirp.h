@@ -12,6 +12,16 @@
 struct Slirp;
 typedef struct Slirp Slirp;
 
+/*
+ * Counts of mbuf allocations the pools could not satisfy, which are
+ * malloc()ed instead
+ */
+struct mbuf_stats {
+    unsigned int pool_misses;  /* m_get() found no free mbuf */
+    unsigned int ext_misses;   /* m_inc() found no free buffer of the class */
+    unsigned int ext_oversize; /* m_inc() asked for more than the largest class */
+};
+
 int get_dns_addr(struct in_addr *pdns_addr);
 
 Slirp *slirp_init(int restricted, struct in_addr vnetwork,
@@ -20,6 +30,7 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
                   const char *bootfile, struct in_addr vdhcp_start,
                   struct in_addr vnameserver, void *opaque);
 void slirp_cleanup(Slirp *slirp);
+void slirp_get_mbuf_stats(Slirp *slirp, struct mbuf_stats *stats);
 
 void slirp_select_fill(Slirp *slirp, int *pnfds,
                        fd_set *readfds, fd_set *writefds, fd_set *xfds);
@@ -27,12 +38,14 @@ void slirp_select_fill(Slirp *slirp, int *pnfds,
 void slirp_select_poll(Slirp *slirp,
                        fd_set *readfds, fd_set *writefds, fd_set *xfds,
                        int select_error);
+int slirp_select_timeout(Slirp *slirp);
 
 void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len);
 
 /* you must provide the following functions: */
 int slirp_can_output(void *opaque);
 void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len);
+void slirp_socket_closed(int fd);
 
 int slirp_add_hostfwd(Slirp *slirp, int is_udp,
                       struct in_addr host_addr, int host_port,
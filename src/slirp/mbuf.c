@@ -17,28 +17,85 @@
 
 #include "slirp.h"
 
-#define MBUF_THRESH 30
-
 /*
  * Find a nice value for msize
  * XXX if_maxlinkhdr already in mtu
  */
 #define SLIRP_MSIZE (IF_MTU + IF_MAXLINKHDR + offsetof(struct mbuf, m_dat) + 6)
 
+/* Spacing of the preallocated mbufs, keeping each one aligned */
+#define MBUF_POOL_STRIDE ((SLIRP_MSIZE + 15) & ~(size_t) 15)
+
+/*
+ * Sizes of the M_EXT data buffers kept for reuse. An mbuf grown by
+ * m_cat() lands in the first, and a full size UDP datagram or
+ * reassembled IP packet in the last. Larger buffers are always malloced.
+ */
+static const int m_ext_sizes[MBUF_EXT_CLASSES] = { 8192, 16384, 65536 + MINCSIZE };
+
+/*
+ * Preallocate the mbufs. If that fails, every mbuf is malloced
+ * on demand instead.
+ */
 void
 m_init(Slirp *slirp)
 {
+    int i;
+
     slirp->m_freelist.m_next = slirp->m_freelist.m_prev = &slirp->m_freelist;
     slirp->m_usedlist.m_next = slirp->m_usedlist.m_prev = &slirp->m_usedlist;
+
+    slirp->m_pool = (char *)malloc(MBUF_POOL_SIZE * MBUF_POOL_STRIDE);
+    if (slirp->m_pool == NULL)
+        return;
+
+    for (i = 0; i < MBUF_POOL_SIZE; i++) {
+        struct mbuf *m = (struct mbuf *)(slirp->m_pool + i * MBUF_POOL_STRIDE);
+
+        m->slirp = slirp;
+        m->m_flags = M_FREELIST;
+        insque(m, &slirp->m_freelist);
+    }
+}
+
+/*
+ * Release the pools, and the mbufs still on the used list
+ */
+void
+m_cleanup(Slirp *slirp)
+{
+    struct mbuf *m, *next;
+    int i;
+
+    for (m = slirp->m_usedlist.m_next; m != &slirp->m_usedlist; m = next) {
+        next = m->m_next;
+        if (m->m_flags & M_EXT)
+            free(m->m_ext);
+        if (m->m_flags & M_DOFREE)
+            free(m);
+    }
+
+    for (i = 0; i < MBUF_EXT_CLASSES; i++) {
+        while (slirp->m_extfree[i] != NULL) {
+            char *dat = slirp->m_extfree[i];
+
+            memcpy(&slirp->m_extfree[i], dat, sizeof(char *));
+            free(dat);
+        }
+        slirp->m_extfree_count[i] = 0;
+    }
+
+    free(slirp->m_pool);
+    slirp->m_pool = NULL;
 }
 
 /*
  * Get an mbuf from the free list, if there are none
  * malloc one
  *
- * Because fragmentation can occur if we alloc new mbufs and
- * free old mbufs, we mark all mbufs above mbuf_thresh as M_DOFREE,
- * which tells m_free to actually free() it
+ * The pool is the only source of mbufs in normal use, so any that
+ * are malloced when it runs dry are marked M_DOFREE, which tells
+ * m_free to actually free() it
  */
 struct mbuf *
 m_get(Slirp *slirp)
@@ -52,8 +109,10 @@ m_get(Slirp *slirp)
 		m = (struct mbuf *)malloc(SLIRP_MSIZE);
 		if (m == NULL) goto end_error;
 		slirp->mbuf_alloced++;
-		if (slirp->mbuf_alloced > MBUF_THRESH)
-			flags = M_DOFREE;
+		slirp->m_stats.pool_misses++;
+		DEBUG_MISC((dfd, " mbuf pool empty, %d extra mbufs in use\n",
+			    slirp->mbuf_alloced));
+		flags = M_DOFREE;
 		m->slirp = slirp;
 	} else {
 		m = slirp->m_freelist.m_next;
@@ -75,6 +134,69 @@ end_error:
 	return m;
 }
 
+/*
+ * Find the size class of an M_EXT buffer of the given size,
+ * or -1 if it is larger than any class
+ */
+static int
+m_ext_class(int size)
+{
+	int i;
+
+	for (i = 0; i < MBUF_EXT_CLASSES; i++) {
+		if (size <= m_ext_sizes[i])
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Get an M_EXT buffer of exactly the size of a class, or of
+ * the given size if it is larger than any class
+ */
+static char *
+m_ext_get(Slirp *slirp, int size)
+{
+	int class = m_ext_class(size);
+	char *dat;
+
+	if (class < 0) {
+		slirp->m_stats.ext_oversize++;
+		return (char *)malloc(size);
+	}
+
+	dat = slirp->m_extfree[class];
+	if (dat == NULL) {
+		slirp->m_stats.ext_misses++;
+		return (char *)malloc(m_ext_sizes[class]);
+	}
+
+	/* The free buffers are chained through their first bytes */
+	memcpy(&slirp->m_extfree[class], dat, sizeof(char *));
+	slirp->m_extfree_count[class]--;
+	return dat;
+}
+
+/*
+ * Return an M_EXT buffer from m_ext_get() for reuse, or free() it
+ * if enough of its class are already free
+ */
+static void
+m_ext_put(Slirp *slirp, char *dat, int size)
+{
+	int class = m_ext_class(size);
+
+	if (class < 0 || size != m_ext_sizes[class] ||
+	    slirp->m_extfree_count[class] >= MBUF_EXT_KEEP) {
+		free(dat);
+		return;
+	}
+
+	memcpy(dat, &slirp->m_extfree[class], sizeof(char *));
+	slirp->m_extfree[class] = dat;
+	slirp->m_extfree_count[class]++;
+}
+
 void
 m_free(struct mbuf *m)
 {
@@ -87,9 +209,9 @@ m_free(struct mbuf *m)
 	if (m->m_flags & M_USEDLIST)
 	   remque(m);
 
-	/* If it's M_EXT, free() it */
+	/* If it's M_EXT, give back its data buffer */
 	if (m->m_flags & M_EXT)
-	   free(m->m_ext);
+	   m_ext_put(m->slirp, m->m_ext, m->m_size);
 
 	/*
 	 * Either free() it or put it on the free list
@@ -130,25 +252,29 @@ void
 m_inc(struct mbuf *m, int size)
 {
 	int datasize;
+	char *dat;
 
 	/* some compiles throw up on gotos.  This one we can fake. */
         if(m->m_size>size) return;
 
+	/* Round up to the size class, so the buffer can be reused */
+	if (m_ext_class(size) >= 0)
+	  size = m_ext_sizes[m_ext_class(size)];
+
+	dat = m_ext_get(m->slirp, size);
+
         if (m->m_flags & M_EXT) {
 	  datasize = m->m_data - m->m_ext;
-	  m->m_ext = (char *)realloc(m->m_ext,size);
-	  m->m_data = m->m_ext + datasize;
+	  memcpy(dat, m->m_ext, m->m_size);
+	  m_ext_put(m->slirp, m->m_ext, m->m_size);
         } else {
-	  char *dat;
 	  datasize = m->m_data - m->m_dat;
-	  dat = (char *)malloc(size);
 	  memcpy(dat, m->m_dat, m->m_size);
-
-	  m->m_ext = dat;
-	  m->m_data = m->m_ext + datasize;
 	  m->m_flags |= M_EXT;
         }
 
+	m->m_ext = dat;
+	m->m_data = m->m_ext + datasize;
         m->m_size = size;
 
 }
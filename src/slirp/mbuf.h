@@ -38,6 +38,10 @@
 
 #define MINCSIZE 4096	/* Amount to increase mbuf if too small */
 
+#define MBUF_POOL_SIZE	256	/* mbufs preallocated for each Slirp */
+#define MBUF_EXT_CLASSES 3	/* Size classes of M_EXT data buffers */
+#define MBUF_EXT_KEEP	8	/* Free M_EXT buffers kept for reuse, per class */
+
 /*
  * Macros for type conversion
  * mtod(m,t) -	convert mbuf pointer to data pointer of correct type
@@ -116,6 +120,7 @@ struct mbuf {
 					 * it rather than putting it on the free list */
 
 void m_init(Slirp *);
+void m_cleanup(Slirp *);
 struct mbuf * m_get(Slirp *);
 void m_free(struct mbuf *);
 void m_cat(register struct mbuf *, register struct mbuf *);
@@ -85,6 +85,16 @@ int os_socket(int domain, int type, int protocol)
     return socket(domain, type, protocol);
 }
 
+#ifndef _WIN32
+/* Close a socket, first letting the application forget any state it
+ * holds about the descriptor, which may be reused straight away */
+int slirp_closesocket(int s)
+{
+    slirp_socket_closed(s);
+    return close(s);
+}
+#endif
+
 uint32_t os_get_time_ms(void)
 {
     struct timespec ts;
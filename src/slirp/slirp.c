@@ -238,11 +238,17 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
 
 void slirp_cleanup(Slirp *slirp)
 {
+    m_cleanup(slirp);
     free(slirp->tftp_prefix);
     free(slirp->bootp_filename);
     free(slirp);
 }
 
+void slirp_get_mbuf_stats(Slirp *slirp, struct mbuf_stats *stats)
+{
+    *stats = slirp->m_stats;
+}
+
 #define CONN_CANFSEND(so) (((so)->so_state & (SS_FCANTSENDMORE|SS_ISFCONNECTED)) == SS_ISFCONNECTED)
 #define CONN_CANFRCV(so) (((so)->so_state & (SS_FCANTRCVMORE|SS_ISFCONNECTED)) == SS_ISFCONNECTED)
 #define UPD_NFDS(x) if (nfds < (x)) nfds = (x)
@@ -365,6 +371,30 @@ void slirp_select_fill(Slirp *slirp, int *pnfds,
         *pnfds = nfds;
 }
 
+/*
+ * Milliseconds until slirp_select_poll() must next be called to run the
+ * TCP and IP timers, or -1 if none are due. Valid after slirp_select_fill().
+ */
+int slirp_select_timeout(Slirp *slirp)
+{
+    uint32_t now = os_get_time_ms();
+    int timeout = -1;
+
+    (void) slirp;
+
+    if (time_fasttimo) {
+        timeout = ((now - time_fasttimo) >= 2) ? 0 : (int) (2 - (now - time_fasttimo));
+    }
+    if (do_slowtimo) {
+        int t = ((now - last_slowtimo) >= 499) ? 0 : (int) (499 - (now - last_slowtimo));
+
+        if (timeout < 0 || t < timeout) {
+            timeout = t;
+        }
+    }
+    return timeout;
+}
+
 void slirp_select_poll(Slirp *slirp,
                        fd_set *readfds, fd_set *writefds, fd_set *xfds,
                        int select_error)
@@ -738,7 +768,7 @@ int slirp_remove_hostfwd(Slirp *slirp, int is_udp, struct in_addr host_addr,
             getsockname(so->s, (struct sockaddr *)&addr, &addr_len) == 0 &&
             addr.sin_addr.s_addr == host_addr.s_addr &&
             addr.sin_port == port) {
-            close(so->s);
+            closesocket(so->s);
             sofree(so);
             return 0;
         }
@@ -25,7 +25,8 @@ typedef char *caddr_t;
 # define ECONNREFUSED WSAECONNREFUSED
 #else
 # define ioctlsocket ioctl
-# define closesocket(s) close(s)
+# define closesocket(s) slirp_closesocket(s)
+int slirp_closesocket(int s);
 # if !defined(__HAIKU__)
 #  define O_BINARY 0
 # endif
@@ -186,7 +187,11 @@ struct Slirp {
 
     /* mbuf states */
     struct mbuf m_freelist, m_usedlist;
-    int mbuf_alloced;
+    int mbuf_alloced;       /* mbufs malloced because the pool was empty */
+    char *m_pool;           /* preallocated mbufs */
+    char *m_extfree[MBUF_EXT_CLASSES]; /* free M_EXT buffers of each class */
+    int m_extfree_count[MBUF_EXT_CLASSES];
+    struct mbuf_stats m_stats;
 
     /* if states */
     int if_queued;          /* number of packets queued so far */
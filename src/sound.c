@@ -20,27 +20,71 @@
 
 /* Sound emulation */
 #include <assert.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "rpcemu.h"
 #include "mem.h"
 #include "iomd.h"
+#include "resample.h"
+#include "capture.h"
+#include "cdrom-iso.h"
 
 #include "sound.h"
 
+#define SOUND_CD_RATE	44100	/**< Sample rate of CD audio */
+#define SOUND_CD_FRAMES	588	/**< Stereo samples in one CD sector */
+
 uint32_t soundaddr[4];
 static uint32_t samplefreq = 41666;
 int soundinited, soundlatch, soundcount;
 
-#define BUFFERLENSAMPLES (4410)
-#define BUFFERLENBYTES (BUFFERLENSAMPLES * 2)
-static int16_t bigsoundbuffer[4][BUFFERLENSAMPLES]; /**< Temp store, used to buffer
-                                                      data between the emulated sound
-                                                       and platform */
-static int bigsoundpos = 0;
-static int bigsoundbufferhead = 0; // sound buffer being written to
-static int bigsoundbuffertail = 0; // sound buffer being read from
+/* Ring of periods of sound data, used to buffer data between the emulated
+   sound (the emulator thread, the only writer) and the platform (the sound
+   thread, the only reader). The head and tail are free-running counts of
+   periods written and read, so no locking is needed: the ring is empty when
+   they are equal, and full when they differ by sound_periods. */
+static int16_t *sound_ring = NULL;
+static uint32_t *sound_ring_rate = NULL;	/**< Sample rate of each period in the ring */
+static uint32_t sound_periods;			/**< Number of periods in the ring */
+static uint32_t sound_period_samples;		/**< Size of one period in 16-bit samples */
+static atomic_uint sound_ring_head;		/**< Periods written, by the emulator thread */
+static atomic_uint sound_ring_tail;		/**< Periods read, by the sound thread */
+static uint32_t sound_ring_pos = 0;		/**< Samples written to the period at the head */
+
+/* Conversion of the ring's data to the host's sample rate, so the platform
+   audio output stays open at one rate whatever the guest selects. Owned by
+   the sound thread. */
+static Resampler sound_resampler;
+static uint32_t sound_host_rate;		/**< Sample rate of the platform audio output */
+static int16_t *sound_out = NULL;		/**< Resampled data waiting to be played */
+static uint32_t sound_out_frames = 0;		/**< Capacity of sound_out in stereo samples */
+static uint32_t sound_out_pos = 0;		/**< Bytes of sound_out already played */
+static uint32_t sound_out_len = 0;		/**< Bytes of sound_out that are valid */
+
+/* CD audio, from an image's audio tracks, converted to the host's rate and
+   mixed into the output. Owned by the sound thread. */
+static Resampler sound_cd_resampler;
+static int16_t sound_cd_in[SOUND_CD_FRAMES * 2];	/**< One sector of CD audio */
+static int16_t *sound_cd = NULL;		/**< Converted CD audio waiting to be mixed */
+static uint32_t sound_cd_frames = 0;		/**< Capacity of sound_cd in stereo samples */
+static uint32_t sound_cd_len = 0;		/**< Stereo samples of sound_cd that are valid */
 
+static atomic_uint sound_underruns;		/**< Times the platform ran out of data */
+static atomic_uint sound_overruns;		/**< Times the ring was full when the guest had data */
+
+/**
+ * Get pointer to the start of the given period in the ring.
+ *
+ * @param count Free-running count of the period
+ * @return Pointer to sample data
+ */
+static inline int16_t *
+sound_ring_period(uint32_t count)
+{
+	return sound_ring + (count % sound_periods) * sound_period_samples;
+}
 
 /**
  * Called on program startup to initialise the sound system
@@ -48,6 +92,31 @@ static int bigsoundbuffertail = 0; // sound buffer being read from
 void
 sound_init(void)
 {
+	/* Size the ring from the configuration, clamped to sensible values */
+	sound_periods = (uint32_t) config.sound_periods;
+	if (sound_periods < SOUND_PERIODS_MIN) {
+		sound_periods = SOUND_PERIODS_MIN;
+	} else if (sound_periods > SOUND_PERIODS_MAX) {
+		sound_periods = SOUND_PERIODS_MAX;
+	}
+	sound_period_samples = (uint32_t) config.sound_period_size * 2;
+	if (sound_period_samples < SOUND_PERIOD_SIZE_MIN * 2) {
+		sound_period_samples = SOUND_PERIOD_SIZE_MIN * 2;
+	} else if (sound_period_samples > SOUND_PERIOD_SIZE_MAX * 2) {
+		sound_period_samples = SOUND_PERIOD_SIZE_MAX * 2;
+	}
+
+	sound_ring = calloc(sound_periods * sound_period_samples, sizeof(int16_t));
+	sound_ring_rate = calloc(sound_periods, sizeof(uint32_t));
+	if (sound_ring == NULL || sound_ring_rate == NULL) {
+		fatal("Out of memory for sound buffer");
+	}
+	atomic_init(&sound_ring_head, 0);
+	atomic_init(&sound_ring_tail, 0);
+	sound_ring_pos = 0;
+
+	rpclog("Sound: %u periods of %u samples\n", sound_periods, sound_period_samples / 2);
+
 	/* Call the platform code to create a thread for handing sound updates */
 	sound_thread_start();
 
@@ -55,7 +124,53 @@ sound_init(void)
 	samplefreq = 41666;
 
 	/* Call the platform specific code to start the audio playing */
-	plt_sound_init(BUFFERLENBYTES);
+	plt_sound_init(sound_period_samples * sizeof(int16_t));
+
+	sound_host_rate = plt_sound_samplerate();
+	rpclog("Sound: host sample rate %uHz\n", sound_host_rate);
+
+	resample_init(&sound_resampler, sound_period_samples / 2);
+	resample_set_rates(&sound_resampler, samplefreq, sound_host_rate);
+
+	resample_init(&sound_cd_resampler, SOUND_CD_FRAMES);
+	resample_set_rates(&sound_cd_resampler, SOUND_CD_RATE, sound_host_rate);
+}
+
+/**
+ * Called on program shutdown to stop the sound system
+ */
+void
+sound_close(void)
+{
+	sound_thread_close();
+
+	rpclog("Sound: %u underruns, %u overruns\n",
+	       atomic_load(&sound_underruns), atomic_load(&sound_overruns));
+
+	resample_free(&sound_resampler);
+	resample_free(&sound_cd_resampler);
+
+	free(sound_cd);
+	sound_cd = NULL;
+	free(sound_out);
+	sound_out = NULL;
+	free(sound_ring_rate);
+	sound_ring_rate = NULL;
+	free(sound_ring);
+	sound_ring = NULL;
+}
+
+/**
+ * Read the counts of sound buffer underruns and overruns since startup.
+ *
+ * @param underruns Filled in with times the platform ran out of data
+ * @param overruns  Filled in with times the guest's data could not be buffered
+ */
+void
+sound_get_stats(uint32_t *underruns, uint32_t *overruns)
+{
+	*underruns = atomic_load(&sound_underruns);
+	*overruns = atomic_load(&sound_overruns);
 }
 
 /**
@@ -91,16 +206,9 @@ sound_pause(void)
 void
 sound_samplefreq_change(int newsamplefreq)
 {
-	if((uint32_t) newsamplefreq != samplefreq) {
-		int i;
-		/* to prevent queued data being played at the wrong frequency
-		   blank it */
-		for(i = 0; i < 4; i++) {
-			memset(bigsoundbuffer[i], 0, BUFFERLENBYTES);
-		}
-
-		samplefreq = (uint32_t) newsamplefreq;
-	}
+	/* Periods already queued keep the rate they were recorded at, the
+	   resampler is switched over when it reaches the new rate */
+	samplefreq = (uint32_t) newsamplefreq;
 }
 
 /**
@@ -114,17 +222,19 @@ void
 sound_irq_update(void)
 {
 	const uint32_t *ramp; /**< Pointer to which bank of RAM 'page' is in */
-        uint32_t page,start,end,temp;
+	const uint32_t *src;
+        uint32_t page,start,end,words;
         int offset = (iomd.sndstat & IOMD_DMA_STATUS_BUFFER) << 1;
         int len;
-        unsigned int c;
+	uint32_t head = atomic_load_explicit(&sound_ring_head, memory_order_relaxed);
+	int16_t *period;
 
-        // If bigsoundbufferhead is 1 less than bigsoundbuffertail, then
-        // the buffer list is full.
-        if (((bigsoundbufferhead + 1) & 3) == bigsoundbuffertail)
+        // If every period is waiting to be played, the ring is full
+        if (head - atomic_load_explicit(&sound_ring_tail, memory_order_acquire) >= sound_periods)
         {
+                atomic_fetch_add(&sound_overruns, 1);
                 soundcount += 4000;
-                // kick the sound thread to clear the list
+                // kick the sound thread to clear the ring
                 sound_thread_wakeup();
                 return;
         }
@@ -149,23 +259,111 @@ sound_irq_update(void)
 		ramp = ram00;
 	}
 
-        for (c = start; c < end; c += 4)
-        {
-                temp = ramp[((c + page) & mem_rammask) >> 2];
-                bigsoundbuffer[bigsoundbufferhead][bigsoundpos++] = (temp & 0xFFFF); //^0x8000;
-                bigsoundbuffer[bigsoundbufferhead][bigsoundpos++] = (temp >> 16); //&0x8000;
-                if (bigsoundpos >= (BUFFERLENSAMPLES))
-                {
-                        bigsoundbufferhead++;
-                        bigsoundbufferhead &= 3; /* if (bigsoundbufferhead > 3) { bigsoundbufferhead = 0; } */
-                        bigsoundpos = 0;
-                        sound_thread_wakeup();
-                }
-        }
+	/* The DMA buffer lies within one page, so is contiguous in host memory */
+	src = &ramp[((page + start) & mem_rammask) >> 2];
+	words = (end > start) ? ((end - start) >> 2) : 0;
+
+	period = sound_ring_period(head);
+	while (words > 0) {
+		/* Copy as much as fits in the current period in one go */
+		uint32_t run = (sound_period_samples - sound_ring_pos) / 2;
+		if (run > words) {
+			run = words;
+		}
+
+#ifdef _RPCEMU_BIG_ENDIAN
+		{
+			int16_t *dest = &period[sound_ring_pos];
+			uint32_t i;
+
+			for (i = 0; i < run; i++) {
+				dest[i * 2]     = (int16_t) (src[i] & 0xffff);
+				dest[i * 2 + 1] = (int16_t) (src[i] >> 16);
+			}
+		}
+#else
+		/* Each word holds a left and right sample, in the order they are
+		   stored in the ring */
+		memcpy(&period[sound_ring_pos], src, run * sizeof(uint32_t));
+#endif
+		src += run;
+		words -= run;
+		sound_ring_pos += run * 2;
+
+		if (sound_ring_pos >= sound_period_samples) {
+			/* Period complete, publish it to the sound thread */
+			sound_ring_rate[head % sound_periods] = samplefreq;
+			head++;
+			atomic_store_explicit(&sound_ring_head, head, memory_order_release);
+			sound_ring_pos = 0;
+			sound_thread_wakeup();
+
+			/* Stop if the ring is now full, the rest of this
+			   DMA buffer is dropped */
+			if (head - atomic_load_explicit(&sound_ring_tail, memory_order_acquire) >= sound_periods) {
+				atomic_fetch_add(&sound_overruns, 1);
+				break;
+			}
+			period = sound_ring_period(head);
+		}
+	}
+}
+
+/**
+ * Mix any CD audio being played into converted sound data.
+ *
+ * @param out    Stereo samples at the host's rate
+ * @param frames Number of stereo samples
+ * @thread sound
+ */
+static void
+sound_mix_cd(int16_t *out, uint32_t frames)
+{
+	uint32_t n, i;
+
+	/* Convert CD audio a sector at a time until there is enough */
+	while (sound_cd_len < frames) {
+		const uint32_t in = iso_audio_read(sound_cd_in, SOUND_CD_FRAMES);
+		uint32_t needed;
+
+		if (in == 0) {
+			break;
+		}
+		needed = sound_cd_len + resample_max_output(&sound_cd_resampler, in);
+		if (needed > sound_cd_frames) {
+			sound_cd = realloc(sound_cd, needed * 2 * sizeof(int16_t));
+			if (sound_cd == NULL) {
+				fatal("Out of memory for sound buffer");
+			}
+			sound_cd_frames = needed;
+		}
+		sound_cd_len += resample_process(&sound_cd_resampler, sound_cd_in, in,
+		                                 sound_cd + sound_cd_len * 2,
+		                                 sound_cd_frames - sound_cd_len);
+	}
+
+	if (sound_cd_len == 0) {
+		return;
+	}
+
+	n = (sound_cd_len < frames) ? sound_cd_len : frames;
+	for (i = 0; i < n * 2; i++) {
+		int32_t sample = (int32_t) out[i] + sound_cd[i];
+
+		if (sample > INT16_MAX) {
+			sample = INT16_MAX;
+		} else if (sample < INT16_MIN) {
+			sample = INT16_MIN;
+		}
+		out[i] = (int16_t) sample;
+	}
+	sound_cd_len -= n;
+	memmove(sound_cd, sound_cd + n * 2, sound_cd_len * 2 * sizeof(int16_t));
 }
 
 /**
- * Copy data from the temp store into the platform specific output sound buffer.
+ * Copy data from the temp store into the platform specific output sound buffer,
+ * converting it to the platform's sample rate.
  *
  * Called from host platform-specific sound thread function.
  * @thread sound 
@@ -173,18 +371,68 @@ sound_irq_update(void)
 void
 sound_buffer_update(void)
 {
-	while (bigsoundbuffertail != bigsoundbufferhead) {
-		if(plt_sound_buffer_free() >= (BUFFERLENBYTES)) {
+	const uint32_t period_frames = sound_period_samples / 2;
+	uint32_t tail = atomic_load_explicit(&sound_ring_tail, memory_order_relaxed);
+
+	for (;;) {
+		uint32_t rate, needed, frames;
+
+		/* Play as much converted data as the platform has room for */
+		if (sound_out_pos < sound_out_len) {
+			const int32_t buffer_free = plt_sound_buffer_free() & ~3; /* Whole stereo samples */
+			uint32_t length = sound_out_len - sound_out_pos;
+
+			if (buffer_free <= 0) {
+				/* Still playing previous block of data, no need to fill it up yet */
+				break;
+			}
+
+			/* If the platform had nothing left to play, it has
+			   run out of data */
+			if (config.soundenabled && buffer_free >= plt_sound_buffer_size()) {
+				atomic_fetch_add(&sound_underruns, 1);
+				capture_audio_underrun();
+			}
+
+			if (length > (uint32_t) buffer_free) {
+				length = (uint32_t) buffer_free;
+			}
 			if (config.soundenabled) {
-				plt_sound_buffer_play(samplefreq, (const char *) bigsoundbuffer[bigsoundbuffertail], BUFFERLENBYTES);  // write one buffer
+				plt_sound_buffer_play(sound_host_rate, (const char *) sound_out + sound_out_pos, length);
 			}
+			sound_out_pos += length;
+			continue;
+		}
 
-			bigsoundbuffertail++;
-			bigsoundbuffertail &= 3; /* if (bigsoundbuffertail > 3) { bigsoundbuffertail = 0; } */
-		} else {
-			/* Still playing previous block of data, no need to fill it up yet */
+		if (tail == atomic_load_explicit(&sound_ring_head, memory_order_acquire)) {
 			break;
 		}
+
+		/* Convert the next period to the platform's rate */
+		rate = sound_ring_rate[tail % sound_periods];
+		if (rate != sound_resampler.in_rate) {
+			resample_set_rates(&sound_resampler, rate, sound_host_rate);
+		}
+
+		needed = resample_max_output(&sound_resampler, period_frames);
+		if (needed > sound_out_frames) {
+			sound_out = realloc(sound_out, needed * 2 * sizeof(int16_t));
+			if (sound_out == NULL) {
+				fatal("Out of memory for sound buffer");
+			}
+			sound_out_frames = needed;
+		}
+
+		frames = resample_process(&sound_resampler, sound_ring_period(tail), period_frames,
+		                          sound_out, sound_out_frames);
+		sound_out_len = frames * 2 * sizeof(int16_t);
+		sound_out_pos = 0;
+
+		sound_mix_cd(sound_out, frames);
+
+		capture_audio(sound_out, frames, sound_host_rate);
+
+		tail++;
+		atomic_store_explicit(&sound_ring_tail, tail, memory_order_release);
 	}
 }
-
@@ -25,7 +25,15 @@
 extern "C" {
 #endif /* __cplusplus */
 
+/* Limits on the configured size of the sound buffer ring */
+#define SOUND_PERIODS_MIN	2
+#define SOUND_PERIODS_MAX	32
+#define SOUND_PERIOD_SIZE_MIN	256	/* In stereo sample pairs */
+#define SOUND_PERIOD_SIZE_MAX	16384	/* In stereo sample pairs */
+
 extern void sound_init(void);
+extern void sound_close(void);
+extern void sound_get_stats(uint32_t *underruns, uint32_t *overruns);
 
 extern void sound_restart(void);
 extern void sound_pause(void);
@@ -43,6 +51,8 @@ extern void plt_sound_init(uint32_t bufferlen);
 extern void plt_sound_restart(void);
 extern void plt_sound_pause(void);
 extern int32_t plt_sound_buffer_free(void);
+extern int32_t plt_sound_buffer_size(void);
+extern uint32_t plt_sound_samplerate(void);
 extern void plt_sound_buffer_play(uint32_t samplerate, const char *buffer, uint32_t length);
 
 #ifdef __cplusplus
@@ -0,0 +1,71 @@
+/*
+  RPCEmu - An Acorn system emulator
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Command line tool for converting CD-ROM images (ISO or BIN/CUE) to the
+   compressed format, which the emulator can load in the same way:
+
+     cdcompress compress game.cue game.cdz
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cdimage.h"
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+	        "Usage: %s compress <image> <output>   Write a compressed copy of an image\n"
+	        "       %s info <image>                List the tracks of an image\n",
+	        prog, prog);
+}
+
+int
+main(int argc, char **argv)
+{
+	int ret;
+
+	if (argc == 4 && strcmp(argv[1], "compress") == 0) {
+		ret = cdimage_compress(argv[2], argv[3]);
+	} else if (argc == 3 && strcmp(argv[1], "info") == 0) {
+		CdImage *img = cdimage_open(argv[2], 0, 0);
+		int i;
+
+		ret = (img != NULL) ? 0 : -1;
+		if (img != NULL) {
+			for (i = 0; i < cdimage_track_count(img); i++) {
+				const CdTrackInfo *info = cdimage_track(img, i);
+
+				printf("Track %2d: %s, start %d, %d sectors\n", info->number,
+				       info->audio ? "audio" : "data ", info->start, info->length);
+			}
+			printf("Lead-out: %d\n", cdimage_leadout(img));
+			cdimage_close(img);
+		}
+	} else {
+		usage(argv[0]);
+		return 2;
+	}
+
+	if (ret != 0) {
+		fprintf(stderr, "%s: %s\n", argv[0], cdimage_error());
+		return 1;
+	}
+	return 0;
+}
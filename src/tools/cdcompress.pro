@@ -0,0 +1,22 @@
+# Command line tool for compressing CD-ROM images
+# Build with: qmake cdcompress.pro && make
+
+TEMPLATE = app
+CONFIG += console
+CONFIG -= qt app_bundle
+
+INCLUDEPATH += ../
+
+QMAKE_CFLAGS += -std=gnu17
+
+HEADERS =	../cdimage.h \
+		../lz.h \
+		../hostio.h
+
+SOURCES =	cdcompress.c \
+		../cdimage.c \
+		../lz.c \
+		../hostio.c
+
+# Place exes in top level directory
+DESTDIR = ../..
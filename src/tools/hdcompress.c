@@ -0,0 +1,76 @@
+/*
+  RPCEmu - An Acorn system emulator
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Command line tool for converting hard disc images to and from the
+   compressed format
+
+   The emulator opens compressed images in the same way as plain ones, so
+   an image can be compressed in place of a machine's hd4.hdf:
+
+     hdcompress compress hd4.hdf hd4.tmp && mv hd4.tmp hd4.hdf
+
+   Compressing an already compressed image recovers space left behind by
+   rewritten blocks. The emulator must not be running on an image while it
+   is converted.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "hdfile.h"
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+	        "Usage: %s compress <image> <output>     Write a compressed copy of an image\n"
+	        "       %s decompress <image> <output>   Write a plain copy of an image\n"
+	        "       %s info <image>                  Describe a compressed image\n",
+	        prog, prog, prog);
+}
+
+int
+main(int argc, char **argv)
+{
+	int ret;
+
+	if (argc == 4 && strcmp(argv[1], "compress") == 0) {
+		ret = hdfile_convert(argv[2], argv[3], 1);
+	} else if (argc == 4 && strcmp(argv[1], "decompress") == 0) {
+		ret = hdfile_convert(argv[2], argv[3], 0);
+	} else if (argc == 3 && strcmp(argv[1], "info") == 0) {
+		int64_t size, stored;
+		uint32_t blocks;
+
+		ret = hdfile_compressed_info(argv[2], &size, &blocks, &stored);
+		if (ret == 0) {
+			printf("Image size: %lld bytes\n", (long long) size);
+			printf("Blocks stored: %u\n", blocks);
+			printf("Bytes stored: %lld\n", (long long) stored);
+		}
+	} else {
+		usage(argv[0]);
+		return 2;
+	}
+
+	if (ret != 0) {
+		fprintf(stderr, "%s: %s\n", argv[0], hdfile_error());
+		return 1;
+	}
+	return 0;
+}
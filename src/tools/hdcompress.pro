@@ -0,0 +1,22 @@
+# Command line tool for converting compressed hard disc images
+# Build with: qmake hdcompress.pro && make
+
+TEMPLATE = app
+CONFIG += console
+CONFIG -= qt app_bundle
+
+INCLUDEPATH += ../
+
+QMAKE_CFLAGS += -std=gnu17
+
+HEADERS =	../hdfile.h \
+		../lz.h \
+		../hostio.h
+
+SOURCES =	hdcompress.c \
+		../hdfile.c \
+		../lz.c \
+		../hostio.c
+
+# Place exes in top level directory
+DESTDIR = ../..
@@ -0,0 +1,79 @@
+/*
+  RPCEmu - An Acorn system emulator
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Command line tool for managing copy-on-write overlay hard disc images
+
+   To share one base image between several machines, create an overlay in
+   place of each machine's hd4.hdf:
+
+     hdoverlay create hd4.hdf /path/to/golden.hdf
+
+   The emulator must not be running on an overlay while it is committed or
+   discarded, and nothing else may be using the base image while an overlay
+   is committed to it.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "hdfile.h"
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+	        "Usage: %s create <overlay> <base>   Create an empty overlay on a base image\n"
+	        "       %s commit <overlay>          Write the overlay's changes into its base image\n"
+	        "       %s discard <overlay>         Throw away the overlay's changes\n"
+	        "       %s info <overlay>            Describe an overlay\n",
+	        prog, prog, prog, prog);
+}
+
+int
+main(int argc, char **argv)
+{
+	int ret;
+
+	if (argc == 4 && strcmp(argv[1], "create") == 0) {
+		ret = hdfile_overlay_create(argv[2], argv[3]);
+	} else if (argc == 3 && strcmp(argv[1], "commit") == 0) {
+		ret = hdfile_overlay_commit(argv[2]);
+	} else if (argc == 3 && strcmp(argv[1], "discard") == 0) {
+		ret = hdfile_overlay_discard(argv[2]);
+	} else if (argc == 3 && strcmp(argv[1], "info") == 0) {
+		char base[1024];
+		int64_t size;
+		uint32_t blocks;
+
+		ret = hdfile_overlay_info(argv[2], base, sizeof(base), &size, &blocks);
+		if (ret == 0) {
+			printf("Base image: %s\n", base);
+			printf("Image size: %lld bytes\n", (long long) size);
+			printf("Blocks in overlay: %u\n", blocks);
+		}
+	} else {
+		usage(argv[0]);
+		return 2;
+	}
+
+	if (ret != 0) {
+		fprintf(stderr, "%s: %s\n", argv[0], hdfile_error());
+		return 1;
+	}
+	return 0;
+}
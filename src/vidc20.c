@@ -29,6 +29,7 @@
    Cirrus Logic CL-PS7500FE Advance Data Book
 */
 #include <assert.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,6 +37,7 @@
 #include "rpcemu.h"
 #include "cp15.h"
 #include "vidc20.h"
+#include "capture.h"
 #include "keyboard.h"
 #include "sound.h"
 #include "mem.h"
@@ -71,7 +73,7 @@ static struct cached_state {
         {
                 uint32_t r,g,b;
         } pal[256];
-	uint32_t *bitmap;
+	uint32_t *bitmap;		/**< Image data of the 'back' frame */
         uint32_t palette[256];		/**< Video Palette */
         uint32_t border_colour;		/**< Border Colour */
         uint32_t cursor_palette[3];	/**< Cursor Palette */
@@ -102,6 +104,35 @@ static uint8_t dirtybuffer2[512 * 4];
 /* Dirty buffer currently in use by main thread */
 uint8_t *dirtybuffer = dirtybuffer1;
 
+#define VIDEO_FRAMES	3	/**< Number of frames in the hand-off ring */
+#define FRAME_NEW	4	/**< Flag in frame_state, ready frame not yet seen by the GUI */
+
+/* Triple buffered hand-off of completed frames to the GUI.
+
+   Each frame is in one of three roles: 'back' is being drawn into by the
+   holder of the video mutex, 'ready' is the most recently completed frame,
+   and 'front' is being displayed by the GUI. Roles are exchanged by atomic
+   swaps of frame_state, so the GUI paints directly from the frame without
+   a copy, and neither side ever waits for the other. */
+static VideoFrame frames[VIDEO_FRAMES];
+static atomic_uint frame_state = 1;	/**< Index of the 'ready' frame, plus FRAME_NEW */
+static unsigned frame_back = 0;		/**< Index of the 'back' frame, owned by the holder of the video mutex */
+static unsigned frame_front = 2;	/**< Index of the 'front' frame, owned by the GUI thread */
+static uint32_t frame_seq = 0;		/**< Sequence number of last published frame */
+
+/* Rows of each frame that are out of date, because they have been redrawn in
+   other frames since this one was last drawn. Owned by the holder of the
+   video mutex. The range is empty when yh <= yl. */
+static struct {
+	int yl;
+	int yh;
+} frame_stale[VIDEO_FRAMES];
+
+/* Position of the cursor in the previous frame, the rows beneath it need to
+   be redrawn to remove it */
+static int oldcursorheight;
+static int oldcursory;
+
 
 /**
  * Obtain pointer to given row of image data buffer.
@@ -116,18 +147,121 @@ video_image_scanline(int row)
 }
 
 /**
- * Prepare and send a video update message to the GUI.
+ * Make the 'back' frame ready to be drawn into, reallocating it if the size
+ * of the display has changed since it was last drawn.
  *
- * thread: video
+ * Called when holding the video mutex.
+ */
+static void
+video_frame_prepare(void)
+{
+	VideoFrame *frame = &frames[frame_back];
+
+	if (frame->xsize != current_sizex || frame->ysize != current_sizey) {
+		frame->bitmap = realloc(frame->bitmap, current_sizex * current_sizey * sizeof(uint32_t));
+		if (frame->bitmap == NULL) {
+			fatal("Out of memory for video frame");
+		}
+		frame->xsize = current_sizex;
+		frame->ysize = current_sizey;
+
+		/* Contents are undefined, so all of it must be drawn */
+		frame_stale[frame_back].yl = 0;
+		frame_stale[frame_back].yh = current_sizey;
+	}
+
+	thr.bitmap = frame->bitmap;
+}
+
+/**
+ * Does the given row need to be drawn, regardless of the dirty buffer?
+ * True for rows beneath the previous cursor position, and rows that are
+ * out of date in the 'back' frame.
+ *
+ * @param y Row of image
+ * @return Non-zero if the row must be drawn
+ */
+static inline int
+video_row_forced(int y)
+{
+	return (y < (oldcursorheight + oldcursory) && y >= (oldcursory - 2)) ||
+	       (y >= frame_stale[frame_back].yl && y < frame_stale[frame_back].yh);
+}
+
+/**
+ * Publish the 'back' frame to the GUI and send a video update message.
+ *
+ * Called when holding the video mutex.
  *
- * @param yl
- * @param yh
+ * @param yl First row changed in this frame
+ * @param yh Row after the last row changed in this frame
  */
 static void
 video_update(int yl, int yh)
 {
-	rpcemu_video_update(thr.bitmap, current_sizex, current_sizey,
-	    yl, yh, thr.doublesize, thr.host_xsize, thr.host_ysize);
+	const unsigned published = frame_back;
+	VideoFrame *frame = &frames[published];
+	unsigned i;
+
+	frame->yl = yl;
+	frame->yh = yh;
+	frame->double_size = thr.doublesize;
+	frame->host_xsize = thr.host_xsize;
+	frame->host_ysize = thr.host_ysize;
+	frame->seq = ++frame_seq;
+
+	capture_video(frame);
+
+	/* Any out of date rows were drawn along with this frame */
+	frame_stale[published].yl = 0;
+	frame_stale[published].yh = 0;
+
+	/* Swap with the 'ready' frame, the previous 'ready' frame (which the GUI
+	   never saw, or has finished with) becomes the new 'back' frame */
+	frame_back = atomic_exchange(&frame_state, published | FRAME_NEW) & ~FRAME_NEW;
+
+	/* The rows changed in this frame are now out of date in the others */
+	for (i = 0; i < VIDEO_FRAMES; i++) {
+		if (i == published) {
+			continue;
+		}
+		if (frame_stale[i].yh <= frame_stale[i].yl) {
+			frame_stale[i].yl = yl;
+			frame_stale[i].yh = yh;
+		} else {
+			if (yl < frame_stale[i].yl) {
+				frame_stale[i].yl = yl;
+			}
+			if (yh > frame_stale[i].yh) {
+				frame_stale[i].yh = yh;
+			}
+		}
+	}
+
+	rpcemu_video_update();
+}
+
+/**
+ * Obtain the most recently completed frame for display, if there is one that
+ * the GUI has not yet seen. The frame remains valid and unchanged until the
+ * next call that returns a frame.
+ *
+ * thread: GUI
+ *
+ * @return Pointer to new frame, or NULL if there is no new frame
+ */
+const VideoFrame *
+vidc_frame_acquire(void)
+{
+	/* Only the GUI clears FRAME_NEW, so if it is set here it is still set
+	   at the exchange */
+	if ((atomic_load(&frame_state) & FRAME_NEW) == 0) {
+		return NULL;
+	}
+
+	frame_front = atomic_exchange(&frame_state, frame_front) & ~FRAME_NEW;
+
+	return &frames[frame_front];
 }
 
 void
@@ -198,8 +332,7 @@ resizedisplay(int x, int y)
 	current_sizex = x;
 	current_sizey = y;
 
-	thr.bitmap = realloc(thr.bitmap, x * y * sizeof(uint32_t));
-
+	/* Each frame's buffer is reallocated when it is next drawn into */
 	resetbuffer();
 }
 
@@ -329,6 +462,8 @@ drawscr(void)
 			dirtybuffer[0] = 0;
 			vidc.palchange = 0;
 
+			video_frame_prepare();
+
 			// Fill the bitmap with the border colour
 			p = thr.bitmap;
 			for (i = 0; i < current_sizex * current_sizey; i++) {
@@ -411,8 +546,6 @@ vidcthread(void)
 	const uint8_t *ramp;
 	uint32_t addr;
 	int yl = -1, yh = -1;
-	static int oldcursorheight;
-	static int oldcursory;
 
 	/* Deal with the possibility of a spurious thread wakeup */
 	if (thr.threadpending == 0) {
@@ -421,6 +554,8 @@ vidcthread(void)
 
 	thr.threadpending = 0;
 
+	video_frame_prepare();
+
 	if (thr.iomd_vidinit & 0x10000000) {
 		/* Using DRAM for video */
 		/* TODO video could be in DRAM other than simm 0 bank 0 */
@@ -447,7 +582,7 @@ vidcthread(void)
 		for (y = 0; y < thr.vidc_ysize; y++) {
 			uint32_t *vidp = video_image_scanline(y);
 
-			if (y < (oldcursorheight + oldcursory) && (y >= (oldcursory - 2))) {
+			if (video_row_forced(y)) {
 				drawit = 1;
 				yh = y + 8;
 				if (yl == -1) {
@@ -485,7 +620,7 @@ vidcthread(void)
 				}
 				if ((addr & 0xfff) == 0) {
 					drawit = thr.dirtybuffer[addr >> 12];
-					if (y < (oldcursorheight + oldcursory) && (y >= (oldcursory - 2))) {
+					if (video_row_forced(y)) {
 						drawit = 1;
 					}
 					if (drawit) {
@@ -502,7 +637,7 @@ vidcthread(void)
 		for (y = 0; y < thr.vidc_ysize; y++) {
 			uint32_t *vidp = video_image_scanline(y);
 
-			if (y < (oldcursorheight + oldcursory) && (y >= (oldcursory - 2))) {
+			if (video_row_forced(y)) {
 				drawit = 1;
 				yh = y + 8;
 				if (yl == -1) {
@@ -536,7 +671,7 @@ vidcthread(void)
 				}
 				if ((addr & 0xfff) == 0) {
 					drawit = thr.dirtybuffer[addr >> 12];
-					if (y < (oldcursorheight + oldcursory) && (y >= (oldcursory - 2))) {
+					if (video_row_forced(y)) {
 						drawit = 1;
 					}
 					if (drawit) {
@@ -553,7 +688,7 @@ vidcthread(void)
 		for (y = 0; y < thr.vidc_ysize; y++) {
 			uint32_t *vidp = video_image_scanline(y);
 
-			if (y < (oldcursorheight + oldcursory) && (y >= (oldcursory - 2))) {
+			if (video_row_forced(y)) {
 				drawit = 1;
 				yh = y + 8;
 				if (yl == -1) {
@@ -596,7 +731,7 @@ vidcthread(void)
 				}
 				if ((addr & 0xfff) == 0) {
 					drawit = thr.dirtybuffer[addr >> 12];
-					if (y < (oldcursorheight + oldcursory) && (y >= (oldcursory - 2))) {
+					if (video_row_forced(y)) {
 						drawit = 1;
 					}
 					if (drawit) {
@@ -613,7 +748,7 @@ vidcthread(void)
 		for (y = 0; y < thr.vidc_ysize; y++) {
 			uint32_t *vidp = video_image_scanline(y);
 
-			if (y < (oldcursorheight + oldcursory) && (y >= (oldcursory - 2))) {
+			if (video_row_forced(y)) {
 				drawit = 1;
 				yh = y + 8;
 				if (yl == -1) {
@@ -648,7 +783,7 @@ vidcthread(void)
 				}
 				if ((addr & 0xfff) == 0) {
 					drawit = thr.dirtybuffer[addr >> 12];
-					if (y < (oldcursorheight + oldcursory) && (y >= (oldcursory - 2))) {
+					if (video_row_forced(y)) {
 						drawit = 1;
 					}
 					if (drawit) {
@@ -665,7 +800,7 @@ vidcthread(void)
 		for (y = 0; y < thr.vidc_ysize; y++) {
 			uint32_t *vidp = video_image_scanline(y);
 
-			if (y < (oldcursorheight + oldcursory) && (y >= (oldcursory - 2))) {
+			if (video_row_forced(y)) {
 				drawit = 1;
 				yh = y + 8;
 				if (yl == -1) {
@@ -704,7 +839,7 @@ vidcthread(void)
 				}
 				if ((addr & 0xfff) == 0) {
 					drawit = thr.dirtybuffer[addr >> 12];
-					if (y < (oldcursorheight + oldcursory) && (y >= (oldcursory - 2))) {
+					if (video_row_forced(y)) {
 						drawit = 1;
 					}
 					if (drawit) {
@@ -721,7 +856,7 @@ vidcthread(void)
 		for (y = 0; y < thr.vidc_ysize; y++) {
 			uint32_t *vidp = video_image_scanline(y);
 
-			if (y < (oldcursorheight + oldcursory) && (y >= (oldcursory - 2))) {
+			if (video_row_forced(y)) {
 				drawit = 1;
 				yh = y + 8;
 				if (yl == -1) {
@@ -750,7 +885,7 @@ vidcthread(void)
 				}
 				if ((addr & 0xfff) == 0) {
 					drawit = thr.dirtybuffer[addr >> 12];
-					if (y < (oldcursorheight + oldcursory) && (y >= (oldcursory - 2))) {
+					if (video_row_forced(y)) {
 						drawit = 1;
 					}
 					if (drawit) {
@@ -843,7 +978,7 @@ vidcthread(void)
 		yl = thr.vidc_ysize - 1;
 	}
 	
-	/* Copy backbuffer to screen */
+	/* Hand the completed frame to the GUI */
 	video_update(yl, yh);
 }
 
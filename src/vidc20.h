@@ -32,6 +32,19 @@ extern "C" {
 #define VIDC_DOUBLE_Y		2
 #define VIDC_DOUBLE_BOTH	3
 
+/** A completed frame of video, handed from the emulator to the GUI */
+typedef struct {
+	uint32_t *bitmap;	/**< Image data, xsize * ysize pixels in 32bpp */
+	int xsize;		/**< Width of image in pixels */
+	int ysize;		/**< Height of image in pixels */
+	int yl;			/**< First row changed since the previous frame */
+	int yh;			/**< Row after the last row changed since the previous frame */
+	int double_size;	/**< State of doubling X/Y values */
+	int host_xsize;		/**< X pixel size of display including any doubling */
+	int host_ysize;		/**< Y pixel size of display including any doubling */
+	uint32_t seq;		/**< Sequence number, used to detect frames skipped by the GUI */
+} VideoFrame;
+
 extern void initvideo(void);
 extern void closevideo(void);
 extern int vidc_get_xsize(void);
@@ -41,6 +54,7 @@ extern void writevidc20(uint32_t val);
 extern void drawscr(void);
 extern void vidcthread(void);
 extern void vidc_get_doublesize(int *double_x, int *double_y);
+extern const VideoFrame *vidc_frame_acquire(void);
 
 /* Platform specific functions */
 extern void vidcstartthread(void);
@@ -137,6 +137,14 @@ static uint8_t ioctl_getcurrentsubchannel(uint8_t *b, int msf)
         return sub.CurrentPosition.Header.AudioStatus;
 }
 
+static uint32_t ioctl_getposition(void)
+{
+	uint8_t b[11];
+
+	ioctl_getcurrentsubchannel(b, 0);
+	return ((uint32_t) b[3] << 24) | (b[4] << 16) | (b[5] << 8) | b[6];
+}
+
 static void ioctl_eject(void)
 {
         unsigned long size;
@@ -283,6 +291,7 @@ static ATAPI ioctl_atapi=
         ioctl_ready,
         ioctl_readtoc,
         ioctl_getcurrentsubchannel,
+        ioctl_getposition,
         ioctl_readsector,
         ioctl_playaudio,
         ioctl_seek,
@@ -30,6 +30,8 @@
 #include "network.h"
 #include "tap.h"
 
+extern int handle_sigio; /**< bool to indicate new network data is received */
+
 /* The opened tunnel device */
 static void *tap_handle = NULL;
 
@@ -216,10 +218,17 @@ network_plt_setirqstatus(uint32_t address)
     irqstatus = address;
 }
 
+/**
+ * Raise the receive interrupt if the tap driver has signalled that frames
+ * have arrived for the guest. Called regularly from the emulator thread.
+ */
 void
-sig_io(int sig)
+network_plt_poll(void)
 {
-    NOT_USED(sig);
+    if (!handle_sigio) {
+        return;
+    }
+    handle_sigio = 0;
 
     if (irqstatus) {
         mem_write8(irqstatus, 1);